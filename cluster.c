@@ -38,6 +38,9 @@ static void cluster_fork_parent_(void);
 static void cluster_fork_child_(void);
 #endif
 
+static unsigned long cluster_published_(CLUSTER *cluster, CLUSTERPUBLISHED *state);
+static size_t cluster_diff_subtract_(int base, int count, int obase, int ocount, CLUSTERRANGE *out);
+
 static void cluster_list_wrlock_(void);
 static void cluster_list_rdlock_(void);
 static void cluster_list_unlock_(void);
@@ -62,9 +65,16 @@ cluster_create(const char *key)
 	pthread_once(&cluster_list_control_, cluster_list_init_);
 	pthread_once(&cluster_fork_control_, cluster_fork_init_);
 	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+#endif
+#ifdef ENABLE_SQL
+	cluster_sql_init_(p);
 #endif
 	p->forkmode = CLUSTER_FORK_CHILD;
 	p->inst_threads = 1;
+	p->inst_weight = 1;
+	p->reported.index = -1;
+	cluster_publish_locked_(p);
 	p->instid = (char *) malloc(33);
 	if(!p->instid)
 	{
@@ -101,9 +111,12 @@ cluster_create(const char *key)
 		cluster_destroy(p);
 		return NULL;
 	}
-# if defined(ENABLE_ETCD) || defined(ENABLE_SQL)
+	p->connect_timeout = CLUSTER_DEFAULT_CONNECT_TIMEOUT;
+	p->request_timeout = CLUSTER_DEFAULT_REQUEST_TIMEOUT;
+# if defined(ENABLE_ETCD) || defined(ENABLE_SQL) || defined(ENABLE_MEM)
 	p->ttl = CLUSTER_DEFAULT_TTL;
 	p->refresh = CLUSTER_DEFAULT_REFRESH;
+	p->slot = -1;
 # endif
 	cluster_list_wrlock_();
 	if(cluster_last_)
@@ -143,15 +156,33 @@ cluster_destroy(CLUSTER *cluster)
 	}
 	cluster_list_unlock_();
 	cluster_leave(cluster);
+	/* Pass any remaining messages to the logging callback */
+	cluster_log_destroy_(cluster);
 	cluster_wrlock_(cluster);
 	free(cluster->instid);
 	free(cluster->key);
 	free(cluster->env);
 	free(cluster->registry);
 	free(cluster->partition);
+	free(cluster->snapshot);
+#ifdef CLUSTER_HOST_STATE
+	cluster_host_destroy_(cluster);
+#endif
+#ifdef CLUSTER_WORKER_POOL
+	cluster_pool_destroy_(cluster);
+#endif
+	cluster_members_clear_(cluster);
+	free(cluster->members);
+	free(cluster->memberorder);
+	cluster_ring_destroy_(cluster);
 	cluster_unlock_(cluster);
 #ifdef WITH_PTHREAD
 	pthread_rwlock_destroy(&(cluster->lock));
+	pthread_cond_destroy(&(cluster->wake_cond));
+	pthread_mutex_destroy(&(cluster->wake_lock));
+#endif
+#ifdef ENABLE_SQL
+	cluster_sql_destroy_(cluster);
 #endif
 	free(cluster);
 	return 0;
@@ -163,51 +194,58 @@ cluster_destroy(CLUSTER *cluster)
 int
 cluster_join(CLUSTER *cluster)
 {
-	CLUSTERTYPE type;
+	int r;
 
 	cluster_rdlock_(cluster);
-	if((cluster->flags & CF_JOINED))
+	if((cluster->flags & (CF_JOINED|CF_PROVISIONAL)))
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: ignoring attempt to join a cluster which has already been joined\n");
 		cluster_unlock_(cluster);
 		return 0;
 	}
-	type = cluster->type;
 	cluster_unlock_(cluster);
-	switch(type)
+	r = cluster_snapshot_join_(cluster);
+	if(r)
 	{
-	case CT_STATIC:
-		return cluster_static_join_(cluster);
-#ifdef ENABLE_ETCD
-	case CT_ETCD:
-		return cluster_etcd_join_(cluster);
-#endif
-#ifdef ENABLE_SQL
-	case CT_SQL:
-		return cluster_sql_join_(cluster);
-#endif
-	default:
-		break;
+		return (r < 0 ? -1 : 0);
 	}
-	cluster_logf_(cluster, LOG_CRIT, "libcluster: cannot join cluster type <%d> which is not implemented\n", type);
-	errno = EPERM;
-	return -1;
+	return cluster_join_engine_(cluster);
 }
 
 /* Join a cluster passively */
 int
 cluster_join_passive(CLUSTER *cluster)
 {
-	CLUSTERTYPE type;
+	int r;
 
-	cluster_rdlock_(cluster);
-	if((cluster->flags & CF_JOINED))
+	cluster_wrlock_(cluster);
+	if((cluster->flags & (CF_JOINED|CF_PROVISIONAL)))
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: ignoring attempt to join a cluster which has already been joined\n");
 		cluster_unlock_(cluster);
 		return 0;
 	}
 	cluster->flags |= CF_PASSIVE;
+	cluster_unlock_(cluster);
+	r = cluster_snapshot_join_(cluster);
+	if(r)
+	{
+		return (r < 0 ? -1 : 0);
+	}
+	return cluster_join_engine_(cluster);
+}
+
+/* Join a cluster using its registry, synchronously: invoked by
+ * cluster_join(), cluster_join_passive() and the snapshot thread.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_join_engine_(CLUSTER *cluster)
+{
+	CLUSTERTYPE type;
+
+	cluster_rdlock_(cluster);
 	type = cluster->type;
 	cluster_unlock_(cluster);
 	switch(type)
@@ -217,10 +255,24 @@ cluster_join_passive(CLUSTER *cluster)
 #ifdef ENABLE_ETCD
 	case CT_ETCD:
 		return cluster_etcd_join_(cluster);
+	case CT_ETCD3:
+		return cluster_etcd3_join_(cluster);
 #endif
 #ifdef ENABLE_SQL
 	case CT_SQL:
 		return cluster_sql_join_(cluster);
+#endif
+#ifdef ENABLE_MEM
+	case CT_MEM:
+		return cluster_mem_join_(cluster);
+#endif
+#ifdef CLUSTER_HOST_STATE
+	case CT_HOST:
+		return cluster_host_join_(cluster);
+#endif
+#ifdef CLUSTER_WORKER_POOL
+	case CT_POOL:
+		return cluster_pool_join_(cluster);
 #endif
 	default:
 		break;
@@ -234,14 +286,28 @@ cluster_join_passive(CLUSTER *cluster)
 int
 cluster_leave(CLUSTER *cluster)
 {
-	CLUSTERTYPE type;
-
+	/* Abandon any provisional join which is still in progress */
+	cluster_snapshot_leave_(cluster);
 	cluster_rdlock_(cluster);
 	if(!(cluster->flags & CF_JOINED))
 	{
 		cluster_unlock_(cluster);
 		return 0;
 	}
+	cluster_unlock_(cluster);
+	return cluster_leave_engine_(cluster);
+}
+
+/* Leave a cluster which has been joined using its registry.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_leave_engine_(CLUSTER *cluster)
+{
+	CLUSTERTYPE type;
+
+	cluster_rdlock_(cluster);
 	type = cluster->type;
 	cluster_unlock_(cluster);
 	switch(type)
@@ -251,10 +317,24 @@ cluster_leave(CLUSTER *cluster)
 #ifdef ENABLE_ETCD
 	case CT_ETCD:
 		return cluster_etcd_leave_(cluster);
+	case CT_ETCD3:
+		return cluster_etcd3_leave_(cluster);
 #endif
 #ifdef ENABLE_SQL
 	case CT_SQL:
 		return cluster_sql_leave_(cluster);
+#endif
+#ifdef ENABLE_MEM
+	case CT_MEM:
+		return cluster_mem_leave_(cluster);
+#endif
+#ifdef CLUSTER_HOST_STATE
+	case CT_HOST:
+		return cluster_host_leave_(cluster);
+#endif
+#ifdef CLUSTER_WORKER_POOL
+	case CT_POOL:
+		return cluster_pool_leave_(cluster);
 #endif
 	default:
 		break;
@@ -312,7 +392,7 @@ cluster_set_env(CLUSTER *cluster, const char *env)
 	char *p;
 	
 	cluster_wrlock_(cluster);
-	if(cluster->flags & CF_JOINED)
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
 	{
 		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
 		cluster_unlock_(cluster);
@@ -361,7 +441,7 @@ cluster_set_instance(CLUSTER *cluster, const char *name)
 	char *p;
 
 	cluster_wrlock_(cluster);
-	if(cluster->flags & CF_JOINED)
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
 	{
 		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
 		cluster_unlock_(cluster);
@@ -428,6 +508,10 @@ cluster_reset_instance_locked_(CLUSTER *p)
 # endif
 	free(p->instid);
 	p->instid = instid;
+# if defined(ENABLE_ETCD) || defined(ENABLE_SQL) || defined(ENABLE_MEM)
+	/* Any slot claimed belongs to the old identifier */
+	p->slot = -1;
+# endif
 	return 0;
 }
 
@@ -448,63 +532,48 @@ cluster_reset_instance(CLUSTER *p)
 int
 cluster_index(CLUSTER *cluster, int worker)
 {
-	int r;
+	CLUSTERPUBLISHED state;
 
-	cluster_rdlock_(cluster);
-	if(cluster->flags & CF_JOINED)
-	{
-		r = cluster->inst_index + worker;
-	}
-	else
+	cluster_published_(cluster, &state);
+	if(state.joined)
 	{
-		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: attempt to retrieve worker index when not joined\n");
-		errno = EPERM;
-		r = -1;
+		return state.index + worker;
 	}
-	cluster_unlock_(cluster);
-	return r;
+	cluster_logf_(cluster, LOG_WARNING, "libcluster: attempt to retrieve worker index when not joined\n");
+	errno = EPERM;
+	return -1;
 }
 
 /* Get the total worker count for this cluster (not valid when not joined) */
 int
 cluster_total(CLUSTER *cluster)
 {
-	int r;
+	CLUSTERPUBLISHED state;
 
-	cluster_rdlock_(cluster);
-	if(cluster->flags & CF_JOINED)
-	{
-		r = cluster->total_threads;
-	}
-	else
+	cluster_published_(cluster, &state);
+	if(state.joined)
 	{
-		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: attempt to retrieve cluster thread count when not joined\n");
-		errno = EPERM;
-		r = 0;
+		return state.total;
 	}
-	cluster_unlock_(cluster);
-	return r;
+	cluster_logf_(cluster, LOG_WARNING, "libcluster: attempt to retrieve cluster thread count when not joined\n");
+	errno = EPERM;
+	return 0;
 }
 
 /* Get the number of threads (or 'sub-instances') this cluster member has */
 int
 cluster_workers(CLUSTER *cluster)
 {
-	int r;
+	CLUSTERPUBLISHED state;
 
-	cluster_rdlock_(cluster);
-	if(cluster->flags & CF_JOINED)
-	{
-		r = cluster->inst_threads;
-	}
-	else
+	cluster_published_(cluster, &state);
+	if(state.joined)
 	{
-		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: attempt to retrieve member worker count when not joined\n");
-		errno = EPERM;
-		r = 0;
+		return state.workers;
 	}
-	cluster_unlock_(cluster);
-	return r;
+	cluster_logf_(cluster, LOG_WARNING, "libcluster: attempt to retrieve member worker count when not joined\n");
+	errno = EPERM;
+	return 0;
 }
 
 /* Set the logging callback */
@@ -533,12 +602,45 @@ cluster_set_balancer(CLUSTER *cluster, CLUSTERBALANCE callback)
 	return 0;
 }
 
+/* Set the callback invoked with the changes to this member's indices when
+ * its status within the cluster has changed
+ */
+int
+cluster_set_diff_balancer(CLUSTER *cluster, CLUSTERDIFFBALANCE callback)
+{
+	cluster_wrlock_(cluster);
+	cluster->diff_balancer = callback;
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Set the re-balancing settle window */
+int
+cluster_set_rebalance_delay(CLUSTER *cluster, int delay, int limit)
+{
+	if(delay < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cluster_wrlock_(cluster);
+	cluster->settle_delay = delay;
+	/* The limit cannot be shorter than the window itself */
+	cluster->settle_limit = (limit < delay ? delay : limit);
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: re-balancing settle window set to %d seconds (limit %d seconds)\n", cluster->settle_delay, cluster->settle_limit);
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
 /* Set the registry URI for this cluster */
 int
 cluster_set_registry(CLUSTER *cluster, const char *uri)
 {
    	cluster_wrlock_(cluster);
-	if(cluster->flags & CF_JOINED)
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
 	{
 		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
 		cluster_unlock_(cluster);
@@ -588,7 +690,88 @@ cluster_set_registry(CLUSTER *cluster, const char *uri)
 		}
 	}
 #endif /*ENABLE_SQL*/
+	if(!strncmp(uri, "host:", 5))
+	{
+#ifdef CLUSTER_HOST_STATE
+		char *p;
+
+		p = strdup(uri);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate registry URI\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+		free(cluster->registry);
+		cluster->registry = p;
+		cluster->type = CT_HOST;
+		if(cluster->flags & CF_VERBOSE)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: cluster type set to 'host' with state segment <%s>\n", cluster->registry);
+		}
+		cluster_unlock_(cluster);
+		return 0;
+#else
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host state segments are not supported by this build\n");
+		cluster_unlock_(cluster);
+		errno = ENOTSUP;
+		return -1;
+#endif
+	}
+#ifdef ENABLE_MEM
+	if(!strncmp(uri, "mem:", 4) || !strncmp(uri, "shm:", 4))
+	{
+		char *p;
+
+# ifndef CLUSTER_MEM_SHARED
+		if(!strncmp(uri, "shm:", 4))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: shared memory registries are not supported by this build\n");
+			cluster_unlock_(cluster);
+			errno = ENOTSUP;
+			return -1;
+		}
+# endif
+		p = strdup(uri);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate registry URI\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+		free(cluster->registry);
+		cluster->registry = p;
+		cluster->type = CT_MEM;
+		if(cluster->flags & CF_VERBOSE)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: cluster type set to 'mem' with registry <%s>\n", cluster->registry);
+		}
+		cluster_unlock_(cluster);
+		return 0;
+	}
+#endif /*ENABLE_MEM*/
 #ifdef ENABLE_ETCD
+	if(!strncmp(uri, "etcd3:", 6) || !strncmp(uri, "etcd3s:", 7))
+	{
+		char *p;
+
+		p = strdup(uri);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate registry URI\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+		free(cluster->registry);
+		cluster->registry = p;
+		cluster->type = CT_ETCD3;
+		if(cluster->flags & CF_VERBOSE)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: cluster type set to 'etcd3' with registry <%s>\n", cluster->registry);
+		}
+		cluster_unlock_(cluster);
+		return 0;
+	}
 	if(!strncmp(uri, "http:", 5))
 	{
 		char *p;
@@ -621,110 +804,323 @@ cluster_set_registry(CLUSTER *cluster, const char *uri)
 int
 cluster_set_workers(CLUSTER *cluster, int nworkers)
 {
-	/* TODO: we should notify the ping thread that this has changed so that
-	 * that it doesn't take until cluster->etcd_refresh to inform other
-	 * nodes.
-	 */
 	cluster_wrlock_(cluster);
 	cluster->inst_threads = nworkers;
+	cluster_publish_locked_(cluster);
 	if(cluster->flags & CF_VERBOSE)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: number of workers in this cluster member set to %d\n", cluster->inst_threads);
 	}
 	cluster_unlock_(cluster);
+#ifdef WITH_PTHREAD
+	/* Inform the other members now, rather than at the next refresh */
+	cluster_wake_(cluster, CW_PING);
+#endif
 	return 0;
 }
 
-/* Atomically obtain the current state of the cluster membership */
+/* Get the capacity weight of each of this member's workers */
 int
-cluster_state(CLUSTER *cluster, CLUSTERSTATE *state)
+cluster_weight(CLUSTER *cluster)
 {
-	memset(state, 0, sizeof(CLUSTERSTATE));
+	int r;
+
 	cluster_rdlock_(cluster);
-	state->index = cluster->inst_index;
-	state->workers = cluster->inst_threads;
-	state->total = cluster->total_threads;
-	state->passive = !!(cluster->flags & CF_PASSIVE);
+	r = cluster->inst_weight;
 	cluster_unlock_(cluster);
-	return 0;
-}
-
-/* DEPRECATED: provided only for binary compatibility */
-int
-cluster_set_threads(CLUSTER *cluster, int nthreads)
-{
-	return cluster_set_workers(cluster, nthreads);
+	return r;
 }
 
-/* Retrieve the partition this member is part of (if any) */
-/* MT-safety: safe provided barriered against cluster_set_partition() or
- *            cluster_destroy()
+/* Set the capacity weight of each of this member's workers, which is
+ * published alongside the worker count and determines the share of the
+ * keys which each of them owns
  */
-const char *
-cluster_partition(CLUSTER *cluster)
+int
+cluster_set_weight(CLUSTER *cluster, int weight)
 {
-	errno = 0;
-	return cluster->partition;
+	if(weight < 1 || weight > CLUSTER_MAX_WEIGHT)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cluster_wrlock_(cluster);
+	cluster->inst_weight = weight;
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: capacity weight of this cluster member's workers set to %d\n", cluster->inst_weight);
+	}
+	cluster_unlock_(cluster);
+#ifdef WITH_PTHREAD
+	/* Inform the other members now, rather than at the next refresh */
+	cluster_wake_(cluster, CW_PING);
+#endif
+	return 0;
 }
 
-/* Set the partition that this member is part of (cannot be invoked after the
- * cluster has been joined)
+/* Set whether the cluster's housekeeping (registry refreshes and waiting
+ * for changes) should be performed by a single thread shared by all of the
+ * clusters in the process which enable it, rather than by per-cluster
+ * threads (cannot be invoked after the cluster has been joined). This is
+ * currently only supported by etcd-based clusters.
  */
 int
-cluster_set_partition(CLUSTER *cluster, const char *partition)
+cluster_set_shared_housekeeping(CLUSTER *cluster, int shared)
 {
-	char *p;
-
-   	cluster_wrlock_(cluster);
-	if(cluster->flags & CF_JOINED)
+	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
 	{
 		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
 		cluster_unlock_(cluster);
 		errno = EPERM;
 		return -1;
 	}
-	if(partition)
+#ifdef CLUSTER_REACTOR
+	if(shared)
 	{
-		p = strdup(partition);
-		if(!p)
-		{
-			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate partition name\n");
-			cluster_unlock_(cluster);
-			return -1;
-		}
+		cluster->flags |= CF_SHARED;
 	}
 	else
 	{
-		p = NULL;
+		cluster->flags &= ~CF_SHARED;
 	}
-	free(cluster->partition);
-	cluster->partition = p;
-	if(cluster->flags & CF_VERBOSE)
+	cluster_unlock_(cluster);
+	return 0;
+#else
+	if(shared)
 	{
-		if(p)
-		{
-			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: partition set '%s'\n", p);
-		}
-		else
-		{
-			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: instance is not part of a partition\n");
-		}
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: shared housekeeping is not supported by this build\n");
+		cluster_unlock_(cluster);
+		errno = ENOTSUP;
+		return -1;
 	}
 	cluster_unlock_(cluster);
 	return 0;
+#endif
 }
 
-/* Log a message when the cluster is already locked */
-/* Because this function is varadic, we provide a no-op implementation
- * rather than using macros to eliminate calls if the compiler doesn't
- * provide a sensible way to do that.
+/* Set whether members claim stable slots (cannot be invoked after the
+ * cluster has been joined). Each member claims the lowest slot number not
+ * held by another when it joins, and retains it for as long as it remains
+ * a member; indices are assigned in slot order. As a result, a member
+ * joining only adds indices beyond those of the existing members, unless
+ * it fills a slot left vacant by a member which has left.
  */
-#if ENABLE_LOGGING || NEED_LOGGING_NOOPS
-void
-cluster_logf_locked_(CLUSTER *cluster, int priority, const char *format, ...)
+int
+cluster_set_stable_slots(CLUSTER *cluster, int enable)
 {
-#ifdef ENABLE_LOGGING
-	va_list ap;
+	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	if(enable)
+	{
+		cluster->flags |= CF_SLOTS;
+	}
+	else
+	{
+		cluster->flags &= ~CF_SLOTS;
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Set the timeouts applied to requests made to an etcd registry */
+int
+cluster_set_registry_timeouts(CLUSTER *cluster, int connect, int request)
+{
+	if(connect < 0 || request < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	cluster->connect_timeout = connect;
+	cluster->request_timeout = request;
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: registry timeouts set to %dms (connection) and %dms (request)\n", connect, request);
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Set the fork behaviour: whether the cluster membership continues in the
+ * child process, the parent, or both
+ */
+int
+cluster_set_fork(CLUSTER *cluster, CLUSTERFORK mode)
+{
+	/* The fork handlers test the individual bits */
+	if(mode & CLUSTER_FORK_POOL)
+	{
+		/* The membership continues in the parent only */
+		mode = (CLUSTERFORK) (CLUSTER_FORK_POOL | CLUSTER_FORK_PARENT);
+	}
+	else if(mode & CLUSTER_FORK_BOTH)
+	{
+		mode = (CLUSTERFORK) (CLUSTER_FORK_CHILD | CLUSTER_FORK_PARENT);
+	}
+	if(!(mode & (CLUSTER_FORK_CHILD | CLUSTER_FORK_PARENT)))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+#ifndef CLUSTER_WORKER_POOL
+	if(mode & CLUSTER_FORK_POOL)
+	{
+		cluster_logf_(cluster, LOG_ERR, "libcluster: worker pools are not supported by this build\n");
+		errno = ENOTSUP;
+		return -1;
+	}
+#endif
+	cluster_wrlock_(cluster);
+#ifdef CLUSTER_WORKER_POOL
+	if((mode & CLUSTER_FORK_POOL) && cluster_pool_create_locked_(cluster))
+	{
+		cluster_unlock_(cluster);
+		return -1;
+	}
+#endif
+	cluster->forkmode = mode;
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Atomically obtain the current state of the cluster membership */
+int
+cluster_state(CLUSTER *cluster, CLUSTERSTATE *state)
+{
+	CLUSTERPUBLISHED pub;
+
+	cluster_published_(cluster, &pub);
+	memset(state, 0, sizeof(CLUSTERSTATE));
+	state->index = pub.index;
+	state->workers = pub.workers;
+	state->total = pub.total;
+	state->passive = pub.passive;
+	return 0;
+}
+
+/* Determine whether the current state is provisional */
+int
+cluster_provisional(CLUSTER *cluster)
+{
+	CLUSTERPUBLISHED pub;
+
+	cluster_published_(cluster, &pub);
+	return pub.provisional;
+}
+
+/* Obtain the generation number of the current cluster state */
+unsigned long
+cluster_state_generation(CLUSTER *cluster)
+{
+#ifdef CLUSTER_ATOMICS
+	unsigned long seq;
+
+	/* If an update is in progress, the generation it will produce is
+	 * returned; a caller reading the state afterwards will either see the
+	 * new state or a later one.
+	 */
+	seq = __atomic_load_n(&(cluster->pubseq), __ATOMIC_ACQUIRE);
+	return (seq + 1) >> 1;
+#else
+	unsigned long seq;
+
+	cluster_rdlock_(cluster);
+	seq = cluster->pubseq;
+	cluster_unlock_(cluster);
+	return seq >> 1;
+#endif
+}
+
+/* DEPRECATED: provided only for binary compatibility */
+int
+cluster_set_threads(CLUSTER *cluster, int nthreads)
+{
+	return cluster_set_workers(cluster, nthreads);
+}
+
+/* Retrieve the partition this member is part of (if any) */
+/* MT-safety: safe provided barriered against cluster_set_partition() or
+ *            cluster_destroy()
+ */
+const char *
+cluster_partition(CLUSTER *cluster)
+{
+	errno = 0;
+	return cluster->partition;
+}
+
+/* Set the partition that this member is part of (cannot be invoked after the
+ * cluster has been joined)
+ */
+int
+cluster_set_partition(CLUSTER *cluster, const char *partition)
+{
+	char *p;
+
+   	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	if(partition)
+	{
+		p = strdup(partition);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate partition name\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+	}
+	else
+	{
+		p = NULL;
+	}
+	free(cluster->partition);
+	cluster->partition = p;
+	if(cluster->flags & CF_VERBOSE)
+	{
+		if(p)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: partition set '%s'\n", p);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: instance is not part of a partition\n");
+		}
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Log a message when the cluster is already locked */
+/* Because this function is varadic, we provide a no-op implementation
+ * rather than using macros to eliminate calls if the compiler doesn't
+ * provide a sensible way to do that.
+ */
+#if ENABLE_LOGGING || NEED_LOGGING_NOOPS
+void
+cluster_logf_locked_(CLUSTER *cluster, int priority, const char *format, ...)
+{
+#ifdef ENABLE_LOGGING
+	va_list ap;
 
 	va_start(ap, format);
 	cluster_vlogf_locked_(cluster, priority, format, ap);
@@ -739,6 +1135,18 @@ cluster_logf_locked_(CLUSTER *cluster, int priority, const char *format, ...)
 #ifdef ENABLE_LOGGING
 void
 cluster_vlogf_locked_(CLUSTER *cluster, int priority, const char *format, va_list ap)
+{
+	if(!cluster_log_async_(cluster, priority, NULL, 0, 0, format, ap))
+	{
+		cluster_log_write_locked_(cluster, priority, format, ap);
+	}
+}
+
+/* Pass a message to the logging callback (or write it to standard error),
+ * regardless of whether asynchronous logging is enabled
+ */
+void
+cluster_log_write_locked_(CLUSTER *cluster, int priority, const char *format, va_list ap)
 {
 	if(cluster->logger)
 	{
@@ -764,9 +1172,7 @@ cluster_logf_(CLUSTER *cluster, int priority, const char *format, ...)
 	va_list ap;
 
 	va_start(ap, format);
-	cluster_rdlock_(cluster);
-	cluster_vlogf_locked_(cluster, priority, format, ap);
-	cluster_unlock_(cluster);
+	cluster_vlogf_(cluster, priority, format, ap);
 	va_end(ap);
 #else
 	(void) cluster;
@@ -779,8 +1185,13 @@ void
 cluster_vlogf_(CLUSTER *cluster, int priority, const char *format, va_list ap)
 {
 #ifdef ENABLE_LOGGING
+	/* Asynchronous logging doesn't require the lock */
+	if(cluster_log_async_(cluster, priority, NULL, 0, 0, format, ap))
+	{
+		return;
+	}
 	cluster_rdlock_(cluster);
-	cluster_vlogf_locked_(cluster, priority, format, ap);
+	cluster_log_write_locked_(cluster, priority, format, ap);
 	cluster_unlock_(cluster);
 #else
 	(void) cluster;
@@ -801,21 +1212,313 @@ cluster_rebalanced_(CLUSTER *cluster)
 	CLUSTERSTATE state;
 
 	cluster_rdlock_(cluster);
-	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: re-balanced; this instance has base index %d (%d workers) from a total of %d\n", cluster->inst_index, cluster->inst_threads, cluster->total_threads);
-	if(!cluster->balancer)
+	if(cluster->flags & CF_PROVISIONAL)
 	{
+		/* The snapshot thread reports the state once the join completes */
 		cluster_unlock_(cluster);
 		return 0;
 	}
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: re-balanced; this instance has base index %d (%d workers) from a total of %d\n", cluster->inst_index, cluster->inst_threads, cluster->total_threads);
 	memset(&state, 0, sizeof(state));
 	state.index = cluster->inst_index;
 	state.workers = cluster->inst_threads;
 	state.total = cluster->total_threads;
+	state.passive = !!(cluster->flags & CF_PASSIVE);
+	cluster_unlock_(cluster);
+	cluster_snapshot_write_(cluster, &state);
+	return cluster_report_(cluster, &state);
+}
+
+/* Pass a new state to the balancing callbacks, determining the changes to
+ * this member's indices since the last state passed to them.
+ * The calling thread should not hold the lock when this function is
+ * invoked.
+ */
+int
+cluster_report_(CLUSTER *cluster, CLUSTERSTATE *state)
+{
+	CLUSTERBALANCE balancer;
+	CLUSTERDIFFBALANCE differ;
+	CLUSTERDIFF diff;
+	CLUSTERMEMBERS *members;
+	uint64_t start;
+	int current, previous;
+
+	cluster_wrlock_(cluster);
+	memset(&diff, 0, sizeof(diff));
+	diff.previous = cluster->reported;
+	cluster->reported = *state;
+	balancer = cluster->balancer;
+	differ = cluster->diff_balancer;
 	cluster_unlock_(cluster);
-	cluster->balancer(cluster, &state);
+	if(!balancer && !differ)
+	{
+		return 0;
+	}
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_REBALANCE);
+	if(balancer)
+	{
+		balancer(cluster, state);
+	}
+	if(differ)
+	{
+		/* Passive members and those without an index have no workers */
+		current = (state->index >= 0 && !state->passive) ? state->workers : 0;
+		previous = (diff.previous.index >= 0 && !diff.previous.passive) ? diff.previous.workers : 0;
+		diff.ngained = cluster_diff_subtract_(state->index, current, diff.previous.index, previous, diff.gained);
+		diff.nlost = cluster_diff_subtract_(diff.previous.index, previous, state->index, current, diff.lost);
+		members = cluster_members(cluster);
+		diff.members = members;
+		differ(cluster, state, &diff);
+		cluster_members_release(members);
+	}
+	cluster_stats_record_(&(cluster->stats.rebalance), start);
+	cluster_trace_end_(cluster, CLUSTER_TRACE_REBALANCE, start, 0);
+	return 0;
+}
+
+/* Determine the ranges of indices within [base, base + count) which are
+ * not within [obase, obase + ocount), writing up to two ranges to out and
+ * returning the number written
+ */
+static size_t
+cluster_diff_subtract_(int base, int count, int obase, int ocount, CLUSTERRANGE *out)
+{
+	size_t n;
+
+	if(count <= 0)
+	{
+		return 0;
+	}
+	if(ocount <= 0 || obase >= base + count || obase + ocount <= base)
+	{
+		out[0].base = base;
+		out[0].count = count;
+		return 1;
+	}
+	n = 0;
+	if(base < obase)
+	{
+		out[n].base = base;
+		out[n].count = obase - base;
+		n++;
+	}
+	if(obase + ocount < base + count)
+	{
+		out[n].base = obase + ocount;
+		out[n].count = (base + count) - (obase + ocount);
+		n++;
+	}
+	return n;
+}
+
+/* Note that a change to the membership has been applied, and determine
+ * whether re-balancing should be deferred to allow further changes to
+ * arrive: returns 1 if so, or 0 if the cluster should be re-balanced now.
+ * If re-balancing is deferred, the engine must invoke
+ * cluster_settled_locked_() once cluster_settle_wait_() indicates that it
+ * is due.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+int
+cluster_settle_locked_(CLUSTER *cluster)
+{
+	time_t now;
+
+	if(!cluster->settle_delay)
+	{
+		return 0;
+	}
+	now = cluster_now_();
+	if(!cluster->settle_first)
+	{
+		cluster->settle_first = now;
+	}
+	cluster->settle_deadline = now + cluster->settle_delay;
+	if(cluster->settle_deadline - cluster->settle_first > cluster->settle_limit)
+	{
+		cluster->settle_deadline = cluster->settle_first + cluster->settle_limit;
+	}
+	if(cluster->settle_deadline <= now)
+	{
+		cluster->settle_first = 0;
+		cluster->settle_deadline = 0;
+		return 0;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: deferring re-balancing for %d seconds\n", (int) (cluster->settle_deadline - now));
+	}
+	return 1;
+}
+
+/* Determine whether deferred re-balancing is now due: if so, the deferral
+ * is cleared and 1 is returned, and the cluster should be re-balanced.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+int
+cluster_settled_locked_(CLUSTER *cluster)
+{
+	if(!cluster->settle_deadline || cluster->settle_deadline > cluster_now_())
+	{
+		return 0;
+	}
+	cluster->settle_first = 0;
+	cluster->settle_deadline = 0;
+	return 1;
+}
+
+/* Return the number of seconds until deferred re-balancing is due (zero if
+ * it is already due), or -1 if none has been deferred.
+ *
+ * This function should only be invoked by the thread which performs
+ * re-balancing, and does not require the cluster lock to be held.
+ */
+int
+cluster_settle_wait_(CLUSTER *cluster)
+{
+	time_t now;
+
+	if(!cluster->settle_deadline)
+	{
+		return -1;
+	}
+	now = cluster_now_();
+	if(cluster->settle_deadline <= now)
+	{
+		return 0;
+	}
+	return (int) (cluster->settle_deadline - now);
+}
+
+/* Obtain the current monotonic time, in seconds */
+time_t
+cluster_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Write the scope of the cluster (its key, partition and environment,
+ * separated by slashes) to buf, which must be CLUSTER_SCOPE_LEN bytes
+ * long; returns -1 if it doesn't fit
+ */
+int
+cluster_scope_locked_(CLUSTER *cluster, char *buf)
+{
+	int l;
+
+	l = snprintf(buf, CLUSTER_SCOPE_LEN, "%s/%s/%s", cluster->key, (cluster->partition ? cluster->partition : ""), cluster->env);
+	if(l < 0 || l >= CLUSTER_SCOPE_LEN)
+	{
+		return -1;
+	}
 	return 0;
 }
 
+/* Publish the current state of this member for the benefit of lock-free
+ * readers, if it has changed. This must be invoked, with the cluster
+ * write-locked, whenever the index, worker count, total or the joined or
+ * passive flags are modified.
+ *
+ * The published copy is protected by a sequence counter: the (only) writer
+ * makes the counter odd, updates the copy, then makes it even again;
+ * readers retry if the counter was odd or changed while they were reading.
+ */
+void
+cluster_publish_locked_(CLUSTER *cluster)
+{
+	CLUSTERPUBLISHED state;
+	CLUSTERPUBLISHED *p;
+	unsigned long seq;
+
+	state.passive = !!(cluster->flags & CF_PASSIVE);
+	state.workers = cluster->inst_threads;
+	if(cluster->flags & CF_PROVISIONAL)
+	{
+		/* Until the registry has answered, the members are as they were
+		 * when the snapshot was written
+		 */
+		state.joined = 1;
+		state.index = cluster->snapshot_index;
+		state.total = cluster->snapshot_others + (state.passive ? 0 : state.workers);
+		state.provisional = 1;
+	}
+	else
+	{
+		state.joined = !!(cluster->flags & CF_JOINED);
+		state.index = cluster->inst_index;
+		state.total = cluster->total_threads;
+		state.provisional = 0;
+	}
+	p = &(cluster->published);
+	if(!memcmp(&state, p, sizeof(CLUSTERPUBLISHED)))
+	{
+		return;
+	}
+#ifdef CLUSTER_ATOMICS
+	seq = __atomic_load_n(&(cluster->pubseq), __ATOMIC_RELAXED);
+	__atomic_store_n(&(cluster->pubseq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&(p->joined), state.joined, __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->index), state.index, __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->workers), state.workers, __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->total), state.total, __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->passive), state.passive, __ATOMIC_RELAXED);
+	__atomic_store_n(&(p->provisional), state.provisional, __ATOMIC_RELAXED);
+	__atomic_store_n(&(cluster->pubseq), seq + 2, __ATOMIC_RELEASE);
+#else
+	seq = cluster->pubseq;
+	*p = state;
+	cluster->pubseq = seq + 2;
+#endif
+#ifdef CLUSTER_WORKER_POOL
+	cluster_pool_publish_locked_(cluster);
+#endif
+}
+
+/* Obtain a consistent copy of the published state, returning the value of
+ * the sequence counter it corresponds to. The cluster should not be locked
+ * by the calling thread.
+ */
+static unsigned long
+cluster_published_(CLUSTER *cluster, CLUSTERPUBLISHED *state)
+{
+	unsigned long seq;
+#ifdef CLUSTER_ATOMICS
+	unsigned long check;
+	CLUSTERPUBLISHED *p;
+
+	p = &(cluster->published);
+	for(;;)
+	{
+		seq = __atomic_load_n(&(cluster->pubseq), __ATOMIC_ACQUIRE);
+		state->joined = __atomic_load_n(&(p->joined), __ATOMIC_RELAXED);
+		state->index = __atomic_load_n(&(p->index), __ATOMIC_RELAXED);
+		state->workers = __atomic_load_n(&(p->workers), __ATOMIC_RELAXED);
+		state->total = __atomic_load_n(&(p->total), __ATOMIC_RELAXED);
+		state->passive = __atomic_load_n(&(p->passive), __ATOMIC_RELAXED);
+		state->provisional = __atomic_load_n(&(p->provisional), __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		check = __atomic_load_n(&(cluster->pubseq), __ATOMIC_RELAXED);
+		if(!(seq & 1) && seq == check)
+		{
+			return seq;
+		}
+	}
+#else
+	cluster_rdlock_(cluster);
+	*state = cluster->published;
+	seq = cluster->pubseq;
+	cluster_unlock_(cluster);
+	return seq;
+#endif
+}
+
 /* Read-lock the cluster so that the object's contents can be inspected.
  *
  * Mulitple threads can read-lock a cluster simultaneously, but only if
@@ -824,10 +1527,22 @@ cluster_rebalanced_(CLUSTER *cluster)
 void
 cluster_rdlock_(CLUSTER *cluster)
 {
-	(void) cluster;
-
 #ifdef WITH_PTHREAD
-	pthread_rwlock_rdlock(&(cluster->lock));
+	uint64_t start;
+
+	/* Only contended acquisitions are timed */
+	if(pthread_rwlock_tryrdlock(&(cluster->lock)))
+	{
+		start = cluster_stats_start_();
+		pthread_rwlock_rdlock(&(cluster->lock));
+		cluster_stats_record_(&(cluster->stats.lock_wait), start);
+		cluster_trace_end_(cluster, CLUSTER_TRACE_LOCK, start, 0);
+		CLUSTER_PROBE3(lock__acquire, cluster, 0, 1);
+		return;
+	}
+	CLUSTER_PROBE3(lock__acquire, cluster, 0, 0);
+#else
+	(void) cluster;
 #endif
 }
 
@@ -838,10 +1553,30 @@ cluster_rdlock_(CLUSTER *cluster)
 void
 cluster_wrlock_(CLUSTER *cluster)
 {
-	(void) cluster;
-
 #ifdef WITH_PTHREAD
-	pthread_rwlock_wrlock(&(cluster->lock));
+	uint64_t start;
+
+	if(pthread_rwlock_trywrlock(&(cluster->lock)))
+	{
+		start = cluster_stats_start_();
+		pthread_rwlock_wrlock(&(cluster->lock));
+		cluster_stats_record_(&(cluster->stats.lock_wait), start);
+		cluster_trace_end_locked_(cluster, CLUSTER_TRACE_LOCK, start, 1);
+		CLUSTER_PROBE3(lock__acquire, cluster, 1, 1);
+	}
+	else
+	{
+		CLUSTER_PROBE3(lock__acquire, cluster, 1, 0);
+	}
+	/* The time for which the write lock is held is reported when it is
+	 * released; only the holder of the write lock sets (or clears) this
+	 */
+	if(cluster_tracing_(cluster))
+	{
+		cluster->locked_at = cluster_stats_start_();
+	}
+#else
+	(void) cluster;
 #endif
 }
 
@@ -849,14 +1584,225 @@ cluster_wrlock_(CLUSTER *cluster)
 void
 cluster_unlock_(CLUSTER *cluster)
 {
+#ifdef WITH_PTHREAD
+	CLUSTERTRACE pending[CLUSTER_TRACE_PENDING];
+	uint64_t start;
+	int npending;
+
+	CLUSTER_PROBE1(lock__release, cluster);
+	if(cluster->locked_at)
+	{
+		/* Only a writer can observe locked_at being set */
+		start = cluster->locked_at;
+		cluster->locked_at = 0;
+		cluster_trace_end_locked_(cluster, CLUSTER_TRACE_UNLOCK, start, 0);
+	}
+	/* Similarly, only a writer can have kept any events */
+	npending = cluster->trace_npending;
+	if(npending)
+	{
+		memcpy(pending, cluster->trace_pending, npending * sizeof(CLUSTERTRACE));
+		cluster->trace_npending = 0;
+	}
+	pthread_rwlock_unlock(&(cluster->lock));
+	if(npending)
+	{
+		cluster_trace_flush_(cluster, pending, npending);
+	}
+#else
 	(void) cluster;
+#endif
+}
 
 #ifdef WITH_PTHREAD
-	pthread_rwlock_unlock(&(cluster->lock));
+/* Initialise the state used to wake a cluster's housekeeping threads; this
+ * is also invoked in the child after a fork(), where another thread may
+ * have held the mutex at the point of forking
+ */
+void
+cluster_wake_init_(CLUSTER *cluster)
+{
+	pthread_condattr_t attr;
+
+	pthread_mutex_init(&(cluster->wake_lock), NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(cluster->wake_cond), &attr);
+	pthread_condattr_destroy(&attr);
+	cluster->wake_events = CW_NONE;
+}
+
+/* Raise events, waking any housekeeping threads waiting for them */
+void
+cluster_wake_(CLUSTER *cluster, CLUSTERWAKE events)
+{
+	pthread_mutex_lock(&(cluster->wake_lock));
+	cluster->wake_events |= events;
+	pthread_cond_broadcast(&(cluster->wake_cond));
+	pthread_mutex_unlock(&(cluster->wake_lock));
+#ifdef ENABLE_ETCD
+	/* The shared housekeeping thread (if running) waits on its own terms */
+	cluster_reactor_wake_();
+#endif
+}
+
+/* Discard any raised events: invoked before housekeeping threads are
+ * (re-)started
+ */
+void
+cluster_wake_reset_(CLUSTER *cluster)
+{
+	pthread_mutex_lock(&(cluster->wake_lock));
+	cluster->wake_events = CW_NONE;
+	pthread_mutex_unlock(&(cluster->wake_lock));
+}
+
+/* Wait for up to the specified number of seconds for any of events (or
+ * CW_LEAVE, which is always included) to be raised. Events other than
+ * CW_LEAVE are consumed by the wait. Returns the events which were raised,
+ * or CW_NONE if the deadline passed.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+CLUSTERWAKE
+cluster_wait_(CLUSTER *cluster, CLUSTERWAKE events, int seconds)
+{
+	struct timespec deadline;
+	unsigned int raised;
+
+	events |= CW_LEAVE;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += seconds;
+	pthread_mutex_lock(&(cluster->wake_lock));
+	while(!(cluster->wake_events & events))
+	{
+		if(pthread_cond_timedwait(&(cluster->wake_cond), &(cluster->wake_lock), &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	raised = cluster->wake_events & events;
+	cluster->wake_events &= ~(raised & ~CW_LEAVE);
+	pthread_mutex_unlock(&(cluster->wake_lock));
+	return (CLUSTERWAKE) raised;
+}
+
+/* Determine, without waiting, whether the housekeeping threads have been
+ * asked to terminate
+ */
+int
+cluster_leaving_(CLUSTER *cluster)
+{
+	int r;
+
+	pthread_mutex_lock(&(cluster->wake_lock));
+	r = (cluster->wake_events & CW_LEAVE) ? 1 : 0;
+	pthread_mutex_unlock(&(cluster->wake_lock));
+	return r;
+}
+
+/* Determine, without waiting or consuming them, which of events have been
+ * raised
+ */
+CLUSTERWAKE
+cluster_woken_(CLUSTER *cluster, CLUSTERWAKE events)
+{
+	unsigned int raised;
+
+	pthread_mutex_lock(&(cluster->wake_lock));
+	raised = cluster->wake_events & events;
+	pthread_mutex_unlock(&(cluster->wake_lock));
+	return (CLUSTERWAKE) raised;
+}
+
+#if defined(CLUSTER_MEM_SHARED) || defined(CLUSTER_WORKER_POOL)
+/* Wait until the counter at word, in memory shared with other processes,
+ * no longer holds value, or the cluster is leaving, or the time given by
+ * boundary (if non-zero) has passed, for up to CLUSTER_SHARED_WAIT seconds.
+ * Whichever process changes the counter should invoke cluster_shared_wake_()
+ * afterwards.
+ *
+ * Where futexes are available, the wait is upon the least significant half
+ * of the counter, which changes whenever the counter is advanced; otherwise,
+ * the counter is polled, less often the longer it remains unchanged.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+void
+cluster_shared_wait_(CLUSTER *cluster, uint64_t *word, uint64_t value, time_t boundary)
+{
+	struct timespec deadline, now, ts;
+#ifdef CLUSTER_SHARED_FUTEX
+	uint32_t *futex;
+
+# if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	futex = ((uint32_t *) (void *) word) + 1;
+# else
+	futex = (uint32_t *) (void *) word;
+# endif
+#else
+	long interval;
+
+	interval = CLUSTER_SHARED_POLL_MIN_MS;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CLUSTER_SHARED_WAIT;
+	if(boundary && boundary < deadline.tv_sec)
+	{
+		deadline.tv_sec = boundary;
+		deadline.tv_nsec = 0;
+	}
+	while(__atomic_load_n(word, __ATOMIC_ACQUIRE) == value && !cluster_leaving_(cluster))
+	{
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if(now.tv_sec > deadline.tv_sec ||
+		   (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec))
+		{
+			break;
+		}
+		ts.tv_sec = deadline.tv_sec - now.tv_sec;
+		ts.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+		if(ts.tv_nsec < 0)
+		{
+			ts.tv_sec--;
+			ts.tv_nsec += 1000000000;
+		}
+#ifdef CLUSTER_SHARED_FUTEX
+		/* Returns immediately if the counter has changed meanwhile */
+		syscall(SYS_futex, futex, FUTEX_WAIT, (uint32_t) value, &ts, NULL, 0);
+#else
+		if(ts.tv_sec || ts.tv_nsec > interval * 1000000)
+		{
+			ts.tv_sec = 0;
+			ts.tv_nsec = interval * 1000000;
+		}
+		nanosleep(&ts, NULL);
+		if(interval < CLUSTER_SHARED_POLL_MAX_MS)
+		{
+			interval *= 2;
+		}
+#endif
+	}
+}
+
+/* Wake the threads (in any process) waiting in cluster_shared_wait_() for
+ * the counter at word to change
+ */
+void
+cluster_shared_wake_(uint64_t *word)
+{
+#ifdef CLUSTER_SHARED_FUTEX
+# if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	syscall(SYS_futex, ((uint32_t *) (void *) word) + 1, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+# else
+	syscall(SYS_futex, (uint32_t *) (void *) word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+# endif
+#else
+	(void) word;
 #endif
 }
+#endif
 
-#if WITH_PTHREAD
 /* Initialse the R/W lock which protects the cluster list */
 static void
 cluster_list_init_(void)
@@ -880,16 +1826,44 @@ cluster_fork_prepare_(void)
 	cluster_list_rdlock_();
 	for(p = cluster_first_; p; p = p->next)
 	{
+		/* Wait for the outcome of any provisional join in progress */
+		cluster_snapshot_prepare_(p);
+#ifdef CLUSTER_WORKER_POOL
+		if(cluster_pool_prepare_(p))
+		{
+			continue;
+		}
+#endif
 		switch(p->type)
 		{
 		case CT_STATIC:
 			break;
+#ifdef CLUSTER_WORKER_POOL
+		case CT_POOL:
+			/* Handled by cluster_pool_prepare_() */
+			break;
+#endif
 		case CT_ETCD:
 			cluster_etcd_prepare_(p);
 			break;
+#ifdef ENABLE_ETCD
+		case CT_ETCD3:
+			cluster_etcd3_prepare_(p);
+			break;
+#endif
 		case CT_SQL:
 			cluster_sql_prepare_(p);
 			break;
+#ifdef ENABLE_MEM
+		case CT_MEM:
+			cluster_mem_prepare_(p);
+			break;
+#endif
+#ifdef CLUSTER_HOST_STATE
+		case CT_HOST:
+			cluster_host_prepare_(p);
+			break;
+#endif
 		}
 	}
 	cluster_list_unlock_();
@@ -901,20 +1875,70 @@ cluster_fork_child_(void)
 {
 	CLUSTER *p;
 
+#ifdef ENABLE_ETCD
+	/* The shared housekeeping thread does not exist in the child */
+	cluster_reactor_child_();
+	/* Nor do the etcd v3 lease keepalive threads */
+	cluster_etcd3_reinit_();
+#endif
+#ifdef ENABLE_MEM
+	/* The in-memory registry locks may have been held by other threads */
+	cluster_mem_reinit_();
+#endif
+#ifdef ENABLE_SQL
+	/* Nor do the SQL registry refresh threads */
+	cluster_sql_reinit_();
+#endif
+	/* The job pool lock may have been held by another thread */
+	cluster_job_reinit_();
 	cluster_list_rdlock_();
 	for(p = cluster_first_; p; p = p->next)
 	{
+#ifdef CLUSTER_WORKER_POOL
+		if(p->pool_forking)
+		{
+			cluster_pool_child_(p);
+		}
+		else
+#endif
 		switch(p->type)
 		{
 		case CT_STATIC:
 			break;
+#ifdef CLUSTER_WORKER_POOL
+		case CT_POOL:
+			/* Handled by cluster_pool_child_() */
+			break;
+#endif
 		case CT_ETCD:
 			cluster_etcd_child_(p);
 			break;
+#ifdef ENABLE_ETCD
+		case CT_ETCD3:
+			cluster_etcd3_child_(p);
+			break;
+#endif
 		case CT_SQL:
 			cluster_sql_child_(p);
 			break;
+#ifdef ENABLE_MEM
+		case CT_MEM:
+			cluster_mem_child_(p);
+			break;
+#endif
+#ifdef CLUSTER_HOST_STATE
+		case CT_HOST:
+			cluster_host_child_(p);
+			break;
+#endif
 		}
+		cluster_log_child_(p);
+		cluster_snapshot_child_(p);
+		/* Readers of the ring in other threads do not exist in the child */
+		p->ring_readers[0] = 0;
+		p->ring_readers[1] = 0;
+		/* A write lock held by another thread is not held in the child */
+		p->locked_at = 0;
 	}
 	cluster_list_unlock_();
 }
@@ -928,17 +1952,45 @@ cluster_fork_parent_(void)
 	cluster_list_rdlock_();
 	for(p = cluster_first_; p; p = p->next)
 	{
+#ifdef CLUSTER_WORKER_POOL
+		if(p->pool_forking)
+		{
+			cluster_pool_parent_(p);
+		}
+		else
+#endif
 		switch(p->type)
 		{
 		case CT_STATIC:
 			break;
+#ifdef CLUSTER_WORKER_POOL
+		case CT_POOL:
+			/* Handled by cluster_pool_parent_() */
+			break;
+#endif
 		case CT_ETCD:
 			cluster_etcd_parent_(p);
 			break;
+#ifdef ENABLE_ETCD
+		case CT_ETCD3:
+			cluster_etcd3_parent_(p);
+			break;
+#endif
 		case CT_SQL:
 			cluster_sql_parent_(p);
 			break;
+#ifdef ENABLE_MEM
+		case CT_MEM:
+			cluster_mem_parent_(p);
+			break;
+#endif
+#ifdef CLUSTER_HOST_STATE
+		case CT_HOST:
+			cluster_host_parent_(p);
+			break;
+#endif
 		}
+		cluster_snapshot_parent_(p);
 	}
 	cluster_list_unlock_();
 }
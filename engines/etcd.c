@@ -23,14 +23,54 @@
 
 #ifdef ENABLE_ETCD
 
+/* The directory, within the environment directory, in which stable slots
+ * are claimed (hidden from listings of the environment directory)
+ */
+# define CLUSTER_ETCD_SLOTDIR           "_slots"
+/* The number of attempts made to claim a slot before giving up */
+# define CLUSTER_ETCD_CLAIM_ATTEMPTS    8
+
+/* The requests which make up a heartbeat performed by the shared
+ * housekeeping thread; see cluster_etcd_beat_()
+ */
+# define CLUSTER_ETCD_BEAT_SLOT         1
+# define CLUSTER_ETCD_BEAT_RESLOT       2
+# define CLUSTER_ETCD_BEAT_RECLAIM      3
+# define CLUSTER_ETCD_BEAT_REFRESH      4
+# define CLUSTER_ETCD_BEAT_SET          5
+# define CLUSTER_ETCD_BEAT_CREATE       6
+
+/* The slots found to be held by cluster_etcd_lowest_() */
+struct cluster_etcd_slots_struct
+{
+	CLUSTER *cluster;
+	long *held;
+	size_t count, size;
+};
+
 static int cluster_etcd_ping_(CLUSTER *cluster, ETCDFLAGS flags);
+static int cluster_etcd_entry_(CLUSTER *cluster, ETCDFLAGS flags, int *written);
 static int cluster_etcd_unping_(CLUSTER *cluster, ETCDFLAGS flags);
 static int cluster_etcd_rejoin_(CLUSTER *cluster);
 static void *cluster_etcd_ping_thread_(void *arg);
 static void *cluster_etcd_balancer_thread_(void *arg);
+static int cluster_etcd_reload_(CLUSTER *cluster, ETCD *dir);
+static int cluster_etcd_resync_(CLUSTER *cluster, ETCD *dir, int force);
+static int cluster_etcd_loaded_(void *data, const char *key, const char *value, ETCDINDEX modified);
+static int cluster_etcd_apply_(CLUSTER *cluster, json_t *change, const char *prefix);
 static int cluster_etcd_balance_(CLUSTER *cluster);
-static const char **cluster_etcd_json_keys_(json_t *dict);
-static int cluster_etcd_sort_(const void *ptra, const void *ptrb);
+static int cluster_etcd_value_(json_t *value);
+static int cluster_etcd_claim_(CLUSTER *cluster);
+static int cluster_etcd_lowest_(CLUSTER *cluster);
+static int cluster_etcd_held_(void *data, const char *key, const char *value, ETCDINDEX modified);
+static char *cluster_etcd_prefix_(CLUSTER *cluster);
+static int cluster_etcd_cancelled_(void *data);
+static int cluster_etcd_attach_(CLUSTER *cluster);
+static void cluster_etcd_detach_(CLUSTER *cluster);
+static int cluster_etcd_beaten_(CLUSTER *cluster, uint64_t start, int r);
+static int cluster_etcd_beat_entry_(CLUSTER *cluster, ETCD *dir, ETCDFLAGS flags, ETCDREQUEST **request);
+static int cluster_etcd_beat_slot_(CLUSTER *cluster, ETCD *dir, const char *value, ETCDFLAGS flags, int step, ETCDREQUEST **request);
+static int cluster_etcd_beat_request_(ETCDREQUEST *request, int step);
 
 /* Join an etcd-based cluster. To do this, we first update the relevant
  * directory with information about ourselves, then spawn a 're-balancing
@@ -54,6 +94,7 @@ cluster_etcd_join_(CLUSTER *cluster)
 		return -1;
 	}
 	etcd_set_verbose(cluster->etcd_root, (cluster->flags & CF_VERBOSE));
+	etcd_set_timeouts(cluster->etcd_root, cluster->connect_timeout, cluster->request_timeout);
 	cluster->etcd_clusterdir = etcd_dir_create(cluster->etcd_root, cluster->key, ETCD_NONE);
 	if(!cluster->etcd_clusterdir)
 	{
@@ -98,6 +139,25 @@ cluster_etcd_join_(CLUSTER *cluster)
 			return -1;
 		}
 	}
+	if(cluster->flags & CF_SLOTS)
+	{
+		/* Slots are claimed in a hidden directory within the environment
+		 * directory, and so don't appear in its listing
+		 */
+		cluster->etcd_slotdir = etcd_dir_create(cluster->etcd_envdir, CLUSTER_ETCD_SLOTDIR, ETCD_NONE);
+		if(!cluster->etcd_slotdir)
+		{
+			cluster->etcd_slotdir = etcd_dir_open(cluster->etcd_envdir, CLUSTER_ETCD_SLOTDIR);
+			if(!cluster->etcd_slotdir)
+			{
+				cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to create or open slot directory for environment '%s/%s'\n", cluster->key, cluster->env);
+				cluster_unlock_(cluster);
+				cluster_etcd_leave_(cluster);
+				return -1;
+			}
+		}
+	}
+	cluster->etcd_published = -1;
 	if(cluster_etcd_ping_(cluster, ETCD_NONE))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to perform initial ping\n");
@@ -105,16 +165,30 @@ cluster_etcd_join_(CLUSTER *cluster)
 		cluster_etcd_leave_(cluster);
 		return -1;
 	}
-	if(cluster_etcd_balance_(cluster))
+	if(cluster_etcd_reload_(cluster, cluster->etcd_envdir) || cluster_etcd_balance_(cluster))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to perform initial balancing\n");
 		cluster_unlock_(cluster);
 		cluster_etcd_leave_(cluster);
 		return -1;
 	}
-	pthread_create(&(cluster->ping_thread), NULL, cluster_etcd_ping_thread_, (void *) cluster);
-	pthread_create(&(cluster->balancer_thread), NULL, cluster_etcd_balancer_thread_, (void *) cluster);
+	cluster_wake_reset_(cluster);
+	if(cluster->flags & CF_SHARED)
+	{
+		if(cluster_etcd_attach_(cluster))
+		{
+			cluster_unlock_(cluster);
+			cluster_etcd_leave_(cluster);
+			return -1;
+		}
+	}
+	else
+	{
+		pthread_create(&(cluster->ping_thread), NULL, cluster_etcd_ping_thread_, (void *) cluster);
+		pthread_create(&(cluster->balancer_thread), NULL, cluster_etcd_balancer_thread_, (void *) cluster);
+	}
 	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
 	cluster_unlock_(cluster);
 	return 0;
 }
@@ -136,6 +210,7 @@ cluster_etcd_leave_(CLUSTER *cluster)
 	if(cluster->flags & CF_JOINED)
 	{
 		cluster->flags |= CF_LEAVING;
+		cluster_wake_(cluster, CW_LEAVE);
 		pt = cluster->ping_thread;
 		bt = cluster->balancer_thread;
 		/* Unlock to allow the threads to read the flag */
@@ -148,12 +223,28 @@ cluster_etcd_leave_(CLUSTER *cluster)
 		{
 			pthread_join(bt, NULL);
 		}
-		/* Re-acquire the lock so that the unwinding can safely complete */
+		/* Stop any shared housekeeping and re-acquire the lock so that the
+		 * unwinding can safely complete
+		 */
+		cluster_etcd_detach_(cluster);
+	}
+	else
+	{
 		cluster_wrlock_(cluster);
 	}
 	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster_publish_locked_(cluster);
 	cluster->ping_thread = 0;
 	cluster->balancer_thread = 0;
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
+	cluster->etcd_index = 0;
+	cluster->etcd_reload = 0;
+	if(cluster->etcd_slotdir)
+	{
+		etcd_dir_close(cluster->etcd_slotdir);
+		cluster->etcd_slotdir = NULL;
+	}
 	if(cluster->etcd_envdir)
 	{
 		etcd_dir_close(cluster->etcd_envdir);
@@ -184,53 +275,406 @@ cluster_etcd_leave_(CLUSTER *cluster)
  * instance identifier and the value is the number of threads in this
  * instance.
  *
- * The cluster should be at least read-locked when invoking this function.
+ * Because writing the entry wakes every other member's balancer thread, we
+ * only do so when the value has actually changed: otherwise, we just extend
+ * the TTL of the existing entry, which etcd does not report to watchers. If
+ * the refresh fails (for example because our entry has expired in the
+ * meantime, or the server predates support for refreshing), we fall back to
+ * writing the entry in full.
+ *
+ * If stable slots are in use, the slot is claimed (or its claim renewed)
+ * first, and the entry's value is "WORKERS:SLOT" (see
+ * cluster_etcd_format_()).
+ *
+ * The cluster should be write-locked when invoking this function; the ping
+ * thread uses cluster_etcd_heartbeat_() instead.
  */
 static int
 cluster_etcd_ping_(CLUSTER *cluster, ETCDFLAGS flags)
+{
+	int r, written;
+
+	if(cluster->etcd_slotdir && cluster_etcd_claim_(cluster))
+	{
+		return -1;
+	}
+	r = cluster_etcd_entry_(cluster, flags, &written);
+	if(written)
+	{
+		cluster->etcd_published = cluster->inst_threads;
+		cluster->etcd_weight = cluster->inst_weight;
+	}
+	return r;
+}
+
+/* Refresh or write our registry entry on behalf of cluster_etcd_ping_():
+ * written is set to 1 if the entry was written in full using the current
+ * worker count and weight, which the caller must then record in
+ * etcd_published and etcd_weight while holding the write lock.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd_entry_(CLUSTER *cluster, ETCDFLAGS flags, int *written)
 {
 	char buf[64];
-	
-	snprintf(buf, sizeof(buf) - 1, "%d", cluster->inst_threads);
-	return etcd_key_set_ttl(cluster->etcd_envdir, cluster->instid, buf, cluster->ttl, flags);
+	int r;
+
+	*written = 0;
+	if(cluster->etcd_published == cluster->inst_threads && cluster->etcd_weight == cluster->inst_weight)
+	{
+		r = etcd_key_refresh_ttl(cluster->etcd_envdir, cluster->instid, cluster->ttl);
+		if(!r)
+		{
+			return 0;
+		}
+		if(r == ETCD_E_KEY_NOT_FOUND)
+		{
+			cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd: registry entry for %s has expired; re-creating it\n", cluster->instid);
+			flags &= ~ETCD_EXISTS;
+		}
+	}
+	cluster_etcd_format_(cluster, (cluster->etcd_slotdir ? cluster->slot : -1), buf, sizeof(buf));
+	r = etcd_key_set_ttl(cluster->etcd_envdir, cluster->instid, buf, cluster->ttl, flags);
+	if(r == ETCD_E_KEY_NOT_FOUND && (flags & ETCD_EXISTS))
+	{
+		r = etcd_key_set_ttl(cluster->etcd_envdir, cluster->instid, buf, cluster->ttl, flags & ~ETCD_EXISTS);
+	}
+	if(!r)
+	{
+		*written = 1;
+	}
+	return r;
 }
 
 /* 'Un-ping' - that is, remove our entry from the directory.
  *
- * The cluster should be at least read-locked when invoking this function.
+ * The cluster should be write-locked when invoking this function.
  */
 static int
 cluster_etcd_unping_(CLUSTER *cluster, ETCDFLAGS flags)
 {
+	char name[32];
+
+	if(cluster->etcd_slotdir && cluster->slot >= 0)
+	{
+		/* Release our slot so that it can be re-used */
+		snprintf(name, sizeof(name), "%d", cluster->slot);
+		etcd_key_delete(cluster->etcd_slotdir, name, ETCD_NONE);
+		cluster->slot = -1;
+	}
 	return etcd_key_delete(cluster->etcd_envdir, cluster->instid, flags);
 }
 
-/* Read the directory from the registry service and determine what our index
- * in the cluster is.
+/* Claim the lowest free stable slot, or renew our claim to the one we hold;
+ * slots are keys in the slot directory whose values are the identifiers of
+ * the members holding them, with the same TTL as our registry entry. If
+ * our claim has lapsed and the slot has since been claimed by another
+ * member, a new one is claimed (and our registry entry re-written).
  *
- * The cluster should be write-locked when invoking this function. The lock
- * may be released and re-acquired during the course of its execution.
+ * The cluster should be write-locked when invoking this function.
  */
 static int
-cluster_etcd_balance_(CLUSTER *cluster)
+cluster_etcd_claim_(CLUSTER *cluster)
 {
-	int total, base, val;
+	char name[32];
+	int r, attempt, slot;
+
+	if(cluster->slot >= 0)
+	{
+		snprintf(name, sizeof(name), "%d", cluster->slot);
+		r = etcd_key_refresh_ttl(cluster->etcd_slotdir, name, cluster->ttl);
+		if(r && r != ETCD_E_KEY_NOT_FOUND)
+		{
+			/* The server may not support refreshing */
+			r = etcd_key_set_ttl(cluster->etcd_slotdir, name, cluster->instid, cluster->ttl, ETCD_EXISTS);
+		}
+		if(r == ETCD_E_KEY_NOT_FOUND)
+		{
+			/* Our claim lapsed: reclaim the slot if nobody else has */
+			r = etcd_key_set_ttl(cluster->etcd_slotdir, name, cluster->instid, cluster->ttl, ETCD_CREATE);
+		}
+		if(!r)
+		{
+			return 0;
+		}
+		if(r != ETCD_E_NODE_EXIST)
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to renew claim to slot %d\n", cluster->slot);
+			return -1;
+		}
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd: slot %d has been claimed by another member; claiming another\n", cluster->slot);
+		cluster->slot = -1;
+	}
+	for(attempt = 0; attempt < CLUSTER_ETCD_CLAIM_ATTEMPTS; attempt++)
+	{
+		slot = cluster_etcd_lowest_(cluster);
+		if(slot < 0)
+		{
+			return -1;
+		}
+		if(cluster->slot >= 0)
+		{
+			/* We already hold a slot (for example, following a fork) */
+			break;
+		}
+		snprintf(name, sizeof(name), "%d", slot);
+		r = etcd_key_set_ttl(cluster->etcd_slotdir, name, cluster->instid, cluster->ttl, ETCD_CREATE);
+		if(!r)
+		{
+			cluster->slot = slot;
+			break;
+		}
+		if(r != ETCD_E_NODE_EXIST)
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to claim slot %d\n", slot);
+			return -1;
+		}
+		/* Another member claimed it first: try again */
+	}
+	if(cluster->slot < 0)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to claim a slot after %d attempts\n", attempt);
+		return -1;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: holding slot %d\n", cluster->slot);
+	}
+	/* Our entry must be re-written to include the new slot */
+	cluster->etcd_published = -1;
+	return 0;
+}
+
+/* Read the slot directory and return the lowest slot which isn't held;
+ * if we are found to hold a slot already, cluster->slot is set to it.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd_lowest_(CLUSTER *cluster)
+{
+	struct cluster_etcd_slots_struct s;
+	unsigned char *held;
 	size_t n;
-	const char **keys;
-	json_t *dict, *entry, *value;
+	int slot;
+
+	s.cluster = cluster;
+	s.held = NULL;
+	s.count = s.size = 0;
+	if(etcd_dir_list(cluster->etcd_slotdir, cluster_etcd_held_, (void *) &s, NULL))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to retrieve slot directory\n");
+		free(s.held);
+		return -1;
+	}
+	/* The lowest free slot can be no higher than the number held */
+	held = (unsigned char *) calloc(s.count + 1, 1);
+	if(!held)
+	{
+		free(s.held);
+		return -1;
+	}
+	for(n = 0; n < s.count; n++)
+	{
+		if(s.held[n] >= 0 && (size_t) s.held[n] <= s.count)
+		{
+			held[s.held[n]] = 1;
+		}
+	}
+	free(s.held);
+	for(slot = 0; held[slot]; slot++);
+	free(held);
+	return slot;
+}
+
+/* Record a slot entry retrieved by cluster_etcd_lowest_() */
+static int
+cluster_etcd_held_(void *data, const char *key, const char *value, ETCDINDEX modified)
+{
+	struct cluster_etcd_slots_struct *s;
+	long *p;
+	size_t n;
+
+	(void) modified;
 
+	s = (struct cluster_etcd_slots_struct *) data;
+	if(s->count == s->size)
+	{
+		n = (s->size ? s->size * 2 : 16);
+		p = (long *) realloc(s->held, n * sizeof(long));
+		if(!p)
+		{
+			return -1;
+		}
+		s->held = p;
+		s->size = n;
+	}
+	s->held[s->count] = strtol(key, NULL, 10);
+	if(s->held[s->count] >= 0 && !strcmp(value, s->cluster->instid))
+	{
+		s->cluster->slot = (int) s->held[s->count];
+	}
+	s->count++;
+	return 0;
+}
+
+/* Read the whole directory from the registry service and replace the
+ * contents of the member table with it. This only needs to happen when
+ * joining, or if etcd no longer holds enough history for us to be able to
+ * resume watching for changes from where we left off.
+ *
+ * If the directory can't be read, the member table is left as it was, and
+ * the balancer re-reads the directory before waiting for changes again.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd_reload_(CLUSTER *cluster, ETCD *dir)
+{
+	CLUSTERMEMBERSTASH stash;
+	ETCDINDEX current;
+	uint64_t start;
+	int r;
+	
 	if(cluster->flags & CF_VERBOSE)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: reading state from registry directory\n");
 	}
-	base = -1;
-	if(etcd_dir_get(cluster->etcd_envdir, &dict))
+	/* Entries are listed in order of key, and so are each appended to the
+	 * (new) member table rather than inserted into it
+	 */
+	cluster_members_stash_(cluster, &stash);
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_FETCH);
+	r = etcd_dir_list(dir, cluster_etcd_loaded_, (void *) cluster, &current);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_FETCH, start, (r ? -1 : 0));
+	cluster_members_unstash_(cluster, &stash, r);
+	if(r)
 	{
 		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to retrieve cluster directory\n");
+		/* Any change which prompted the re-read has already been
+		 * consumed, and so waiting from where we were would miss it
+		 */
+		cluster->etcd_index = 0;
+		cluster->etcd_reload = 1;
+		return -1;
+	}
+	cluster->etcd_reload = 0;
+	/* If etcd didn't tell us its current index, we can only wait for
+	 * whatever the next change happens to be.
+	 */
+	cluster->etcd_index = (current ? current + 1 : 0);
+	return 0;
+}
+
+/* Add an entry retrieved by cluster_etcd_reload_() to the member table */
+static int
+cluster_etcd_loaded_(void *data, const char *key, const char *value, ETCDINDEX modified)
+{
+	CLUSTER *cluster;
+
+	cluster = (CLUSTER *) data;
+	if(cluster_member_set_(cluster, key, cluster_etcd_workers_(value), cluster_etcd_weight_(value), cluster_etcd_slot_(value), modified) < 0)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to update member table\n");
 		return -1;
 	}
-	keys = cluster_etcd_json_keys_(dict);
+	return 0;
+}
+
+/* Apply a single change notification received from the registry to the
+ * member table. Returns 0 if the change was applied, -1 if it was not
+ * relevant to the member table (for example, a change to a slot claim,
+ * which the recursive wait also reports), or 1 if the directory must be
+ * re-read in full.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd_apply_(CLUSTER *cluster, json_t *change, const char *prefix)
+{
+	json_t *action, *node, *key, *index;
+	const char *str, *name;
+	size_t plen;
+	ETCDINDEX modified;
+
+	action = json_object_get(change, "action");
+	node = json_object_get(change, "node");
+	if(!json_is_string(action) || !json_is_object(node))
+	{
+		return 1;
+	}
+	index = json_object_get(node, "modifiedIndex");
+	if(!json_is_integer(index))
+	{
+		/* Without an index we can't reliably resume watching */
+		return 1;
+	}
+	modified = (ETCDINDEX) json_integer_value(index);
+	cluster->etcd_index = modified + 1;
+	key = json_object_get(node, "key");
+	if(!json_is_string(key))
+	{
+		return 1;
+	}
+	str = json_string_value(key);
+	plen = strlen(prefix);
+	if(strncmp(str, prefix, plen))
+	{
+		if(!strncmp(str, prefix, plen - 1) && !str[plen - 1])
+		{
+			/* The directory itself has changed */
+			return 1;
+		}
+		return -1;
+	}
+	name = str + plen;
+	if(!*name || strchr(name, '/') || json_is_true(json_object_get(node, "dir")))
+	{
+		/* Not a member entry */
+		return -1;
+	}
+	str = json_string_value(action);
+	if(!strcmp(str, "set") || !strcmp(str, "create") ||
+	   !strcmp(str, "update") || !strcmp(str, "compareAndSwap"))
+	{
+		if(cluster_member_set_(cluster, name, cluster_etcd_value_(json_object_get(node, "value")), cluster_etcd_weight_(json_string_value(json_object_get(node, "value"))), cluster_etcd_slot_(json_string_value(json_object_get(node, "value"))), modified) < 0)
+		{
+			return 1;
+		}
+		return 0;
+	}
+	if(!strcmp(str, "delete") || !strcmp(str, "expire") ||
+	   !strcmp(str, "compareAndDelete"))
+	{
+		cluster_member_remove_(cluster, name);
+		return 0;
+	}
+	cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd: unexpected action '%s' on %s; will re-read directory\n", str, name);
+	return 1;
+}
+
+/* Determine what our index in the cluster is from the member table.
+ *
+ * The cluster should be write-locked when invoking this function. The lock
+ * may be released and re-acquired during the course of its execution.
+ */
+static int
+cluster_etcd_balance_(CLUSTER *cluster)
+{
+	int total, base;
+	size_t n;
+	CLUSTERMEMBER **order, *m;
+	uint64_t start;
+
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	base = -1;
 	total = 0;
+	if(!(order = cluster_members_order_(cluster)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to allocate member order\n");
+		return -1;
+	}
 	if(cluster->flags & CF_VERBOSE)
 	{
 		if(cluster->partition)
@@ -242,20 +686,10 @@ cluster_etcd_balance_(CLUSTER *cluster)
 			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: re-balancing cluster %s/%s:\n", cluster->key, cluster->env);
 		}			
 	}
-	for(n = 0; keys[n]; n++)
+	for(n = 0; n < cluster->nmembers; n++)
 	{
-		entry = json_object_get(dict, keys[n]);
-		if(!entry || !json_is_object(entry))
-		{
-			continue;
-		}
-		value = json_object_get(entry, "value");
-		if(!value)
-		{
-			continue;
-		}
-		val = json_integer_value(value);
-		if(!strcmp(keys[n], cluster->instid))
+		m = order[n];
+		if(!strcmp(m->instid, cluster->instid))
 		{
 			if(cluster->flags & CF_VERBOSE)
 			{
@@ -267,13 +701,18 @@ cluster_etcd_balance_(CLUSTER *cluster)
 		{
 			if(cluster->flags & CF_VERBOSE)
 			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "  %s [%d]\n", keys[n], total);
+				cluster_logf_locked_(cluster, LOG_DEBUG, "  %s [%d]\n", m->instid, total);
 			}
 		}
-		total += val;
+		total += m->workers;
 	}
-	free(keys);
-	json_decref(dict);
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
 	if(total != cluster->total_threads || base != cluster->inst_index)
 	{
 		if(base == -1)
@@ -300,6 +739,7 @@ cluster_etcd_balance_(CLUSTER *cluster)
 		}
 		cluster->inst_index = base;
 		cluster->total_threads = total;
+		cluster_publish_locked_(cluster);
 		cluster_unlock_(cluster);
 		cluster_rebalanced_(cluster);
 		/* Re-acquire the lock to restore state */
@@ -322,6 +762,7 @@ cluster_etcd_prepare_(CLUSTER *p)
 	}
 	flags = p->flags;
 	p->flags |= CF_LEAVING;
+	cluster_wake_(p, CW_LEAVE);
 	pt = p->ping_thread;
 	bt = p->balancer_thread;
 	cluster_unlock_(p);
@@ -333,11 +774,12 @@ cluster_etcd_prepare_(CLUSTER *p)
 	{
 		pthread_join(bt, NULL);
 	}
-	cluster_wrlock_(p);
+	cluster_etcd_detach_(p);
 	p->ping_thread = 0;
 	p->balancer_thread = 0;
 	p->inst_index = -1;
 	p->total_threads = 0;
+	cluster_publish_locked_(p);
 	cluster_rebalanced_(p);
 	if(p->flags & CF_VERBOSE)
 	{
@@ -354,6 +796,7 @@ cluster_etcd_child_(CLUSTER *p)
 
 	r = 0;
 	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
 	cluster_wrlock_(p);
 	if(p->forkmode & CLUSTER_FORK_CHILD)
 	{
@@ -407,16 +850,22 @@ cluster_etcd_parent_(CLUSTER *p)
 static int
 cluster_etcd_rejoin_(CLUSTER *cluster)
 {
+	cluster->etcd_published = -1;
 	if(cluster_etcd_ping_(cluster, ETCD_NONE))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to perform initial ping\n");
 		return -1;
 	}
-	if(cluster_etcd_balance_(cluster))
+	if(cluster_etcd_reload_(cluster, cluster->etcd_envdir) || cluster_etcd_balance_(cluster))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to perform initial balancing\n");
 		return -1;
 	}
+	cluster_wake_reset_(cluster);
+	if(cluster->flags & CF_SHARED)
+	{
+		return cluster_etcd_attach_(cluster);
+	}
 	pthread_create(&(cluster->ping_thread), NULL, cluster_etcd_ping_thread_, (void *) cluster);
 	pthread_create(&(cluster->balancer_thread), NULL, cluster_etcd_balancer_thread_, (void *) cluster);
 	return 0;
@@ -429,81 +878,73 @@ static void *
 cluster_etcd_ping_thread_(void *arg)
 {
 	CLUSTER *cluster;
-	int refresh, count, verbose;
+	int refresh, wait;
 	
 	cluster = (CLUSTER *) arg;
 
 	cluster_rdlock_(cluster);
-	verbose = (cluster->flags & CF_VERBOSE);
 	refresh = cluster->refresh;
-	count = refresh;
+	wait = refresh;
 	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: ping thread starting with ttl=%d, refresh=%d\n", cluster->ttl, cluster->refresh);
 	cluster_unlock_(cluster);
 
 	/* The cluster lock is not held at the start of each pass */
 	for(;;)
 	{
+		/* Wait until the refresh time arrives, or until we're woken
+		 * because we should ping early (e.g., because the worker count
+		 * has changed) or terminate
+		 */
+		cluster_wait_(cluster, CW_PING, wait);
 		/* Check the flags within a read-lock */
 		cluster_rdlock_(cluster);
-		verbose = (cluster->flags & CF_VERBOSE);
 		if(cluster->flags & CF_LEAVING)
 		{
 			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: 'leaving' flag has been set, will terminate ping thread\n");
 			cluster_unlock_(cluster);
 			break;
 		}
-		if(count <= refresh)
-		{
-			/* We haven't yet hit the refresh time, sleep-and-loop until it
-			 * arrives.
-			 */
-			cluster_unlock_(cluster);
-			sleep(1);
-			count++;
-			continue;
-		}
-		if(cluster_etcd_ping_(cluster, ETCD_EXISTS))
-		{
-			/* TODO: if pinging fails, we should try to re-open the
-			 *       directories, and if that fails we should leave the
-			 *       cluster.
-			 */
-			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to update registry\n");
-			cluster_unlock_(cluster);
-			/* Short retry in case of transient problems */
-			sleep(5);
-			continue;
-		}
-		count = 0;
-		if(verbose)
-		{
-			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: updated registry with %s=%d\n", cluster->instid, cluster->inst_threads);
-		}
 		cluster_unlock_(cluster);
+		/* Short retry in case of transient problems */
+		wait = (cluster_etcd_heartbeat_(cluster) ? 5 : refresh);
 	}
-	cluster_rdlock_(cluster);
+	/* Releasing our slot alters cluster->slot */
+	cluster_wrlock_(cluster);
 	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: ping thread is terminating\n");
 	cluster_etcd_unping_(cluster, ETCD_NONE);
 	cluster_unlock_(cluster);
 	return NULL;
 }
 
-/* Re-balancing thread: listen for changes to the etcd directory and
- * invoke cluster_etcd_balance_() (which may invoke the re-balancing callback)
- * when they occur.
+/* Re-balancing thread: listen for changes to the etcd directory, apply
+ * them to the member table, and invoke cluster_etcd_balance_() (which may
+ * invoke the re-balancing callback) when they occur.
  */
 static void *
 cluster_etcd_balancer_thread_(void *arg)
 {
 	CLUSTER *cluster;
 	ETCD *dir;
-	int r, verbose;
+	int r, verbose, delay;
+	ETCDINDEX index;
+	char *prefix;
 	json_t *change;
 
 	cluster = (CLUSTER *) arg;
 	cluster_rdlock_(cluster);
 	verbose = (cluster->flags & CF_VERBOSE);
 	dir = etcd_clone(cluster->etcd_envdir);
+	prefix = cluster_etcd_prefix_(cluster);
+	if(!dir || !prefix)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to initialise re-balancing thread\n");
+		cluster_unlock_(cluster);
+		etcd_dir_close(dir);
+		free(prefix);
+		return NULL;
+	}
+	/* Allow waits for changes to be interrupted when leaving */
+	etcd_set_cancel(dir, cluster_etcd_cancelled_, (void *) cluster);
 	if(cluster->partition)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: re-balancing thread started for %s[%s]/%s at <%s>\n", cluster->key, cluster->partition, cluster->env, cluster->registry);
@@ -518,6 +959,7 @@ cluster_etcd_balancer_thread_(void *arg)
 	for(;;)
 	{
 		r = 0;
+		cluster_etcd_settle_(cluster);
 		/* Check the flags within a read-lock */
 		cluster_rdlock_(cluster);
 		verbose = (cluster->flags & CF_VERBOSE);
@@ -527,15 +969,27 @@ cluster_etcd_balancer_thread_(void *arg)
 			cluster_unlock_(cluster);
 			break;
 		}
+		if(cluster->etcd_reload)
+		{
+			/* A previous attempt to re-read the directory failed */
+			cluster_unlock_(cluster);
+			delay = cluster_etcd_changed_(cluster, dir, prefix, 0, 0, NULL);
+			if(delay)
+			{
+				cluster_wait_(cluster, CW_NONE, delay);
+			}
+			continue;
+		}
+		index = cluster->etcd_index;
 		if(verbose)
 		{
 			if(cluster->partition)
 			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s[%s]/%s from index %llu\n", cluster->key, cluster->partition, cluster->env, index);
 			}
 			else
 			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s/%s\n", cluster->key, cluster->env);
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s/%s from index %llu\n", cluster->key, cluster->env, index);
 			}
 		}
 		/* Wait for changes to the directory; we must release the acquired
@@ -544,68 +998,559 @@ cluster_etcd_balancer_thread_(void *arg)
 		 */
 		cluster_unlock_(cluster);
 		change = NULL;
-		r = etcd_dir_wait(cluster->etcd_envdir, ETCD_RECURSE, &change);
-		if(change)
-		{
-			json_decref(change);
-		}
+		r = etcd_dir_wait_index(dir, ETCD_RECURSE, index, &change);
 		if(verbose)
 		{
 			cluster_logf_(cluster, LOG_DEBUG, "libcluster: etcd: wait result was %d\n", r);
 		}
-		if(r)
+		if(r && (cluster_leaving_(cluster) || !cluster_settle_wait_(cluster)))
 		{
-			cluster_logf_(cluster, LOG_WARNING, "libcluster: etcd: failed to receive changes from registry\n");
-			sleep(30);
+			/* The wait was abandoned because we're leaving, or so that
+			 * deferred re-balancing can be performed
+			 */
+			json_decref(change);
 			continue;
 		}
-		/* Acquire the write-lock before re-balancing */
-		cluster_wrlock_(cluster);  
-		if(cluster_etcd_balance_(cluster))
-		{			
-			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to balance cluster in response to changes\n");
-			cluster_unlock_(cluster);
-			continue;
+		delay = cluster_etcd_changed_(cluster, dir, prefix, r, index, change);
+		if(delay)
+		{
+			cluster_wait_(cluster, CW_NONE, delay);
 		}
-		cluster_unlock_(cluster);
 	}
 	cluster_logf_(cluster, LOG_DEBUG, "libcluster: etcd: balancing thread is terminating\n");
 	etcd_dir_close(dir);
+	free(prefix);
 	return NULL;
 }
 
-/* Return a sorted array containing the keys from a JSON object */
-static const char **
-cluster_etcd_json_keys_(json_t *dict)
+/* Refresh our entry in the registry, logging the outcome; invoked
+ * periodically by the ping thread or the shared housekeeping thread.
+ *
+ * Claiming a slot alters cluster->slot, and so is performed with the write
+ * lock held; the entry itself is refreshed under the read lock, and what
+ * was written recorded under the write lock afterwards.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_etcd_heartbeat_(CLUSTER *cluster)
 {
-	const char **keys;
-	json_t *value;
-	const char *key;
-	size_t n;
+	uint64_t start;
+	int r, slots, written, threads, weight;
 
-	keys = (const char **) calloc(json_object_size(dict) + 1, sizeof(const char *));
-	if(!keys)
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_PING);
+	r = 0;
+	cluster_rdlock_(cluster);
+	slots = (cluster->etcd_slotdir != NULL);
+	cluster_unlock_(cluster);
+	if(slots)
 	{
-		return NULL;
+		cluster_wrlock_(cluster);
+		if(!(cluster->flags & CF_LEAVING))
+		{
+			r = cluster_etcd_claim_(cluster);
+		}
+		cluster_unlock_(cluster);
+	}
+	written = 0;
+	cluster_rdlock_(cluster);
+	if(cluster->flags & CF_LEAVING)
+	{
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	threads = cluster->inst_threads;
+	weight = cluster->inst_weight;
+	if(!r)
+	{
+		r = cluster_etcd_entry_(cluster, ETCD_EXISTS, &written);
+	}
+	r = cluster_etcd_beaten_(cluster, start, r);
+	cluster_unlock_(cluster);
+	if(written)
+	{
+		cluster_wrlock_(cluster);
+		cluster->etcd_published = threads;
+		cluster->etcd_weight = weight;
+		cluster_unlock_(cluster);
+	}
+	return r;
+}
+
+/* Record and log the outcome (r) of a heartbeat which began at start
+ *
+ * The cluster should be read-locked when invoking this function.
+ */
+static int
+cluster_etcd_beaten_(CLUSTER *cluster, uint64_t start, int r)
+{
+	cluster_stats_record_(&(cluster->stats.ping), start);
+	cluster_trace_end_(cluster, CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+	if(r)
+	{
+		/* TODO: if pinging fails, we should try to re-open the
+		 *       directories, and if that fails we should leave the
+		 *       cluster.
+		 */
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to update registry\n");
+		/* Every caller retries shortly afterwards */
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		return -1;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: updated registry with %s=%d\n", cluster->instid, cluster->inst_threads);
+	}
+	return 0;
+}
+
+/* Perform a step of a heartbeat on behalf of the shared housekeeping
+ * thread, which drives the requests involved without blocking, using dir
+ * (a handle for the environment directory belonging to that thread). The
+ * steps are those of cluster_etcd_ping_() and cluster_etcd_claim_(). If
+ * step is zero, a new heartbeat is begun; otherwise, status is the
+ * outcome of the request made for that step.
+ *
+ * Returns the (positive) step of the next request, which is stored in
+ * request and must be performed by the caller; zero if the heartbeat has
+ * completed successfully, or -1 if it has failed; or CLUSTER_ETCD_BEAT_SYNC
+ * if a slot must be claimed, in which case the heartbeat must instead be
+ * performed in full by cluster_etcd_heartbeat_().
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_etcd_beat_(CLUSTER *cluster, ETCD *dir, int step, int status, ETCDREQUEST **request)
+{
+	int r, slot;
+
+	*request = NULL;
+	r = -1;
+	cluster_rdlock_(cluster);
+	slot = cluster->slot;
+	switch(step)
+	{
+	case 0:
+		cluster->reactor_beatstart = cluster_trace_begin_(cluster, CLUSTER_TRACE_PING);
+		if(!cluster->etcd_slotdir)
+		{
+			r = cluster_etcd_beat_entry_(cluster, dir, ETCD_EXISTS, request);
+			break;
+		}
+		if(slot < 0)
+		{
+			cluster_unlock_(cluster);
+			return CLUSTER_ETCD_BEAT_SYNC;
+		}
+		r = cluster_etcd_beat_slot_(cluster, dir, NULL, ETCD_REFRESH, CLUSTER_ETCD_BEAT_SLOT, request);
+		break;
+	case CLUSTER_ETCD_BEAT_SLOT:
+	case CLUSTER_ETCD_BEAT_RESLOT:
+		if(!status)
+		{
+			r = cluster_etcd_beat_entry_(cluster, dir, ETCD_EXISTS, request);
+		}
+		else if(status == ETCD_E_KEY_NOT_FOUND)
+		{
+			/* Our claim lapsed: reclaim the slot if nobody else has */
+			r = cluster_etcd_beat_slot_(cluster, dir, cluster->instid, ETCD_CREATE, CLUSTER_ETCD_BEAT_RECLAIM, request);
+		}
+		else if(step == CLUSTER_ETCD_BEAT_SLOT)
+		{
+			/* The server may not support refreshing */
+			r = cluster_etcd_beat_slot_(cluster, dir, cluster->instid, ETCD_EXISTS, CLUSTER_ETCD_BEAT_RESLOT, request);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to renew claim to slot %d\n", slot);
+		}
+		break;
+	case CLUSTER_ETCD_BEAT_RECLAIM:
+		if(!status)
+		{
+			r = cluster_etcd_beat_entry_(cluster, dir, ETCD_EXISTS, request);
+			break;
+		}
+		if(status != ETCD_E_NODE_EXIST)
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to renew claim to slot %d\n", slot);
+			break;
+		}
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd: slot %d has been claimed by another member; claiming another\n", slot);
+		cluster_unlock_(cluster);
+		cluster_wrlock_(cluster);
+		cluster->slot = -1;
+		cluster_unlock_(cluster);
+		return CLUSTER_ETCD_BEAT_SYNC;
+	case CLUSTER_ETCD_BEAT_REFRESH:
+		if(!status)
+		{
+			r = 0;
+			break;
+		}
+		if(status == ETCD_E_KEY_NOT_FOUND)
+		{
+			cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd: registry entry for %s has expired; re-creating it\n", cluster->instid);
+		}
+		r = cluster_etcd_beat_entry_(cluster, dir, (status == ETCD_E_KEY_NOT_FOUND ? ETCD_NONE : ETCD_EXISTS), request);
+		break;
+	case CLUSTER_ETCD_BEAT_SET:
+	case CLUSTER_ETCD_BEAT_CREATE:
+		if(status == ETCD_E_KEY_NOT_FOUND && step == CLUSTER_ETCD_BEAT_SET)
+		{
+			r = cluster_etcd_beat_entry_(cluster, dir, ETCD_NONE, request);
+			break;
+		}
+		if(status)
+		{
+			break;
+		}
+		/* Record what was written, as cluster_etcd_ping_() does */
+		cluster_unlock_(cluster);
+		cluster_wrlock_(cluster);
+		cluster->etcd_published = cluster->reactor_threads;
+		cluster->etcd_weight = cluster->reactor_weight;
+		r = 0;
+		break;
+	}
+	if(r > 0)
+	{
+		cluster_unlock_(cluster);
+		return r;
+	}
+	r = cluster_etcd_beaten_(cluster, cluster->reactor_beatstart, r);
+	cluster_unlock_(cluster);
+	return r;
+}
+
+/* Prepare the request which refreshes or writes our registry entry as part
+ * of a heartbeat, as cluster_etcd_ping_() would, returning its step
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd_beat_entry_(CLUSTER *cluster, ETCD *dir, ETCDFLAGS flags, ETCDREQUEST **request)
+{
+	char buf[64];
+
+	if((flags & ETCD_EXISTS) && cluster->etcd_published == cluster->inst_threads && cluster->etcd_weight == cluster->inst_weight)
+	{
+		*request = etcd_key_set_request(dir, cluster->instid, NULL, cluster->ttl, ETCD_REFRESH);
+		return cluster_etcd_beat_request_(*request, CLUSTER_ETCD_BEAT_REFRESH);
+	}
+	/* The values written are recorded once the request has succeeded */
+	cluster->reactor_threads = cluster->inst_threads;
+	cluster->reactor_weight = cluster->inst_weight;
+	cluster_etcd_format_(cluster, (cluster->etcd_slotdir ? cluster->slot : -1), buf, sizeof(buf));
+	*request = etcd_key_set_request(dir, cluster->instid, buf, cluster->ttl, flags);
+	return cluster_etcd_beat_request_(*request, (flags & ETCD_EXISTS) ? CLUSTER_ETCD_BEAT_SET : CLUSTER_ETCD_BEAT_CREATE);
+}
+
+/* Prepare a request which refreshes or writes our slot claim as part of a
+ * heartbeat, returning step; the slot directory is within the environment
+ * directory, and so dir is used for these requests too
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd_beat_slot_(CLUSTER *cluster, ETCD *dir, const char *value, ETCDFLAGS flags, int step, ETCDREQUEST **request)
+{
+	char name[48];
+
+	snprintf(name, sizeof(name), "%s/%d", CLUSTER_ETCD_SLOTDIR, cluster->slot);
+	*request = etcd_key_set_request(dir, name, value, cluster->ttl, flags);
+	return cluster_etcd_beat_request_(*request, step);
+}
+
+/* Return step if request was prepared successfully, or -1 otherwise */
+static int
+cluster_etcd_beat_request_(ETCDREQUEST *request, int step)
+{
+	return (request ? step : -1);
+}
+
+/* Process the outcome of waiting for changes to the registry from index:
+ * status is the result of the wait, and change (which is released) the
+ * change reported, if any. dir is the directory handle used for the wait.
+ * Returns the number of seconds to wait before waiting for further changes.
+ *
+ * If the directory must be re-read before waiting again (etcd_reload is
+ * set), this is invoked with a status of zero and no change instead.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_etcd_changed_(CLUSTER *cluster, ETCD *dir, const char *prefix, int status, ETCDINDEX index, json_t *change)
+{
+	int r;
+
+	cluster_stats_count_(&(cluster->stats.wakeups));
+	cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+	if(status == ETCD_E_INDEX_CLEARED)
+	{
+		/* We've fallen too far behind for etcd to be able to tell us
+		 * what changed, so the only option is to start again
+		 */
+		cluster_logf_(cluster, LOG_NOTICE, "libcluster: etcd: registry history has been cleared since index %llu; re-reading directory\n", index);
+		return cluster_etcd_resync_(cluster, dir, 1);
+	}
+	if(status)
+	{
+		cluster_logf_(cluster, LOG_WARNING, "libcluster: etcd: failed to receive changes from registry\n");
+		json_decref(change);
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		return 30;
+	}
+	if(!change)
+	{
+		/* The request completed without reporting any changes, or the
+		 * directory must be re-read
+		 */
+		return cluster_etcd_resync_(cluster, dir, 0);
+	}
+	/* Acquire the write-lock before re-balancing */
+	cluster_wrlock_(cluster);
+	r = (cluster->etcd_reload ? 1 : cluster_etcd_apply_(cluster, change, prefix));
+	if(r > 0 && cluster_etcd_reload_(cluster, dir))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to apply changes from registry\n");
+		cluster_unlock_(cluster);
+		json_decref(change);
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		return 30;
+	}
+	json_decref(change);
+	if(r < 0)
+	{
+		/* The membership is unchanged, and so re-balancing isn't needed */
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	/* Allow further changes to arrive before re-balancing, if configured
+	 * to; cluster_etcd_settle_() will perform it when due
+	 */
+	if(!cluster_settle_locked_(cluster) && cluster_etcd_balance_(cluster))
+	{			
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to balance cluster in response to changes\n");
+		cluster_stats_count_(&(cluster->stats.errors));
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Re-read the directory and re-balance if force is set, or if a previous
+ * attempt to re-read it failed. Returns the number of seconds to wait
+ * before waiting for further changes.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static int
+cluster_etcd_resync_(CLUSTER *cluster, ETCD *dir, int force)
+{
+	cluster_wrlock_(cluster);
+	if(!force && !cluster->etcd_reload)
+	{
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	if(cluster_etcd_reload_(cluster, dir) || cluster_etcd_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to balance cluster after re-reading directory\n");
+		cluster_unlock_(cluster);
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		return 30;
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Begin servicing the cluster from the shared housekeeping thread, which
+ * waits for changes and refreshes our entry using handles of its own for
+ * the directory
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd_attach_(CLUSTER *cluster)
+{
+	ETCD *dir, *pingdir;
+	char *prefix;
+
+	dir = etcd_clone(cluster->etcd_envdir);
+	pingdir = etcd_clone(cluster->etcd_envdir);
+	prefix = cluster_etcd_prefix_(cluster);
+	if(!dir || !pingdir || !prefix || cluster_reactor_attach_(cluster, dir, pingdir, prefix))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd: failed to attach cluster to the shared housekeeping thread\n");
+		etcd_dir_close(dir);
+		etcd_dir_close(pingdir);
+		free(prefix);
+		return -1;
+	}
+	return 0;
+}
+
+/* Stop servicing the cluster from the shared housekeeping thread, if it was
+ * being, removing our entry from the registry as the ping thread would
+ * have done; the cluster is write-locked on return.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_etcd_detach_(CLUSTER *cluster)
+{
+	int attached;
+
+	attached = cluster_reactor_detach_(cluster);
+	cluster_wrlock_(cluster);
+	if(attached)
+	{
+		cluster_etcd_unping_(cluster, ETCD_NONE);
+	}
+}
+
+/* Invoked by libetcd during the balancer thread's requests: abandon them if
+ * the thread should terminate, or if deferred re-balancing has fallen due
+ */
+static int
+cluster_etcd_cancelled_(void *data)
+{
+	return cluster_leaving_((CLUSTER *) data) || !cluster_settle_wait_((CLUSTER *) data);
+}
+
+/* Perform any re-balancing which was deferred to allow the membership to
+ * settle, if it has fallen due
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+void
+cluster_etcd_settle_(CLUSTER *cluster)
+{
+	if(cluster_settle_wait_(cluster))
+	{
+		return;
 	}
-	n = 0;
-	json_object_foreach(dict, key, value)
+	cluster_wrlock_(cluster);
+	if(!(cluster->flags & CF_LEAVING) && cluster_settled_locked_(cluster) &&
+	   cluster_etcd_balance_(cluster))
 	{
-		keys[n] = key;
-		n++;
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd: failed to balance cluster in response to changes\n");
 	}
-	qsort(keys, n, sizeof(const char *), cluster_etcd_sort_);
-	return keys;
+	cluster_unlock_(cluster);
 }
 
+/* Obtain a value from a registry entry: etcd stores values as strings, but
+ * tolerate integers too.
+ */
 static int
-cluster_etcd_sort_(const void *ptra, const void *ptrb)
+cluster_etcd_value_(json_t *value)
+{
+	if(json_is_integer(value))
+	{
+		return (int) json_integer_value(value);
+	}
+	return cluster_etcd_workers_(json_string_value(value));
+}
+
+/* Obtain the number of workers from a registry entry's value; the value's
+ * form is shared by the etcd v3 engine, which uses the same functions
+ */
+int
+cluster_etcd_workers_(const char *value)
+{
+	return (value ? (int) strtol(value, NULL, 10) : 0);
+}
+
+/* Obtain the stable slot from a registry entry's value, which has the form
+ * "WORKERS:SLOT" if the member has claimed one; returns -1 if it has not
+ */
+int
+cluster_etcd_slot_(const char *value)
+{
+	const char *s;
+
+	if(!value || !(s = strchr(value, ':')))
+	{
+		return -1;
+	}
+	return (int) strtol(s + 1, NULL, 10);
+}
+
+/* Obtain the capacity weight from a registry entry's value, which ends
+ * "/WEIGHT" if it is other than 1; returns 1 if it does not
+ */
+int
+cluster_etcd_weight_(const char *value)
 {
-	const char **a, **b;
+	const char *s;
+
+	if(!value || !(s = strchr(value, '/')))
+	{
+		return 1;
+	}
+	return (int) strtol(s + 1, NULL, 10);
+}
 
-	a = (const char **) ptra;
-	b = (const char **) ptrb;
-	return strcmp(*a, *b);
+/* Format the value of our registry entry: "WORKERS", followed by ":SLOT"
+ * if a slot has been claimed and "/WEIGHT" if our weight is other than 1
+ * (members which predate weights disregard the latter)
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+void
+cluster_etcd_format_(CLUSTER *cluster, int slot, char *buf, size_t size)
+{
+	size_t l;
+
+	if(slot >= 0)
+	{
+		snprintf(buf, size, "%d:%d", cluster->inst_threads, slot);
+	}
+	else
+	{
+		snprintf(buf, size, "%d", cluster->inst_threads);
+	}
+	if(cluster->inst_weight != 1)
+	{
+		l = strlen(buf);
+		snprintf(buf + l, size - l, "/%d", cluster->inst_weight);
+	}
+}
+
+/* Return the prefix (including the trailing slash) of the keys of entries
+ * in this cluster's registry directory, as reported by etcd in changes.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static char *
+cluster_etcd_prefix_(CLUSTER *cluster)
+{
+	char *p;
+	size_t l;
+
+	l = strlen(cluster->key) + strlen(cluster->env) + 4;
+	if(cluster->partition)
+	{
+		l += strlen(cluster->partition) + 1;
+	}
+	p = (char *) malloc(l);
+	if(!p)
+	{
+		return NULL;
+	}
+	if(cluster->partition)
+	{
+		snprintf(p, l, "/%s/%s/%s/", cluster->key, cluster->partition, cluster->env);
+	}
+	else
+	{
+		snprintf(p, l, "/%s/%s/", cluster->key, cluster->env);
+	}
+	return p;
 }
 
 #endif /*ENABLE_ETCD*/
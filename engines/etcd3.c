@@ -0,0 +1,1419 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+#ifdef ENABLE_ETCD
+
+/* etcd v3-based clustering
+ *
+ * A registry URI of etcd3://HOST:PORT/ (or etcd3s:// for TLS) uses the
+ * etcd v3 API. Members' entries are keys named PREFIX/INSTID, where PREFIX
+ * is /KEY/ENV or /KEY/PARTITION/ENV, with values of the same form as the
+ * v2 engine's ("WORKERS", or "WORKERS:SLOT" if stable slots are in use);
+ * slots are claimed as keys named PREFIX/_slots/SLOT whose values are the
+ * identifiers of the holding members.
+ *
+ * Rather than each entry having its own TTL which must be refreshed, every
+ * entry written by the process's clusters which use the same registry and
+ * TTL is attached to a single lease, kept alive by one thread: the cost of
+ * heartbeating is therefore the same however many clusters the process
+ * has joined. If the lease expires regardless (for example, because the
+ * registry was unreachable for longer than the TTL), a new one is granted
+ * and each cluster's balancer re-writes its entries under it. The lease is
+ * revoked, deleting any entries still attached to it, once no cluster is
+ * using it.
+ *
+ * When the process forks, the keepalive threads are stopped beforehand and
+ * restarted in the parent, whose leases (and so entries) survive the fork;
+ * the child, which cannot share the parent's leases, is granted its own.
+ *
+ * Each cluster's balancer thread watches its prefix for changes, resuming
+ * from the revision following the last one it has seen, and re-writes our
+ * entry when the worker count changes (or the lease has been replaced).
+ * Passive members have no entry, and so no lease.
+ *
+ * The cluster lock may be held when acquiring the lease lock, but not
+ * vice versa.
+ */
+
+/* The keys, within the prefix, under which stable slots are claimed */
+# define CLUSTER_ETCD3_SLOTDIR          "_slots/"
+/* The number of attempts made to claim a slot before giving up */
+# define CLUSTER_ETCD3_CLAIM_ATTEMPTS   8
+/* The highest slot which may be claimed, plus one */
+# define CLUSTER_ETCD3_MAX_SLOTS        65536
+
+/* The state of a search for the lowest free slot */
+struct cluster_etcd3_slots_struct
+{
+	CLUSTER *cluster;
+	size_t plen;
+	unsigned char *held;
+};
+
+static char *cluster_etcd3_url_(const char *registry);
+static char *cluster_etcd3_prefix_(CLUSTER *cluster);
+static char *cluster_etcd3_key_(CLUSTER *cluster, const char *suffix, int slot);
+static const char *cluster_etcd3_name_(CLUSTER *cluster, const char *key);
+static int cluster_etcd3_attach_(CLUSTER *cluster);
+static void cluster_etcd3_detach_(CLUSTER *cluster);
+static int cluster_etcd3_start_(CLUSTERETCD3LEASE *lease);
+static void cluster_etcd3_halt_(CLUSTERETCD3LEASE *lease);
+static ETCDLEASE cluster_etcd3_lease_id_(CLUSTER *cluster);
+static int cluster_etcd3_ping_(CLUSTER *cluster);
+static void cluster_etcd3_unping_(CLUSTER *cluster);
+static int cluster_etcd3_heartbeat_(CLUSTER *cluster);
+static int cluster_etcd3_claim_(CLUSTER *cluster, ETCDLEASE lease);
+static int cluster_etcd3_lowest_(CLUSTER *cluster);
+static int cluster_etcd3_held_(void *data, const char *key, const char *value, ETCDINDEX revision);
+static int cluster_etcd3_reload_(CLUSTER *cluster, ETCD *etcd);
+static int cluster_etcd3_loaded_(void *data, const char *key, const char *value, ETCDINDEX revision);
+static int cluster_etcd3_changed_(void *data, const char *key, const char *value, ETCDINDEX revision);
+static int cluster_etcd3_balance_(CLUSTER *cluster);
+static void cluster_etcd3_settle_(CLUSTER *cluster);
+static int cluster_etcd3_rejoin_(CLUSTER *cluster);
+static void cluster_etcd3_stop_(CLUSTER *cluster);
+static void cluster_etcd3_forget_(CLUSTER *cluster);
+static int cluster_etcd3_cancelled_(void *data);
+static void *cluster_etcd3_balancer_thread_(void *arg);
+static void *cluster_etcd3_lease_thread_(void *arg);
+
+static pthread_mutex_t cluster_etcd3_lock = PTHREAD_MUTEX_INITIALIZER;
+static CLUSTERETCD3LEASE *cluster_etcd3_first;
+
+/* Join an etcd v3-based cluster: attach to the shared lease, write our
+ * entry, read the membership, then spawn the re-balancing thread
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_etcd3_join_(CLUSTER *cluster)
+{
+	char *url;
+
+	cluster_wrlock_(cluster);
+	cluster->inst_index = -1;
+	url = cluster_etcd3_url_(cluster->registry);
+	cluster->etcd3 = (url ? etcd3_connect(url) : NULL);
+	free(url);
+	cluster->etcd3_prefix = cluster_etcd3_prefix_(cluster);
+	if(!cluster->etcd3 || !cluster->etcd3_prefix)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: cannot connect to registry <%s>\n", cluster->registry);
+		cluster_unlock_(cluster);
+		cluster_etcd3_leave_(cluster);
+		return -1;
+	}
+	etcd_set_verbose(cluster->etcd3, (cluster->flags & CF_VERBOSE));
+	etcd_set_timeouts(cluster->etcd3, cluster->connect_timeout, cluster->request_timeout);
+	if(cluster_etcd3_rejoin_(cluster))
+	{
+		cluster_unlock_(cluster);
+		cluster_etcd3_leave_(cluster);
+		return -1;
+	}
+	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: successfully joined the cluster\n");
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Leave an etcd v3-based cluster: terminate the re-balancing thread, remove
+ * our entry, then detach from the shared lease
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_etcd3_leave_(CLUSTER *cluster)
+{
+	/* Use a write-lock to prevent a read-lock - write-lock race */
+	cluster_wrlock_(cluster);
+	cluster_etcd3_stop_(cluster);
+	if(cluster->etcd3_lease)
+	{
+		cluster_etcd3_unping_(cluster);
+	}
+	cluster_etcd3_forget_(cluster);
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Invoked before a parent process forks: the re-balancing thread and the
+ * shared lease's keepalive thread are terminated, but the cluster remains
+ * attached to the lease (which is not revoked, and so our entries remain),
+ * and the cluster is left locked
+ */
+void
+cluster_etcd3_prepare_(CLUSTER *p)
+{
+	cluster_wrlock_(p);
+	if(p->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(p, LOG_INFO, "libcluster: etcd3: preparing for fork()\n");
+	}
+	cluster_etcd3_stop_(p);
+	if(p->etcd3_lease)
+	{
+		pthread_mutex_lock(&cluster_etcd3_lock);
+		cluster_etcd3_halt_(p->etcd3_lease);
+		pthread_mutex_unlock(&cluster_etcd3_lock);
+	}
+}
+
+/* Invoked after fork() in the parent process */
+void
+cluster_etcd3_parent_(CLUSTER *p)
+{
+	int r;
+
+	/* The cluster is locked on entry */
+	r = 0;
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_PARENT)
+		{
+			if(p->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(p, LOG_NOTICE, "libcluster: etcd3: resuming cluster membership in parent process\n");
+			}
+			r = cluster_etcd3_rejoin_(p);
+		}
+		else
+		{
+			if(p->etcd3_lease && !(p->forkmode & CLUSTER_FORK_CHILD))
+			{
+				/* Other clusters may keep the lease alive */
+				cluster_etcd3_unping_(p);
+			}
+			cluster_etcd3_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+	if(r)
+	{
+		cluster_etcd3_leave_(p);
+	}
+}
+
+/* Invoked after fork() in the child process */
+void
+cluster_etcd3_child_(CLUSTER *p)
+{
+	int r;
+
+	/* The cluster was locked by the parent on entry, reset the lock */
+	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+	cluster_wrlock_(p);
+	/* The lease belongs to the parent (see cluster_etcd3_reinit_()) */
+	p->etcd3_lease = NULL;
+	p->etcd3_next = NULL;
+	r = 0;
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_CHILD)
+		{
+			if(p->forkmode & CLUSTER_FORK_PARENT)
+			{
+				/* We're re-joining the cluster in both the parent and the
+				 * child, therefore the child will be assigned a new instance
+				 * UUID
+				 */
+				cluster_reset_instance_locked_(p);
+			}
+			if(p->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(p, LOG_NOTICE, "libcluster: etcd3: resuming cluster membership in child process\n");
+			}
+			r = cluster_etcd3_rejoin_(p);
+		}
+		else
+		{
+			cluster_etcd3_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+	if(r)
+	{
+		cluster_etcd3_leave_(p);
+	}
+}
+
+/* Invoked in the child after fork(), before the clusters' own handlers:
+ * the leases belong to the parent, which continues to keep them alive, and
+ * so are forgotten; their connections share sockets with the parent's, and
+ * so are abandoned rather than closed. The lock may have been held by
+ * another thread of the parent.
+ */
+void
+cluster_etcd3_reinit_(void)
+{
+	CLUSTERETCD3LEASE *lease;
+
+	pthread_mutex_init(&cluster_etcd3_lock, NULL);
+	while((lease = cluster_etcd3_first))
+	{
+		cluster_etcd3_first = lease->next;
+		free(lease->url);
+		free(lease);
+	}
+}
+
+/* Attach to the lease shared by the clusters using the same registry and
+ * TTL, granting it (and starting its keepalive thread) if there is none
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd3_attach_(CLUSTER *cluster)
+{
+	CLUSTERETCD3LEASE *lease;
+	pthread_condattr_t attr;
+	char *url;
+
+	if(cluster->etcd3_lease)
+	{
+		/* Resuming after a fork(), before which the keepalive thread was
+		 * stopped (unless another cluster has already restarted it)
+		 */
+		pthread_mutex_lock(&cluster_etcd3_lock);
+		if(!cluster->etcd3_lease->running && cluster_etcd3_start_(cluster->etcd3_lease))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to restart lease keepalive thread\n");
+			pthread_mutex_unlock(&cluster_etcd3_lock);
+			return -1;
+		}
+		pthread_mutex_unlock(&cluster_etcd3_lock);
+		return 0;
+	}
+	if(!(url = cluster_etcd3_url_(cluster->registry)))
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&cluster_etcd3_lock);
+	for(lease = cluster_etcd3_first; lease; lease = lease->next)
+	{
+		if(lease->ttl == cluster->ttl && !strcmp(lease->url, url))
+		{
+			break;
+		}
+	}
+	if(lease)
+	{
+		free(url);
+	}
+	else
+	{
+		lease = (CLUSTERETCD3LEASE *) calloc(1, sizeof(CLUSTERETCD3LEASE));
+		if(!lease)
+		{
+			pthread_mutex_unlock(&cluster_etcd3_lock);
+			free(url);
+			return -1;
+		}
+		lease->url = url;
+		lease->ttl = cluster->ttl;
+		lease->refresh = cluster->refresh;
+		if((lease->etcd = etcd3_connect(url)))
+		{
+			etcd_set_timeouts(lease->etcd, cluster->connect_timeout, cluster->request_timeout);
+		}
+		if(!lease->etcd || etcd3_lease_grant(lease->etcd, lease->ttl, &(lease->id)))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to obtain a lease from <%s>\n", cluster->registry);
+			pthread_mutex_unlock(&cluster_etcd3_lock);
+			etcd_disconnect(lease->etcd);
+			free(lease->url);
+			free(lease);
+			return -1;
+		}
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&(lease->cond), &attr);
+		pthread_condattr_destroy(&attr);
+		pthread_cond_init(&(lease->idle), NULL);
+		if(cluster_etcd3_start_(lease))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to start lease keepalive thread\n");
+			pthread_mutex_unlock(&cluster_etcd3_lock);
+			etcd3_lease_revoke(lease->etcd, lease->id);
+			etcd_disconnect(lease->etcd);
+			pthread_cond_destroy(&(lease->cond));
+			pthread_cond_destroy(&(lease->idle));
+			free(lease->url);
+			free(lease);
+			return -1;
+		}
+		lease->next = cluster_etcd3_first;
+		cluster_etcd3_first = lease;
+		if(cluster->flags & CF_VERBOSE)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: granted lease %llx with ttl=%d\n", lease->id, lease->ttl);
+		}
+	}
+	if(cluster->refresh < lease->refresh)
+	{
+		/* Keep the lease alive as often as the most demanding cluster
+		 * using it would refresh its own entry
+		 */
+		lease->refresh = cluster->refresh;
+		pthread_cond_signal(&(lease->cond));
+	}
+	cluster->etcd3_next = lease->clusters;
+	lease->clusters = cluster;
+	cluster->etcd3_lease = lease;
+	pthread_mutex_unlock(&cluster_etcd3_lock);
+	return 0;
+}
+
+/* Detach from the shared lease, if attached; if it was the last cluster
+ * using the lease, its keepalive thread is terminated and the lease
+ * revoked
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static void
+cluster_etcd3_detach_(CLUSTER *cluster)
+{
+	CLUSTERETCD3LEASE *lease, **lp;
+	CLUSTER **cp;
+
+	if(!(lease = cluster->etcd3_lease))
+	{
+		return;
+	}
+	pthread_mutex_lock(&cluster_etcd3_lock);
+	for(cp = &(lease->clusters); *cp; cp = &((*cp)->etcd3_next))
+	{
+		if(*cp == cluster)
+		{
+			*cp = cluster->etcd3_next;
+			break;
+		}
+	}
+	cluster->etcd3_lease = NULL;
+	cluster->etcd3_next = NULL;
+	if(lease->clusters)
+	{
+		/* The keepalive thread may still be recording the outcome of a
+		 * keepalive on our behalf
+		 */
+		while(lease->busy)
+		{
+			pthread_cond_wait(&(lease->idle), &cluster_etcd3_lock);
+		}
+		pthread_mutex_unlock(&cluster_etcd3_lock);
+		return;
+	}
+	for(lp = &cluster_etcd3_first; *lp; lp = &((*lp)->next))
+	{
+		if(*lp == lease)
+		{
+			*lp = lease->next;
+			break;
+		}
+	}
+	cluster_etcd3_halt_(lease);
+	pthread_mutex_unlock(&cluster_etcd3_lock);
+	if(etcd3_lease_revoke(lease->etcd, lease->id))
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: etcd3: failed to revoke lease %llx; entries attached to it will expire\n", lease->id);
+	}
+	else if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: revoked lease %llx\n", lease->id);
+	}
+	etcd_disconnect(lease->etcd);
+	pthread_cond_destroy(&(lease->cond));
+	pthread_cond_destroy(&(lease->idle));
+	free(lease->url);
+	free(lease);
+}
+
+/* Start a lease's keepalive thread
+ *
+ * The lease lock should be held when invoking this function.
+ */
+static int
+cluster_etcd3_start_(CLUSTERETCD3LEASE *lease)
+{
+	if(pthread_create(&(lease->thread), NULL, cluster_etcd3_lease_thread_, (void *) lease))
+	{
+		return -1;
+	}
+	lease->running = 1;
+	return 0;
+}
+
+/* Terminate a lease's keepalive thread, if it's running, without revoking
+ * the lease
+ *
+ * The lease lock should be held when invoking this function, and will be
+ * on return (the lock is released while waiting).
+ */
+static void
+cluster_etcd3_halt_(CLUSTERETCD3LEASE *lease)
+{
+	pthread_t thread;
+
+	if(!lease->running)
+	{
+		return;
+	}
+	lease->running = 0;
+	lease->stop = 1;
+	thread = lease->thread;
+	pthread_cond_signal(&(lease->cond));
+	pthread_mutex_unlock(&cluster_etcd3_lock);
+	/* The keepalive thread doesn't acquire any cluster's lock */
+	pthread_join(thread, NULL);
+	pthread_mutex_lock(&cluster_etcd3_lock);
+	lease->stop = 0;
+}
+
+/* Obtain the current identifier of the lease the cluster is attached to,
+ * which changes if the lease has expired and been replaced
+ */
+static ETCDLEASE
+cluster_etcd3_lease_id_(CLUSTER *cluster)
+{
+	ETCDLEASE id;
+
+	pthread_mutex_lock(&cluster_etcd3_lock);
+	id = (cluster->etcd3_lease ? cluster->etcd3_lease->id : 0);
+	pthread_mutex_unlock(&cluster_etcd3_lock);
+	return id;
+}
+
+/* Write our entry, if it has changed or hasn't been written under the
+ * current lease; otherwise, the lease keeps it alive and there is nothing
+ * to do. If stable slots are in use, the slot is (re-)claimed under the
+ * lease first.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd3_ping_(CLUSTER *cluster)
+{
+	ETCDLEASE lease;
+	char buf[64], *key;
+	int r;
+
+	if(!cluster->etcd3_lease)
+	{
+		/* Passive members have no entry */
+		return 0;
+	}
+	lease = cluster_etcd3_lease_id_(cluster);
+	if(cluster->etcd3_published == lease && cluster->etcd_published == cluster->inst_threads && cluster->etcd_weight == cluster->inst_weight)
+	{
+		return 0;
+	}
+	if(cluster->etcd3_published && cluster->etcd3_published != lease)
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd3: registry entry for %s has expired with its lease; re-creating it\n", cluster->instid);
+	}
+	if((cluster->flags & CF_SLOTS) && cluster->etcd3_published != lease &&
+	   cluster_etcd3_claim_(cluster, lease))
+	{
+		return -1;
+	}
+	cluster_etcd_format_(cluster, ((cluster->flags & CF_SLOTS) ? cluster->slot : -1), buf, sizeof(buf));
+	if(!(key = cluster_etcd3_key_(cluster, cluster->instid, -1)))
+	{
+		return -1;
+	}
+	r = etcd3_kv_put(cluster->etcd3, key, buf, lease, ETCD_NONE);
+	free(key);
+	if(r)
+	{
+		return r;
+	}
+	cluster->etcd_published = cluster->inst_threads;
+	cluster->etcd_weight = cluster->inst_weight;
+	cluster->etcd3_published = lease;
+	return 0;
+}
+
+/* 'Un-ping' - that is, remove our entry (and release our slot, if any)
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static void
+cluster_etcd3_unping_(CLUSTER *cluster)
+{
+	char *key;
+
+	if(cluster->slot >= 0 && (key = cluster_etcd3_key_(cluster, NULL, cluster->slot)))
+	{
+		/* Release our slot so that it can be re-used */
+		etcd3_kv_delete(cluster->etcd3, key, ETCD_NONE);
+		free(key);
+		cluster->slot = -1;
+	}
+	if((key = cluster_etcd3_key_(cluster, cluster->instid, -1)))
+	{
+		etcd3_kv_delete(cluster->etcd3, key, ETCD_NONE);
+		free(key);
+	}
+	cluster->etcd_published = -1;
+	cluster->etcd3_published = 0;
+}
+
+/* Write our entry if needed, logging the outcome; if it fails, the
+ * balancer retries shortly afterwards.
+ *
+ * The cluster should be read-locked when invoking this function.
+ */
+static int
+cluster_etcd3_heartbeat_(CLUSTER *cluster)
+{
+	uint64_t start;
+	int r;
+
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_PING);
+	r = cluster_etcd3_ping_(cluster);
+	cluster_stats_record_(&(cluster->stats.ping), start);
+	cluster_trace_end_(cluster, CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+	if(r)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to update registry\n");
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		return -1;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: registry entry is %s=%d\n", cluster->instid, cluster->inst_threads);
+	}
+	return 0;
+}
+
+/* Claim a stable slot under the given lease: the one we previously held if
+ * nobody else has claimed it since, or else the lowest free one. This is
+ * only invoked when our entry hasn't been written under the lease.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd3_claim_(CLUSTER *cluster, ETCDLEASE lease)
+{
+	char *key;
+	int r, attempt, slot;
+	ETCDFLAGS flags;
+
+	for(attempt = 0; attempt < CLUSTER_ETCD3_CLAIM_ATTEMPTS; attempt++)
+	{
+		flags = ETCD_CREATE;
+		if(cluster->slot < 0)
+		{
+			slot = cluster_etcd3_lowest_(cluster);
+			if(slot < 0)
+			{
+				return -1;
+			}
+			if(cluster->slot >= 0)
+			{
+				/* We already hold a slot, but under an earlier lease (such
+				 * as our parent's, after fork()): move it to this one, so
+				 * that it doesn't vanish when that lease is revoked
+				 */
+				slot = cluster->slot;
+				flags = ETCD_NONE;
+			}
+		}
+		else
+		{
+			slot = cluster->slot;
+		}
+		if(!(key = cluster_etcd3_key_(cluster, NULL, slot)))
+		{
+			return -1;
+		}
+		r = etcd3_kv_put(cluster->etcd3, key, cluster->instid, lease, flags);
+		free(key);
+		if(!r)
+		{
+			cluster->slot = slot;
+			break;
+		}
+		if(r != ETCD_E_NODE_EXIST)
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to claim slot %d\n", slot);
+			return -1;
+		}
+		/* Another member holds it (or we do already, which the search for
+		 * the lowest free slot will discover): try again
+		 */
+		cluster->slot = -1;
+	}
+	if(cluster->slot < 0)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to claim a slot after %d attempts\n", attempt);
+		return -1;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: holding slot %d\n", cluster->slot);
+	}
+	return 0;
+}
+
+/* Read the slot keys and return the lowest slot which isn't held; if we
+ * are found to hold a slot already, cluster->slot is set to it.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_etcd3_lowest_(CLUSTER *cluster)
+{
+	struct cluster_etcd3_slots_struct s;
+	ETCDINDEX revision;
+	char *prefix;
+	int slot;
+
+	if(!(prefix = cluster_etcd3_key_(cluster, CLUSTER_ETCD3_SLOTDIR, -1)))
+	{
+		return -1;
+	}
+	s.cluster = cluster;
+	s.plen = strlen(prefix);
+	s.held = (unsigned char *) calloc(CLUSTER_ETCD3_MAX_SLOTS, 1);
+	if(!s.held)
+	{
+		free(prefix);
+		return -1;
+	}
+	if(etcd3_kv_range(cluster->etcd3, prefix, cluster_etcd3_held_, (void *) &s, &revision))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to retrieve slots\n");
+		free(s.held);
+		free(prefix);
+		return -1;
+	}
+	free(prefix);
+	for(slot = 0; slot < CLUSTER_ETCD3_MAX_SLOTS && s.held[slot]; slot++);
+	free(s.held);
+	if(slot == CLUSTER_ETCD3_MAX_SLOTS)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: no slots are free\n");
+		errno = ENOSPC;
+		return -1;
+	}
+	return slot;
+}
+
+/* Record a slot key retrieved by cluster_etcd3_lowest_() */
+static int
+cluster_etcd3_held_(void *data, const char *key, const char *value, ETCDINDEX revision)
+{
+	struct cluster_etcd3_slots_struct *s;
+	long n;
+
+	(void) revision;
+
+	s = (struct cluster_etcd3_slots_struct *) data;
+	n = strtol(key + s->plen, NULL, 10);
+	if(n < 0 || n >= CLUSTER_ETCD3_MAX_SLOTS)
+	{
+		return 0;
+	}
+	s->held[n] = 1;
+	if(value && !strcmp(value, s->cluster->instid))
+	{
+		s->cluster->slot = (int) n;
+	}
+	return 0;
+}
+
+/* Read the membership in full and replace the contents of the member
+ * table with it; this happens when joining, or if etcd no longer holds
+ * enough history for us to resume watching from where we left off.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd3_reload_(CLUSTER *cluster, ETCD *etcd)
+{
+	ETCDINDEX revision;
+	uint64_t start;
+	int r;
+
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: reading state from registry\n");
+	}
+	cluster_members_clear_(cluster);
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_FETCH);
+	r = etcd3_kv_range(etcd, cluster->etcd3_prefix, cluster_etcd3_loaded_, (void *) cluster, &revision);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_FETCH, start, (r ? -1 : 0));
+	if(r)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to retrieve cluster membership\n");
+		cluster->etcd_index = 0;
+		return -1;
+	}
+	cluster->etcd_index = revision + 1;
+	return 0;
+}
+
+/* Add an entry retrieved by cluster_etcd3_reload_() to the member table */
+static int
+cluster_etcd3_loaded_(void *data, const char *key, const char *value, ETCDINDEX revision)
+{
+	CLUSTER *cluster;
+	const char *name;
+
+	cluster = (CLUSTER *) data;
+	if(!(name = cluster_etcd3_name_(cluster, key)))
+	{
+		return 0;
+	}
+	if(cluster_member_set_(cluster, name, cluster_etcd_workers_(value), cluster_etcd_weight_(value), cluster_etcd_slot_(value), revision) < 0)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to update member table\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Invoked for each change received by the balancer's watch, and (with a
+ * NULL key) once each group of changes has been delivered, whereupon the
+ * cluster is re-balanced. If a change can't be applied, the membership is
+ * re-read in full.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static int
+cluster_etcd3_changed_(void *data, const char *key, const char *value, ETCDINDEX revision)
+{
+	CLUSTER *cluster;
+	const char *name;
+	int r;
+
+	cluster = (CLUSTER *) data;
+	r = 0;
+	cluster_wrlock_(cluster);
+	if(!key)
+	{
+		/* revision is the store's, which may be ahead of the changes
+		 * delivered so far, so only those changes advance etcd_index
+		 */
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_locked_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		/* Allow further changes to arrive before re-balancing, if
+		 * configured to; cluster_etcd3_settle_() will perform it when due
+		 */
+		if(!(cluster->flags & CF_LEAVING) && !cluster_settle_locked_(cluster) &&
+		   cluster_etcd3_balance_(cluster))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to balance cluster in response to changes\n");
+			cluster_stats_count_(&(cluster->stats.errors));
+		}
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	cluster->etcd_index = revision + 1;
+	if((name = cluster_etcd3_name_(cluster, key)))
+	{
+		if(value)
+		{
+			if(cluster_member_set_(cluster, name, cluster_etcd_workers_(value), cluster_etcd_weight_(value), cluster_etcd_slot_(value), revision) < 0)
+			{
+				cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to apply changes from registry\n");
+				/* Abandon the watch and re-read the membership */
+				cluster->etcd_index = 0;
+				r = -1;
+			}
+		}
+		else
+		{
+			cluster_member_remove_(cluster, name);
+		}
+	}
+	cluster_unlock_(cluster);
+	return r;
+}
+
+/* Determine what our index in the cluster is from the member table.
+ *
+ * The cluster should be write-locked when invoking this function. The lock
+ * may be released and re-acquired during the course of its execution.
+ */
+static int
+cluster_etcd3_balance_(CLUSTER *cluster)
+{
+	int total, base;
+	size_t n;
+	CLUSTERMEMBER **order, *m;
+	uint64_t start;
+
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	base = -1;
+	total = 0;
+	if(!(order = cluster_members_order_(cluster)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to allocate member order\n");
+		return -1;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		if(cluster->partition)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: re-balancing cluster %s[%s]/%s:\n", cluster->key, cluster->partition, cluster->env);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: re-balancing cluster %s/%s:\n", cluster->key, cluster->env);
+		}
+	}
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		m = order[n];
+		if(!strcmp(m->instid, cluster->instid))
+		{
+			if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "* %s [%d]\n", cluster->instid, total);
+			}
+			base = total;
+		}
+		else
+		{
+			if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "  %s [%d]\n", m->instid, total);
+			}
+		}
+		total += m->workers;
+	}
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
+	if(total != cluster->total_threads || base != cluster->inst_index)
+	{
+		if(base == -1)
+		{
+			if(cluster->partition)
+			{
+				cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd3: this instance is no longer a member of %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
+			}
+			else
+			{
+				cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd3: this instance is no longer a member of %s/%s\n", cluster->key, cluster->env);
+			}
+		}
+		else
+		{
+			if(cluster->partition)
+			{
+				cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd3: cluster %s[%s]/%s has re-balanced: new base is %d (was %d), new total is %d (was %d)\n", cluster->key, cluster->partition, cluster->env, base, cluster->inst_index, total, cluster->total_threads);
+			}
+			else
+			{
+				cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: etcd3: cluster %s/%s has re-balanced: new base is %d (was %d), new total is %d (was %d)\n", cluster->key, cluster->env, base, cluster->inst_index, total, cluster->total_threads);
+			}
+		}
+		cluster->inst_index = base;
+		cluster->total_threads = total;
+		cluster_publish_locked_(cluster);
+		cluster_unlock_(cluster);
+		cluster_rebalanced_(cluster);
+		/* Re-acquire the lock to restore state */
+		cluster_wrlock_(cluster);
+	}
+	return 0;
+}
+
+/* Perform any re-balancing which was deferred to allow the membership to
+ * settle, if it has fallen due
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_etcd3_settle_(CLUSTER *cluster)
+{
+	if(cluster_settle_wait_(cluster))
+	{
+		return;
+	}
+	cluster_wrlock_(cluster);
+	if(!(cluster->flags & CF_LEAVING) && cluster_settled_locked_(cluster) &&
+	   cluster_etcd3_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to balance cluster in response to changes\n");
+	}
+	cluster_unlock_(cluster);
+}
+
+/* Attach to the lease and write our entry (unless we're passive), read the
+ * membership and balance, and start the re-balancing thread; invoked when
+ * joining and when resuming membership after a fork()
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_etcd3_rejoin_(CLUSTER *cluster)
+{
+	if(!cluster->etcd3_lease)
+	{
+		/* Otherwise, this is the parent after a fork(), and our entry
+		 * survives (and is re-written only if it has expired meanwhile)
+		 */
+		cluster->etcd_published = -1;
+		cluster->etcd3_published = 0;
+	}
+	cluster->etcd3_retry = 0;
+	if(!(cluster->flags & CF_PASSIVE))
+	{
+		if(cluster_etcd3_attach_(cluster) || cluster_etcd3_ping_(cluster))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to perform initial ping\n");
+			return -1;
+		}
+	}
+	if(cluster_etcd3_reload_(cluster, cluster->etcd3) || cluster_etcd3_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to perform initial balancing\n");
+		return -1;
+	}
+	cluster_wake_reset_(cluster);
+	pthread_create(&(cluster->balancer_thread), NULL, cluster_etcd3_balancer_thread_, (void *) cluster);
+	return 0;
+}
+
+/* Terminate the re-balancing thread, if it's running, without altering
+ * our entry; the cluster's flags are preserved
+ *
+ * The cluster should be write-locked when invoking this function, and
+ * will be on return (the lock is released while waiting).
+ */
+static void
+cluster_etcd3_stop_(CLUSTER *cluster)
+{
+	CLUSTERFLAGS flags;
+	pthread_t bt;
+
+	if(!cluster->balancer_thread)
+	{
+		return;
+	}
+	flags = cluster->flags;
+	cluster->flags |= CF_LEAVING;
+	cluster_wake_(cluster, CW_LEAVE);
+	bt = cluster->balancer_thread;
+	/* Unlock to allow the thread to read the flag */
+	cluster_unlock_(cluster);
+	pthread_join(bt, NULL);
+	/* Re-acquire the lock so that the unwinding can safely complete */
+	cluster_wrlock_(cluster);
+	cluster->balancer_thread = 0;
+	cluster->flags = flags;
+}
+
+/* Discard the cluster's membership state, detach from the lease and close
+ * the connection to the registry, without removing our entry
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static void
+cluster_etcd3_forget_(CLUSTER *cluster)
+{
+	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster->inst_index = -1;
+	cluster->total_threads = 0;
+	cluster_publish_locked_(cluster);
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
+	cluster_etcd3_detach_(cluster);
+	cluster->etcd_index = 0;
+	if(cluster->etcd3)
+	{
+		etcd_disconnect(cluster->etcd3);
+		cluster->etcd3 = NULL;
+	}
+	free(cluster->etcd3_prefix);
+	cluster->etcd3_prefix = NULL;
+}
+
+/* Invoked by libetcd during the balancer thread's requests: abandon them if
+ * the thread should terminate, if deferred re-balancing has fallen due, or
+ * if our entry must be written
+ */
+static int
+cluster_etcd3_cancelled_(void *data)
+{
+	CLUSTER *cluster;
+
+	cluster = (CLUSTER *) data;
+	return cluster_leaving_(cluster) || !cluster_settle_wait_(cluster) ||
+		cluster_woken_(cluster, CW_PING) ||
+		(cluster->etcd3_retry && cluster_now_() >= cluster->etcd3_retry);
+}
+
+/* Re-balancing thread: watch for changes to the cluster's entries, apply
+ * them to the member table and re-balance, and re-write our entry when
+ * woken to (because the worker count has changed or the lease has been
+ * replaced)
+ */
+static void *
+cluster_etcd3_balancer_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	ETCD *etcd;
+	ETCDINDEX index;
+	int r, verbose;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	etcd = etcd_clone(cluster->etcd3);
+	if(!etcd)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: etcd3: failed to initialise re-balancing thread\n");
+		cluster_unlock_(cluster);
+		return NULL;
+	}
+	/* Allow watches to be interrupted when leaving */
+	etcd_set_cancel(etcd, cluster_etcd3_cancelled_, (void *) cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: re-balancing thread started for %s at <%s>\n", cluster->etcd3_prefix, cluster->registry);
+	cluster_unlock_(cluster);
+
+	/* The cluster lock is not held at the start of each pass */
+	for(;;)
+	{
+		cluster_etcd3_settle_(cluster);
+		if((cluster_wait_(cluster, CW_PING, 0) & CW_PING) ||
+		   (cluster->etcd3_retry && cluster_now_() >= cluster->etcd3_retry))
+		{
+			cluster_rdlock_(cluster);
+			if(!(cluster->flags & CF_LEAVING))
+			{
+				/* Short retry in case of transient problems */
+				cluster->etcd3_retry = (cluster_etcd3_heartbeat_(cluster) ? cluster_now_() + 5 : 0);
+			}
+			cluster_unlock_(cluster);
+		}
+		/* Check the flags within a read-lock */
+		cluster_rdlock_(cluster);
+		verbose = (cluster->flags & CF_VERBOSE);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: 'leaving' flag has been set, will terminate balancing thread\n");
+			cluster_unlock_(cluster);
+			break;
+		}
+		index = cluster->etcd_index;
+		if(verbose && index)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd3: waiting for changes to %s from revision %llu\n", cluster->etcd3_prefix, index);
+		}
+		cluster_unlock_(cluster);
+		if(!index)
+		{
+			/* The membership must be re-read before watching can resume */
+			cluster_wrlock_(cluster);
+			if(cluster_etcd3_reload_(cluster, etcd) || cluster_etcd3_balance_(cluster))
+			{
+				cluster_logf_locked_(cluster, LOG_ERR, "libcluster: etcd3: failed to balance cluster after re-reading membership\n");
+				cluster_unlock_(cluster);
+				cluster_stats_count_(&(cluster->stats.errors));
+				cluster_stats_count_(&(cluster->stats.retries));
+				cluster_wait_(cluster, CW_NONE, 30);
+				continue;
+			}
+			cluster_unlock_(cluster);
+			continue;
+		}
+		r = etcd3_watch(etcd, cluster->etcd3_prefix, index, cluster_etcd3_changed_, (void *) cluster);
+		if(verbose)
+		{
+			cluster_logf_(cluster, LOG_DEBUG, "libcluster: etcd3: watch result was %d\n", r);
+		}
+		if(!r || cluster_etcd3_cancelled_((void *) cluster))
+		{
+			/* The server ended the watch, or it was abandoned because
+			 * we're leaving, so that deferred re-balancing can be
+			 * performed, or so that our entry can be written
+			 */
+			continue;
+		}
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		if(r == ETCD_E_INDEX_CLEARED)
+		{
+			/* We've fallen too far behind for etcd to be able to tell us
+			 * what changed, so the only option is to start again
+			 */
+			cluster_logf_(cluster, LOG_NOTICE, "libcluster: etcd3: registry history has been compacted since revision %llu; re-reading membership\n", index);
+			cluster_wrlock_(cluster);
+			cluster->etcd_index = 0;
+			cluster_unlock_(cluster);
+			continue;
+		}
+		cluster_rdlock_(cluster);
+		index = cluster->etcd_index;
+		cluster_unlock_(cluster);
+		if(!index)
+		{
+			/* A change couldn't be applied */
+			continue;
+		}
+		cluster_logf_(cluster, LOG_WARNING, "libcluster: etcd3: failed to receive changes from registry\n");
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.retries));
+		cluster_wait_(cluster, CW_NONE, 30);
+	}
+	cluster_logf_(cluster, LOG_DEBUG, "libcluster: etcd3: balancing thread is terminating\n");
+	etcd_disconnect(etcd);
+	return NULL;
+}
+
+/* Lease keepalive thread: keep the lease alive every refresh seconds until
+ * it's no longer used, granting a new one (and waking each cluster's
+ * balancer to re-write its entry) if it has expired; outcomes are recorded
+ * in the statistics of every cluster using the lease. Nothing is logged
+ * here, nor any cluster's lock acquired: the balancers log the
+ * consequences.
+ */
+static void *
+cluster_etcd3_lease_thread_(void *arg)
+{
+	CLUSTERETCD3LEASE *lease;
+	struct timespec deadline;
+	CLUSTER *p, **list, **l;
+	ETCDLEASE id;
+	uint64_t start;
+	time_t last, due;
+	size_t n, nalloc, i;
+	int r, renewed;
+
+	lease = (CLUSTERETCD3LEASE *) arg;
+	list = NULL;
+	nalloc = 0;
+	r = 0;
+	last = cluster_now_();
+	pthread_mutex_lock(&cluster_etcd3_lock);
+	for(;;)
+	{
+		if(lease->stop)
+		{
+			break;
+		}
+		/* Short retry in case of transient problems; refresh may be
+		 * shortened while we wait
+		 */
+		due = last + (r ? 5 : lease->refresh);
+		if(cluster_now_() < due)
+		{
+			deadline.tv_sec = due;
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&(lease->cond), &cluster_etcd3_lock, &deadline);
+			continue;
+		}
+		id = lease->id;
+		pthread_mutex_unlock(&cluster_etcd3_lock);
+		start = cluster_stats_start_();
+		r = etcd3_lease_keepalive(lease->etcd, id);
+		if(r == ETCD_E_KEY_NOT_FOUND)
+		{
+			/* The lease has expired, and with it our entries */
+			r = etcd3_lease_grant(lease->etcd, lease->ttl, &id);
+		}
+		last = cluster_now_();
+		/* Note which clusters use the lease, then record the outcome
+		 * (and, if the lease was re-granted, wake their ping threads to
+		 * re-write their entries) without holding cluster_etcd3_lock
+		 * (see lease->busy)
+		 */
+		pthread_mutex_lock(&cluster_etcd3_lock);
+		renewed = (!r && id != lease->id);
+		if(!r)
+		{
+			lease->id = id;
+		}
+		n = 0;
+		for(p = lease->clusters; p; p = p->etcd3_next)
+		{
+			if(n == nalloc)
+			{
+				if(!(l = (CLUSTER **) realloc(list, (nalloc ? nalloc * 2 : 16) * sizeof(CLUSTER *))))
+				{
+					break;
+				}
+				list = l;
+				nalloc = (nalloc ? nalloc * 2 : 16);
+			}
+			list[n] = p;
+			n++;
+		}
+		lease->busy = 1;
+		pthread_mutex_unlock(&cluster_etcd3_lock);
+		for(i = 0; i < n; i++)
+		{
+			cluster_stats_record_(&(list[i]->stats.ping), start);
+			cluster_trace_end_(list[i], CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+			if(r)
+			{
+				cluster_stats_count_(&(list[i]->stats.errors));
+				cluster_stats_count_(&(list[i]->stats.retries));
+			}
+			else if(renewed)
+			{
+				cluster_wake_(list[i], CW_PING);
+			}
+		}
+		pthread_mutex_lock(&cluster_etcd3_lock);
+		lease->busy = 0;
+		pthread_cond_broadcast(&(lease->idle));
+	}
+	pthread_mutex_unlock(&cluster_etcd3_lock);
+	free(list);
+	return NULL;
+}
+
+/* Obtain the URL of the etcd server from an etcd3: or etcd3s: registry URI,
+ * or a comma-separated list of them
+ */
+static char *
+cluster_etcd3_url_(const char *registry)
+{
+	const char *s;
+	char *p, *d;
+
+	/* The schemes are only ever shortened */
+	p = (char *) malloc(strlen(registry) + 1);
+	if(!p)
+	{
+		return NULL;
+	}
+	d = p;
+	for(s = registry; *s; )
+	{
+		if(!strncmp(s, "etcd3s:", 7))
+		{
+			strcpy(d, "https:");
+			d += 6;
+			s += 7;
+		}
+		else if(!strncmp(s, "etcd3:", 6))
+		{
+			strcpy(d, "http:");
+			d += 5;
+			s += 6;
+		}
+		while(*s && *s != ',')
+		{
+			*d = *s;
+			d++;
+			s++;
+		}
+		while(*s == ',' || isspace((unsigned char) *s))
+		{
+			*d = *s;
+			d++;
+			s++;
+		}
+	}
+	*d = 0;
+	return p;
+}
+
+/* Return the prefix (including the trailing slash) of the keys of entries
+ * in this cluster's registry.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static char *
+cluster_etcd3_prefix_(CLUSTER *cluster)
+{
+	char *p;
+	size_t l;
+
+	l = strlen(cluster->key) + strlen(cluster->env) + 4;
+	if(cluster->partition)
+	{
+		l += strlen(cluster->partition) + 1;
+	}
+	p = (char *) malloc(l);
+	if(!p)
+	{
+		return NULL;
+	}
+	if(cluster->partition)
+	{
+		snprintf(p, l, "/%s/%s/%s/", cluster->key, cluster->partition, cluster->env);
+	}
+	else
+	{
+		snprintf(p, l, "/%s/%s/", cluster->key, cluster->env);
+	}
+	return p;
+}
+
+/* Return the key formed from the cluster's prefix followed by suffix, or
+ * (if suffix is NULL) the key of the given slot
+ */
+static char *
+cluster_etcd3_key_(CLUSTER *cluster, const char *suffix, int slot)
+{
+	char *p;
+	size_t l;
+
+	l = strlen(cluster->etcd3_prefix) + (suffix ? strlen(suffix) : sizeof(CLUSTER_ETCD3_SLOTDIR) + 16) + 1;
+	p = (char *) malloc(l);
+	if(!p)
+	{
+		return NULL;
+	}
+	if(suffix)
+	{
+		snprintf(p, l, "%s%s", cluster->etcd3_prefix, suffix);
+	}
+	else
+	{
+		snprintf(p, l, "%s%s%d", cluster->etcd3_prefix, CLUSTER_ETCD3_SLOTDIR, slot);
+	}
+	return p;
+}
+
+/* Return the member name of a key within the cluster's prefix, or NULL if
+ * it isn't a member entry (such as a slot)
+ */
+static const char *
+cluster_etcd3_name_(CLUSTER *cluster, const char *key)
+{
+	size_t plen;
+
+	plen = strlen(cluster->etcd3_prefix);
+	if(strncmp(key, cluster->etcd3_prefix, plen) || !key[plen] || strchr(key + plen, '/'))
+	{
+		return NULL;
+	}
+	return key + plen;
+}
+
+#endif /*ENABLE_ETCD*/
@@ -0,0 +1,748 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Host state publication
+ *
+ * A member which has been given a host state segment name with
+ * cluster_set_host_state() copies the membership into the POSIX shared
+ * memory object of that name whenever its ring is rebuilt (that is,
+ * whenever the membership changes), and empties it again when it leaves.
+ * Other processes on the host join with a registry URI of 'host:NAME':
+ * they map the segment read-only, and derive their state and ring from
+ * the membership in it, just as the publisher does from the registry, so
+ * that they need no connection to the registry at all.
+ *
+ * The membership is guarded by a sequence counter: the publisher makes
+ * the counter odd, updates the membership, then makes it even again; the
+ * readers' threads wait for the counter to change (see
+ * cluster_shared_wait_()), and retry their copy if the counter was odd or
+ * changed while they were copying. Only one process may publish into a segment
+ * at once: it claims the segment by storing its process ID, and another
+ * may take over only once that process has released it or has exited.
+ */
+
+#ifdef CLUSTER_HOST_STATE
+
+/* Identifies an initialised segment */
+#define CLUSTER_HOST_MAGIC              0x4c434831
+/* How often a reader tries to open a segment which doesn't exist yet */
+#define CLUSTER_HOST_OPEN_WAIT          1
+/* How many times a reader retries a copy which is being updated */
+#define CLUSTER_HOST_READ_TRIES         100
+
+static int cluster_host_open_(CLUSTER *cluster, const char *name, int publish);
+static int cluster_host_claim_locked_(CLUSTER *cluster);
+static int cluster_host_read_(CLUSTER *cluster, uint64_t *seq, uint32_t *nmembers, int *slots);
+static int cluster_host_balance_(CLUSTER *cluster);
+static void cluster_host_stop_(CLUSTER *cluster);
+static void cluster_host_forget_(CLUSTER *cluster);
+static void *cluster_host_thread_(void *arg);
+
+#endif /*CLUSTER_HOST_STATE*/
+
+/* Set the name of the host state segment into which this member publishes
+ * the membership, or NULL to disable publication
+ */
+int
+cluster_set_host_state(CLUSTER *cluster, const char *name)
+{
+#ifdef CLUSTER_HOST_STATE
+	char *p;
+
+	if(name && (!*name || strlen(name) > CLUSTER_MEM_NAME_LEN || strchr(name, '/')))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	p = NULL;
+	if(name)
+	{
+		p = strdup(name);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate host state segment name\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+	}
+	free(cluster->host_name);
+	cluster->host_name = p;
+	if(cluster->host_table && cluster->type != CT_HOST)
+	{
+		munmap(cluster->host_table, sizeof(CLUSTERHOSTTABLE));
+		cluster->host_table = NULL;
+		cluster->host_claimed = 0;
+	}
+	if(cluster->flags & CF_VERBOSE)
+	{
+		if(p)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: membership will be published to host state segment '/%s'\n", p);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host state publication disabled\n");
+		}
+	}
+	cluster_unlock_(cluster);
+	return 0;
+#else
+	(void) name;
+
+	cluster_logf_(cluster, LOG_ERR, "libcluster: host state publication is not supported by this build\n");
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+#ifdef CLUSTER_HOST_STATE
+
+/* Join a cluster by reading the membership published into a host state
+ * segment: such members are always passive. If the segment doesn't exist
+ * yet, the cluster is joined with no members, and the thread continues to
+ * try to open it.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_host_join_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	cluster->flags |= CF_PASSIVE;
+	cluster->inst_index = -1;
+	cluster->total_threads = 0;
+	cluster->host_seq = 0;
+	if(!cluster->host_buf)
+	{
+		cluster->host_buf = (CLUSTERSHAREDMEMBER *) calloc(CLUSTER_SHARED_MEMBERS, sizeof(CLUSTERSHAREDMEMBER));
+		if(!cluster->host_buf)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: host: failed to allocate membership buffer\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+	}
+	if(cluster_host_open_(cluster, cluster->registry + 5, 0) && errno != ENOENT)
+	{
+		cluster_unlock_(cluster);
+		cluster_host_leave_(cluster);
+		return -1;
+	}
+	if(cluster->host_table && cluster_host_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: host: failed to perform initial balancing\n");
+		cluster_unlock_(cluster);
+		cluster_host_leave_(cluster);
+		return -1;
+	}
+	cluster_wake_reset_(cluster);
+	pthread_create(&(cluster->balancer_thread), NULL, cluster_host_thread_, (void *) cluster);
+	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host: successfully joined the cluster\n");
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Leave a cluster joined using a host state segment
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_host_leave_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	cluster_host_stop_(cluster);
+	cluster_host_forget_(cluster);
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Invoked before a parent process forks: the thread is terminated, and
+ * the cluster is left locked
+ */
+void
+cluster_host_prepare_(CLUSTER *p)
+{
+	cluster_wrlock_(p);
+	cluster_host_stop_(p);
+}
+
+/* Invoked after fork() in the parent process */
+void
+cluster_host_parent_(CLUSTER *p)
+{
+	/* The cluster is locked on entry */
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_PARENT)
+		{
+			cluster_wake_reset_(p);
+			pthread_create(&(p->balancer_thread), NULL, cluster_host_thread_, (void *) p);
+		}
+		else
+		{
+			cluster_host_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+}
+
+/* Invoked after fork() in the child process */
+void
+cluster_host_child_(CLUSTER *p)
+{
+	/* The cluster was locked by the parent on entry, reset the lock */
+	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+	cluster_wrlock_(p);
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_CHILD)
+		{
+			pthread_create(&(p->balancer_thread), NULL, cluster_host_thread_, (void *) p);
+		}
+		else
+		{
+			cluster_host_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+}
+
+/* Copy the membership into the host state segment, if this member
+ * publishes one; invoked whenever the ring is rebuilt from the member
+ * table.
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_host_publish_locked_(CLUSTER *cluster)
+{
+	CLUSTERHOSTTABLE *table;
+	CLUSTERSHAREDMEMBER *e;
+	uint64_t seq;
+	size_t n;
+
+	if(!cluster->host_name || cluster->type == CT_HOST || cluster->type == CT_STATIC)
+	{
+		return;
+	}
+	if(!cluster->host_table && cluster_host_open_(cluster, cluster->host_name, 1))
+	{
+		return;
+	}
+	if(cluster_host_claim_locked_(cluster))
+	{
+		return;
+	}
+	if(cluster->nmembers > CLUSTER_SHARED_MEMBERS)
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: host: cannot publish %lu members to host state segment '/%s'\n", (unsigned long) cluster->nmembers, cluster->host_name);
+		return;
+	}
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		if(strlen(cluster->members[n].instid) >= CLUSTER_MEM_NAME_LEN)
+		{
+			cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: host: cannot publish member '%s' to host state segment '/%s'\n", cluster->members[n].instid, cluster->host_name);
+			return;
+		}
+	}
+	table = cluster->host_table;
+	seq = __atomic_load_n(&(table->seq), __ATOMIC_RELAXED);
+	/* A previous publisher may have exited part-way through an update */
+	seq += (seq & 1);
+	__atomic_store_n(&(table->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		e = &(table->members[n]);
+		memset(e->instid, 0, CLUSTER_MEM_NAME_LEN);
+		strcpy(e->instid, cluster->members[n].instid);
+		e->workers = cluster->members[n].workers;
+		e->weight = cluster->members[n].weight;
+		e->slot = cluster->members[n].slot;
+	}
+	__atomic_store_n(&(table->nmembers), (uint32_t) cluster->nmembers, __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->slots), ((cluster->flags & CF_SLOTS) ? 1 : 0), __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->seq), seq + 2, __ATOMIC_RELEASE);
+	cluster_shared_wake_(&(table->seq));
+}
+
+/* Empty the host state segment and release it, if this process has
+ * claimed it; invoked when the ring is withdrawn (i.e., when leaving).
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_host_withdraw_locked_(CLUSTER *cluster)
+{
+	CLUSTERHOSTTABLE *table;
+	uint64_t seq;
+	int32_t pid;
+
+	if(cluster->type == CT_HOST || !cluster->host_table || cluster->host_claimed != getpid())
+	{
+		return;
+	}
+	table = cluster->host_table;
+	seq = __atomic_load_n(&(table->seq), __ATOMIC_RELAXED);
+	seq += (seq & 1);
+	__atomic_store_n(&(table->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&(table->nmembers), 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->seq), seq + 2, __ATOMIC_RELEASE);
+	cluster_shared_wake_(&(table->seq));
+	pid = (int32_t) cluster->host_claimed;
+	__atomic_compare_exchange_n(&(table->publisher), &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	cluster->host_claimed = 0;
+}
+
+/* Release the host state resources of a cluster which is being destroyed */
+void
+cluster_host_destroy_(CLUSTER *cluster)
+{
+	if(cluster->host_table)
+	{
+		munmap(cluster->host_table, sizeof(CLUSTERHOSTTABLE));
+		cluster->host_table = NULL;
+	}
+	free(cluster->host_name);
+	cluster->host_name = NULL;
+	free(cluster->host_buf);
+	cluster->host_buf = NULL;
+}
+
+/* Open and map a host state segment: for publishing, creating it if needed
+ * (whichever process creates the segment initialises it, and others wait
+ * briefly for that to happen); otherwise read-only, failing with ENOENT if
+ * it doesn't exist or hasn't yet been initialised.
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_host_open_(CLUSTER *cluster, const char *name, int publish)
+{
+	CLUSTERHOSTTABLE *table;
+	struct stat sbuf;
+	struct timespec ts;
+	char path[CLUSTER_MEM_NAME_LEN + 2];
+	int fd, created, n, verbose;
+
+	verbose = (cluster->flags & CF_VERBOSE);
+	if(!*name || strlen(name) > CLUSTER_MEM_NAME_LEN)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: host state segment name '%s' is not valid\n", name);
+		errno = EINVAL;
+		return -1;
+	}
+	sprintf(path, "/%s", name);
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	created = 0;
+	if(publish)
+	{
+		created = 1;
+		fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0644);
+		if(fd == -1 && errno == EEXIST)
+		{
+			created = 0;
+			fd = shm_open(path, O_RDWR, 0644);
+		}
+	}
+	else
+	{
+		fd = shm_open(path, O_RDONLY, 0);
+	}
+	if(fd == -1)
+	{
+		if(errno != ENOENT || verbose)
+		{
+			cluster_logf_locked_(cluster, (errno == ENOENT ? LOG_DEBUG : LOG_ERR), "libcluster: host: failed to open host state segment '%s': %s\n", path, strerror(errno));
+		}
+		return -1;
+	}
+	if(created)
+	{
+		if(ftruncate(fd, sizeof(CLUSTERHOSTTABLE)))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: failed to size host state segment '%s': %s\n", path, strerror(errno));
+			close(fd);
+			shm_unlink(path);
+			return -1;
+		}
+	}
+	else
+	{
+		/* Wait for the creator to size the segment */
+		for(n = 0; !fstat(fd, &sbuf) && !sbuf.st_size && publish && n < 100; n++)
+		{
+			nanosleep(&ts, NULL);
+		}
+		if(!sbuf.st_size)
+		{
+			close(fd);
+			errno = ENOENT;
+			return -1;
+		}
+		if(sbuf.st_size != (off_t) sizeof(CLUSTERHOSTTABLE))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: host state segment '%s' is not compatible with this version of libcluster\n", path);
+			close(fd);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	table = (CLUSTERHOSTTABLE *) mmap(NULL, sizeof(CLUSTERHOSTTABLE), (publish ? PROT_READ|PROT_WRITE : PROT_READ), MAP_SHARED, fd, 0);
+	close(fd);
+	if(table == MAP_FAILED)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: failed to map host state segment '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(created)
+	{
+		table->size = (uint32_t) sizeof(CLUSTERHOSTTABLE);
+		__atomic_store_n(&(table->magic), CLUSTER_HOST_MAGIC, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		for(n = 0; __atomic_load_n(&(table->magic), __ATOMIC_ACQUIRE) != CLUSTER_HOST_MAGIC && publish && n < 100; n++)
+		{
+			nanosleep(&ts, NULL);
+		}
+		if(table->magic != CLUSTER_HOST_MAGIC || table->size != (uint32_t) sizeof(CLUSTERHOSTTABLE))
+		{
+			munmap(table, sizeof(CLUSTERHOSTTABLE));
+			if(!publish)
+			{
+				errno = ENOENT;
+				return -1;
+			}
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: host state segment '%s' has not been initialised\n", path);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	cluster->host_table = table;
+	cluster->host_claimed = 0;
+	if(verbose)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host: opened host state segment '%s'%s\n", path, (publish ? "" : " (read-only)"));
+	}
+	return 0;
+}
+
+/* Claim the host state segment for this process, if it isn't already being
+ * published by another which is running; returns 0 if this process may
+ * publish into it.
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_host_claim_locked_(CLUSTER *cluster)
+{
+	CLUSTERHOSTTABLE *table;
+	int32_t holder, pid;
+
+	pid = (int32_t) getpid();
+	if(cluster->host_claimed == pid)
+	{
+		return 0;
+	}
+	table = cluster->host_table;
+	holder = __atomic_load_n(&(table->publisher), __ATOMIC_ACQUIRE);
+	for(;;)
+	{
+		if(holder && holder != pid && (!kill((pid_t) holder, 0) || errno == EPERM))
+		{
+			if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host: host state segment '/%s' is being published by process %ld\n", cluster->host_name, (long) holder);
+			}
+			return -1;
+		}
+		if(__atomic_compare_exchange_n(&(table->publisher), &holder, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			break;
+		}
+	}
+	/* The scope is only written by the process holding the segment, and
+	 * identifies the cluster whose membership it holds
+	 */
+	if(cluster_scope_locked_(cluster, table->scope))
+	{
+		memset(table->scope, 0, CLUSTER_SCOPE_LEN);
+	}
+	cluster->host_claimed = (pid_t) pid;
+	cluster_logf_locked_(cluster, LOG_INFO, "libcluster: host: publishing membership to host state segment '/%s'\n", cluster->host_name);
+	return 0;
+}
+
+/* Obtain a consistent copy of the membership in the segment, placing it
+ * in cluster->host_buf; returns -1 if no consistent copy could be made
+ * (for example, because the publisher exited part-way through an update)
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_host_read_(CLUSTER *cluster, uint64_t *seq, uint32_t *nmembers, int *slots)
+{
+	CLUSTERHOSTTABLE *table;
+	struct timespec ts;
+	uint64_t check;
+	uint32_t n;
+	int tries;
+
+	table = cluster->host_table;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	for(tries = 0; tries < CLUSTER_HOST_READ_TRIES; tries++)
+	{
+		*seq = __atomic_load_n(&(table->seq), __ATOMIC_ACQUIRE);
+		if(!(*seq & 1))
+		{
+			n = __atomic_load_n(&(table->nmembers), __ATOMIC_RELAXED);
+			if(n > CLUSTER_SHARED_MEMBERS)
+			{
+				n = CLUSTER_SHARED_MEMBERS;
+			}
+			memcpy(cluster->host_buf, table->members, n * sizeof(CLUSTERSHAREDMEMBER));
+			*slots = __atomic_load_n(&(table->slots), __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			check = __atomic_load_n(&(table->seq), __ATOMIC_RELAXED);
+			if(check == *seq)
+			{
+				*nmembers = n;
+				return 0;
+			}
+		}
+		nanosleep(&ts, NULL);
+	}
+	return -1;
+}
+
+/* Re-read the membership from the segment and re-balance
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_host_balance_(CLUSTER *cluster)
+{
+	char scope[CLUSTER_SCOPE_LEN];
+	CLUSTERSHAREDMEMBER *e;
+	uint64_t start, seq;
+	uint32_t nmembers, n;
+	int slots, total;
+
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	if(cluster_host_read_(cluster, &seq, &nmembers, &slots))
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: host: failed to obtain a consistent copy of the membership\n");
+		return -1;
+	}
+	cluster->host_seq = seq;
+	if(nmembers && (cluster_scope_locked_(cluster, scope) || strncmp(scope, cluster->host_table->scope, CLUSTER_SCOPE_LEN)))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: host: host state segment <%s> holds the membership of a different cluster\n", cluster->registry);
+		nmembers = 0;
+	}
+	if(slots)
+	{
+		cluster->flags |= CF_SLOTS;
+	}
+	else
+	{
+		cluster->flags &= ~CF_SLOTS;
+	}
+	cluster->host_pass++;
+	total = 0;
+	for(n = 0; n < nmembers; n++)
+	{
+		e = &(cluster->host_buf[n]);
+		e->instid[CLUSTER_MEM_NAME_LEN - 1] = 0;
+		if(!e->instid[0] || e->workers < 0)
+		{
+			continue;
+		}
+		if(cluster_member_set_(cluster, e->instid, e->workers, e->weight, e->slot, cluster->host_pass) < 0)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: host: failed to update member table\n");
+			return -1;
+		}
+		total += e->workers;
+	}
+	cluster_members_expire_(cluster, cluster->host_pass);
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
+	if(total != cluster->total_threads)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host: cluster %s/%s has re-balanced: new total is %d (was %d)\n", cluster->key, cluster->env, total, cluster->total_threads);
+		cluster->total_threads = total;
+		cluster_publish_locked_(cluster);
+		cluster_unlock_(cluster);
+		cluster_rebalanced_(cluster);
+		/* Re-acquire the lock to restore state */
+		cluster_wrlock_(cluster);
+	}
+	return 0;
+}
+
+/* Terminate the thread, if it's running
+ *
+ * The cluster must be write-locked when invoking this function; the lock
+ * will be released while waiting for the thread to terminate.
+ */
+static void
+cluster_host_stop_(CLUSTER *cluster)
+{
+	CLUSTERFLAGS flags;
+	pthread_t bt;
+
+	if(!cluster->balancer_thread)
+	{
+		return;
+	}
+	flags = cluster->flags;
+	cluster->flags |= CF_LEAVING;
+	cluster_wake_(cluster, CW_LEAVE);
+	bt = cluster->balancer_thread;
+	if(cluster->host_table)
+	{
+		/* The thread may be waiting for the segment to change */
+		cluster_shared_wake_(&(cluster->host_table->seq));
+	}
+	/* Unlock to allow the thread to read the flag */
+	cluster_unlock_(cluster);
+	pthread_join(bt, NULL);
+	/* Re-acquire the lock so that the unwinding can safely complete */
+	cluster_wrlock_(cluster);
+	cluster->balancer_thread = 0;
+	cluster->flags = flags;
+}
+
+/* Discard the cluster's membership state and unmap the segment
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static void
+cluster_host_forget_(CLUSTER *cluster)
+{
+	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster->inst_index = -1;
+	cluster->total_threads = 0;
+	cluster_publish_locked_(cluster);
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
+	if(cluster->host_table)
+	{
+		munmap(cluster->host_table, sizeof(CLUSTERHOSTTABLE));
+		cluster->host_table = NULL;
+	}
+}
+
+/* The reader thread: wait for the segment's sequence counter to change,
+ * re-reading the membership whenever it does, until cluster->flags &
+ * CF_LEAVING is set
+ */
+static void *
+cluster_host_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	CLUSTERHOSTTABLE *table;
+	time_t retry;
+	uint64_t seen, seq;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: host: re-balancing thread started for %s/%s at <%s>\n", cluster->key, cluster->env, cluster->registry);
+	table = cluster->host_table;
+	seen = cluster->host_seq;
+	cluster_unlock_(cluster);
+	retry = 0;
+	while(!cluster_leaving_(cluster))
+	{
+		if(!table)
+		{
+			/* Wait for the publisher to create the segment */
+			if(cluster_now_() >= retry)
+			{
+				cluster_wrlock_(cluster);
+				if(!cluster_host_open_(cluster, cluster->registry + 5, 0))
+				{
+					table = cluster->host_table;
+					seen = ~cluster->host_seq;
+				}
+				cluster_unlock_(cluster);
+				retry = cluster_now_() + CLUSTER_HOST_OPEN_WAIT;
+			}
+			if(!table)
+			{
+				cluster_wait_(cluster, CW_NONE, CLUSTER_HOST_OPEN_WAIT);
+				continue;
+			}
+		}
+		seq = __atomic_load_n(&(table->seq), __ATOMIC_ACQUIRE);
+		if(seq == seen || (seq & 1))
+		{
+			cluster_shared_wait_(cluster, &(table->seq), seq, 0);
+			continue;
+		}
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		cluster_wrlock_(cluster);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_unlock_(cluster);
+			break;
+		}
+		if(cluster_host_balance_(cluster))
+		{
+			cluster_stats_count_(&(cluster->stats.errors));
+			seen = seq;
+		}
+		else
+		{
+			seen = cluster->host_seq;
+		}
+		cluster_unlock_(cluster);
+	}
+	cluster_logf_(cluster, LOG_DEBUG, "libcluster: host: re-balancing thread is terminating\n");
+	return NULL;
+}
+
+#endif /*CLUSTER_HOST_STATE*/
@@ -0,0 +1,1126 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+#ifdef ENABLE_MEM
+
+/* In-memory registries
+ *
+ * A 'mem:NAME' registry is a table of member entries held within this
+ * process, shared by every cluster connection which names it; a
+ * 'shm:NAME' registry is the same table held in a POSIX shared memory
+ * segment, and so shared by every process on the host which names it.
+ * Members refresh their entries every cluster->refresh seconds, and an
+ * entry which hasn't been refreshed within the TTL is disregarded, just as
+ * with the other registries.
+ *
+ * Any change to an entry advances the table's generation, and the
+ * re-balancing threads re-read the membership when it does; they also do
+ * so once the earliest expiry time of the members they last read has
+ * passed. The balancers of a private table wait upon its condition
+ * variable, which is signalled when the generation is advanced; those of a
+ * shared table wait for the generation itself to change instead (see
+ * cluster_shared_wait_()), because a process-shared condition variable
+ * cannot be relied upon once a process waiting upon it has been killed.
+ *
+ * A process's handles on the registries it uses are kept in a list, and
+ * released when no cluster connection is using them: a private table is
+ * discarded at that point, whereas a shared memory segment persists until
+ * it's removed (e.g., with shm_unlink()) or the host is restarted.
+ *
+ * The cluster lock may be held when acquiring a table's lock, but not
+ * vice versa.
+ */
+
+/* Identifies an initialised shared table */
+#define CLUSTER_MEM_MAGIC               0x4c434d31
+/* The longest a balancer waits before checking the cluster's flags */
+#define CLUSTER_MEM_BALANCE_WAIT        1
+
+static int cluster_mem_attach_(CLUSTER *cluster);
+static void cluster_mem_detach_(CLUSTER *cluster);
+static int cluster_mem_table_init_(CLUSTERMEMTABLE *table, int shared);
+#ifdef CLUSTER_MEM_SHARED
+static int cluster_mem_shm_open_(CLUSTER *cluster, CLUSTERMEMREGISTRY *reg);
+#endif
+static void cluster_mem_lock_(CLUSTERMEMTABLE *table);
+static void cluster_mem_unlock_(CLUSTERMEMTABLE *table);
+static void cluster_mem_advance_(CLUSTERMEMREGISTRY *reg);
+static int cluster_mem_match_(CLUSTER *cluster, const CLUSTERMEMENTRY *entry);
+static int cluster_mem_ping_(CLUSTER *cluster);
+static void cluster_mem_unping_(CLUSTER *cluster);
+static int cluster_mem_balance_(CLUSTER *cluster);
+static int cluster_mem_wait_(CLUSTER *cluster, CLUSTERMEMREGISTRY *reg, uint64_t *seen, time_t boundary);
+static void cluster_mem_stop_(CLUSTER *cluster);
+static void cluster_mem_forget_(CLUSTER *cluster);
+static int cluster_mem_rejoin_(CLUSTER *cluster);
+static void *cluster_mem_ping_thread_(void *arg);
+static void *cluster_mem_balancer_thread_(void *arg);
+
+static pthread_mutex_t cluster_mem_lock = PTHREAD_MUTEX_INITIALIZER;
+static CLUSTERMEMREGISTRY *cluster_mem_first;
+
+/* Join a cluster using an in-memory registry: add our entry to the table,
+ * read the membership, then spawn the ping and re-balancing threads
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_mem_join_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	cluster->inst_index = -1;
+	if(cluster_mem_attach_(cluster))
+	{
+		cluster_unlock_(cluster);
+		cluster_mem_leave_(cluster);
+		return -1;
+	}
+	if(cluster_mem_rejoin_(cluster))
+	{
+		cluster_unlock_(cluster);
+		cluster_mem_leave_(cluster);
+		return -1;
+	}
+	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: successfully joined the cluster\n");
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Leave a cluster using an in-memory registry: terminate the threads, then
+ * remove our entry from the table
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_mem_leave_(CLUSTER *cluster)
+{
+	/* Use a write-lock to prevent a read-lock - write-lock race */
+	cluster_wrlock_(cluster);
+	cluster_mem_stop_(cluster);
+	if(cluster->mem_registry)
+	{
+		cluster_mem_unping_(cluster);
+	}
+	cluster_mem_forget_(cluster);
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Invoked before a parent process forks: the threads are terminated (but
+ * our entry remains in the table), and the cluster is left locked
+ */
+void
+cluster_mem_prepare_(CLUSTER *p)
+{
+	cluster_wrlock_(p);
+	if(p->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(p, LOG_INFO, "libcluster: mem: preparing for fork()\n");
+	}
+	cluster_mem_stop_(p);
+}
+
+/* Invoked after fork() in the parent process */
+void
+cluster_mem_parent_(CLUSTER *p)
+{
+	int r;
+
+	/* The cluster is locked on entry */
+	r = 0;
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_PARENT)
+		{
+			if(p->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(p, LOG_NOTICE, "libcluster: mem: resuming cluster membership in parent process\n");
+			}
+			r = cluster_mem_rejoin_(p);
+		}
+		else
+		{
+			/* The membership has passed to the child; a shared entry is
+			 * now refreshed by it, but a private table is this process's
+			 * alone
+			 */
+			if(!p->mem_registry->shared)
+			{
+				cluster_mem_unping_(p);
+			}
+			cluster_mem_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+	if(r)
+	{
+		cluster_mem_leave_(p);
+	}
+}
+
+/* Invoked after fork() in the child process */
+void
+cluster_mem_child_(CLUSTER *p)
+{
+	int r;
+
+	/* The cluster was locked by the parent on entry, reset the lock */
+	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+	cluster_wrlock_(p);
+	r = 0;
+	if(p->flags & CF_JOINED)
+	{
+		if(p->forkmode & CLUSTER_FORK_CHILD)
+		{
+			if(p->forkmode & CLUSTER_FORK_PARENT)
+			{
+				/* We're re-joining the cluster in both the parent and the
+				 * child, therefore the child will be assigned a new instance
+				 * UUID
+				 */
+				cluster_reset_instance_locked_(p);
+			}
+			if(p->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(p, LOG_NOTICE, "libcluster: mem: resuming cluster membership in child process\n");
+			}
+			r = cluster_mem_rejoin_(p);
+		}
+		else
+		{
+			/* The parent retains the membership, and so its entry */
+			cluster_mem_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+	if(r)
+	{
+		cluster_mem_leave_(p);
+	}
+}
+
+/* Invoked in the child after fork(), before the clusters' own handlers:
+ * the locks of private tables may have been held by other threads of the
+ * parent, which don't exist in the child. The entries of private tables
+ * are those of the parent's clusters, and so are discarded; the child's
+ * clusters add their own when they resume membership.
+ */
+void
+cluster_mem_reinit_(void)
+{
+	CLUSTERMEMREGISTRY *reg;
+
+	pthread_mutex_init(&cluster_mem_lock, NULL);
+	for(reg = cluster_mem_first; reg; reg = reg->next)
+	{
+		if(!reg->shared)
+		{
+			cluster_mem_table_init_(reg->table, 0);
+			memset(reg->table->entries, 0, sizeof(reg->table->entries));
+			reg->table->used = 0;
+			reg->table->generation++;
+		}
+	}
+}
+
+/* Attach to the registry named by the cluster's registry URI, creating it
+ * if needed
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_mem_attach_(CLUSTER *cluster)
+{
+	CLUSTERMEMREGISTRY *reg;
+	const char *name;
+	int shared;
+
+	if(strlen(cluster->key) >= CLUSTER_MEM_NAME_LEN ||
+	   strlen(cluster->env) >= CLUSTER_MEM_NAME_LEN ||
+	   strlen(cluster->instid) >= CLUSTER_MEM_NAME_LEN ||
+	   (cluster->partition && strlen(cluster->partition) >= CLUSTER_MEM_NAME_LEN))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: cluster key, environment, partition and instance identifier must each be shorter than %d characters\n", CLUSTER_MEM_NAME_LEN);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	shared = (strncmp(cluster->registry, "shm:", 4) ? 0 : 1);
+	name = cluster->registry + 4;
+	if(shared)
+	{
+		/* POSIX shared memory object names have a single leading slash */
+		while(*name == '/')
+		{
+			name++;
+		}
+		if(!*name || strchr(name, '/'))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: invalid shared memory registry <%s>\n", cluster->registry);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&cluster_mem_lock);
+	for(reg = cluster_mem_first; reg; reg = reg->next)
+	{
+		if(reg->shared == shared && !strcmp(reg->name, name))
+		{
+			break;
+		}
+	}
+	if(!reg)
+	{
+		reg = (CLUSTERMEMREGISTRY *) calloc(1, sizeof(CLUSTERMEMREGISTRY));
+		if(!reg || !(reg->name = strdup(name)))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to allocate registry\n");
+			free(reg);
+			pthread_mutex_unlock(&cluster_mem_lock);
+			return -1;
+		}
+		reg->shared = shared;
+		if(shared)
+		{
+#ifdef CLUSTER_MEM_SHARED
+			if(cluster_mem_shm_open_(cluster, reg))
+			{
+				free(reg->name);
+				free(reg);
+				pthread_mutex_unlock(&cluster_mem_lock);
+				return -1;
+			}
+#else
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: shared memory registries are not supported by this build\n");
+			free(reg->name);
+			free(reg);
+			pthread_mutex_unlock(&cluster_mem_lock);
+			errno = ENOTSUP;
+			return -1;
+#endif
+		}
+		else
+		{
+			reg->table = (CLUSTERMEMTABLE *) calloc(1, sizeof(CLUSTERMEMTABLE));
+			if(!reg->table || cluster_mem_table_init_(reg->table, 0))
+			{
+				cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to allocate registry table\n");
+				free(reg->table);
+				free(reg->name);
+				free(reg);
+				pthread_mutex_unlock(&cluster_mem_lock);
+				return -1;
+			}
+		}
+		reg->next = cluster_mem_first;
+		cluster_mem_first = reg;
+	}
+	reg->refcount++;
+	pthread_mutex_unlock(&cluster_mem_lock);
+	cluster->mem_registry = reg;
+	cluster->mem_generation = 0;
+	cluster->mem_boundary = 0;
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: attached to %s registry '%s'\n", (shared ? "shared memory" : "in-memory"), name);
+	}
+	return 0;
+}
+
+/* Release the cluster's handle on its registry
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static void
+cluster_mem_detach_(CLUSTER *cluster)
+{
+	CLUSTERMEMREGISTRY *reg, *p, *prev;
+
+	reg = cluster->mem_registry;
+	if(!reg)
+	{
+		return;
+	}
+	cluster->mem_registry = NULL;
+	pthread_mutex_lock(&cluster_mem_lock);
+	reg->refcount--;
+	if(reg->refcount)
+	{
+		pthread_mutex_unlock(&cluster_mem_lock);
+		return;
+	}
+	prev = NULL;
+	for(p = cluster_mem_first; p && p != reg; p = p->next)
+	{
+		prev = p;
+	}
+	if(prev)
+	{
+		prev->next = reg->next;
+	}
+	else
+	{
+		cluster_mem_first = reg->next;
+	}
+	pthread_mutex_unlock(&cluster_mem_lock);
+	if(reg->shared)
+	{
+#ifdef CLUSTER_MEM_SHARED
+		munmap(reg->table, sizeof(CLUSTERMEMTABLE));
+#endif
+	}
+	else
+	{
+		pthread_cond_destroy(&(reg->table->cond));
+		pthread_mutex_destroy(&(reg->table->lock));
+		free(reg->table);
+	}
+	free(reg->name);
+	free(reg);
+}
+
+/* Initialise a table's lock and (for a private table) its condition
+ * variable; the lock of a shared table must be usable by other processes,
+ * and remain usable if a process dies while holding it
+ */
+static int
+cluster_mem_table_init_(CLUSTERMEMTABLE *table, int shared)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+
+	pthread_mutexattr_init(&mattr);
+	if(shared)
+	{
+		pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+		pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+	}
+	pthread_mutex_init(&(table->lock), &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	if(!shared)
+	{
+		pthread_condattr_init(&cattr);
+		pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+		pthread_cond_init(&(table->cond), &cattr);
+		pthread_condattr_destroy(&cattr);
+	}
+	table->size = (uint32_t) sizeof(CLUSTERMEMTABLE);
+	return 0;
+}
+
+#ifdef CLUSTER_MEM_SHARED
+/* Open (creating, if needed) the shared memory segment holding a shared
+ * registry's table. Whichever process creates the segment initialises it;
+ * others wait briefly for that to happen.
+ */
+static int
+cluster_mem_shm_open_(CLUSTER *cluster, CLUSTERMEMREGISTRY *reg)
+{
+	CLUSTERMEMTABLE *table;
+	struct stat sbuf;
+	struct timespec ts;
+	char path[CLUSTER_MEM_NAME_LEN + 2];
+	int fd, created, n;
+
+	if(strlen(reg->name) > CLUSTER_MEM_NAME_LEN)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: shared memory registry name '%s' is too long\n", reg->name);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	sprintf(path, "/%s", reg->name);
+	ts.tv_sec = 0;
+	ts.tv_nsec = 10000000;
+	created = 1;
+	fd = shm_open(path, O_RDWR|O_CREAT|O_EXCL, 0600);
+	if(fd == -1 && errno == EEXIST)
+	{
+		created = 0;
+		fd = shm_open(path, O_RDWR, 0600);
+	}
+	if(fd == -1)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to open shared memory registry '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(created)
+	{
+		if(ftruncate(fd, sizeof(CLUSTERMEMTABLE)))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to size shared memory registry '%s': %s\n", path, strerror(errno));
+			close(fd);
+			shm_unlink(path);
+			return -1;
+		}
+	}
+	else
+	{
+		/* Wait for the creator to size the segment */
+		for(n = 0; !fstat(fd, &sbuf) && !sbuf.st_size && n < 100; n++)
+		{
+			nanosleep(&ts, NULL);
+		}
+		if(sbuf.st_size != (off_t) sizeof(CLUSTERMEMTABLE))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: shared memory registry '%s' is not compatible with this version of libcluster\n", path);
+			close(fd);
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	table = (CLUSTERMEMTABLE *) mmap(NULL, sizeof(CLUSTERMEMTABLE), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(table == MAP_FAILED)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to map shared memory registry '%s': %s\n", path, strerror(errno));
+		return -1;
+	}
+	if(created)
+	{
+		cluster_mem_table_init_(table, 1);
+		__atomic_store_n(&(table->magic), CLUSTER_MEM_MAGIC, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		for(n = 0; __atomic_load_n(&(table->magic), __ATOMIC_ACQUIRE) != CLUSTER_MEM_MAGIC && n < 100; n++)
+		{
+			nanosleep(&ts, NULL);
+		}
+		if(table->magic != CLUSTER_MEM_MAGIC || table->size != (uint32_t) sizeof(CLUSTERMEMTABLE))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: shared memory registry '%s' has not been initialised\n", path);
+			munmap(table, sizeof(CLUSTERMEMTABLE));
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	reg->table = table;
+	return 0;
+}
+#endif /*CLUSTER_MEM_SHARED*/
+
+/* Acquire a table's lock; if a process died while holding the lock of a
+ * shared table, its entries may be in an intermediate state, but are
+ * otherwise usable
+ */
+static void
+cluster_mem_lock_(CLUSTERMEMTABLE *table)
+{
+	if(pthread_mutex_lock(&(table->lock)) == EOWNERDEAD)
+	{
+		pthread_mutex_consistent(&(table->lock));
+	}
+}
+
+static void
+cluster_mem_unlock_(CLUSTERMEMTABLE *table)
+{
+	pthread_mutex_unlock(&(table->lock));
+}
+
+/* Advance a table's generation, waking the balancers waiting upon it; the
+ * table should be locked when invoking this function
+ */
+static void
+cluster_mem_advance_(CLUSTERMEMREGISTRY *reg)
+{
+#ifdef CLUSTER_ATOMICS
+	__atomic_add_fetch(&(reg->table->generation), 1, __ATOMIC_RELEASE);
+#else
+	reg->table->generation++;
+#endif
+	if(!reg->shared)
+	{
+		pthread_cond_broadcast(&(reg->table->cond));
+	}
+#ifdef CLUSTER_MEM_SHARED
+	else
+	{
+		cluster_shared_wake_(&(reg->table->generation));
+	}
+#endif
+}
+
+/* Determine whether a (non-free) entry belongs to the cluster */
+static int
+cluster_mem_match_(CLUSTER *cluster, const CLUSTERMEMENTRY *entry)
+{
+	return (!strcmp(entry->key, cluster->key) &&
+			!strcmp(entry->env, cluster->env) &&
+			!strcmp(entry->partition, (cluster->partition ? cluster->partition : "")));
+}
+
+/* Add or refresh our entry in the table, claiming a stable slot if needed.
+ * The table's generation is only advanced if the entry is new or its
+ * worker count or slot have changed: refreshes don't alter the balance.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_mem_ping_(CLUSTER *cluster)
+{
+	CLUSTERMEMTABLE *table;
+	CLUSTERMEMENTRY *entry, *avail, *e;
+	unsigned char held[CLUSTER_MEM_ENTRIES / 8];
+	time_t now;
+	size_t n;
+	int changed, slot;
+
+	if(cluster->flags & CF_PASSIVE)
+	{
+		return 0;
+	}
+	table = cluster->mem_registry->table;
+	now = cluster_now_();
+	changed = 0;
+	entry = NULL;
+	avail = NULL;
+	memset(held, 0, sizeof(held));
+	cluster_mem_lock_(table);
+	for(n = 0; n < table->used; n++)
+	{
+		e = &(table->entries[n]);
+		if(!e->instid[0])
+		{
+			if(!avail)
+			{
+				avail = e;
+			}
+			continue;
+		}
+		if(!cluster_mem_match_(cluster, e))
+		{
+			if(e->expires <= now)
+			{
+				/* Reclaim the entries of members which have gone */
+				memset(e, 0, sizeof(CLUSTERMEMENTRY));
+				if(!avail)
+				{
+					avail = e;
+				}
+			}
+			continue;
+		}
+		if(!strcmp(e->instid, cluster->instid))
+		{
+			entry = e;
+			if(e->expires <= now)
+			{
+				/* Our entry expired, and so we must announce it again */
+				changed = 1;
+			}
+			continue;
+		}
+		if(e->expires > now && e->slot >= 0 && e->slot < CLUSTER_MEM_ENTRIES)
+		{
+			held[e->slot / 8] |= (1 << (e->slot % 8));
+		}
+	}
+	if(!entry)
+	{
+		if(!avail)
+		{
+			if(table->used >= CLUSTER_MEM_ENTRIES)
+			{
+				cluster_mem_unlock_(table);
+				cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: registry table is full\n");
+				errno = ENOSPC;
+				return -1;
+			}
+			avail = &(table->entries[table->used]);
+			table->used++;
+		}
+		entry = avail;
+		strcpy(entry->key, cluster->key);
+		strcpy(entry->env, cluster->env);
+		strcpy(entry->partition, (cluster->partition ? cluster->partition : ""));
+		strcpy(entry->instid, cluster->instid);
+		entry->slot = -1;
+		changed = 1;
+	}
+	slot = -1;
+	if(cluster->flags & CF_SLOTS)
+	{
+		/* Retain any slot we've claimed, unless another member has since
+		 * taken it; otherwise, claim the lowest which is free
+		 */
+		slot = cluster->slot;
+		if(slot < 0 || slot >= CLUSTER_MEM_ENTRIES || (held[slot / 8] & (1 << (slot % 8))))
+		{
+			for(slot = 0; held[slot / 8] & (1 << (slot % 8)); slot++);
+		}
+		cluster->slot = slot;
+	}
+	if(entry->workers != cluster->inst_threads || entry->weight != cluster->inst_weight || entry->slot != slot)
+	{
+		changed = 1;
+	}
+	entry->workers = cluster->inst_threads;
+	entry->weight = cluster->inst_weight;
+	entry->slot = slot;
+	entry->expires = now + cluster->ttl;
+	if(changed)
+	{
+		cluster_mem_advance_(cluster->mem_registry);
+	}
+	cluster_mem_unlock_(table);
+	return 0;
+}
+
+/* Remove our entry from the table
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static void
+cluster_mem_unping_(CLUSTER *cluster)
+{
+	CLUSTERMEMTABLE *table;
+	CLUSTERMEMENTRY *e;
+	size_t n;
+
+	if(cluster->flags & CF_PASSIVE)
+	{
+		return;
+	}
+	table = cluster->mem_registry->table;
+	cluster_mem_lock_(table);
+	for(n = 0; n < table->used; n++)
+	{
+		e = &(table->entries[n]);
+		if(e->instid[0] && !strcmp(e->instid, cluster->instid) && cluster_mem_match_(cluster, e))
+		{
+			memset(e, 0, sizeof(CLUSTERMEMENTRY));
+			cluster_mem_advance_(cluster->mem_registry);
+			break;
+		}
+	}
+	cluster_mem_unlock_(table);
+}
+
+/* Read the cluster's members from the table and determine what our index
+ * in the cluster is.
+ *
+ * The cluster should be write-locked when invoking this function. The lock
+ * may be released and re-acquired during the course of its execution.
+ */
+static int
+cluster_mem_balance_(CLUSTER *cluster)
+{
+	CLUSTERMEMTABLE *table;
+	CLUSTERMEMENTRY *e;
+	CLUSTERMEMBER **order, *m;
+	time_t now, boundary;
+	int total, base;
+	size_t n;
+	uint64_t start;
+
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: re-balancing cluster %s/%s:\n", cluster->key, cluster->env);
+	}
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	table = cluster->mem_registry->table;
+	now = cluster_now_();
+	boundary = 0;
+	cluster->mem_pass++;
+	cluster_mem_lock_(table);
+	cluster->mem_generation = table->generation;
+	for(n = 0; n < table->used; n++)
+	{
+		e = &(table->entries[n]);
+		if(!e->instid[0] || e->expires <= now || !cluster_mem_match_(cluster, e))
+		{
+			continue;
+		}
+		/* The membership needn't be re-read until the earliest expiry
+		 * time has passed, unless the generation changes
+		 */
+		if(!boundary || e->expires < boundary)
+		{
+			boundary = (time_t) e->expires;
+		}
+		/* Members are marked with the number of this pass so that those
+		 * which were not present can be discarded afterwards
+		 */
+		if(cluster_member_set_(cluster, e->instid, e->workers, e->weight, e->slot, cluster->mem_pass) < 0)
+		{
+			cluster_mem_unlock_(table);
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to update member table\n");
+			return -1;
+		}
+	}
+	cluster_mem_unlock_(table);
+	cluster->mem_boundary = boundary;
+	cluster_members_expire_(cluster, cluster->mem_pass);
+	if(!(order = cluster_members_order_(cluster)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to allocate member order\n");
+		return -1;
+	}
+	total = 0;
+	base = -1;
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		m = order[n];
+		if(!strcmp(m->instid, cluster->instid) && !(cluster->flags & CF_PASSIVE))
+		{
+			base = total;
+			if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: * %s [%d]\n", cluster->instid, total);
+			}
+		}
+		else
+		{
+			if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster:   %s [%d]\n", m->instid, total);
+			}
+		}
+		total += m->workers;
+	}
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
+	if(total != cluster->total_threads || base != cluster->inst_index)
+	{
+		if(base == -1)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: this instance is not a member of %s/%s\n", cluster->key, cluster->env);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: cluster %s/%s has re-balanced: new base is %d (was %d), new total is %d (was %d)\n", cluster->key, cluster->env, base, cluster->inst_index, total, cluster->total_threads);
+		}
+		cluster->inst_index = base;
+		cluster->total_threads = total;
+		cluster_publish_locked_(cluster);
+		cluster_unlock_(cluster);
+		cluster_rebalanced_(cluster);
+		/* Re-acquire the lock to restore state */
+		cluster_wrlock_(cluster);
+	}
+	return 0;
+}
+
+/* Wait until the table's generation differs from *seen (which is
+ * updated), the time given by boundary (if non-zero) has passed, or the
+ * cluster is leaving, for up to CLUSTER_MEM_BALANCE_WAIT seconds. Returns 1
+ * if the membership should be re-read, and 0 otherwise.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static int
+cluster_mem_wait_(CLUSTER *cluster, CLUSTERMEMREGISTRY *reg, uint64_t *seen, time_t boundary)
+{
+	CLUSTERMEMTABLE *table;
+	struct timespec deadline;
+#ifdef CLUSTER_MEM_SHARED
+	uint64_t generation;
+#endif
+	int r;
+
+	table = reg->table;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += CLUSTER_MEM_BALANCE_WAIT;
+	if(boundary && boundary < deadline.tv_sec)
+	{
+		deadline.tv_sec = boundary;
+		deadline.tv_nsec = 0;
+	}
+#ifdef CLUSTER_MEM_SHARED
+	if(reg->shared)
+	{
+		cluster_shared_wait_(cluster, &(table->generation), *seen, boundary);
+		generation = __atomic_load_n(&(table->generation), __ATOMIC_ACQUIRE);
+		if(generation != *seen)
+		{
+			*seen = generation;
+			return 1;
+		}
+		return (boundary && cluster_now_() >= boundary);
+	}
+#endif
+	cluster_mem_lock_(table);
+	while(table->generation == *seen && !cluster_leaving_(cluster) &&
+		  !(boundary && cluster_now_() >= boundary))
+	{
+		if(pthread_cond_timedwait(&(table->cond), &(table->lock), &deadline))
+		{
+			break;
+		}
+	}
+	r = 0;
+	if(table->generation != *seen)
+	{
+		*seen = table->generation;
+		r = 1;
+	}
+	else if(boundary && cluster_now_() >= boundary)
+	{
+		r = 1;
+	}
+	cluster_mem_unlock_(table);
+	return r;
+}
+
+/* Terminate the cluster's threads, if they're running
+ *
+ * The cluster should be write-locked when invoking this function. The lock
+ * is released and re-acquired during the course of its execution.
+ */
+static void
+cluster_mem_stop_(CLUSTER *cluster)
+{
+	CLUSTERFLAGS flags;
+	pthread_t pt, bt;
+
+	if(!cluster->ping_thread && !cluster->balancer_thread)
+	{
+		return;
+	}
+	flags = cluster->flags;
+	cluster->flags |= CF_LEAVING;
+	cluster_wake_(cluster, CW_LEAVE);
+	pt = cluster->ping_thread;
+	bt = cluster->balancer_thread;
+	/* The balancer may be waiting for the table to change */
+	if(!cluster->mem_registry->shared)
+	{
+		cluster_mem_lock_(cluster->mem_registry->table);
+		pthread_cond_broadcast(&(cluster->mem_registry->table->cond));
+		cluster_mem_unlock_(cluster->mem_registry->table);
+	}
+#ifdef CLUSTER_MEM_SHARED
+	else
+	{
+		cluster_shared_wake_(&(cluster->mem_registry->table->generation));
+	}
+#endif
+	/* Unlock to allow the threads to read the flag */
+	cluster_unlock_(cluster);
+	if(pt)
+	{
+		pthread_join(pt, NULL);
+	}
+	if(bt)
+	{
+		pthread_join(bt, NULL);
+	}
+	/* Re-acquire the lock so that the unwinding can safely complete */
+	cluster_wrlock_(cluster);
+	cluster->ping_thread = 0;
+	cluster->balancer_thread = 0;
+	cluster->flags = flags;
+}
+
+/* Discard the cluster's membership state and release its registry, without
+ * altering its entry
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static void
+cluster_mem_forget_(CLUSTER *cluster)
+{
+	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster->inst_index = -1;
+	cluster->total_threads = 0;
+	cluster_publish_locked_(cluster);
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
+	cluster_mem_detach_(cluster);
+}
+
+/* Add our entry, balance, and start the threads; invoked when joining and
+ * when resuming membership after a fork()
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_mem_rejoin_(CLUSTER *cluster)
+{
+	if(cluster_mem_ping_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to perform initial ping\n");
+		return -1;
+	}
+	if(cluster_mem_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: mem: failed to perform initial balancing\n");
+		return -1;
+	}
+	cluster_wake_reset_(cluster);
+	if(!(cluster->flags & CF_PASSIVE))
+	{
+		pthread_create(&(cluster->ping_thread), NULL, cluster_mem_ping_thread_, (void *) cluster);
+	}
+	pthread_create(&(cluster->balancer_thread), NULL, cluster_mem_balancer_thread_, (void *) cluster);
+	return 0;
+}
+
+/* Periodic ping thread: refresh our entry every cluster->refresh seconds
+ * until cluster->flags & CF_LEAVING is set
+ */
+static void *
+cluster_mem_ping_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	int refresh, wait, r;
+	uint64_t start;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	refresh = cluster->refresh;
+	wait = refresh;
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: ping thread starting with ttl=%d, refresh=%d\n", cluster->ttl, cluster->refresh);
+	cluster_unlock_(cluster);
+
+	/* The cluster lock is not held at the start of each pass */
+	for(;;)
+	{
+		/* Wait until the refresh time arrives, or until we're woken
+		 * because we should ping early (e.g., because the worker count
+		 * has changed) or terminate
+		 */
+		cluster_wait_(cluster, CW_PING, wait);
+		cluster_rdlock_(cluster);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: 'leaving' flag has been set, will terminate ping thread\n");
+			cluster_unlock_(cluster);
+			break;
+		}
+		start = cluster_trace_begin_(cluster, CLUSTER_TRACE_PING);
+		r = cluster_mem_ping_(cluster);
+		cluster_stats_record_(&(cluster->stats.ping), start);
+		cluster_trace_end_(cluster, CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+		if(r)
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to update registry\n");
+			cluster_stats_count_(&(cluster->stats.errors));
+			cluster_stats_count_(&(cluster->stats.retries));
+			/* Short retry in case space becomes available */
+			wait = 5;
+		}
+		else
+		{
+			wait = refresh;
+		}
+		cluster_unlock_(cluster);
+	}
+	return NULL;
+}
+
+/* Re-balancing thread: wait for the table to change, or for the earliest
+ * expiry time of the members last read to pass, and invoke
+ * cluster_mem_balance_() (which may invoke the re-balancing callback) when
+ * either happens
+ */
+static void *
+cluster_mem_balancer_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	CLUSTERMEMREGISTRY *reg;
+	uint64_t seen;
+	time_t boundary;
+	int settle;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: re-balancing thread started for %s/%s\n", cluster->key, cluster->env);
+	reg = cluster->mem_registry;
+	seen = cluster->mem_generation;
+	boundary = cluster->mem_boundary;
+	cluster_unlock_(cluster);
+
+	/* The cluster lock is not held at the start of each pass */
+	for(;;)
+	{
+		/* Perform any re-balancing which was deferred to allow the
+		 * membership to settle, if it has fallen due
+		 */
+		settle = cluster_settle_wait_(cluster);
+		if(!settle)
+		{
+			cluster_wrlock_(cluster);
+			if(!(cluster->flags & CF_LEAVING) && cluster_settled_locked_(cluster))
+			{
+				if(cluster_mem_balance_(cluster))
+				{
+					cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to balance cluster in response to changes\n");
+					cluster_stats_count_(&(cluster->stats.errors));
+				}
+				seen = cluster->mem_generation;
+				boundary = cluster->mem_boundary;
+			}
+			cluster_unlock_(cluster);
+		}
+		cluster_rdlock_(cluster);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: mem: 'leaving' flag has been set, will terminate balancing thread\n");
+			cluster_unlock_(cluster);
+			break;
+		}
+		cluster_unlock_(cluster);
+		if(!cluster_mem_wait_(cluster, reg, &seen, boundary))
+		{
+			continue;
+		}
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		/* Don't wake for the same expiry time again */
+		boundary = 0;
+		/* Acquire the write-lock before re-balancing */
+		cluster_wrlock_(cluster);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_unlock_(cluster);
+			continue;
+		}
+		if(cluster_settle_locked_(cluster))
+		{
+			/* Allow further changes to arrive before re-balancing */
+			cluster_unlock_(cluster);
+			continue;
+		}
+		if(cluster_mem_balance_(cluster))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: mem: failed to balance cluster in response to changes\n");
+			cluster_stats_count_(&(cluster->stats.errors));
+		}
+		seen = cluster->mem_generation;
+		boundary = cluster->mem_boundary;
+		cluster_unlock_(cluster);
+	}
+	cluster_logf_(cluster, LOG_DEBUG, "libcluster: mem: balancing thread is terminating\n");
+	return NULL;
+}
+
+#endif /*ENABLE_MEM*/
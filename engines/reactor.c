@@ -0,0 +1,783 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Shared housekeeping thread
+ *
+ * Rather than each etcd-based cluster having a ping thread and a balancing
+ * thread of its own, clusters which have enabled shared housekeeping are
+ * attached to a single thread, which refreshes each cluster's registry
+ * entry when it falls due and keeps a wait for changes outstanding for each
+ * cluster, multiplexing both using a libcurl multi handle; heartbeats are
+ * driven a request at a time by cluster_etcd_beat_(), so that a registry
+ * request which is slow to complete (or sits out its timeout) holds up
+ * only the cluster it was made for.
+ *
+ * Anything which may block, or take an unbounded amount of time, is handed
+ * to a dispatch thread which accompanies the reactor thread: applying the
+ * changes received (which may involve re-reading the directory), performing
+ * deferred re-balancing, and claiming slots. This is also where balancing
+ * callbacks are invoked, so that a slow callback delays other clusters'
+ * re-balancing, but never their heartbeats.
+ *
+ * The threads are started when the first cluster is attached, and terminate
+ * once the last has been detached. The reactor thread maintains its own list
+ * of the clusters which it is servicing (rather than walking the global
+ * cluster list, which is locked by cluster_destroy() while a cluster is
+ * leaving), and only releases a detached cluster once the dispatch thread
+ * has finished with it.
+ *
+ * Lock ordering: the cluster lock (if held) must be acquired before the
+ * reactor lock; neither thread acquires a cluster lock while holding the
+ * reactor lock.
+ */
+
+#if defined(ENABLE_ETCD) && defined(CLUSTER_REACTOR)
+
+# define REACTOR_NONE                   0
+# define REACTOR_PENDING                1
+# define REACTOR_ACTIVE                 2
+
+/* Work handed to the dispatch thread */
+# define REACTOR_CHANGE                 (1<<0)
+# define REACTOR_SETTLE                 (1<<1)
+# define REACTOR_BEAT                   (1<<2)
+
+/* The longest time the thread will wait without re-examining its clusters */
+# define REACTOR_MAXWAIT                30
+
+/* The dispatch thread accompanying a single instance of the reactor
+ * thread, and its queue; the queue is protected by the reactor lock
+ */
+struct cluster_reactor_dispatch_struct
+{
+	CURLM *multi;
+	pthread_t thread;
+	pthread_cond_t cond;
+	CLUSTER *first;
+	CLUSTER *last;
+	int stop;
+};
+
+static void *cluster_reactor_thread_(void *arg);
+static void *cluster_reactor_dispatch_thread_(void *arg);
+static void cluster_reactor_service_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, time_t now, time_t *next);
+static void cluster_reactor_beat_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, int step, ETCDREQUEST *request);
+static void cluster_reactor_done_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, CURLcode result);
+static void cluster_reactor_submit_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, int work, int status, json_t *change);
+static void cluster_reactor_enqueue_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster);
+static void cluster_reactor_collect_(CLUSTER *cluster, time_t now);
+static void cluster_reactor_perform_(CLUSTER *cluster, int work, int status, json_t *change);
+static int cluster_reactor_release_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster);
+
+static pthread_mutex_t cluster_reactor_lock_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cluster_reactor_cond_ = PTHREAD_COND_INITIALIZER;
+/* Clusters which have been attached but not yet adopted by the thread */
+static CLUSTER *cluster_reactor_pending_;
+/* The multi handle belonging to the running thread, if any */
+static CURLM *cluster_reactor_multi_;
+
+/* Attach a cluster to the shared housekeeping thread, starting it if
+ * needed; the thread takes ownership of dir and prefix, which are used to
+ * wait for changes to the registry, and pingdir, which is used to refresh
+ * our entry.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+int
+cluster_reactor_attach_(CLUSTER *cluster, ETCD *dir, ETCD *pingdir, char *prefix)
+{
+	struct cluster_reactor_dispatch_struct *dispatch;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int r;
+
+	pthread_mutex_lock(&cluster_reactor_lock_);
+	if(!cluster_reactor_multi_)
+	{
+		dispatch = (struct cluster_reactor_dispatch_struct *) calloc(1, sizeof(struct cluster_reactor_dispatch_struct));
+		if(!dispatch)
+		{
+			pthread_mutex_unlock(&cluster_reactor_lock_);
+			return -1;
+		}
+		dispatch->multi = curl_multi_init();
+		if(!dispatch->multi)
+		{
+			free(dispatch);
+			pthread_mutex_unlock(&cluster_reactor_lock_);
+			errno = ENOMEM;
+			return -1;
+		}
+		pthread_cond_init(&(dispatch->cond), NULL);
+		r = pthread_create(&(dispatch->thread), NULL, cluster_reactor_dispatch_thread_, (void *) dispatch);
+		if(!r)
+		{
+			pthread_attr_init(&attr);
+			pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+			r = pthread_create(&thread, &attr, cluster_reactor_thread_, (void *) dispatch);
+			pthread_attr_destroy(&attr);
+			if(r)
+			{
+				dispatch->stop = 1;
+				pthread_cond_signal(&(dispatch->cond));
+				pthread_mutex_unlock(&cluster_reactor_lock_);
+				pthread_join(dispatch->thread, NULL);
+				pthread_mutex_lock(&cluster_reactor_lock_);
+			}
+		}
+		if(r)
+		{
+			pthread_cond_destroy(&(dispatch->cond));
+			curl_multi_cleanup(dispatch->multi);
+			free(dispatch);
+			pthread_mutex_unlock(&cluster_reactor_lock_);
+			errno = r;
+			return -1;
+		}
+		cluster_reactor_multi_ = dispatch->multi;
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: shared housekeeping thread started\n");
+	}
+	cluster->reactor_dir = dir;
+	cluster->reactor_pingdir = pingdir;
+	cluster->reactor_prefix = prefix;
+	cluster->reactor_watch = NULL;
+	cluster->reactor_beat = NULL;
+	cluster->reactor_step = 0;
+	cluster->reactor_index = 0;
+	/* The initial ping has just been performed by the join */
+	cluster->reactor_ping = cluster_now_() + cluster->refresh;
+	cluster->reactor_retry = 0;
+	cluster->reactor_pending = 0;
+	cluster->reactor_due = 0;
+	cluster->reactor_qnext = NULL;
+	cluster->reactor_queued = 0;
+	cluster->reactor_busy = 0;
+	cluster->reactor_work = 0;
+	cluster->reactor_done = 0;
+	cluster->reactor_change = NULL;
+	/* Re-balancing may have been deferred by the join */
+	cluster->reactor_settle = cluster_now_();
+	cluster->reactor_detach = 0;
+	cluster->reactor_state = REACTOR_PENDING;
+	cluster->reactor_next = cluster_reactor_pending_;
+	cluster_reactor_pending_ = cluster;
+	curl_multi_wakeup(cluster_reactor_multi_);
+	pthread_mutex_unlock(&cluster_reactor_lock_);
+	return 0;
+}
+
+/* Detach a cluster from the shared housekeeping thread, waiting for the
+ * thread to release it. Returns 1 if the cluster was attached, 0 otherwise.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_reactor_detach_(CLUSTER *cluster)
+{
+	CLUSTER **p;
+
+	pthread_mutex_lock(&cluster_reactor_lock_);
+	if(cluster->reactor_state == REACTOR_NONE)
+	{
+		pthread_mutex_unlock(&cluster_reactor_lock_);
+		return 0;
+	}
+	if(cluster->reactor_state == REACTOR_PENDING)
+	{
+		for(p = &cluster_reactor_pending_; *p; p = &((*p)->reactor_next))
+		{
+			if(*p == cluster)
+			{
+				*p = cluster->reactor_next;
+				break;
+			}
+		}
+		cluster->reactor_next = NULL;
+		cluster->reactor_state = REACTOR_NONE;
+	}
+	else
+	{
+		cluster->reactor_detach = 1;
+		curl_multi_wakeup(cluster_reactor_multi_);
+		while(cluster->reactor_state != REACTOR_NONE)
+		{
+			pthread_cond_wait(&cluster_reactor_cond_, &cluster_reactor_lock_);
+		}
+	}
+	pthread_mutex_unlock(&cluster_reactor_lock_);
+	etcd_dir_close(cluster->reactor_dir);
+	etcd_dir_close(cluster->reactor_pingdir);
+	free(cluster->reactor_prefix);
+	cluster->reactor_dir = NULL;
+	cluster->reactor_pingdir = NULL;
+	cluster->reactor_prefix = NULL;
+	return 1;
+}
+
+/* Wake the shared housekeeping thread, if it is running, so that it
+ * re-examines its clusters' events
+ */
+void
+cluster_reactor_wake_(void)
+{
+	pthread_mutex_lock(&cluster_reactor_lock_);
+	if(cluster_reactor_multi_)
+	{
+		curl_multi_wakeup(cluster_reactor_multi_);
+	}
+	pthread_mutex_unlock(&cluster_reactor_lock_);
+}
+
+/* Invoked after fork() in the child process, where the threads do not
+ * exist (their clusters having been detached by the prepare handlers)
+ */
+void
+cluster_reactor_child_(void)
+{
+	pthread_mutex_init(&cluster_reactor_lock_, NULL);
+	pthread_cond_init(&cluster_reactor_cond_, NULL);
+	cluster_reactor_pending_ = NULL;
+	/* The multi handle belongs to the parent's thread */
+	cluster_reactor_multi_ = NULL;
+}
+
+/* The shared housekeeping thread itself */
+static void *
+cluster_reactor_thread_(void *arg)
+{
+	struct cluster_reactor_dispatch_struct *dispatch;
+	CURLM *multi;
+	CURLMsg *msg;
+	CURL *ch;
+	CLUSTER *active, *p, **pp;
+	ETCDREQUEST *request;
+	CURLcode result;
+	json_t *dummy;
+	char *priv;
+	time_t now, next;
+	int n, step, status;
+
+	dispatch = (struct cluster_reactor_dispatch_struct *) arg;
+	multi = dispatch->multi;
+	active = NULL;
+	for(;;)
+	{
+		pthread_mutex_lock(&cluster_reactor_lock_);
+		/* Adopt any newly-attached clusters */
+		while(cluster_reactor_pending_)
+		{
+			p = cluster_reactor_pending_;
+			cluster_reactor_pending_ = p->reactor_next;
+			p->reactor_next = active;
+			p->reactor_state = REACTOR_ACTIVE;
+			active = p;
+		}
+		/* Release any which are being detached, once the dispatch thread
+		 * has finished with them, and collect the outcome of any work it
+		 * has completed for the others
+		 */
+		now = cluster_now_();
+		for(pp = &active; *pp;)
+		{
+			p = *pp;
+			if(p->reactor_detach && cluster_reactor_release_(dispatch, p))
+			{
+				*pp = p->reactor_next;
+				p->reactor_next = NULL;
+				p->reactor_detach = 0;
+				p->reactor_state = REACTOR_NONE;
+				continue;
+			}
+			cluster_reactor_collect_(p, now);
+			pp = &(p->reactor_next);
+		}
+		pthread_cond_broadcast(&cluster_reactor_cond_);
+		if(!active)
+		{
+			cluster_reactor_multi_ = NULL;
+			dispatch->stop = 1;
+			pthread_cond_signal(&(dispatch->cond));
+			pthread_mutex_unlock(&cluster_reactor_lock_);
+			break;
+		}
+		pthread_mutex_unlock(&cluster_reactor_lock_);
+
+		/* Perform any housekeeping which has fallen due */
+		next = now + REACTOR_MAXWAIT;
+		for(p = active; p; p = p->reactor_next)
+		{
+			cluster_reactor_service_(dispatch, p, now, &next);
+		}
+		/* Wait until the next deadline, until a response arrives, or until
+		 * we're woken by curl_multi_wakeup()
+		 */
+		now = cluster_now_();
+		curl_multi_poll(multi, NULL, 0, (next > now ? (int) (next - now) * 1000 : 0), NULL);
+		curl_multi_perform(multi, &n);
+		while((msg = curl_multi_info_read(multi, &n)))
+		{
+			if(msg->msg != CURLMSG_DONE)
+			{
+				continue;
+			}
+			ch = msg->easy_handle;
+			priv = NULL;
+			curl_easy_getinfo(ch, CURLINFO_PRIVATE, &priv);
+			p = (CLUSTER *) (void *) priv;
+			result = msg->data.result;
+			/* msg is invalidated by removing the handle */
+			curl_multi_remove_handle(multi, ch);
+			if(p->reactor_watch && ch == etcd_request_handle(p->reactor_watch))
+			{
+				cluster_reactor_done_(dispatch, p, result);
+				continue;
+			}
+			request = p->reactor_beat;
+			p->reactor_beat = NULL;
+			dummy = NULL;
+			status = etcd_request_finish(request, result, &dummy);
+			json_decref(dummy);
+			step = cluster_etcd_beat_(p, p->reactor_pingdir, p->reactor_step, status, &request);
+			cluster_reactor_beat_(dispatch, p, step, request);
+		}
+	}
+	pthread_join(dispatch->thread, NULL);
+	pthread_cond_destroy(&(dispatch->cond));
+	curl_multi_cleanup(multi);
+	free(dispatch);
+	return NULL;
+}
+
+/* The dispatch thread, which performs the work handed to it by the reactor
+ * thread for each cluster in turn
+ */
+static void *
+cluster_reactor_dispatch_thread_(void *arg)
+{
+	struct cluster_reactor_dispatch_struct *dispatch;
+	CLUSTER *p;
+	json_t *change;
+	int work, status, settle;
+
+	dispatch = (struct cluster_reactor_dispatch_struct *) arg;
+	pthread_mutex_lock(&cluster_reactor_lock_);
+	for(;;)
+	{
+		while(!dispatch->first && !dispatch->stop)
+		{
+			pthread_cond_wait(&(dispatch->cond), &cluster_reactor_lock_);
+		}
+		if(!dispatch->first)
+		{
+			break;
+		}
+		p = dispatch->first;
+		dispatch->first = p->reactor_qnext;
+		if(!dispatch->first)
+		{
+			dispatch->last = NULL;
+		}
+		p->reactor_qnext = NULL;
+		p->reactor_queued = 0;
+		p->reactor_busy = 1;
+		work = p->reactor_work;
+		status = p->reactor_status;
+		change = p->reactor_change;
+		p->reactor_work = 0;
+		p->reactor_change = NULL;
+		pthread_mutex_unlock(&cluster_reactor_lock_);
+
+		cluster_reactor_perform_(p, work, status, change);
+		/* Deferred re-balancing is only examined by this thread */
+		settle = cluster_settle_wait_(p);
+
+		pthread_mutex_lock(&cluster_reactor_lock_);
+		p->reactor_busy = 0;
+		p->reactor_done |= work;
+		p->reactor_settle = (settle < 0 ? 0 : cluster_now_() + settle);
+		if(p->reactor_work)
+		{
+			cluster_reactor_enqueue_(dispatch, p);
+		}
+		curl_multi_wakeup(dispatch->multi);
+	}
+	pthread_mutex_unlock(&cluster_reactor_lock_);
+	return NULL;
+}
+
+/* Perform work handed to the dispatch thread for a cluster
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_reactor_perform_(CLUSTER *cluster, int work, int status, json_t *change)
+{
+	if(work & REACTOR_CHANGE)
+	{
+		/* The reactor thread doesn't wait for changes again (and so use
+		 * the directory handle, or alter reactor_index) until it has
+		 * collected the outcome
+		 */
+		if(cluster_leaving_(cluster))
+		{
+			json_decref(change);
+			cluster->reactor_delay = 0;
+		}
+		else
+		{
+			cluster->reactor_delay = cluster_etcd_changed_(cluster, cluster->reactor_dir, cluster->reactor_prefix, status, cluster->reactor_index, change);
+		}
+	}
+	if(work & REACTOR_SETTLE)
+	{
+		cluster_etcd_settle_(cluster);
+	}
+	if(work & REACTOR_BEAT)
+	{
+		cluster->reactor_beatfail = cluster_etcd_heartbeat_(cluster);
+	}
+}
+
+/* Refresh a cluster's registry entry if it's due (or an early refresh has
+ * been requested), hand any deferred re-balancing which has fallen due to
+ * the dispatch thread, and ensure that a wait for changes is outstanding;
+ * next is updated with the time that the cluster next needs attention.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_reactor_service_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, time_t now, time_t *next)
+{
+	ETCDREQUEST *request;
+	int step;
+
+	if(cluster_leaving_(cluster))
+	{
+		return;
+	}
+	if(!cluster->reactor_beat && !(cluster->reactor_pending & REACTOR_BEAT))
+	{
+		/* An early refresh requested while a heartbeat is in progress is
+		 * left until that heartbeat has completed
+		 */
+		if(cluster_wait_(cluster, CW_PING, 0) & CW_PING)
+		{
+			cluster->reactor_ping = now;
+		}
+		if(cluster->reactor_ping <= now)
+		{
+			step = cluster_etcd_beat_(cluster, cluster->reactor_pingdir, 0, 0, &request);
+			cluster_reactor_beat_(dispatch, cluster, step, request);
+		}
+	}
+	if(cluster->reactor_due && cluster->reactor_due <= now && !(cluster->reactor_pending & REACTOR_SETTLE))
+	{
+		cluster->reactor_due = 0;
+		cluster_reactor_submit_(dispatch, cluster, REACTOR_SETTLE, 0, NULL);
+	}
+	cluster_rdlock_(cluster);
+	if(!cluster->reactor_watch && !(cluster->reactor_pending & REACTOR_CHANGE) && cluster->reactor_retry <= now && cluster->etcd_reload)
+	{
+		/* A previous attempt to re-read the directory failed, and so it
+		 * must be re-read (by the dispatch thread) before waiting again
+		 */
+		cluster_unlock_(cluster);
+		cluster_reactor_submit_(dispatch, cluster, REACTOR_CHANGE, 0, NULL);
+		cluster_rdlock_(cluster);
+	}
+	if(!cluster->reactor_watch && !(cluster->reactor_pending & REACTOR_CHANGE) && cluster->reactor_retry <= now)
+	{
+		cluster->reactor_index = cluster->etcd_index;
+		if(cluster->flags & CF_VERBOSE)
+		{
+			if(cluster->partition)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s[%s]/%s from index %llu\n", cluster->key, cluster->partition, cluster->env, cluster->reactor_index);
+			}
+			else
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: etcd: waiting for changes to %s/%s from index %llu\n", cluster->key, cluster->env, cluster->reactor_index);
+			}
+		}
+		cluster->reactor_watch = etcd_dir_wait_request(cluster->reactor_dir, ETCD_RECURSE, cluster->reactor_index);
+		if(cluster->reactor_watch)
+		{
+			curl_easy_setopt(etcd_request_handle(cluster->reactor_watch), CURLOPT_PRIVATE, (void *) cluster);
+			if(curl_multi_add_handle(dispatch->multi, etcd_request_handle(cluster->reactor_watch)) != CURLM_OK)
+			{
+				etcd_request_cancel(cluster->reactor_watch);
+				cluster->reactor_watch = NULL;
+			}
+		}
+		if(!cluster->reactor_watch)
+		{
+			cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: etcd: failed to wait for changes from registry\n");
+			cluster->reactor_retry = now + 30;
+		}
+	}
+	cluster_unlock_(cluster);
+	if(!cluster->reactor_beat && !(cluster->reactor_pending & REACTOR_BEAT) && cluster->reactor_ping < *next)
+	{
+		*next = cluster->reactor_ping;
+	}
+	if(!cluster->reactor_watch && !(cluster->reactor_pending & REACTOR_CHANGE) && cluster->reactor_retry < *next)
+	{
+		*next = cluster->reactor_retry;
+	}
+	if(cluster->reactor_due && !(cluster->reactor_pending & REACTOR_SETTLE) && cluster->reactor_due < *next)
+	{
+		*next = cluster->reactor_due;
+	}
+}
+
+/* Act upon the next step of a cluster's heartbeat, as returned by
+ * cluster_etcd_beat_(): perform the request for it, hand the heartbeat to
+ * the dispatch thread if it must be performed synchronously, or schedule
+ * the next once it has completed
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_reactor_beat_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, int step, ETCDREQUEST *request)
+{
+	CURL *ch;
+
+	if(step == CLUSTER_ETCD_BEAT_SYNC)
+	{
+		cluster_reactor_submit_(dispatch, cluster, REACTOR_BEAT, 0, NULL);
+		return;
+	}
+	if(step > 0)
+	{
+		ch = etcd_request_handle(request);
+		curl_easy_setopt(ch, CURLOPT_PRIVATE, (void *) cluster);
+		if(!cluster->request_timeout)
+		{
+			/* A heartbeat which takes longer than the refresh interval
+			 * has been overtaken by the next, however long we wait
+			 */
+			curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, (long) cluster->refresh * 1000L);
+		}
+		if(curl_multi_add_handle(dispatch->multi, ch) == CURLM_OK)
+		{
+			cluster->reactor_beat = request;
+			cluster->reactor_step = step;
+			return;
+		}
+		etcd_request_cancel(request);
+		step = cluster_etcd_beat_(cluster, cluster->reactor_pingdir, step, -1, &request);
+		if(request)
+		{
+			etcd_request_cancel(request);
+			step = -1;
+		}
+	}
+	cluster->reactor_step = 0;
+	/* Short retry in case of transient problems */
+	cluster->reactor_ping = cluster_now_() + (step ? 5 : cluster->refresh);
+}
+
+/* Process the completion of a cluster's wait for changes, handing the
+ * change to the dispatch thread to be applied
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_reactor_done_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, CURLcode result)
+{
+	json_t *change;
+	int r;
+
+	change = NULL;
+	r = etcd_request_finish(cluster->reactor_watch, result, &change);
+	cluster->reactor_watch = NULL;
+	if(cluster_leaving_(cluster))
+	{
+		json_decref(change);
+		return;
+	}
+	cluster_reactor_submit_(dispatch, cluster, REACTOR_CHANGE, r, change);
+}
+
+/* Hand work for a cluster to the dispatch thread; change (if any) is
+ * released by it
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static void
+cluster_reactor_submit_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster, int work, int status, json_t *change)
+{
+	cluster->reactor_pending |= work;
+	pthread_mutex_lock(&cluster_reactor_lock_);
+	cluster->reactor_work |= work;
+	if(work & REACTOR_CHANGE)
+	{
+		cluster->reactor_status = status;
+		cluster->reactor_change = change;
+	}
+	if(!cluster->reactor_busy)
+	{
+		cluster_reactor_enqueue_(dispatch, cluster);
+	}
+	pthread_mutex_unlock(&cluster_reactor_lock_);
+}
+
+/* Add a cluster to the end of the dispatch thread's queue, if it isn't
+ * already queued
+ *
+ * The reactor lock should be held when invoking this function.
+ */
+static void
+cluster_reactor_enqueue_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster)
+{
+	if(cluster->reactor_queued)
+	{
+		return;
+	}
+	cluster->reactor_queued = 1;
+	cluster->reactor_qnext = NULL;
+	if(dispatch->last)
+	{
+		dispatch->last->reactor_qnext = cluster;
+	}
+	else
+	{
+		dispatch->first = cluster;
+	}
+	dispatch->last = cluster;
+	pthread_cond_signal(&(dispatch->cond));
+}
+
+/* Collect the outcome of the work the dispatch thread has completed for a
+ * cluster
+ *
+ * The reactor lock should be held when invoking this function.
+ */
+static void
+cluster_reactor_collect_(CLUSTER *cluster, time_t now)
+{
+	int done;
+
+	cluster->reactor_due = cluster->reactor_settle;
+	done = cluster->reactor_done;
+	if(!done)
+	{
+		return;
+	}
+	cluster->reactor_done = 0;
+	cluster->reactor_pending &= ~done;
+	if(done & REACTOR_CHANGE)
+	{
+		cluster->reactor_retry = now + cluster->reactor_delay;
+	}
+	if(done & REACTOR_BEAT)
+	{
+		/* Short retry in case of transient problems */
+		cluster->reactor_ping = now + (cluster->reactor_beatfail ? 5 : cluster->refresh);
+	}
+}
+
+/* Stop servicing a cluster which is being detached, if the dispatch thread
+ * isn't performing work for it; returns 1 if it was released, 0 if not
+ *
+ * The reactor lock should be held when invoking this function.
+ */
+static int
+cluster_reactor_release_(struct cluster_reactor_dispatch_struct *dispatch, CLUSTER *cluster)
+{
+	CLUSTER **p;
+
+	if(cluster->reactor_busy)
+	{
+		/* The dispatch thread wakes us once it has finished */
+		return 0;
+	}
+	if(cluster->reactor_queued)
+	{
+		for(p = &(dispatch->first), dispatch->last = NULL; *p; p = &((*p)->reactor_qnext))
+		{
+			if(*p == cluster)
+			{
+				*p = cluster->reactor_qnext;
+				if(!*p)
+				{
+					break;
+				}
+			}
+			dispatch->last = *p;
+		}
+		cluster->reactor_qnext = NULL;
+		cluster->reactor_queued = 0;
+	}
+	json_decref(cluster->reactor_change);
+	cluster->reactor_change = NULL;
+	cluster->reactor_work = 0;
+	cluster->reactor_done = 0;
+	if(cluster->reactor_watch)
+	{
+		curl_multi_remove_handle(dispatch->multi, etcd_request_handle(cluster->reactor_watch));
+		etcd_request_cancel(cluster->reactor_watch);
+		cluster->reactor_watch = NULL;
+	}
+	if(cluster->reactor_beat)
+	{
+		curl_multi_remove_handle(dispatch->multi, etcd_request_handle(cluster->reactor_beat));
+		etcd_request_cancel(cluster->reactor_beat);
+		cluster->reactor_beat = NULL;
+	}
+	return 1;
+}
+
+#elif defined(ENABLE_ETCD)
+
+int
+cluster_reactor_attach_(CLUSTER *cluster, ETCD *dir, ETCD *pingdir, char *prefix)
+{
+	(void) cluster;
+	(void) dir;
+	(void) pingdir;
+	(void) prefix;
+
+	errno = ENOSYS;
+	return -1;
+}
+
+int
+cluster_reactor_detach_(CLUSTER *cluster)
+{
+	(void) cluster;
+
+	return 0;
+}
+
+void
+cluster_reactor_wake_(void)
+{
+}
+
+void
+cluster_reactor_child_(void)
+{
+}
+
+#endif /*ENABLE_ETCD*/
@@ -23,29 +23,133 @@
 
 #ifdef ENABLE_SQL
 
-# define CLUSTER_SQL_SCHEMA_VERSION     8
+# ifdef WITH_LIBPQ
+#  include <poll.h>
+#  include <libpq-fe.h>
+# endif
+
+# define CLUSTER_SQL_SCHEMA_VERSION     12
 # define CLUSTER_SQL_BALANCE_SLEEP      5
 # define CLUSTER_SQL_MAX_BALANCEWAIT    30
+/* The number of attempts made to claim a stable slot before giving up */
+# define CLUSTER_SQL_CLAIM_ATTEMPTS     8
+/* The interval between writes of queued job updates, and the number of
+ * jobs with queued updates which causes them to be written immediately
+ * (which is also the maximum number of rows written by one statement)
+ */
+# define CLUSTER_SQL_JOB_FLUSH          1
+# define CLUSTER_SQL_JOB_BATCH          100
+/* The maximum number of entries refreshed by one statement */
+# define CLUSTER_SQL_PING_BATCH         100
+
+/* The connections shared by the clusters using a registry; each is used
+ * by one thread at a time, so that (for example) the job claims of all of
+ * the clusters in the process using a registry are made one after another
+ */
+# define CLUSTER_SQL_PINGDB             0
+# define CLUSTER_SQL_BALANCEDB          1
+# define CLUSTER_SQL_JOBDB              2
+
+/* SQL dialects, which determine how pings and queries are expressed */
+# define CLUSTER_SQL_GENERIC            0
+# define CLUSTER_SQL_MYSQL              1
+# define CLUSTER_SQL_POSTGRES           2
+# define CLUSTER_SQL_SQLITE             3
+
+/* Server-side prepared statements (PostgreSQL only) */
+# define CLUSTER_SQL_STMT_PING          (1<<0)
+# define CLUSTER_SQL_STMT_GENERATION    (1<<1)
+
+/* A batch of job updates written within a single transaction */
+typedef struct cluster_sql_jobs_struct CLUSTERSQLJOBS;
+
+struct cluster_sql_jobs_struct
+{
+	CLUSTER *cluster;
+	CLUSTERJOBUPDATE *first;
+	size_t count;
+};
+
+/* The jobs claimed by cluster_sql_job_claim_() */
+typedef struct cluster_sql_claim_struct CLUSTERSQLCLAIM;
+
+struct cluster_sql_claim_struct
+{
+	CLUSTER *cluster;
+	int max;
+	int count;
+	CLUSTERJOB **out;
+};
 
 static SQL *cluster_sql_connect_(CLUSTER *cluster, const char *purpose);
+static int cluster_sql_attach_(CLUSTER *cluster);
+static CLUSTERSQLSHARE *cluster_sql_share_(CLUSTER *cluster);
+static void cluster_sql_detach_(CLUSTER *cluster);
+static SQL *cluster_sql_acquire_(CLUSTER *cluster, int conn);
+static void cluster_sql_release_(CLUSTER *cluster, int conn);
 static int cluster_sql_rejoin_(CLUSTER *cluster);
 static int cluster_sql_ping_(CLUSTER *cluster);
 static int cluster_sql_perform_ping_(SQL *restrict sql, void *restrict userdata);
+static int cluster_sql_upsert_(CLUSTER *restrict cluster, SQL *restrict db);
 static int cluster_sql_unping_(CLUSTER *cluster);
+static int cluster_sql_announce_(CLUSTER *restrict cluster, SQL *restrict db);
+static int cluster_sql_batched_(CLUSTER *cluster);
 static void *cluster_sql_ping_thread_(void *arg);
+static void *cluster_sql_refresh_thread_(void *arg);
+static int cluster_sql_refresh_(CLUSTERSQLSHARE *share);
+static char *cluster_sql_batchrow_(CLUSTER *cluster);
 static void *cluster_sql_balancer_thread_(void *arg);
 static int cluster_sql_balance_(CLUSTER *cluster);
+static int cluster_sql_fetch_(CLUSTER *cluster);
+static int cluster_sql_members_(CLUSTER *restrict cluster, SQL *restrict db);
+static char *cluster_sql_scopes_(CLUSTERSQLSHARE *share, unsigned long long fetch, int generation);
+static int cluster_sql_scope_(CLUSTER *restrict cluster, const char *restrict key, const char *restrict env, const char *restrict partition);
+static int cluster_sql_row_(CLUSTER *cluster, const char *id, int threads, int weight, const char *expires, int slot);
+static int cluster_sql_changed_(CLUSTER *cluster, long long *generation, const char *boundary);
+static const char *cluster_sql_now_(CLUSTER *cluster, char *buf, size_t bufsize);
+static const char *cluster_sql_expiry_(CLUSTER *cluster, char *buf, size_t bufsize);
+static const char *cluster_sql_slot_(CLUSTER *cluster, char *buf, size_t bufsize);
+static int cluster_sql_claim_(CLUSTER *restrict cluster, SQL *restrict db);
+static void *cluster_sql_job_thread_(void *arg);
+static int cluster_sql_job_queue_(CLUSTERJOB *job, int create);
+static unsigned int cluster_sql_job_bucket_(const char *id);
+static CLUSTERJOBUPDATE *cluster_sql_job_find_locked_(CLUSTER *cluster, const char *id, unsigned int bucket);
+static void cluster_sql_job_queue_locked_(CLUSTER *cluster, CLUSTERJOBUPDATE *p, unsigned int bucket);
+static int cluster_sql_job_flush_(CLUSTER *cluster);
+static int cluster_sql_job_write_(CLUSTER *restrict cluster, SQL *restrict db, CLUSTERJOBUPDATE *first, size_t count);
+static char *cluster_sql_job_rows_(CLUSTER *restrict cluster, char *restrict s, CLUSTERJOBUPDATE *first, size_t count, int overwrite, const char *now);
+static int cluster_sql_perform_jobs_(SQL *restrict sql, void *restrict userdata);
+static char *cluster_sql_quote_(CLUSTER *cluster, char *dest, const char *str);
+static int cluster_sql_perform_claim_(SQL *restrict sql, void *restrict userdata);
+static int cluster_sql_claim_pass_(SQL *restrict sql, CLUSTERSQLCLAIM *restrict claim, const char *restrict cond);
+static void cluster_sql_claim_discard_(CLUSTERSQLCLAIM *claim);
+static int cluster_sql_cache_(SQL *restrict sql, unsigned *restrict mask, unsigned stmt, const char *restrict statement);
+static void cluster_sql_dialect_(CLUSTER *cluster);
+static int cluster_sql_mysql_skiplocked_(SQL *sql);
+# ifdef WITH_LIBPQ
+static PGconn *cluster_sql_listen_(CLUSTER *cluster);
+static int cluster_sql_notified_(PGconn *conn, int timeout);
+# endif
 
 static int cluster_sql_migrate_(SQL *restrict sql, const char *restrict identifier, int newversion, void *restrict userdata);
 
 static int cluster_sql_querylog_(SQL *restrict sql, const char *restrict query);
 static int cluster_sql_errorlog_(SQL *restrict sql, const char *restrict sqlstate, const char *restrict message);
+static void cluster_sql_reset_(CLUSTER *restrict cluster, SQL *restrict sql, const char *restrict sqlstate);
 static int cluster_sql_noticelog_(SQL *restrict sql, const char *restrict message);
 
+static pthread_mutex_t cluster_sql_lock = PTHREAD_MUTEX_INITIALIZER;
+static CLUSTERSQLSHARE *cluster_sql_first;
+
 /* Join a SQL database cluster. To do this, we first update the relevant
  * directory with information about ourselves, then spawn a 're-balancing
  * thread' which watches for changes on that directory.
  *
+ * The connections to the database are shared by all of the clusters in
+ * this process which use the same registry: once our entry has been
+ * written, it's refreshed along with theirs, and our membership is read
+ * along with theirs where that can be done at the same time.
+ *
  * The cluster lock should not be held when invoking this function.
  */
 int
@@ -53,31 +157,14 @@ cluster_sql_join_(CLUSTER *cluster)
 {	
 	cluster_wrlock_(cluster);
 	cluster->inst_index = -1;
-	if(!(cluster->pingdb = cluster_sql_connect_(cluster, "ping")))
-	{
-		cluster_unlock_(cluster);
-		cluster_sql_leave_(cluster);
-		return -1;
-	}  
-	if(sql_migrate(cluster->pingdb, "com.github.bbcarchdev.libcluster", cluster_sql_migrate_, (void *) cluster))
-	{
-		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: schema migration failed\n");
-		cluster_unlock_(cluster);
-		cluster_sql_leave_(cluster);
-		return -1;
-	}
-	if(!(cluster->balancedb = cluster_sql_connect_(cluster, "balancer")))
-	{
-		cluster_unlock_(cluster);
-		cluster_sql_leave_(cluster);
-		return -1;
-	}  
-	if(!(cluster->jobdb = cluster_sql_connect_(cluster, "jobs")))
+	if(cluster_sql_attach_(cluster))
 	{
 		cluster_unlock_(cluster);
 		cluster_sql_leave_(cluster);
 		return -1;
 	}
+	cluster_sql_dialect_(cluster);
+	cluster->sql_generation = -1;
 	if(cluster_sql_ping_(cluster))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to perform initial ping\n");
@@ -92,12 +179,18 @@ cluster_sql_join_(CLUSTER *cluster)
 		cluster_sql_leave_(cluster);
 		return -1;
 	}
+	cluster_wake_reset_(cluster);
 	if(!(cluster->flags & CF_PASSIVE))
 	{
 		pthread_create(&(cluster->ping_thread), NULL, cluster_sql_ping_thread_, (void *) cluster);
 	}
 	pthread_create(&(cluster->balancer_thread), NULL, cluster_sql_balancer_thread_, (void *) cluster);
+	pthread_mutex_lock(&(cluster->job_lock));
+	cluster->job_accept = 1;
+	pthread_mutex_unlock(&(cluster->job_lock));
+	pthread_create(&(cluster->job_thread), NULL, cluster_sql_job_thread_, (void *) cluster);
 	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
 	cluster_unlock_(cluster);
 	return 0;
 }
@@ -112,15 +205,17 @@ cluster_sql_join_(CLUSTER *cluster)
 int
 cluster_sql_leave_(CLUSTER *cluster)
 {
-	pthread_t pt, bt;
+	pthread_t pt, bt, jt;
 
 	/* Use a write-lock to prevent a read-lock - write-lock race */
 	cluster_wrlock_(cluster);
 	if(cluster->flags & CF_JOINED)
 	{
 		cluster->flags |= CF_LEAVING;
+		cluster_wake_(cluster, CW_LEAVE);
 		pt = cluster->ping_thread;
 		bt = cluster->balancer_thread;
+		jt = cluster->job_thread;
 		/* Unlock to allow the threads to read the flag */		
 		cluster_unlock_(cluster);
 		if(pt)
@@ -131,31 +226,252 @@ cluster_sql_leave_(CLUSTER *cluster)
 		{
 			pthread_join(bt, NULL);
 		}
+		if(jt)
+		{
+			pthread_join(jt, NULL);
+		}
 		/* Re-acquire the lock so that the unwinding can safely complete */
 		cluster_wrlock_(cluster);
 	}
 	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster_publish_locked_(cluster);
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
 	cluster->ping_thread = 0;
 	cluster->balancer_thread = 0;
-	if(cluster->pingdb)
+	cluster->job_thread = 0;
+	cluster_sql_detach_(cluster);
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Invoked in the child after fork(), before the clusters' own handlers:
+ * the refresh threads don't exist in the child, and the lock may have been
+ * held by another thread of the parent. Any connections which remain open
+ * (because a cluster's membership remains with the parent) are abandoned
+ * rather than closed, as they're still in use by the parent.
+ */
+void
+cluster_sql_reinit_(void)
+{
+	pthread_mutex_init(&cluster_sql_lock, NULL);
+	cluster_sql_first = NULL;
+}
+
+/* Attach to the connections shared by the clusters using the same
+ * registry, establishing them (migrating the schema, and starting the
+ * refresh thread) if there are none
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_sql_attach_(CLUSTER *cluster)
+{
+	CLUSTERSQLSHARE *share;
+
+	pthread_mutex_lock(&cluster_sql_lock);
+	for(share = cluster_sql_first; share; share = share->next)
 	{
-		sql_disconnect(cluster->pingdb);
-		cluster->pingdb = NULL;
+		if(!strcmp(share->registry, cluster->registry))
+		{
+			break;
+		}
 	}
-	if(cluster->balancedb)
+	if(!share)
 	{
-		sql_disconnect(cluster->balancedb);
-		cluster->balancedb = NULL;
+		if(!(share = cluster_sql_share_(cluster)))
+		{
+			pthread_mutex_unlock(&cluster_sql_lock);
+			return -1;
+		}
+		share->next = cluster_sql_first;
+		cluster_sql_first = share;
 	}
-	if(cluster->jobdb)
+	if(cluster->refresh < share->refresh)
 	{
-		sql_disconnect(cluster->jobdb);
-		cluster->jobdb = NULL;
+		/* Refresh as often as the most demanding cluster using the
+		 * connections would refresh its own entry
+		 */
+		share->refresh = cluster->refresh;
+		pthread_cond_signal(&(share->cond));
 	}
-	cluster_unlock_(cluster);
+	cluster->sql_next = share->clusters;
+	share->clusters = cluster;
+	cluster->sql_share = share;
+	cluster->sql_batched = 0;
+	cluster->sql_fetched = 0;
+	cluster->sql_fetching = 0;
+	pthread_mutex_unlock(&cluster_sql_lock);
 	return 0;
 }
 
+/* Establish a new set of shared connections to a cluster's registry,
+ * migrating its schema if needed, and start their refresh thread
+ *
+ * The cluster should be write-locked, and cluster_sql_lock held, when
+ * invoking this function.
+ */
+static CLUSTERSQLSHARE *
+cluster_sql_share_(CLUSTER *cluster)
+{
+	static const char *purposes[CLUSTER_SQL_CONNECTIONS] = { "ping", "balancer", "jobs" };
+	CLUSTERSQLSHARE *share;
+	pthread_condattr_t attr;
+	int n;
+
+	share = (CLUSTERSQLSHARE *) calloc(1, sizeof(CLUSTERSQLSHARE));
+	if(!share)
+	{
+		return NULL;
+	}
+	if(!(share->registry = strdup(cluster->registry)))
+	{
+		free(share);
+		return NULL;
+	}
+	share->refresh = cluster->refresh;
+	for(n = 0; n < CLUSTER_SQL_CONNECTIONS; n++)
+	{
+		if(!(share->db[n] = cluster_sql_connect_(cluster, purposes[n])))
+		{
+			break;
+		}
+		/* Nothing has been prepared on a new server session */
+		share->stmts[n] = 0;
+		if(n == CLUSTER_SQL_PINGDB && sql_migrate(share->db[n], "com.github.bbcarchdev.libcluster", cluster_sql_migrate_, (void *) cluster))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: schema migration failed\n");
+			n++;
+			break;
+		}
+	}
+	if(n == CLUSTER_SQL_CONNECTIONS)
+	{
+		for(n = 0; n < CLUSTER_SQL_CONNECTIONS; n++)
+		{
+			pthread_mutex_init(&(share->dblock[n]), NULL);
+		}
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&(share->cond), &attr);
+		pthread_condattr_destroy(&attr);
+		pthread_cond_init(&(share->idle), NULL);
+		if(!pthread_create(&(share->thread), NULL, cluster_sql_refresh_thread_, (void *) share))
+		{
+			return share;
+		}
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to start refresh thread\n");
+		for(n = 0; n < CLUSTER_SQL_CONNECTIONS; n++)
+		{
+			pthread_mutex_destroy(&(share->dblock[n]));
+		}
+		pthread_cond_destroy(&(share->cond));
+		pthread_cond_destroy(&(share->idle));
+	}
+	while(n > 0)
+	{
+		n--;
+		sql_disconnect(share->db[n]);
+	}
+	free(share->registry);
+	free(share);
+	return NULL;
+}
+
+/* Detach from the shared connections, if attached; if it was the last
+ * cluster using them, the refresh thread is terminated and they are closed
+ *
+ * The cluster should be write-locked, and none of the connections in use
+ * on its behalf, when invoking this function.
+ */
+static void
+cluster_sql_detach_(CLUSTER *cluster)
+{
+	CLUSTERSQLSHARE *share, **sp;
+	CLUSTER **cp;
+	int n;
+
+	if(!(share = cluster->sql_share))
+	{
+		return;
+	}
+	pthread_mutex_lock(&cluster_sql_lock);
+	for(cp = &(share->clusters); *cp; cp = &((*cp)->sql_next))
+	{
+		if(*cp == cluster)
+		{
+			*cp = cluster->sql_next;
+			break;
+		}
+	}
+	cluster->sql_share = NULL;
+	cluster->sql_next = NULL;
+	cluster->sql_batched = 0;
+	free(cluster->sql_batchrow);
+	cluster->sql_batchrow = NULL;
+	cluster->sql_fetched = 0;
+	if(share->clusters)
+	{
+		/* The refresh thread may still be recording the outcome of a
+		 * refresh which included us
+		 */
+		while(share->busy)
+		{
+			pthread_cond_wait(&(share->idle), &cluster_sql_lock);
+		}
+		pthread_mutex_unlock(&cluster_sql_lock);
+		return;
+	}
+	for(sp = &cluster_sql_first; *sp; sp = &((*sp)->next))
+	{
+		if(*sp == share)
+		{
+			*sp = share->next;
+			break;
+		}
+	}
+	share->stop = 1;
+	pthread_cond_signal(&(share->cond));
+	pthread_mutex_unlock(&cluster_sql_lock);
+	/* The refresh thread doesn't acquire any cluster's lock */
+	pthread_join(share->thread, NULL);
+	for(n = 0; n < CLUSTER_SQL_CONNECTIONS; n++)
+	{
+		/* Anything logged while disconnecting is attributed to us */
+		sql_set_userdata(share->db[n], (void *) cluster);
+		sql_disconnect(share->db[n]);
+		pthread_mutex_destroy(&(share->dblock[n]));
+	}
+	pthread_cond_destroy(&(share->cond));
+	pthread_cond_destroy(&(share->idle));
+	free(share->registry);
+	free(share);
+}
+
+/* Obtain exclusive use of one of the shared connections on behalf of a
+ * cluster, to which anything logged by libsql is attributed until it's
+ * released
+ *
+ * The cluster should be at least read-locked (or its balancer thread be
+ * the caller) when invoking this function.
+ */
+static SQL *
+cluster_sql_acquire_(CLUSTER *cluster, int conn)
+{
+	CLUSTERSQLSHARE *share;
+
+	share = cluster->sql_share;
+	pthread_mutex_lock(&(share->dblock[conn]));
+	sql_set_userdata(share->db[conn], (void *) cluster);
+	return share->db[conn];
+}
+
+static void
+cluster_sql_release_(CLUSTER *cluster, int conn)
+{
+	pthread_mutex_unlock(&(cluster->sql_share->dblock[conn]));
+}
+
 /* Actually connect to the SQL database we use as a registry */
 static SQL *
 cluster_sql_connect_(CLUSTER *cluster, const char *purpose)
@@ -186,25 +502,89 @@ cluster_sql_connect_(CLUSTER *cluster, const char *purpose)
 static int
 cluster_sql_ping_(CLUSTER *cluster)
 {
+	SQL *db;
+	char *row, *prev;
+	int r;
+
 	if(cluster->flags & CF_PASSIVE)
 	{
 		return 0;
 	}
-	return sql_perform(cluster->pingdb, cluster_sql_perform_ping_, (void *) cluster, 5, SQL_TXN_CONSISTENT);
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_PINGDB);
+	r = -1;
+	if((cluster->flags & CF_SLOTS) && cluster_sql_claim_(cluster, db))
+	{
+		/* Our entry can't be written without a slot */
+	}
+	else if(cluster->sql_dialect == CLUSTER_SQL_GENERIC)
+	{
+		/* Replace our entry within a transaction */
+		r = sql_perform(db, cluster_sql_perform_ping_, (void *) cluster, 5, SQL_TXN_CONSISTENT);
+	}
+	else
+	{
+		r = cluster_sql_upsert_(cluster, db);
+	}
+	/* Only a new entry or a change to our worker count or weight is
+	 * announced: routine refreshes don't alter the balance, and balancers
+	 * notice when entries may have expired by themselves
+	 */
+	if(!r && (cluster->sql_announced != cluster->inst_threads || cluster->sql_announcedweight != cluster->inst_weight))
+	{
+		r = cluster_sql_announce_(cluster, db);
+		if(!r)
+		{
+			cluster->sql_announced = cluster->inst_threads;
+			cluster->sql_announcedweight = cluster->inst_weight;
+		}
+	}
+	/* Once written, our entry is refreshed along with those of the other
+	 * clusters using the connections, unless the dialect doesn't allow it
+	 * or our claim to a slot must also be renewed. This is recorded before
+	 * the connection is released, so that the refresh thread can't then
+	 * write a worker count or weight older than those written here.
+	 */
+	row = NULL;
+	if(!r && cluster->sql_dialect != CLUSTER_SQL_GENERIC && !(cluster->flags & CF_SLOTS))
+	{
+		row = cluster_sql_batchrow_(cluster);
+	}
+	pthread_mutex_lock(&cluster_sql_lock);
+	cluster->sql_batched = (row != NULL);
+	prev = cluster->sql_batchrow;
+	cluster->sql_batchrow = row;
+	cluster->sql_batchdialect = cluster->sql_dialect;
+	pthread_mutex_unlock(&cluster_sql_lock);
+	free(prev);
+	cluster_sql_release_(cluster, CLUSTER_SQL_PINGDB);
+	return (r ? -1 : 0);
+}
+
+/* Determine whether our entry is currently refreshed by the refresh thread */
+static int
+cluster_sql_batched_(CLUSTER *cluster)
+{
+	int r;
+
+	pthread_mutex_lock(&cluster_sql_lock);
+	r = cluster->sql_batched;
+	pthread_mutex_unlock(&cluster_sql_lock);
+	return r;
 }
 
-/* Invoked when a job is created. If a job with the specified ID exists, update
- * the job object with the information from the database. If it does not exist,
- * create the new job in the database using the values provided. In either case,
- * upon a successful return, the job object should match the database (until
- * another cluster member modifies it).
+/* Invoked when a job is created: the creation of the job's row is queued
+ * along with changes to jobs, so that creating a job doesn't wait for the
+ * database. If a row for the job's ID already exists when the queue is
+ * written, it's left as it is unless the job has been changed since.
+ *
+ * Jobs are only recorded while the cluster is joined.
+ *
+ * The cluster lock need not be held when invoking this function.
  */
 int
 cluster_sql_job_create_(CLUSTERJOB *job)
 {
-	(void) job;
-
-	return 0;
+	return cluster_sql_job_queue_(job, 1);
 }
 
 static int
@@ -213,7 +593,7 @@ cluster_sql_perform_ping_(SQL *restrict sql, void *restrict userdata)
 	CLUSTER *cluster;
 	time_t t;
 	struct tm tm;
-	char nowbuf[64], expbuf[64];
+	char nowbuf[64], expbuf[64], slotbuf[16];
 
 	t = time(NULL);
 	cluster = (CLUSTER *) userdata;
@@ -228,15 +608,62 @@ cluster_sql_perform_ping_(SQL *restrict sql, void *restrict userdata)
 	gmtime_r(&t, &tm);
 	strftime(expbuf, sizeof(expbuf) -1, "%Y-%m-%d %H:%M:%S", &tm);
 
-	if(sql_executef(sql, "INSERT INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"updated\", \"expires\") VALUES (%Q, %Q, %Q, %Q, %d, %Q, %Q)",
+	if(sql_executef(sql, "INSERT INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"weight\", \"slot\", \"updated\", \"expires\") VALUES (%Q, %Q, %Q, %Q, %d, %d, %s, %Q, %Q)",
 					cluster->instid, cluster->key, cluster->partition,
-					cluster->env, cluster->inst_threads, nowbuf, expbuf))
+					cluster->env, cluster->inst_threads, cluster->inst_weight, cluster_sql_slot_(cluster, slotbuf, sizeof(slotbuf)), nowbuf, expbuf))
 	{
 		return -1;
 	}
 	return 1;
 }
 
+/* Create or refresh our entry in the registry using a single statement,
+ * with the timestamps computed by the database server.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_sql_upsert_(CLUSTER *restrict cluster, SQL *restrict db)
+{
+	char modbuf[32], slotbuf[16];
+	const char *slot;
+
+	slot = cluster_sql_slot_(cluster, slotbuf, sizeof(slotbuf));
+	switch(cluster->sql_dialect)
+	{
+	case CLUSTER_SQL_POSTGRES:
+		if(cluster_sql_cache_(db, &(cluster->sql_share->stmts[CLUSTER_SQL_PINGDB]), CLUSTER_SQL_STMT_PING,
+							  "PREPARE \"cluster_ping\" (VARCHAR, VARCHAR, VARCHAR, VARCHAR, INT, INT, INT, INT) AS "
+							  "INSERT INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"weight\", \"slot\", \"updated\", \"expires\") "
+							  "VALUES ($1, $2, $3, $4, $5, $8, $7, now() AT TIME ZONE 'UTC', (now() AT TIME ZONE 'UTC') + $6 * INTERVAL '1 second') "
+							  "ON CONFLICT (\"id\", \"key\", \"env\") DO UPDATE SET "
+							  "\"partition\" = EXCLUDED.\"partition\", \"threads\" = EXCLUDED.\"threads\", \"weight\" = EXCLUDED.\"weight\", \"slot\" = EXCLUDED.\"slot\", "
+							  "\"updated\" = EXCLUDED.\"updated\", \"expires\" = EXCLUDED.\"expires\""))
+		{
+			return -1;
+		}
+		return sql_executef(db, "EXECUTE \"cluster_ping\" (%Q, %Q, %Q, %Q, %d, %d, %s, %d)",
+							cluster->instid, cluster->key, cluster->partition,
+							cluster->env, cluster->inst_threads, cluster->ttl, slot, cluster->inst_weight);
+	case CLUSTER_SQL_MYSQL:
+		return sql_executef(db, "INSERT INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"weight\", \"slot\", \"updated\", \"expires\") "
+							"VALUES (%Q, %Q, %Q, %Q, %d, %d, %s, UTC_TIMESTAMP(), UTC_TIMESTAMP() + INTERVAL %d SECOND) "
+							"ON DUPLICATE KEY UPDATE "
+							"\"partition\" = VALUES(\"partition\"), \"threads\" = VALUES(\"threads\"), \"weight\" = VALUES(\"weight\"), \"slot\" = VALUES(\"slot\"), "
+							"\"updated\" = VALUES(\"updated\"), \"expires\" = VALUES(\"expires\")",
+							cluster->instid, cluster->key, cluster->partition,
+							cluster->env, cluster->inst_threads, cluster->inst_weight, slot, cluster->ttl);
+	case CLUSTER_SQL_SQLITE:
+		snprintf(modbuf, sizeof(modbuf), "+%d seconds", cluster->ttl);
+		return sql_executef(db, "INSERT OR REPLACE INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"weight\", \"slot\", \"updated\", \"expires\") "
+							"VALUES (%Q, %Q, %Q, %Q, %d, %d, %s, datetime('now'), datetime('now', %Q))",
+							cluster->instid, cluster->key, cluster->partition,
+							cluster->env, cluster->inst_threads, cluster->inst_weight, slot, modbuf);
+	}
+	errno = EINVAL;
+	return -1;
+}
+
 /* 'Un-ping' - that is, remove our entry from the directory.
  *
  * The cluster should be at least read-locked when invoking this function.
@@ -244,17 +671,191 @@ cluster_sql_perform_ping_(SQL *restrict sql, void *restrict userdata)
 static int
 cluster_sql_unping_(CLUSTER *cluster)
 {
+	SQL *db;
+	int r;
+
 	if(cluster->flags & CF_PASSIVE)
 	{
 		return 0;
 	}
-	if(sql_executef(cluster->pingdb, "DELETE FROM \"cluster_node\" WHERE \"id\" = %Q AND \"key\" = %Q AND \"env\" = %Q", cluster->instid, cluster->key, cluster->env))
+	/* Stop the refresh thread from writing our entry before acquiring the
+	 * connection, so that it can't be re-created once deleted
+	 */
+	pthread_mutex_lock(&cluster_sql_lock);
+	cluster->sql_batched = 0;
+	pthread_mutex_unlock(&cluster_sql_lock);
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_PINGDB);
+	r = -1;
+	if(sql_executef(db, "DELETE FROM \"cluster_node\" WHERE \"id\" = %Q AND \"key\" = %Q AND \"env\" = %Q", cluster->instid, cluster->key, cluster->env))
+	{
+		/* Failed */
+	}
+	else if(cluster->slot >= 0 &&
+			sql_executef(db, "DELETE FROM \"cluster_slot\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"id\" = %Q",
+						 cluster->key, cluster->env, (cluster->partition ? cluster->partition : ""), cluster->instid))
+	{
+		/* Our slot couldn't be released for re-use */
+	}
+	else
+	{
+		cluster->slot = -1;
+		cluster->sql_announced = -1;
+		r = cluster_sql_announce_(cluster, db);
+	}
+	cluster_sql_release_(cluster, CLUSTER_SQL_PINGDB);
+	return r;
+}
+
+/* Announce a change to our entry (its creation or removal, or a change to
+ * our worker count or weight) by incrementing the cluster's generation number and,
+ * if the registry supports it, notifying the cluster's channel.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_sql_announce_(CLUSTER *restrict cluster, SQL *restrict db)
+{
+	const char *partition;
+	int r;
+
+	/* The partition is part of the primary key, so can't be NULL */
+	partition = (cluster->partition ? cluster->partition : "");
+	switch(cluster->sql_dialect)
+	{
+	case CLUSTER_SQL_POSTGRES:
+		r = sql_executef(db, "INSERT INTO \"cluster_generation\" (\"key\", \"env\", \"partition\", \"generation\") VALUES (%Q, %Q, %Q, 1) "
+						 "ON CONFLICT (\"key\", \"env\", \"partition\") DO UPDATE SET \"generation\" = \"cluster_generation\".\"generation\" + 1",
+						 cluster->key, cluster->env, partition);
+		break;
+	case CLUSTER_SQL_MYSQL:
+		r = sql_executef(db, "INSERT INTO \"cluster_generation\" (\"key\", \"env\", \"partition\", \"generation\") VALUES (%Q, %Q, %Q, 1) "
+						 "ON DUPLICATE KEY UPDATE \"generation\" = \"generation\" + 1",
+						 cluster->key, cluster->env, partition);
+		break;
+	default:
+		r = sql_executef(db, "INSERT INTO \"cluster_generation\" (\"key\", \"env\", \"partition\", \"generation\") SELECT %Q, %Q, %Q, 0 "
+						 "WHERE NOT EXISTS (SELECT 1 FROM \"cluster_generation\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q)",
+						 cluster->key, cluster->env, partition, cluster->key, cluster->env, partition);
+		if(!r)
+		{
+			r = sql_executef(db, "UPDATE \"cluster_generation\" SET \"generation\" = \"generation\" + 1 WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q",
+							 cluster->key, cluster->env, partition);
+		}
+		break;
+	}
+	if(r)
 	{
 		return -1;
 	}
+	if(cluster->sql_notify)
+	{
+		if(sql_executef(db, "NOTIFY \"%s\"", cluster->sql_channel))
+		{
+			return -1;
+		}
+	}
 	return 0;
 }
 
+/* Determine the SQL dialect spoken by the registry (and whether it
+ * supports SKIP LOCKED) and, if it supports change notifications (that is,
+ * it's a PostgreSQL database), derive the name of the notification channel
+ * for this cluster: the key, environment and partition are hashed (FNV-1a)
+ * so that the name is always a valid identifier.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static void
+cluster_sql_dialect_(CLUSTER *cluster)
+{
+	const char *s;
+	uint32_t h;
+	int n;
+
+	cluster->sql_dialect = CLUSTER_SQL_GENERIC;
+	cluster->sql_notify = 0;
+	cluster->sql_announced = -1;
+	cluster->sql_channel[0] = 0;
+	cluster->sql_boundary[0] = 0;
+	cluster->sql_skiplocked = 0;
+	if(sql_variant(cluster->sql_share->db[CLUSTER_SQL_PINGDB]) == SQL_VARIANT_MYSQL)
+	{
+		cluster->sql_dialect = CLUSTER_SQL_MYSQL;
+	}
+	else if(!strncasecmp(cluster->registry, "pgsql:", 6) ||
+			!strncasecmp(cluster->registry, "postgres:", 9) ||
+			!strncasecmp(cluster->registry, "postgresql:", 11))
+	{
+		cluster->sql_dialect = CLUSTER_SQL_POSTGRES;
+	}
+	else if(!strncasecmp(cluster->registry, "sqlite", 6))
+	{
+		cluster->sql_dialect = CLUSTER_SQL_SQLITE;
+	}
+	if(cluster->sql_dialect == CLUSTER_SQL_POSTGRES)
+	{
+		cluster->sql_skiplocked = 1;
+	}
+	else if(cluster->sql_dialect == CLUSTER_SQL_MYSQL)
+	{
+		cluster->sql_skiplocked = cluster_sql_mysql_skiplocked_(cluster->sql_share->db[CLUSTER_SQL_PINGDB]);
+		if(!cluster->sql_skiplocked)
+		{
+			cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: SQL: server does not support SKIP LOCKED; claims will wait for locked jobs\n");
+		}
+	}
+	if(cluster->sql_dialect != CLUSTER_SQL_POSTGRES)
+	{
+		return;
+	}
+	h = 2166136261U;
+	for(n = 0; n < 3; n++)
+	{
+		s = (n == 0 ? cluster->key : (n == 1 ? cluster->env : cluster->partition));
+		for(; s && *s; s++)
+		{
+			h = (h ^ (unsigned char) *s) * 16777619U;
+		}
+		/* Separate the components */
+		h = (h ^ 0xff) * 16777619U;
+	}
+	snprintf(cluster->sql_channel, sizeof(cluster->sql_channel), "libcluster_%08lx", (unsigned long) h);
+	cluster->sql_notify = 1;
+}
+
+/* Determine from its version whether a MySQL server supports SKIP LOCKED,
+ * which was introduced by MySQL 8.0 and MariaDB 10.6
+ */
+static int
+cluster_sql_mysql_skiplocked_(SQL *sql)
+{
+	SQL_STATEMENT *rs;
+	const char *version;
+	int major, minor, r;
+
+	rs = sql_queryf(sql, "SELECT VERSION()");
+	if(!rs)
+	{
+		/* Claims which wait for locks work with any version */
+		return 0;
+	}
+	r = 0;
+	version = (sql_stmt_eof(rs) ? NULL : sql_stmt_str(rs, 0));
+	if(version && sscanf(version, "%d.%d", &major, &minor) == 2)
+	{
+		if(strstr(version, "MariaDB"))
+		{
+			r = (major > 10 || (major == 10 && minor >= 6));
+		}
+		else
+		{
+			r = (major >= 8);
+		}
+	}
+	sql_stmt_destroy(rs);
+	return r;
+}
+
 /* Read the directory from the registry service and determine what our index
  * in the cluster is.
  *
@@ -264,37 +865,64 @@ cluster_sql_unping_(CLUSTER *cluster)
 static int
 cluster_sql_balance_(CLUSTER *cluster)
 {
-	SQL_STATEMENT *rs;
-	const char *id;
-	int total, base, val;
-	time_t now;
-	struct tm tm;
-	char nowbuf[64];
+	CLUSTERSQLROW *row;
+	CLUSTERMEMBER **order, *m;
+	int total, base;
+	size_t n;
+	uint64_t start;
 	
 	if(cluster->flags & CF_VERBOSE)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: re-balancing cluster %s/%s:\n", cluster->key, cluster->env);
 	}
-	now = time(NULL);
-	gmtime_r(&now, &tm);
-	strftime(nowbuf, sizeof(nowbuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
-	if(cluster->partition)
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	if(cluster_sql_fetch_(cluster))
 	{
-		rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"expires\" >= %Q ORDER BY \"id\" ASC",
-						cluster->key, cluster->env, cluster->partition, nowbuf);
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to query cluster membership\n");
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, -1);
+		return -1;
 	}
-	else
+	/* cluster_sql_lock is now held */
+	cluster->sql_pass++;
+	cluster->sql_boundary[0] = 0;
+	for(n = 0; n < cluster->sql_nrows; n++)
 	{
-		rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" IS NULL AND \"expires\" >= %Q ORDER BY \"id\" ASC",
-						cluster->key, cluster->env, nowbuf);
+		row = &(cluster->sql_rows[n]);
+		/* Track the earliest expiry time: the membership needn't be re-read
+		 * until it has passed, unless the generation changes. Timestamps
+		 * are all in the same form, and so can be compared as strings.
+		 */
+		if(row->expires[0] && (!cluster->sql_boundary[0] || strcmp(row->expires, cluster->sql_boundary) < 0))
+		{
+			strcpy(cluster->sql_boundary, row->expires);
+		}
+		/* Members are marked with the number of this pass so that those
+		 * which were not returned can be discarded afterwards
+		 */
+		if(cluster_member_set_(cluster, row->id, row->threads, row->weight, row->slot, cluster->sql_pass) < 0)
+		{
+			pthread_mutex_unlock(&cluster_sql_lock);
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to update member table\n");
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&cluster_sql_lock);
+	cluster_members_expire_(cluster, cluster->sql_pass);
+	/* Indices are assigned in the order given by the member table, so
+	 * that they agree with the ring
+	 */
+	if(!(order = cluster_members_order_(cluster)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to allocate member order\n");
+		return -1;
 	}
 	total = 0;
 	base = -1;
-	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	for(n = 0; n < cluster->nmembers; n++)
 	{
-		id = sql_stmt_str(rs, 0);
-		val = sql_stmt_long(rs, 1);
-		if(!strcmp(id, cluster->instid) && !(cluster->flags & CF_PASSIVE))
+		m = order[n];
+		if(!strcmp(m->instid, cluster->instid) && !(cluster->flags & CF_PASSIVE))
 		{
 			base = total;
 			if(cluster->flags & CF_VERBOSE)
@@ -306,12 +934,18 @@ cluster_sql_balance_(CLUSTER *cluster)
 		{
 			if(cluster->flags & CF_VERBOSE)
 			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster:   %s [%d]\n", id, total);
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster:   %s [%d]\n", m->instid, total);
 			}
 		}
-		total += val;
+		total += m->workers;
 	}
-	sql_stmt_destroy(rs);
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
 	if(total != cluster->total_threads || base != cluster->inst_index)
 	{
 		if(base == -1)
@@ -338,6 +972,7 @@ cluster_sql_balance_(CLUSTER *cluster)
 		}
 		cluster->inst_index = base;
 		cluster->total_threads = total;
+		cluster_publish_locked_(cluster);
 		cluster_unlock_(cluster);
 		cluster_rebalanced_(cluster);
 		/* Re-acquire the lock to restore state */
@@ -346,12 +981,431 @@ cluster_sql_balance_(CLUSTER *cluster)
 	return 0;
 }
 
-/* Invoked before a parent process forks */
+/* Obtain the current members of the cluster: those read by the last
+ * combined membership query to include it, if they reflect the generation
+ * number the membership must (as determined by cluster_sql_changed_()), or
+ * otherwise those read by a new one. Waiting for the connection allows a
+ * query which is already in progress on behalf of another cluster to
+ * provide them. On success, returns with cluster_sql_lock held, so that
+ * the members can be read before they're replaced.
+ *
+ * The cluster should be write-locked when invoking this function.
+ */
+static int
+cluster_sql_fetch_(CLUSTER *cluster)
+{
+	SQL *db;
+	uint64_t start;
+	int r;
+
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_BALANCEDB);
+	pthread_mutex_lock(&cluster_sql_lock);
+	if(cluster->sql_fetched && cluster->sql_generation >= 0 && cluster->sql_rowsgen >= cluster->sql_generation)
+	{
+		cluster_sql_release_(cluster, CLUSTER_SQL_BALANCEDB);
+		return 0;
+	}
+	pthread_mutex_unlock(&cluster_sql_lock);
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_FETCH);
+	r = cluster_sql_members_(cluster, db);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_FETCH, start, (r ? -1 : 0));
+	cluster_sql_release_(cluster, CLUSTER_SQL_BALANCEDB);
+	return r;
+}
+
+/* Query the current (unexpired) members of every cluster using the
+ * connections, ordered by their identifiers, along with their stable slots
+ * (or -1), using a single query for all of the clusters' keys,
+ * environments and partitions; the results are divided between the
+ * clusters. On success, returns with cluster_sql_lock held.
+ *
+ * The cluster should be write-locked, and the balancing connection (db)
+ * acquired, when invoking this function.
+ */
+static int
+cluster_sql_members_(CLUSTER *restrict cluster, SQL *restrict db)
+{
+	CLUSTERSQLSHARE *share;
+	SQL_STATEMENT *rs;
+	CLUSTER *p;
+	const char *now, *key, *env, *partition;
+	char nowbuf[64], *gencond, *cond;
+	unsigned long long fetch;
+
+	share = cluster->sql_share;
+	pthread_mutex_lock(&cluster_sql_lock);
+	fetch = ++share->fetches;
+	gencond = cluster_sql_scopes_(share, fetch, 1);
+	cond = cluster_sql_scopes_(share, fetch, 0);
+	pthread_mutex_unlock(&cluster_sql_lock);
+	if(!gencond || !cond)
+	{
+		free(gencond);
+		free(cond);
+		return -1;
+	}
+	/* The generation numbers are read first: members write their entries
+	 * before announcing changes to them, and so the entries read
+	 * afterwards reflect at least these generations
+	 */
+	rs = sql_queryf(db, "SELECT \"key\", \"env\", \"partition\", \"generation\" FROM \"cluster_generation\" WHERE %s", gencond);
+	free(gencond);
+	if(!rs)
+	{
+		free(cond);
+		return -1;
+	}
+	pthread_mutex_lock(&cluster_sql_lock);
+	for(p = share->clusters; p; p = p->sql_next)
+	{
+		/* If there's no generation row, no member has ever joined */
+		if(p->sql_fetching == fetch)
+		{
+			p->sql_fetchgen = 0;
+		}
+	}
+	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	{
+		key = sql_stmt_str(rs, 0);
+		env = sql_stmt_str(rs, 1);
+		partition = sql_stmt_str(rs, 2);
+		for(p = share->clusters; p; p = p->sql_next)
+		{
+			if(p->sql_fetching == fetch && cluster_sql_scope_(p, key, env, (partition && partition[0] ? partition : NULL)))
+			{
+				p->sql_fetchgen = sql_stmt_long(rs, 3);
+			}
+		}
+	}
+	pthread_mutex_unlock(&cluster_sql_lock);
+	sql_stmt_destroy(rs);
+	now = cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf));
+	rs = sql_queryf(db, "SELECT \"key\", \"env\", \"partition\", \"id\", \"threads\", \"expires\", COALESCE(\"slot\", -1), \"weight\" FROM \"cluster_node\" "
+					"WHERE \"expires\" >= %s AND (%s) ORDER BY \"key\" ASC, \"env\" ASC, \"partition\" ASC, \"id\" ASC",
+					now, cond);
+	free(cond);
+	if(!rs)
+	{
+		return -1;
+	}
+	pthread_mutex_lock(&cluster_sql_lock);
+	for(p = share->clusters; p; p = p->sql_next)
+	{
+		if(p->sql_fetching == fetch)
+		{
+			p->sql_nrows = 0;
+			p->sql_rowsgen = p->sql_fetchgen;
+			p->sql_fetched = 1;
+		}
+	}
+	for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+	{
+		key = sql_stmt_str(rs, 0);
+		env = sql_stmt_str(rs, 1);
+		partition = sql_stmt_str(rs, 2);
+		for(p = share->clusters; p; p = p->sql_next)
+		{
+			if(p->sql_fetched && p->sql_fetching == fetch && cluster_sql_scope_(p, key, env, partition) &&
+			   cluster_sql_row_(p, sql_stmt_str(rs, 3), sql_stmt_long(rs, 4), sql_stmt_long(rs, 7), sql_stmt_str(rs, 5), sql_stmt_long(rs, 6)))
+			{
+				/* This cluster will have to query its members itself */
+				p->sql_fetched = 0;
+			}
+		}
+	}
+	sql_stmt_destroy(rs);
+	if(!cluster->sql_fetched)
+	{
+		pthread_mutex_unlock(&cluster_sql_lock);
+		return -1;
+	}
+	return 0;
+}
+
+/* Assemble the condition which matches the entries (or, if generation is
+ * non-zero, the generation numbers) of every distinct key, environment and
+ * partition of the clusters using the connections, marking each of those
+ * clusters with fetch. Returns NULL if it can't be allocated.
+ *
+ * cluster_sql_lock should be held when invoking this function.
+ */
+static char *
+cluster_sql_scopes_(CLUSTERSQLSHARE *share, unsigned long long fetch, int generation)
+{
+	CLUSTER *p, *q;
+	char *buf, *s;
+	size_t size;
+
+	/* Three quoted strings, whose lengths may double when quoted, and the
+	 * comparisons between them
+	 */
+	size = 1;
+	for(p = share->clusters; p; p = p->sql_next)
+	{
+		size += 2 * (strlen(p->key) + strlen(p->env) + (p->partition ? strlen(p->partition) : 0)) + 80;
+	}
+	if(!(buf = (char *) malloc(size)))
+	{
+		return NULL;
+	}
+	s = buf;
+	for(p = share->clusters; p; p = p->sql_next)
+	{
+		p->sql_fetching = fetch;
+		for(q = share->clusters; q != p && !cluster_sql_scope_(q, p->key, p->env, p->partition); q = q->sql_next);
+		if(q != p)
+		{
+			/* Already included */
+			continue;
+		}
+		s += sprintf(s, "%s(\"key\" = ", (s > buf ? " OR " : ""));
+		s = cluster_sql_quote_(p, s, p->key);
+		s += sprintf(s, " AND \"env\" = ");
+		s = cluster_sql_quote_(p, s, p->env);
+		/* The partition is part of the primary key of cluster_generation,
+		 * so can't be NULL there
+		 */
+		if(generation || p->partition)
+		{
+			s += sprintf(s, " AND \"partition\" = ");
+			s = cluster_sql_quote_(p, s, (p->partition ? p->partition : ""));
+			*s++ = ')';
+		}
+		else
+		{
+			s += sprintf(s, " AND \"partition\" IS NULL)");
+		}
+	}
+	*s = 0;
+	return buf;
+}
+
+/* Determine whether a cluster has a particular key, environment and
+ * partition (which may be NULL)
+ */
+static int
+cluster_sql_scope_(CLUSTER *restrict cluster, const char *restrict key, const char *restrict env, const char *restrict partition)
+{
+	if(!key || !env || strcmp(cluster->key, key) || strcmp(cluster->env, env))
+	{
+		return 0;
+	}
+	if(!cluster->partition || !partition)
+	{
+		return (!cluster->partition && !partition);
+	}
+	return !strcmp(cluster->partition, partition);
+}
+
+/* Add a member's entry to those read for a cluster
+ *
+ * cluster_sql_lock should be held when invoking this function.
+ */
+static int
+cluster_sql_row_(CLUSTER *cluster, const char *id, int threads, int weight, const char *expires, int slot)
+{
+	CLUSTERSQLROW *rows, *row;
+	size_t size;
+
+	if(!id)
+	{
+		return 0;
+	}
+	if(cluster->sql_nrows == cluster->sql_rowsize)
+	{
+		size = (cluster->sql_rowsize ? cluster->sql_rowsize * 2 : 16);
+		if(!(rows = (CLUSTERSQLROW *) realloc(cluster->sql_rows, size * sizeof(CLUSTERSQLROW))))
+		{
+			return -1;
+		}
+		cluster->sql_rows = rows;
+		cluster->sql_rowsize = size;
+	}
+	row = &(cluster->sql_rows[cluster->sql_nrows]);
+	strncpy(row->id, id, sizeof(row->id) - 1);
+	row->id[sizeof(row->id) - 1] = 0;
+	strncpy(row->expires, (expires ? expires : ""), sizeof(row->expires) - 1);
+	row->expires[sizeof(row->expires) - 1] = 0;
+	row->threads = threads;
+	row->weight = weight;
+	row->slot = slot;
+	cluster->sql_nrows++;
+	return 0;
+}
+
+/* Obtain an SQL expression for the current (UTC) time: where the dialect
+ * allows, this is evaluated by the database server, so that the clocks of
+ * the cluster members needn't agree; otherwise, it's a literal timestamp
+ * which is written to buf.
+ */
+static const char *
+cluster_sql_now_(CLUSTER *cluster, char *buf, size_t bufsize)
+{
+	time_t now;
+	struct tm tm;
+
+	switch(cluster->sql_dialect)
+	{
+	case CLUSTER_SQL_POSTGRES:
+		return "(now() AT TIME ZONE 'UTC')";
+	case CLUSTER_SQL_MYSQL:
+		return "UTC_TIMESTAMP()";
+	case CLUSTER_SQL_SQLITE:
+		return "datetime('now')";
+	}
+	now = time(NULL);
+	gmtime_r(&now, &tm);
+	strftime(buf, bufsize - 1, "'%Y-%m-%d %H:%M:%S'", &tm);
+	return buf;
+}
+
+/* Obtain an SQL expression for the time at which our entry (or our claim
+ * to a slot) expires if not refreshed, as cluster_sql_now_()
+ */
+static const char *
+cluster_sql_expiry_(CLUSTER *cluster, char *buf, size_t bufsize)
+{
+	time_t t;
+	struct tm tm;
+
+	switch(cluster->sql_dialect)
+	{
+	case CLUSTER_SQL_POSTGRES:
+		snprintf(buf, bufsize, "((now() AT TIME ZONE 'UTC') + INTERVAL '%d seconds')", cluster->ttl);
+		return buf;
+	case CLUSTER_SQL_MYSQL:
+		snprintf(buf, bufsize, "(UTC_TIMESTAMP() + INTERVAL %d SECOND)", cluster->ttl);
+		return buf;
+	case CLUSTER_SQL_SQLITE:
+		snprintf(buf, bufsize, "datetime('now', '+%d seconds')", cluster->ttl);
+		return buf;
+	}
+	t = time(NULL) + cluster->ttl;
+	gmtime_r(&t, &tm);
+	strftime(buf, bufsize - 1, "'%Y-%m-%d %H:%M:%S'", &tm);
+	return buf;
+}
+
+/* Obtain an SQL expression for our stable slot: NULL if we don't hold one */
+static const char *
+cluster_sql_slot_(CLUSTER *cluster, char *buf, size_t bufsize)
+{
+	if(cluster->slot < 0)
+	{
+		return "NULL";
+	}
+	snprintf(buf, bufsize, "%d", cluster->slot);
+	return buf;
+}
+
+/* Claim the lowest free stable slot, or renew our claim to the one we hold.
+ * Claims are rows in cluster_slot, whose primary key ensures that a slot
+ * can only be held by one member at a time; they expire in the same way as
+ * entries in cluster_node, and lapsed claims are discarded by whichever
+ * member next pings. If our slot changes, the change is announced by the
+ * subsequent ping.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static int
+cluster_sql_claim_(CLUSTER *restrict cluster, SQL *restrict db)
+{
+	SQL_STATEMENT *rs;
+	const char *partition, *now, *expiry, *id;
+	char nowbuf[64], expbuf[96];
+	int attempt, slot, held, n;
+
+	partition = (cluster->partition ? cluster->partition : "");
+	now = cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf));
+	expiry = cluster_sql_expiry_(cluster, expbuf, sizeof(expbuf));
+	if(sql_executef(db, "DELETE FROM \"cluster_slot\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"expires\" < %s",
+					cluster->key, cluster->env, partition, now))
+	{
+		return -1;
+	}
+	if(sql_executef(db, "UPDATE \"cluster_slot\" SET \"expires\" = %s WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"id\" = %Q",
+					expiry, cluster->key, cluster->env, partition, cluster->instid))
+	{
+		return -1;
+	}
+	for(attempt = 0; attempt < CLUSTER_SQL_CLAIM_ATTEMPTS; attempt++)
+	{
+		rs = sql_queryf(db, "SELECT \"slot\", \"id\" FROM \"cluster_slot\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q ORDER BY \"slot\" ASC",
+						cluster->key, cluster->env, partition);
+		if(!rs)
+		{
+			return -1;
+		}
+		/* Find the slot we hold, if any, and the lowest which is free */
+		slot = 0;
+		held = -1;
+		for(; !sql_stmt_eof(rs); sql_stmt_next(rs))
+		{
+			n = (int) sql_stmt_long(rs, 0);
+			id = sql_stmt_str(rs, 1);
+			if(id && !strcmp(id, cluster->instid))
+			{
+				held = n;
+			}
+			if(n == slot)
+			{
+				slot++;
+			}
+		}
+		sql_stmt_destroy(rs);
+		if(held < 0)
+		{
+			/* This will fail if another member claims the slot first */
+			if(sql_executef(db, "INSERT INTO \"cluster_slot\" (\"key\", \"env\", \"partition\", \"slot\", \"id\", \"expires\") VALUES (%Q, %Q, %Q, %d, %Q, %s)",
+							cluster->key, cluster->env, partition, slot, cluster->instid, expiry))
+			{
+				continue;
+			}
+			held = slot;
+		}
+		if(held != cluster->slot)
+		{
+			if(cluster->slot >= 0)
+			{
+				cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: SQL: claim to slot %d lapsed; now holding slot %d\n", cluster->slot, held);
+			}
+			else if(cluster->flags & CF_VERBOSE)
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: holding slot %d\n", held);
+			}
+			cluster->slot = held;
+			cluster->sql_announced = -1;
+		}
+		return 0;
+	}
+	cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to claim a slot after %d attempts\n", attempt);
+	return -1;
+}
+
+/* Create a server-side prepared statement on a connection, unless it has
+ * already been (as recorded in mask)
+ */
+static int
+cluster_sql_cache_(SQL *restrict sql, unsigned *restrict mask, unsigned stmt, const char *restrict statement)
+{
+	if(*mask & stmt)
+	{
+		return 0;
+	}
+	if(sql_execute(sql, statement))
+	{
+		return -1;
+	}
+	*mask |= stmt;
+	return 0;
+}
+
+/* Invoked before a parent process forks */
 void
 cluster_sql_prepare_(CLUSTER *p)
 {
 	CLUSTERFLAGS flags;
-	pthread_t pt, bt;
+	pthread_t pt, bt, jt;
 
 	cluster_wrlock_(p);
 	if(p->flags & CF_VERBOSE)
@@ -360,8 +1414,10 @@ cluster_sql_prepare_(CLUSTER *p)
 	}
 	flags = p->flags;
 	p->flags |= CF_LEAVING;
+	cluster_wake_(p, CW_LEAVE);
 	pt = p->ping_thread;
 	bt = p->balancer_thread;
+	jt = p->job_thread;
 	cluster_unlock_(p);
 	if(pt)
 	{
@@ -371,11 +1427,21 @@ cluster_sql_prepare_(CLUSTER *p)
 	{
 		pthread_join(bt, NULL);
 	}
+	if(jt)
+	{
+		pthread_join(jt, NULL);
+	}
 	cluster_wrlock_(p);
 	p->ping_thread = 0;
 	p->balancer_thread = 0;
+	p->job_thread = 0;
+	/* The shared connections can't be used by both processes: the last
+	 * cluster to detach closes them, and each process re-attaches
+	 */
+	cluster_sql_detach_(p);
 	p->inst_index = -1;
 	p->total_threads = 0;
+	cluster_publish_locked_(p);
 	cluster_rebalanced_(p);
 	if(p->flags & CF_VERBOSE)
 	{
@@ -398,7 +1464,7 @@ cluster_sql_parent_(CLUSTER *p)
 		{
 			cluster_logf_locked_(p, LOG_NOTICE, "libcluster: SQL: resuming cluster membership in parent process\n");
 		}
-		cluster_sql_rejoin_(p);
+		r = cluster_sql_rejoin_(p);
 	}
 	cluster_unlock_(p);
 	if(r)
@@ -414,6 +1480,8 @@ cluster_sql_child_(CLUSTER *p)
 
 	/* The cluster was locked by the parent on entry, reset the lock */
 	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+	pthread_mutex_init(&(p->job_lock), NULL);
 	cluster_wrlock_(p);
 	r = 0;
 	if(p->forkmode & CLUSTER_FORK_CHILD)
@@ -445,6 +1513,12 @@ cluster_sql_child_(CLUSTER *p)
 static int
 cluster_sql_rejoin_(CLUSTER *cluster)
 {
+	if(cluster_sql_attach_(cluster))
+	{
+		return -1;
+	}
+	cluster->sql_announced = -1;
+	cluster->sql_generation = -1;
 	if(cluster_sql_ping_(cluster))
 	{
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to perform initial ping\n");
@@ -455,36 +1529,49 @@ cluster_sql_rejoin_(CLUSTER *cluster)
 		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: failed to perform initial balancing\n");
 		return -1;
 	}
+	cluster_wake_reset_(cluster);
 	if(!(cluster->flags & CF_PASSIVE))
 	{
 		pthread_create(&(cluster->ping_thread), NULL, cluster_sql_ping_thread_, (void *) cluster);
 	}
 	pthread_create(&(cluster->balancer_thread), NULL, cluster_sql_balancer_thread_, (void *) cluster);
+	pthread_mutex_lock(&(cluster->job_lock));
+	cluster->job_accept = 1;
+	pthread_mutex_unlock(&(cluster->job_lock));
+	pthread_create(&(cluster->job_thread), NULL, cluster_sql_job_thread_, (void *) cluster);
 	return 0;
 }
 
 
 /* Periodic ping thread: periodically (every cluster->etcd_refresh seconds)
  * ping the registry service until cluster->flags & CF_LEAVING is set.
+ * While our entry is refreshed by the refresh thread, only the early pings
+ * are made here.
  */
 static void *
 cluster_sql_ping_thread_(void *arg)
 {
 	CLUSTER *cluster;
-	int refresh, count, verbose;
+	int refresh, wait, verbose, raised, r;
+	uint64_t start;
 	
 	cluster = (CLUSTER *) arg;
 
 	cluster_rdlock_(cluster);
 	verbose = (cluster->flags & CF_VERBOSE);
 	refresh = cluster->refresh;
-	count = refresh;
+	wait = refresh;
 	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: ping thread starting with ttl=%d, refresh=%d\n", cluster->ttl, cluster->refresh);
 	cluster_unlock_(cluster);
 
 	/* The cluster lock is not held at the start of each pass */
 	for(;;)
 	{
+		/* Wait until the refresh time arrives, or until we're woken
+		 * because we should ping early (e.g., because the worker count
+		 * has changed) or terminate
+		 */
+		raised = cluster_wait_(cluster, CW_PING, wait);
 		/* Check the flags within a read-lock */
 		cluster_rdlock_(cluster);
 		verbose = (cluster->flags & CF_VERBOSE);
@@ -494,29 +1581,30 @@ cluster_sql_ping_thread_(void *arg)
 			cluster_unlock_(cluster);
 			break;
 		}
-		if(count <= refresh)
+		if(!(raised & CW_PING) && cluster_sql_batched_(cluster))
 		{
-			/* We haven't yet hit the refresh time, sleep-and-loop until it
-			 * arrives.
-			 */
 			cluster_unlock_(cluster);
-			sleep(1);
-			count++;
 			continue;
 		}
-		if(cluster_sql_ping_(cluster))
+		start = cluster_trace_begin_(cluster, CLUSTER_TRACE_PING);
+		r = cluster_sql_ping_(cluster);
+		cluster_stats_record_(&(cluster->stats.ping), start);
+		cluster_trace_end_(cluster, CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+		if(r)
 		{
 			/* TODO: if pinging fails, we should try to re-connect to the
 			 *       database, and if that fails we should leave the
 			 *       cluster.
 			 */
 			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to update registry\n");
+			cluster_stats_count_(&(cluster->stats.errors));
+			cluster_stats_count_(&(cluster->stats.retries));
 			cluster_unlock_(cluster);
 			/* Short retry in case of transient problems */
-			sleep(5);
+			wait = 5;
 			continue;
 		}
-		count = 0;
+		wait = refresh;
 		if(verbose)
 		{
 			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: updated registry with %s=%d\n", cluster->instid, cluster->inst_threads);
@@ -530,119 +1618,625 @@ cluster_sql_ping_thread_(void *arg)
 	return NULL;
 }
 
-/* Re-balancing thread: wait for changes to the cluster_node table and
- * invoke cluster_sql_balance_() (which may invoke the re-balancing callback)
- * when they occur.
- *
+/* Refresh thread: every refresh seconds, refresh the entries of all of the
+ * clusters using the connections whose entries have been written by their
+ * own ping threads (see cluster_sql_ping_()), using as few statements as
+ * possible; outcomes are recorded in the statistics of each of them.
+ * Nothing is logged here, nor any cluster's lock acquired: if the refresh
+ * fails, each cluster's ping thread is woken to write its own entry
+ * instead, and logs the outcome.
  */
 static void *
-cluster_sql_balancer_thread_(void *arg)
+cluster_sql_refresh_thread_(void *arg)
 {
-	CLUSTER *cluster;
-	int verbose;
-	time_t now, last;
-	struct tm tm;
-	char nowbuf[64], lastbuf[64];
-	SQL_STATEMENT *rs;
-
-	last = 0;
-	lastbuf[0] = 0;	
-	cluster = (CLUSTER *) arg;
-	cluster_rdlock_(cluster);
-	verbose = (cluster->flags & CF_VERBOSE);
-	if(cluster->partition)
-	{
-		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: re-balancing thread started for %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
-	}
-	else
-	{
-		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: re-balancing thread started for %s/%s\n", cluster->key, cluster->env);
-	}
-	cluster_unlock_(cluster);
+	CLUSTERSQLSHARE *share;
+	struct timespec deadline;
+	CLUSTER *p, **list, **l;
+	uint64_t start;
+	time_t last, due;
+	size_t n, nalloc, i;
+	int r;
 
-	/* The cluster lock is not held at the start of each pass */	
+	share = (CLUSTERSQLSHARE *) arg;
+	list = NULL;
+	nalloc = 0;
+	last = cluster_now_();
+	pthread_mutex_lock(&cluster_sql_lock);
 	for(;;)
 	{
-		/* Check the flags within a read-lock */
-		cluster_rdlock_(cluster);
-		verbose = (cluster->flags & CF_VERBOSE);
-		if(cluster->flags & CF_LEAVING)
+		if(share->stop)
 		{
-			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: 'leaving' flag has been set, will terminate balancing thread\n");
-			cluster_unlock_(cluster);
 			break;
 		}
-		if(verbose)
+		/* refresh may be shortened while we wait */
+		due = last + share->refresh;
+		if(cluster_now_() < due)
 		{
-			if(cluster->partition)
-			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: waiting for changes to %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
-			}
-			else
-			{
-				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: waiting for changes to %s/%s\n", cluster->key, cluster->env);
-			}
+			deadline.tv_sec = due;
+			deadline.tv_nsec = 0;
+			pthread_cond_timedwait(&(share->cond), &cluster_sql_lock, &deadline);
+			continue;
 		}
-		/* Check for changes to the table; we must release the acquired
-		 * read lock while we do this (or the ping thread will be
-		 * prevented from working until this loop completes).
+		pthread_mutex_unlock(&cluster_sql_lock);
+		start = cluster_stats_start_();
+		r = cluster_sql_refresh_(share);
+		last = cluster_now_();
+		/* Note which clusters were refreshed, and after a failure stop
+		 * refreshing them, then record the outcome and wake their ping
+		 * threads without holding cluster_sql_lock (see share->busy)
 		 */
-		cluster_unlock_(cluster);
-		sleep(CLUSTER_SQL_BALANCE_SLEEP);
-		now = time(NULL);
-		gmtime_r(&now, &tm);
-		strftime(nowbuf, sizeof(nowbuf) - 1, "%Y-%m-%d %H:%M:%S", &tm);
-		if(lastbuf[0])
+		pthread_mutex_lock(&cluster_sql_lock);
+		n = 0;
+		for(p = share->clusters; p; p = p->sql_next)
 		{
-			if(cluster->partition)
-			{
-				rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"expires\" >= %Q AND \"updated\" >= %Q",
-								cluster->key, cluster->env, cluster->partition, nowbuf, lastbuf);
-			}
-			else
+			if(!p->sql_batched)
 			{
-				rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" IS NULL AND \"expires\" >= %Q AND \"updated\" >= %Q",
-							cluster->key, cluster->env, nowbuf, lastbuf);
+				continue;
 			}
-		}
-		else
-		{
-			if(cluster->partition)
+			if(r)
 			{
-				rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q AND \"expires\" >= %Q",
-								cluster->key, cluster->env, cluster->partition, nowbuf);
-
+				p->sql_batched = 0;
 			}
-			else
+			if(n == nalloc)
 			{
-				rs = sql_queryf(cluster->balancedb, "SELECT \"id\", \"threads\" FROM \"cluster_node\" WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" IS NULL AND \"expires\" >= %Q",
-								cluster->key, cluster->env, nowbuf);
+				if(!(l = (CLUSTER **) realloc(list, (nalloc ? nalloc * 2 : 16) * sizeof(CLUSTER *))))
+				{
+					/* The others' ping threads will notice by themselves */
+					continue;
+				}
+				list = l;
+				nalloc = (nalloc ? nalloc * 2 : 16);
 			}
+			list[n] = p;
+			n++;
 		}
-		strcpy(lastbuf, nowbuf);
-		if(sql_stmt_eof(rs) && now - last < CLUSTER_SQL_MAX_BALANCEWAIT)
+		share->busy = 1;
+		pthread_mutex_unlock(&cluster_sql_lock);
+		for(i = 0; i < n; i++)
 		{
-			sql_stmt_destroy(rs);
-			continue;
-		}
-		sql_stmt_destroy(rs);
-		/* Acquire the write-lock before re-balancing */
-		cluster_wrlock_(cluster);
-		last = now;
-		if(cluster_sql_balance_(cluster))
-		{
-			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to balance cluster in response to changes\n");
-			cluster_unlock_(cluster);
-			continue;
+			cluster_stats_record_(&(list[i]->stats.ping), start);
+			cluster_trace_end_(list[i], CLUSTER_TRACE_PING, start, (r ? -1 : 0));
+			if(r)
+			{
+				cluster_stats_count_(&(list[i]->stats.errors));
+				cluster_stats_count_(&(list[i]->stats.retries));
+				cluster_wake_(list[i], CW_PING);
+			}
 		}
-		cluster_unlock_(cluster);
+		pthread_mutex_lock(&cluster_sql_lock);
+		share->busy = 0;
+		pthread_cond_broadcast(&(share->idle));
 	}
-	cluster_logf_(cluster, LOG_DEBUG, "libcluster: SQL: balancing thread is terminating\n");
+	pthread_mutex_unlock(&cluster_sql_lock);
+	free(list);
 	return NULL;
 }
 
-static int
-cluster_sql_migrate_(SQL *restrict sql, const char *restrict identifier, int newversion, void *restrict userdata)
+/* Format our entry as a row of the statements executed by
+ * cluster_sql_refresh_(), which doesn't examine the cluster itself; the
+ * timestamps of the dialects which allow refreshing are expressions
+ * evaluated by the server, and so can be formatted in advance. Returns
+ * NULL if memory couldn't be allocated.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static char *
+cluster_sql_batchrow_(CLUSTER *cluster)
+{
+	const char *now, *expiry;
+	char nowbuf[64], expbuf[96], *row, *s;
+	size_t need;
+
+	now = cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf));
+	expiry = cluster_sql_expiry_(cluster, expbuf, sizeof(expbuf));
+	/* Four quoted strings, whose lengths may double when quoted, two
+	 * timestamp expressions and two integers
+	 */
+	need = 2 * (strlen(cluster->instid) + strlen(cluster->key) + strlen(cluster->env) + (cluster->partition ? strlen(cluster->partition) : 0)) + strlen(now) + strlen(expiry) + 64;
+	if(!(row = (char *) malloc(need)))
+	{
+		return NULL;
+	}
+	s = row;
+	*s++ = '(';
+	s = cluster_sql_quote_(cluster, s, cluster->instid);
+	*s++ = ',';
+	s = cluster_sql_quote_(cluster, s, cluster->key);
+	*s++ = ',';
+	s = cluster_sql_quote_(cluster, s, cluster->partition);
+	*s++ = ',';
+	s = cluster_sql_quote_(cluster, s, cluster->env);
+	sprintf(s, ",%d,%d,NULL,%s,%s)", cluster->inst_threads, cluster->inst_weight, now, expiry);
+	return row;
+}
+
+/* Refresh the entries of the clusters whose entries are refreshed by the
+ * refresh thread, using one multi-row upsert for each CLUSTER_SQL_PING_BATCH
+ * of them. The rows formatted by their ping threads are copied while
+ * holding cluster_sql_lock, and the statements executed once it has been
+ * released.
+ */
+static int
+cluster_sql_refresh_(CLUSTERSQLSHARE *share)
+{
+	CLUSTER *p;
+	SQL *db;
+	char *buf, *stmt, *s;
+	size_t *ends, *e, nrows, nalloc, size, len, need, first, n, c, i;
+	int dialect, r;
+
+	db = share->db[CLUSTER_SQL_PINGDB];
+	pthread_mutex_lock(&(share->dblock[CLUSTER_SQL_PINGDB]));
+	/* Nothing is logged on behalf of any cluster */
+	sql_set_userdata(db, NULL);
+	buf = NULL;
+	ends = NULL;
+	nrows = nalloc = size = len = 0;
+	dialect = CLUSTER_SQL_GENERIC;
+	r = 0;
+	pthread_mutex_lock(&cluster_sql_lock);
+	for(p = share->clusters; p; p = p->sql_next)
+	{
+		if(!p->sql_batched)
+		{
+			continue;
+		}
+		dialect = p->sql_batchdialect;
+		need = strlen(p->sql_batchrow);
+		if(len + need > size)
+		{
+			size = (len + need) * 2;
+			if(!(s = (char *) realloc(buf, size)))
+			{
+				r = -1;
+				break;
+			}
+			buf = s;
+		}
+		if(nrows == nalloc)
+		{
+			nalloc = (nalloc ? nalloc * 2 : 16);
+			if(!(e = (size_t *) realloc(ends, nalloc * sizeof(size_t))))
+			{
+				r = -1;
+				break;
+			}
+			ends = e;
+		}
+		memcpy(buf + len, p->sql_batchrow, need);
+		len += need;
+		ends[nrows] = len;
+		nrows++;
+	}
+	pthread_mutex_unlock(&cluster_sql_lock);
+	for(n = 0; !r && n < nrows; n += c)
+	{
+		c = (nrows - n < CLUSTER_SQL_PING_BATCH ? nrows - n : CLUSTER_SQL_PING_BATCH);
+		first = (n ? ends[n - 1] : 0);
+		if(!(stmt = (char *) malloc(512 + ends[n + c - 1] - first + c)))
+		{
+			r = -1;
+			break;
+		}
+		s = stmt + sprintf(stmt, "%s INTO \"cluster_node\" (\"id\", \"key\", \"partition\", \"env\", \"threads\", \"weight\", \"slot\", \"updated\", \"expires\") VALUES ",
+						   (dialect == CLUSTER_SQL_SQLITE ? "INSERT OR REPLACE" : "INSERT"));
+		for(i = n; i < n + c; i++)
+		{
+			if(i > n)
+			{
+				*s++ = ',';
+			}
+			len = ends[i] - first;
+			memcpy(s, buf + first, len);
+			s += len;
+			first = ends[i];
+		}
+		if(dialect == CLUSTER_SQL_POSTGRES)
+		{
+			strcpy(s, " ON CONFLICT (\"id\", \"key\", \"env\") DO UPDATE SET "
+				   "\"partition\" = EXCLUDED.\"partition\", \"threads\" = EXCLUDED.\"threads\", \"weight\" = EXCLUDED.\"weight\", \"slot\" = EXCLUDED.\"slot\", "
+				   "\"updated\" = EXCLUDED.\"updated\", \"expires\" = EXCLUDED.\"expires\"");
+		}
+		else if(dialect == CLUSTER_SQL_MYSQL)
+		{
+			strcpy(s, " ON DUPLICATE KEY UPDATE "
+				   "\"partition\" = VALUES(\"partition\"), \"threads\" = VALUES(\"threads\"), \"weight\" = VALUES(\"weight\"), \"slot\" = VALUES(\"slot\"), "
+				   "\"updated\" = VALUES(\"updated\"), \"expires\" = VALUES(\"expires\")");
+		}
+		else
+		{
+			*s = 0;
+		}
+		r = sql_execute(db, stmt);
+		free(stmt);
+	}
+	pthread_mutex_unlock(&(share->dblock[CLUSTER_SQL_PINGDB]));
+	free(ends);
+	free(buf);
+	return (r ? -1 : 0);
+}
+
+/* Job thread: write the queued job updates every CLUSTER_SQL_JOB_FLUSH
+ * seconds, or when woken because the queue is full, until the cluster is
+ * left; any updates which remain are written before the thread terminates.
+ */
+static void *
+cluster_sql_job_thread_(void *arg)
+{
+	CLUSTER *cluster;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: job thread starting\n");
+	cluster_unlock_(cluster);
+	while(!(cluster_wait_(cluster, CW_JOBS, CLUSTER_SQL_JOB_FLUSH) & CW_LEAVE))
+	{
+		cluster_sql_job_flush_(cluster);
+	}
+	pthread_mutex_lock(&(cluster->job_lock));
+	cluster->job_accept = 0;
+	pthread_mutex_unlock(&(cluster->job_lock));
+	cluster_sql_job_flush_(cluster);
+	cluster_rdlock_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: job thread is terminating\n");
+	cluster_unlock_(cluster);
+	return NULL;
+}
+
+/* Re-balancing thread: wait for changes to the cluster_node table and
+ * invoke cluster_sql_balance_() (which may invoke the re-balancing callback)
+ * when they occur.
+ *
+ * Changes are detected by checking the cluster's generation number (which
+ * is incremented by members when they join, leave, or change their worker
+ * counts), and whether the earliest expiry time of the members last read
+ * has passed; the membership is only re-read if either is the case. The
+ * check is made every CLUSTER_SQL_BALANCE_SLEEP seconds; if the registry
+ * is a PostgreSQL database (and libpq is available), the thread instead
+ * listens on the cluster's notification channel and checks when notified,
+ * or otherwise every CLUSTER_SQL_MAX_BALANCEWAIT seconds.
+ */
+static void *
+cluster_sql_balancer_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	int verbose, wait, settle;
+	long long generation;
+	char boundary[64];
+# ifdef WITH_LIBPQ
+	PGconn *listener;
+	time_t now, last;
+	int changed;
+
+	last = 0;
+# endif
+	generation = -1;
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	verbose = (cluster->flags & CF_VERBOSE);
+	if(cluster->partition)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: re-balancing thread started for %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
+	}
+	else
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: re-balancing thread started for %s/%s\n", cluster->key, cluster->env);
+	}
+# ifdef WITH_LIBPQ
+	listener = (cluster->sql_notify ? cluster_sql_listen_(cluster) : NULL);
+# endif
+	cluster_unlock_(cluster);
+
+	/* The cluster lock is not held at the start of each pass */	
+	for(;;)
+	{
+		/* Perform any re-balancing which was deferred to allow the
+		 * membership to settle, if it has fallen due
+		 */
+		settle = cluster_settle_wait_(cluster);
+		if(!settle)
+		{
+			cluster_wrlock_(cluster);
+			if(!(cluster->flags & CF_LEAVING) && cluster_settled_locked_(cluster) &&
+			   cluster_sql_balance_(cluster))
+			{
+				cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to balance cluster in response to changes\n");
+				/* Ensure the next check re-balances */
+				generation = -1;
+				cluster_stats_count_(&(cluster->stats.retries));
+			}
+			cluster_unlock_(cluster);
+		}
+		/* Check the flags within a read-lock */
+		cluster_rdlock_(cluster);
+		verbose = (cluster->flags & CF_VERBOSE);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: 'leaving' flag has been set, will terminate balancing thread\n");
+			cluster_unlock_(cluster);
+			break;
+		}
+		strcpy(boundary, cluster->sql_boundary);
+# ifdef WITH_LIBPQ
+		if(listener)
+		{
+			/* Wait (for up to a second, so that the flags are checked
+			 * regularly) for a notification
+			 */
+			cluster_unlock_(cluster);
+			changed = cluster_sql_notified_(listener, 1);
+			now = time(NULL);
+			if(changed < 0)
+			{
+				cluster_logf_(cluster, LOG_WARNING, "libcluster: SQL: lost notification connection; will poll for changes\n");
+				PQfinish(listener);
+				listener = NULL;
+				/* Notifications may have been missed */
+				changed = 1;
+			}
+			if(!changed && now - last < CLUSTER_SQL_MAX_BALANCEWAIT)
+			{
+				continue;
+			}
+			last = now;
+		}
+		else
+# endif
+		{
+			if(verbose)
+			{
+				if(cluster->partition)
+				{
+					cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: waiting for changes to %s[%s]/%s\n", cluster->key, cluster->partition, cluster->env);
+				}
+				else
+				{
+					cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: waiting for changes to %s/%s\n", cluster->key, cluster->env);
+				}
+			}
+			/* Check for changes to the table; we must release the acquired
+			 * read lock while we do this (or the ping thread will be
+			 * prevented from working until this loop completes).
+			 */
+			cluster_unlock_(cluster);
+			/* Don't wait beyond the time any deferred re-balancing
+			 * falls due
+			 */
+			wait = CLUSTER_SQL_BALANCE_SLEEP;
+			if(settle > 0 && settle < wait)
+			{
+				wait = settle;
+			}
+			cluster_wait_(cluster, CW_NONE, wait);
+		}
+		if(!cluster_sql_changed_(cluster, &generation, boundary))
+		{
+			continue;
+		}
+		/* Acquire the write-lock before re-balancing */
+		cluster_wrlock_(cluster);
+# ifdef WITH_LIBPQ
+		if(!listener && cluster->sql_notify)
+		{
+			/* Try to re-establish the notification connection before
+			 * re-balancing, so that no changes are missed
+			 */
+			listener = cluster_sql_listen_(cluster);
+		}
+# endif
+		if(cluster_settle_locked_(cluster))
+		{
+			/* Allow further changes to arrive before re-balancing */
+			cluster_unlock_(cluster);
+			continue;
+		}
+		if(cluster_sql_balance_(cluster))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to balance cluster in response to changes\n");
+			cluster_unlock_(cluster);
+			/* Ensure the next check re-balances */
+			generation = -1;
+			cluster_stats_count_(&(cluster->stats.retries));
+			continue;
+		}
+		cluster_unlock_(cluster);
+	}
+# ifdef WITH_LIBPQ
+	if(listener)
+	{
+		PQfinish(listener);
+	}
+# endif
+	cluster_logf_(cluster, LOG_DEBUG, "libcluster: SQL: balancing thread is terminating\n");
+	return NULL;
+}
+
+/* Determine whether the membership of the cluster should be re-read: that
+ * is, whether its generation number differs from *generation (which is
+ * updated), or the time given by boundary (if any) has passed, according to
+ * the database server. Returns 1 if the membership should be re-read (or if
+ * the query fails), and 0 otherwise.
+ *
+ * The generation number is also recorded as the one the membership must
+ * reflect when next read; if entries may have expired (or the query fails),
+ * members read before now won't do.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static int
+cluster_sql_changed_(CLUSTER *cluster, long long *generation, const char *boundary)
+{
+	SQL *db;
+	SQL_STATEMENT *rs;
+	const char *now, *partition;
+	char nowbuf[64];
+	long long current;
+	int expired;
+
+	partition = (cluster->partition ? cluster->partition : "");
+	if(!boundary[0])
+	{
+		boundary = NULL;
+	}
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_BALANCEDB);
+	cluster->sql_generation = -1;
+	if(cluster->sql_dialect == CLUSTER_SQL_POSTGRES)
+	{
+		if(cluster_sql_cache_(db, &(cluster->sql_share->stmts[CLUSTER_SQL_BALANCEDB]), CLUSTER_SQL_STMT_GENERATION,
+							  "PREPARE \"cluster_generation\" (VARCHAR, VARCHAR, VARCHAR, TIMESTAMP) AS "
+							  "SELECT \"generation\", CASE WHEN (now() AT TIME ZONE 'UTC') > $4 THEN 1 ELSE 0 END FROM \"cluster_generation\" "
+							  "WHERE \"key\" = $1 AND \"env\" = $2 AND \"partition\" = $3"))
+		{
+			cluster_sql_release_(cluster, CLUSTER_SQL_BALANCEDB);
+			cluster_stats_count_(&(cluster->stats.errors));
+			cluster_stats_count_(&(cluster->stats.wakeups));
+			cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+			*generation = -1;
+			return 1;
+		}
+		rs = sql_queryf(db, "EXECUTE \"cluster_generation\" (%Q, %Q, %Q, %Q)", cluster->key, cluster->env, partition, boundary);
+	}
+	else
+	{
+		now = cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf));
+		rs = sql_queryf(db, "SELECT \"generation\", CASE WHEN %s > %Q THEN 1 ELSE 0 END FROM \"cluster_generation\" "
+						"WHERE \"key\" = %Q AND \"env\" = %Q AND \"partition\" = %Q",
+						now, boundary, cluster->key, cluster->env, partition);
+	}
+	if(!rs)
+	{
+		cluster_sql_release_(cluster, CLUSTER_SQL_BALANCEDB);
+		cluster_stats_count_(&(cluster->stats.errors));
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		*generation = -1;
+		return 1;
+	}
+	/* If there's no generation row, no member has ever joined */
+	current = 0;
+	expired = 0;
+	if(!sql_stmt_eof(rs))
+	{
+		current = sql_stmt_long(rs, 0);
+		expired = sql_stmt_long(rs, 1);
+	}
+	sql_stmt_destroy(rs);
+	if(!expired)
+	{
+		cluster->sql_generation = current;
+	}
+	cluster_sql_release_(cluster, CLUSTER_SQL_BALANCEDB);
+	if(current != *generation || expired)
+	{
+		/* The membership may have changed */
+		cluster_stats_count_(&(cluster->stats.wakeups));
+		cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+	}
+	if(current != *generation)
+	{
+		*generation = current;
+		return 1;
+	}
+	return expired;
+}
+
+# ifdef WITH_LIBPQ
+/* Open a dedicated connection to a PostgreSQL registry and LISTEN on the
+ * cluster's notification channel; libsql doesn't expose notifications, so
+ * libpq is used directly, converting the registry URI to the form it
+ * expects. Returns NULL if this isn't possible, in which case the caller
+ * should fall back to polling.
+ *
+ * The cluster should be at least read-locked when invoking this function.
+ */
+static PGconn *
+cluster_sql_listen_(CLUSTER *cluster)
+{
+	const char *p;
+	char *conninfo, query[64];
+	PGconn *conn;
+	PGresult *res;
+
+	p = strchr(cluster->registry, ':');
+	conninfo = (char *) malloc(strlen(p) + 11);
+	if(!conninfo)
+	{
+		return NULL;
+	}
+	strcpy(conninfo, "postgresql");
+	strcat(conninfo, p);
+	conn = PQconnectdb(conninfo);
+	free(conninfo);
+	if(!conn)
+	{
+		return NULL;
+	}
+	if(PQstatus(conn) != CONNECTION_OK)
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: SQL: cannot establish notification connection to <%s>: %s", cluster->registry, PQerrorMessage(conn));
+		PQfinish(conn);
+		return NULL;
+	}
+	snprintf(query, sizeof(query), "LISTEN \"%s\"", cluster->sql_channel);
+	res = PQexec(conn, query);
+	if(PQresultStatus(res) != PGRES_COMMAND_OK)
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: SQL: failed to listen for notifications: %s", PQerrorMessage(conn));
+		PQclear(res);
+		PQfinish(conn);
+		return NULL;
+	}
+	PQclear(res);
+	if(cluster->flags & CF_VERBOSE)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: listening for changes on channel %s\n", cluster->sql_channel);
+	}
+	return conn;
+}
+
+/* Wait for up to timeout seconds for notifications to arrive on a listening
+ * connection; returns 1 if any did, 0 if none did, and -1 if the connection
+ * has failed.
+ */
+static int
+cluster_sql_notified_(PGconn *conn, int timeout)
+{
+	struct pollfd pfd;
+	PGnotify *notify;
+	int r;
+
+	pfd.fd = PQsocket(conn);
+	if(pfd.fd < 0)
+	{
+		return -1;
+	}
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	r = poll(&pfd, 1, timeout * 1000);
+	if(r < 0)
+	{
+		return (errno == EINTR ? 0 : -1);
+	}
+	if(!r)
+	{
+		return 0;
+	}
+	if(!PQconsumeInput(conn))
+	{
+		return -1;
+	}
+	r = 0;
+	while((notify = PQnotifies(conn)))
+	{
+		r = 1;
+		PQfreemem(notify);
+	}
+	return r;
+}
+# endif /*WITH_LIBPQ*/
+
+static int
+cluster_sql_migrate_(SQL *restrict sql, const char *restrict identifier, int newversion, void *restrict userdata)
 {
 	CLUSTER *cluster;
 	SQL_VARIANT variant;
@@ -652,6 +2246,8 @@ cluster_sql_migrate_(SQL *restrict sql, const char *restrict identifier, int new
 
 	ddl = NULL;
 	cluster = (CLUSTER *) userdata;
+	/* Used only if logging is enabled */
+	(void) cluster;
 	variant = sql_variant(sql);
 	if(!newversion)
 	{
@@ -805,45 +2401,773 @@ cluster_sql_migrate_(SQL *restrict sql, const char *restrict identifier, int new
 		}
 		return 0;
 	}
-	cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: attempt to update schema to unsupported version %d\n", newversion);
-	return -1;
-}
-
-/* Logging callbacks invoked by libsql
- * Note that the cluster object will always be locked at the point where these
- * are invoked.
- */
-static int
-cluster_sql_querylog_(SQL *restrict sql, const char *restrict query)
-{
-	CLUSTER *cluster;
-	
-	cluster = (CLUSTER *) sql_userdata(sql);
-	if(cluster->flags & CF_VERBOSE)
+	if(newversion == 9)
 	{
-		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL query: %s\n", query);
-	}
-	return 0;
-}
-
-static int
-cluster_sql_errorlog_(SQL *restrict sql, const char *restrict sqlstate, const char *restrict message)
-{
-	CLUSTER *cluster;
-	
-	cluster = (CLUSTER *) sql_userdata(sql);
-	cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: [%s] %s\n", sqlstate, message);
-	return 0;
-}
-
-static int
-cluster_sql_noticelog_(SQL *restrict sql, const char *restrict message)
+		/* cluster_generation holds a generation number for each cluster,
+		 * incremented whenever a member joins, leaves, or changes its
+		 * worker count, so that balancers needn't re-read the membership
+		 * unless it changes; the partition is '' for unpartitioned
+		 * clusters
+		 */
+		if(variant == SQL_VARIANT_MYSQL)
+		{
+			ddl = "CREATE TABLE \"cluster_generation\" ("
+				"\"key\" VARCHAR(32) NOT NULL, "
+				"\"env\" VARCHAR(32) NOT NULL, "
+				"\"partition\" VARCHAR(32) NOT NULL DEFAULT '', "
+				"\"generation\" BIGINT NOT NULL DEFAULT 0, "
+				"PRIMARY KEY (\"key\", \"env\", \"partition\")"
+				") ENGINE=InnoDB DEFAULT CHARSET=utf8 DEFAULT COLLATE=utf8_unicode_ci";
+		}
+		else
+		{
+			ddl = "CREATE TABLE \"cluster_generation\" ("
+				"\"key\" VARCHAR(32) NOT NULL, "
+				"\"env\" VARCHAR(32) NOT NULL, "
+				"\"partition\" VARCHAR(32) NOT NULL DEFAULT '', "
+				"\"generation\" BIGINT NOT NULL DEFAULT 0, "
+				"PRIMARY KEY (\"key\", \"env\", \"partition\")"
+				")";
+		}
+		if(sql_execute(sql, ddl))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 10)
+	{
+		/* cluster_slot holds members' claims to stable slots: the primary
+		 * key ensures that each slot is held by only one member; the slot
+		 * a member holds is also recorded in its cluster_node entry
+		 */
+		if(variant == SQL_VARIANT_MYSQL)
+		{
+			ddl = "CREATE TABLE \"cluster_slot\" ("
+				"\"key\" VARCHAR(32) NOT NULL, "
+				"\"env\" VARCHAR(32) NOT NULL, "
+				"\"partition\" VARCHAR(32) NOT NULL DEFAULT '', "
+				"\"slot\" INT NOT NULL, "
+				"\"id\" VARCHAR(32) NOT NULL, "
+				"\"expires\" DATETIME NOT NULL, "
+				"PRIMARY KEY (\"key\", \"env\", \"partition\", \"slot\")"
+				") ENGINE=InnoDB DEFAULT CHARSET=utf8 DEFAULT COLLATE=utf8_unicode_ci";
+		}
+		else
+		{
+			ddl = "CREATE TABLE \"cluster_slot\" ("
+				"\"key\" VARCHAR(32) NOT NULL, "
+				"\"env\" VARCHAR(32) NOT NULL, "
+				"\"partition\" VARCHAR(32) NOT NULL DEFAULT '', "
+				"\"slot\" INT NOT NULL, "
+				"\"id\" VARCHAR(32) NOT NULL, "
+				"\"expires\" TIMESTAMP NOT NULL, "
+				"PRIMARY KEY (\"key\", \"env\", \"partition\", \"slot\")"
+				")";
+		}
+		if(sql_execute(sql, ddl))
+		{
+			return -1;
+		}
+		if(sql_execute(sql, "ALTER TABLE \"cluster_node\" ADD \"slot\" INT default NULL"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 11)
+	{
+		/* Used to select waiting jobs, oldest first, when claiming */
+		if(sql_execute(sql, "CREATE INDEX \"cluster_job_key_env_status_created\" ON \"cluster_job\" (\"key\", \"env\", \"status\", \"created\")"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	if(newversion == 12)
+	{
+		/* The capacity weight of each of a member's workers */
+		if(sql_execute(sql, "ALTER TABLE \"cluster_node\" ADD \"weight\" INT NOT NULL default 1"))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: SQL: attempt to update schema to unsupported version %d\n", newversion);
+	return -1;
+}
+
+/* Logging callbacks invoked by libsql
+ * Note that the cluster object will always be locked at the point where these
+ * are invoked, except when a connection is used by the refresh thread, in
+ * which case there is no cluster and nothing is logged.
+ */
+static int
+cluster_sql_querylog_(SQL *restrict sql, const char *restrict query)
 {
 	CLUSTER *cluster;
 	
 	cluster = (CLUSTER *) sql_userdata(sql);
-	cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: SQL: %s", message);
+	if(cluster && (cluster->flags & CF_VERBOSE))
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL query: %s\n", query);
+	}
+	return 0;
+}
+
+static int
+cluster_sql_errorlog_(SQL *restrict sql, const char *restrict sqlstate, const char *restrict message)
+{
+	CLUSTER *cluster;
+	
+	cluster = (CLUSTER *) sql_userdata(sql);
+	if(cluster)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: [%s] %s\n", sqlstate, message);
+		cluster_sql_reset_(cluster, sql, sqlstate);
+	}
+	return 0;
+}
+
+/* Forget the prepared statements recorded for a shared connection if an
+ * error indicates that its server session has been lost (or replaced when
+ * the connection was re-established), so that they're prepared again
+ * before next being executed
+ *
+ * Invoked with the connection held on behalf of the cluster.
+ */
+static void
+cluster_sql_reset_(CLUSTER *restrict cluster, SQL *restrict sql, const char *restrict sqlstate)
+{
+	CLUSTERSQLSHARE *share;
+	int n;
+
+	if(!(share = cluster->sql_share) || !sqlstate)
+	{
+		return;
+	}
+	/* Class 08 is a connection exception, 57P01-57P03 the server shutting
+	 * down or refusing connections, and 26000 a statement which doesn't
+	 * exist in this session
+	 */
+	if(strncmp(sqlstate, "08", 2) && strncmp(sqlstate, "57P0", 4) && strcmp(sqlstate, "26000"))
+	{
+		return;
+	}
+	for(n = 0; n < CLUSTER_SQL_CONNECTIONS; n++)
+	{
+		if(share->db[n] == sql)
+		{
+			if(share->stmts[n] && (cluster->flags & CF_VERBOSE))
+			{
+				cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: SQL: server session lost; prepared statements will be re-created\n");
+			}
+			share->stmts[n] = 0;
+			break;
+		}
+	}
+}
+
+static int
+cluster_sql_noticelog_(SQL *restrict sql, const char *restrict message)
+{
+	CLUSTER *cluster;
+	
+	cluster = (CLUSTER *) sql_userdata(sql);
+	if(cluster)
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: SQL: %s", message);
+	}
+	return 0;
+}
+
+/* Job persistence
+ *
+ * Neither the creation of jobs nor changes to their state are written to
+ * the database as they are made; instead, a copy of the job's new state is
+ * added to the cluster's queue (replacing any copy already queued for the
+ * same job), and the job thread
+ * writes the contents of the queue every CLUSTER_SQL_JOB_FLUSH seconds, or
+ * as soon as CLUSTER_SQL_JOB_BATCH jobs have updates queued. The queued
+ * updates are written in batches of up to CLUSTER_SQL_JOB_BATCH rows, using
+ * a single multi-row upsert where the dialect allows, or otherwise a single
+ * transaction per batch.
+ */
+
+/* Initialise a cluster's job queue: invoked when the cluster is created */
+void
+cluster_sql_init_(CLUSTER *cluster)
+{
+	pthread_mutex_init(&(cluster->job_lock), NULL);
+}
+
+/* Free a cluster's job queue and membership buffer: invoked when the
+ * cluster is destroyed
+ */
+void
+cluster_sql_destroy_(CLUSTER *cluster)
+{
+	CLUSTERJOBUPDATE *p;
+
+	while(cluster->job_queue)
+	{
+		p = cluster->job_queue;
+		cluster->job_queue = p->next;
+		free(p);
+	}
+	while(cluster->job_free)
+	{
+		p = cluster->job_free;
+		cluster->job_free = p->next;
+		free(p);
+	}
+	free(cluster->sql_rows);
+	pthread_mutex_destroy(&(cluster->job_lock));
+}
+
+/* Queue an update to a job's persistent state; if an update to the same job
+ * is already queued, it is replaced. Updates are discarded if the cluster
+ * isn't joined.
+ *
+ * The cluster lock need not be held when invoking this function.
+ */
+int
+cluster_sql_job_update_(CLUSTERJOB *job)
+{
+	return cluster_sql_job_queue_(job, 0);
+}
+
+/* Queue the creation of (if create is set) or an update to a job's row */
+static int
+cluster_sql_job_queue_(CLUSTERJOB *job, int create)
+{
+	CLUSTER *cluster;
+	CLUSTERJOBUPDATE *p;
+	unsigned int bucket;
+	int wake;
+
+	cluster = job->cluster;
+	bucket = cluster_sql_job_bucket_(job->id);
+	wake = 0;
+	pthread_mutex_lock(&(cluster->job_lock));
+	if(!cluster->job_accept)
+	{
+		pthread_mutex_unlock(&(cluster->job_lock));
+		return 0;
+	}
+	p = cluster_sql_job_find_locked_(cluster, job->id, bucket);
+	if(!p)
+	{
+		if(cluster->job_free)
+		{
+			p = cluster->job_free;
+			cluster->job_free = p->next;
+		}
+		else if(!(p = (CLUSTERJOBUPDATE *) calloc(1, sizeof(CLUSTERJOBUPDATE))))
+		{
+			pthread_mutex_unlock(&(cluster->job_lock));
+			return -1;
+		}
+		strcpy(p->id, job->id);
+		p->insert = 0;
+		p->overwrite = 0;
+		cluster_sql_job_queue_locked_(cluster, p, bucket);
+		/* Wake the job thread once, when the queue reaches the batch size */
+		wake = (cluster->job_queued == CLUSTER_SQL_JOB_BATCH);
+	}
+	else if(create)
+	{
+		/* The job's state has already been queued to be written */
+		p->insert = 1;
+		pthread_mutex_unlock(&(cluster->job_lock));
+		return 0;
+	}
+	if(create)
+	{
+		p->insert = 1;
+	}
+	else
+	{
+		p->overwrite = 1;
+	}
+	strcpy(p->parent, job->parent);
+	p->status = job->status;
+	p->total = job->total;
+	p->progress = job->progress;
+	pthread_mutex_unlock(&(cluster->job_lock));
+	if(wake)
+	{
+		cluster_wake_(cluster, CW_JOBS);
+	}
+	return 0;
+}
+
+/* Determine which hash bucket queued updates to a job are placed in */
+static unsigned int
+cluster_sql_job_bucket_(const char *id)
+{
+	uint32_t h;
+
+	/* FNV-1a */
+	h = 2166136261U;
+	for(; *id; id++)
+	{
+		h ^= (unsigned char) *id;
+		h *= 16777619U;
+	}
+	return h % CLUSTER_JOB_BUCKETS;
+}
+
+/* Find the queued update to a job, if there is one; job_lock must be held */
+static CLUSTERJOBUPDATE *
+cluster_sql_job_find_locked_(CLUSTER *cluster, const char *id, unsigned int bucket)
+{
+	CLUSTERJOBUPDATE *p;
+
+	for(p = cluster->job_hash[bucket]; p; p = p->hnext)
+	{
+		if(!strcmp(p->id, id))
+		{
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Add an update to the queue; job_lock must be held */
+static void
+cluster_sql_job_queue_locked_(CLUSTER *cluster, CLUSTERJOBUPDATE *p, unsigned int bucket)
+{
+	p->hnext = cluster->job_hash[bucket];
+	cluster->job_hash[bucket] = p;
+	p->next = cluster->job_queue;
+	cluster->job_queue = p;
+	cluster->job_queued++;
+}
+
+/* Write all of the queued job updates to the database. Any which can't be
+ * written are returned to the queue, unless a newer update to the same job
+ * has been queued in the meantime.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+static int
+cluster_sql_job_flush_(CLUSTER *cluster)
+{
+	CLUSTERJOBUPDATE *list, *p, *next, *last;
+	SQL *db;
+	unsigned int bucket;
+	size_t count;
+	int r;
+
+	/* Take the whole queue, so that updates can continue to be queued while
+	 * this one is written
+	 */
+	pthread_mutex_lock(&(cluster->job_lock));
+	list = cluster->job_queue;
+	cluster->job_queue = NULL;
+	cluster->job_queued = 0;
+	memset(cluster->job_hash, 0, sizeof(cluster->job_hash));
+	pthread_mutex_unlock(&(cluster->job_lock));
+	if(!list)
+	{
+		return 0;
+	}
+	r = 0;
+	cluster_rdlock_(cluster);
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_JOBDB);
+	for(p = list; p; p = next)
+	{
+		for(next = p, count = 0; next && count < CLUSTER_SQL_JOB_BATCH; count++)
+		{
+			next = next->next;
+		}
+		if(cluster_sql_job_write_(cluster, db, p, count))
+		{
+			cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to write job updates\n");
+			r = -1;
+			break;
+		}
+	}
+	cluster_sql_release_(cluster, CLUSTER_SQL_JOBDB);
+	cluster_unlock_(cluster);
+	pthread_mutex_lock(&(cluster->job_lock));
+	/* The updates which were written (those before p) can be re-used */
+	for(last = list; last != p; last = next)
+	{
+		next = last->next;
+		last->next = cluster->job_free;
+		cluster->job_free = last;
+	}
+	for(; p; p = next)
+	{
+		next = p->next;
+		bucket = cluster_sql_job_bucket_(p->id);
+		if((last = cluster_sql_job_find_locked_(cluster, p->id, bucket)))
+		{
+			/* The newer update supersedes this one, but the row may
+			 * still need to be created
+			 */
+			last->insert |= p->insert;
+			p->next = cluster->job_free;
+			cluster->job_free = p;
+		}
+		else
+		{
+			cluster_sql_job_queue_locked_(cluster, p, bucket);
+		}
+	}
+	pthread_mutex_unlock(&(cluster->job_lock));
+	return r;
+}
+
+/* Write a batch of count updates (starting with first) to the database.
+ *
+ * The cluster should be at least read-locked, and the job connection (db)
+ * acquired, when invoking this function.
+ */
+static int
+cluster_sql_job_write_(CLUSTER *restrict cluster, SQL *restrict db, CLUSTERJOBUPDATE *first, size_t count)
+{
+	CLUSTERSQLJOBS jobs;
+	char nowbuf[64], *buf, *s, *rows;
+	const char *now;
+	size_t rowmax;
+	int overwrite;
+
+	if(cluster->sql_dialect != CLUSTER_SQL_POSTGRES && cluster->sql_dialect != CLUSTER_SQL_MYSQL)
+	{
+		/* No (suitable) upsert syntax: create any rows which don't exist
+		 * and update the rest within a single transaction
+		 */
+		jobs.cluster = cluster;
+		jobs.first = first;
+		jobs.count = count;
+		if(sql_perform(db, cluster_sql_perform_jobs_, (void *) &jobs, 5, SQL_TXN_CONSISTENT))
+		{
+			return -1;
+		}
+		return 0;
+	}
+	now = cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf));
+	/* Each row consists of at most five quoted strings (the job ID, parent,
+	 * key, environment and node) whose lengths may double when quoted, two
+	 * timestamp expressions, a status name and two integers
+	 */
+	rowmax = 2 * (strlen(cluster->key) + strlen(cluster->env) + strlen(cluster->instid) + 2 * CLUSTER_JOB_ID_LEN) + 2 * strlen(now) + 96;
+	buf = (char *) malloc(512 + count * rowmax);
+	if(!buf)
+	{
+		return -1;
+	}
+	/* Jobs which have changed replace any existing rows; those which have
+	 * only been created leave them as they are
+	 */
+	for(overwrite = 1; overwrite >= 0; overwrite--)
+	{
+		rows = buf + sprintf(buf, "INSERT INTO \"cluster_job\" (\"id\", \"key\", \"env\", \"parent\", \"status\", \"created\", \"updated\", \"node\", \"progress\", \"total\") VALUES ");
+		s = cluster_sql_job_rows_(cluster, rows, first, count, overwrite, now);
+		if(s == rows)
+		{
+			continue;
+		}
+		if(cluster->sql_dialect == CLUSTER_SQL_POSTGRES)
+		{
+			strcpy(s, (overwrite ?
+					   " ON CONFLICT (\"id\", \"key\", \"env\") DO UPDATE SET "
+					   "\"parent\" = EXCLUDED.\"parent\", \"status\" = EXCLUDED.\"status\", \"updated\" = EXCLUDED.\"updated\", "
+					   "\"node\" = EXCLUDED.\"node\", \"progress\" = EXCLUDED.\"progress\", \"total\" = EXCLUDED.\"total\"" :
+					   " ON CONFLICT (\"id\", \"key\", \"env\") DO NOTHING"));
+		}
+		else
+		{
+			/* INSERT IGNORE would also disregard errors other than
+			 * duplicate keys
+			 */
+			strcpy(s, (overwrite ?
+					   " ON DUPLICATE KEY UPDATE "
+					   "\"parent\" = VALUES(\"parent\"), \"status\" = VALUES(\"status\"), \"updated\" = VALUES(\"updated\"), "
+					   "\"node\" = VALUES(\"node\"), \"progress\" = VALUES(\"progress\"), \"total\" = VALUES(\"total\")" :
+					   " ON DUPLICATE KEY UPDATE \"id\" = \"id\""));
+		}
+		if(sql_execute(db, buf))
+		{
+			free(buf);
+			return -1;
+		}
+	}
+	free(buf);
 	return 0;
 }
 
+/* Append the rows for those of count updates (starting with first) whose
+ * overwrite flag matches overwrite to a multi-row INSERT, returning a
+ * pointer to the end of the rows (s, if there are none). Jobs which have
+ * only been created have no node, as none is working on them yet.
+ */
+static char *
+cluster_sql_job_rows_(CLUSTER *restrict cluster, char *restrict s, CLUSTERJOBUPDATE *first, size_t count, int overwrite, const char *now)
+{
+	CLUSTERJOBUPDATE *p;
+	size_t c;
+	int n;
+
+	for(p = first, c = 0, n = 0; c < count; p = p->next, c++)
+	{
+		if(!p->overwrite != !overwrite)
+		{
+			continue;
+		}
+		if(n)
+		{
+			*s++ = ',';
+		}
+		n++;
+		*s++ = '(';
+		s = cluster_sql_quote_(cluster, s, p->id);
+		*s++ = ',';
+		s = cluster_sql_quote_(cluster, s, cluster->key);
+		*s++ = ',';
+		s = cluster_sql_quote_(cluster, s, cluster->env);
+		*s++ = ',';
+		s = cluster_sql_quote_(cluster, s, (p->parent[0] ? p->parent : NULL));
+		s += sprintf(s, ",'%s',%s,%s,", cluster_job_status_name_(p->status), now, now);
+		s = cluster_sql_quote_(cluster, s, (overwrite ? cluster->instid : NULL));
+		s += sprintf(s, ",%d,%d)", p->progress, p->total);
+	}
+	return s;
+}
+
+static int
+cluster_sql_perform_jobs_(SQL *restrict sql, void *restrict userdata)
+{
+	CLUSTERSQLJOBS *jobs;
+	CLUSTERJOBUPDATE *p;
+	char nowbuf[64];
+	const char *now;
+	size_t c;
+
+	jobs = (CLUSTERSQLJOBS *) userdata;
+	now = cluster_sql_now_(jobs->cluster, nowbuf, sizeof(nowbuf));
+	for(p = jobs->first, c = 0; c < jobs->count; p = p->next, c++)
+	{
+		if(p->insert &&
+		   sql_executef(sql, "INSERT INTO \"cluster_job\" (\"id\", \"key\", \"env\", \"parent\", \"status\", \"created\", \"updated\", \"node\", \"progress\", \"total\") "
+						"SELECT %Q, %Q, %Q, %Q, %Q, %s, %s, NULL, %d, %d "
+						"WHERE NOT EXISTS (SELECT 1 FROM \"cluster_job\" WHERE \"id\" = %Q AND \"key\" = %Q AND \"env\" = %Q)",
+						p->id, jobs->cluster->key, jobs->cluster->env, (p->parent[0] ? p->parent : NULL),
+						cluster_job_status_name_(p->status), now, now, p->progress, p->total,
+						p->id, jobs->cluster->key, jobs->cluster->env))
+		{
+			return -1;
+		}
+		if(p->overwrite &&
+		   sql_executef(sql, "UPDATE \"cluster_job\" SET \"parent\" = %Q, \"status\" = %Q, \"updated\" = %s, \"node\" = %Q, \"progress\" = %d, \"total\" = %d "
+						"WHERE \"id\" = %Q AND \"key\" = %Q AND \"env\" = %Q",
+						(p->parent[0] ? p->parent : NULL), cluster_job_status_name_(p->status), now,
+						jobs->cluster->instid, p->progress, p->total,
+						p->id, jobs->cluster->key, jobs->cluster->env))
+		{
+			return -1;
+		}
+	}
+	return 1;
+}
+
+/* Write a string to dest as a quoted SQL literal ('NULL' if str is NULL),
+ * for use where a statement must be assembled by hand; returns a pointer to
+ * the end of the literal (which is not NUL-terminated). Quotes are doubled,
+ * as are backslashes where the server would otherwise treat them as escapes.
+ */
+static char *
+cluster_sql_quote_(CLUSTER *cluster, char *dest, const char *str)
+{
+	if(!str)
+	{
+		memcpy(dest, "NULL", 4);
+		return dest + 4;
+	}
+	*dest++ = '\'';
+	for(; *str; str++)
+	{
+		if(*str == '\'' || (*str == '\\' && cluster->sql_dialect == CLUSTER_SQL_MYSQL))
+		{
+			*dest++ = *str;
+		}
+		*dest++ = *str;
+	}
+	*dest++ = '\'';
+	return dest;
+}
+
+/* Claim up to max waiting jobs, as cluster_job_claim().
+ *
+ * Where the dialect allows, candidate jobs are first selected from this
+ * member's share of the jobs (those whose IDs hash to one of its worker
+ * indices), so that members claiming at the same time generally select
+ * different rows; only if that share is exhausted are jobs claimed from
+ * the remainder. Rows locked by other members' claims are skipped where
+ * the database supports it.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_sql_job_claim_(CLUSTER *cluster, int max, CLUSTERJOB **out)
+{
+	CLUSTERSQLCLAIM claim;
+	SQL *db;
+	int r;
+
+	cluster_rdlock_(cluster);
+	if(!cluster->sql_share)
+	{
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	claim.cluster = cluster;
+	claim.max = max;
+	claim.count = 0;
+	claim.out = out;
+	db = cluster_sql_acquire_(cluster, CLUSTER_SQL_JOBDB);
+	r = sql_perform(db, cluster_sql_perform_claim_, (void *) &claim, 5, (cluster->sql_skiplocked ? SQL_TXN_DEFAULT : SQL_TXN_CONSISTENT));
+	cluster_sql_release_(cluster, CLUSTER_SQL_JOBDB);
+	if(r)
+	{
+		cluster_sql_claim_discard_(&claim);
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: SQL: failed to claim jobs\n");
+		cluster_unlock_(cluster);
+		return -1;
+	}
+	cluster_unlock_(cluster);
+	return claim.count;
+}
+
+static int
+cluster_sql_perform_claim_(SQL *restrict sql, void *restrict userdata)
+{
+	CLUSTERSQLCLAIM *claim;
+	CLUSTER *cluster;
+	char partbuf[128];
+
+	claim = (CLUSTERSQLCLAIM *) userdata;
+	cluster = claim->cluster;
+	/* Discard anything claimed by a previous attempt */
+	cluster_sql_claim_discard_(claim);
+	partbuf[0] = 0;
+	if(cluster->inst_index >= 0 && cluster->total_threads > 0)
+	{
+		switch(cluster->sql_dialect)
+		{
+		case CLUSTER_SQL_POSTGRES:
+			snprintf(partbuf, sizeof(partbuf), " AND (hashtext(\"id\") & 2147483647) %% %d BETWEEN %d AND %d",
+					 cluster->total_threads, cluster->inst_index, cluster->inst_index + cluster->inst_threads - 1);
+			break;
+		case CLUSTER_SQL_MYSQL:
+			snprintf(partbuf, sizeof(partbuf), " AND CRC32(\"id\") %% %d BETWEEN %d AND %d",
+					 cluster->total_threads, cluster->inst_index, cluster->inst_index + cluster->inst_threads - 1);
+			break;
+		}
+	}
+	if(partbuf[0] && cluster_sql_claim_pass_(sql, claim, partbuf))
+	{
+		return -1;
+	}
+	if(claim->count < claim->max && cluster_sql_claim_pass_(sql, claim, ""))
+	{
+		return -1;
+	}
+	return 1;
+}
+
+/* Select up to (max - count) waiting jobs matching the condition cond, add
+ * them to the claimed jobs and mark them as active
+ */
+static int
+cluster_sql_claim_pass_(SQL *restrict sql, CLUSTERSQLCLAIM *restrict claim, const char *restrict cond)
+{
+	CLUSTER *cluster;
+	SQL_STATEMENT *rs;
+	CLUSTERJOB *job;
+	const char *id, *parent, *lock;
+	char nowbuf[64], *buf, *s;
+	int first;
+
+	cluster = claim->cluster;
+	if(cluster->sql_skiplocked)
+	{
+		lock = " FOR UPDATE SKIP LOCKED";
+	}
+	else if(cluster->sql_dialect == CLUSTER_SQL_POSTGRES || cluster->sql_dialect == CLUSTER_SQL_MYSQL)
+	{
+		lock = " FOR UPDATE";
+	}
+	else
+	{
+		lock = "";
+	}
+	rs = sql_queryf(sql, "SELECT \"id\", \"parent\", \"progress\", \"total\" FROM \"cluster_job\" "
+					"WHERE \"key\" = %Q AND \"env\" = %Q AND \"status\" = 'WAIT'%s ORDER BY \"created\" LIMIT %d%s",
+					cluster->key, cluster->env, cond, claim->max - claim->count, lock);
+	if(!rs)
+	{
+		return -1;
+	}
+	/* Each ID may double in length when quoted */
+	buf = (char *) malloc(512 + (claim->max - claim->count) * (2 * CLUSTER_JOB_ID_LEN + 3));
+	if(!buf)
+	{
+		sql_stmt_destroy(rs);
+		return -1;
+	}
+	s = buf + sprintf(buf, "\"id\" IN (");
+	first = claim->count;
+	for(; !sql_stmt_eof(rs) && claim->count < claim->max; sql_stmt_next(rs))
+	{
+		id = sql_stmt_str(rs, 0);
+		if(!id || !(job = cluster_job_alloc_(cluster, id)))
+		{
+			continue;
+		}
+		parent = sql_stmt_str(rs, 1);
+		if(parent)
+		{
+			strncpy(job->parent, parent, CLUSTER_JOB_ID_LEN);
+			job->parent[CLUSTER_JOB_ID_LEN] = 0;
+		}
+		job->progress = (int) sql_stmt_long(rs, 2);
+		job->total = (int) sql_stmt_long(rs, 3);
+		job->status = CJS_ACTIVE;
+		if(claim->count > first)
+		{
+			*s++ = ',';
+		}
+		s = cluster_sql_quote_(cluster, s, job->id);
+		claim->out[claim->count] = job;
+		claim->count++;
+	}
+	sql_stmt_destroy(rs);
+	strcpy(s, ")");
+	if(claim->count > first &&
+	   sql_executef(sql, "UPDATE \"cluster_job\" SET \"status\" = 'ACTIVE', \"node\" = %Q, \"updated\" = %s WHERE \"key\" = %Q AND \"env\" = %Q AND %s",
+					cluster->instid, cluster_sql_now_(cluster, nowbuf, sizeof(nowbuf)), cluster->key, cluster->env, buf))
+	{
+		free(buf);
+		return -1;
+	}
+	free(buf);
+	return 0;
+}
+
+/* Destroy the job objects created by a claim */
+static void
+cluster_sql_claim_discard_(CLUSTERSQLCLAIM *claim)
+{
+	for(; claim->count > 0; claim->count--)
+	{
+		cluster_job_destroy(claim->out[claim->count - 1]);
+		claim->out[claim->count - 1] = NULL;
+	}
+}
+
 #endif /*ENABLE_SQL*/
@@ -41,6 +41,7 @@ cluster_static_set_index(CLUSTER *cluster, int instindex)
 		return -1;
 	}
 	cluster->inst_index = instindex;
+	cluster_publish_locked_(cluster);
 	if(cluster->flags & CF_VERBOSE)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: static: this member's base index set to %d\n", cluster->inst_index);
@@ -69,6 +70,7 @@ cluster_static_set_total(CLUSTER *cluster, int total)
 		return -1;
 	}
 	cluster->total_threads = total;
+	cluster_publish_locked_(cluster);
 	if(cluster->flags & CF_VERBOSE)
 	{
 		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: static: total cluster worker count set to %d\n", cluster->inst_index);
@@ -104,7 +106,13 @@ cluster_static_join_(CLUSTER *cluster)
 		errno = EINVAL;
 		return -1;
 	}
+	if(cluster_ring_static_locked_(cluster))
+	{
+		cluster_unlock_(cluster);
+		return -1;
+	}
 	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
 	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: static: successfully joined the cluster\n");
 	cluster_unlock_(cluster);
 	return cluster_rebalanced_(cluster);
@@ -116,6 +124,8 @@ cluster_static_leave_(CLUSTER *cluster)
 {
 	cluster_wrlock_(cluster);
 	cluster->flags &= ~(CF_JOINED | CF_LEAVING);
+	cluster_publish_locked_(cluster);
+	cluster_ring_clear_locked_(cluster);
 	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: static: successfully left the cluster\n");
 	cluster_unlock_(cluster);
 	return 0;
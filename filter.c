@@ -0,0 +1,307 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Batched ownership filtering
+ *
+ * These functions resolve the ownership of a whole batch of keys against a
+ * single snapshot of the hash ring. The keys' positions are computed (and,
+ * where possible, their bucket table entries fetched) several at a time
+ * using vector instructions where the processor supports them; only the
+ * keys falling into buckets shared between workers need further work.
+ *
+ * On x86, an AVX2 kernel is compiled in (if the compiler supports it) and
+ * used if the processor does; on ARM, a NEON kernel is used if the target
+ * supports NEON. Otherwise, a scalar kernel is used.
+ */
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define CLUSTER_FILTER_AVX2           1
+# include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+# define CLUSTER_FILTER_NEON           1
+# include <arm_neon.h>
+#endif
+
+/* The number of keys processed per block by cluster_compact_owned() */
+#define CLUSTER_FILTER_BLOCK           256
+/* The number of keys processed per block by the vector kernels */
+#define CLUSTER_FILTER_LANES           64
+
+typedef size_t (*CLUSTERFILTERFN)(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask);
+
+static size_t cluster_filter_scalar_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask);
+#ifdef CLUSTER_FILTER_AVX2
+static size_t cluster_filter_avx2_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask);
+#endif
+#ifdef CLUSTER_FILTER_NEON
+static size_t cluster_filter_neon_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask);
+#endif
+static void cluster_filter_init_(void);
+static CLUSTERRING *cluster_filter_ring_(CLUSTER *cluster, int worker, int *owner, int *reader);
+
+static CLUSTERFILTERFN cluster_filter_kernel_;
+
+#ifdef WITH_PTHREAD
+static pthread_once_t cluster_filter_control_ = PTHREAD_ONCE_INIT;
+#endif
+
+/* Determine which of a batch of keys (given their 64-bit hashes) are owned
+ * by a worker of this member: mask_out[n] is set to 1 if hashes[n] is
+ * owned, and 0 otherwise. Returns the number of keys owned.
+ */
+size_t
+cluster_filter_owned(CLUSTER *cluster, int worker, const uint64_t *hashes, size_t n, uint8_t *mask_out)
+{
+	CLUSTERRING *ring;
+	size_t r;
+	int owner, reader;
+
+	ring = cluster_filter_ring_(cluster, worker, &owner, &reader);
+	if(!ring)
+	{
+		memset(mask_out, 0, n);
+		return 0;
+	}
+	r = cluster_filter_kernel_(ring, owner, hashes, n, mask_out);
+	cluster_ring_release_(cluster, reader);
+	errno = 0;
+	return r;
+}
+
+/* Determine which of a batch of keys are owned by a worker of this member,
+ * writing the positions (within hashes) of those which are to index_out,
+ * which must have room for n entries. Returns the number of positions
+ * written.
+ */
+size_t
+cluster_compact_owned(CLUSTER *cluster, int worker, const uint64_t *hashes, size_t n, size_t *index_out)
+{
+	CLUSTERRING *ring;
+	uint8_t mask[CLUSTER_FILTER_BLOCK];
+	size_t c, i, j, count;
+	int owner, reader;
+
+	ring = cluster_filter_ring_(cluster, worker, &owner, &reader);
+	if(!ring)
+	{
+		return 0;
+	}
+	count = 0;
+	for(i = 0; i < n; i += c)
+	{
+		c = n - i;
+		if(c > CLUSTER_FILTER_BLOCK)
+		{
+			c = CLUSTER_FILTER_BLOCK;
+		}
+		if(!cluster_filter_kernel_(ring, owner, &(hashes[i]), c, mask))
+		{
+			continue;
+		}
+		for(j = 0; j < c; j++)
+		{
+			index_out[count] = i + j;
+			count += mask[j];
+		}
+	}
+	cluster_ring_release_(cluster, reader);
+	errno = 0;
+	return count;
+}
+
+/* Obtain the ring for a filtering operation and the index of the worker
+ * whose keys are being selected; returns NULL (with errno set) if the
+ * operation cannot be performed. If a ring is returned, the caller must
+ * invoke cluster_ring_release_() with reader when it has finished.
+ */
+static CLUSTERRING *
+cluster_filter_ring_(CLUSTER *cluster, int worker, int *owner, int *reader)
+{
+	CLUSTERRING *ring;
+
+#ifdef WITH_PTHREAD
+	pthread_once(&cluster_filter_control_, cluster_filter_init_);
+#else
+	if(!cluster_filter_kernel_)
+	{
+		cluster_filter_init_();
+	}
+#endif
+	ring = cluster_ring_acquire_(cluster, reader);
+	if(!ring || ring->base < 0)
+	{
+		cluster_ring_release_(cluster, *reader);
+		errno = EPERM;
+		return NULL;
+	}
+	if(worker < 0 || worker >= ring->workers)
+	{
+		cluster_ring_release_(cluster, *reader);
+		errno = EINVAL;
+		return NULL;
+	}
+	*owner = ring->base + worker;
+	return ring;
+}
+
+/* Select the kernel to use */
+static void
+cluster_filter_init_(void)
+{
+	cluster_filter_kernel_ = cluster_filter_scalar_;
+#ifdef CLUSTER_FILTER_NEON
+	cluster_filter_kernel_ = cluster_filter_neon_;
+#endif
+#ifdef CLUSTER_FILTER_AVX2
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		cluster_filter_kernel_ = cluster_filter_avx2_;
+	}
+#endif
+}
+
+/* Scalar kernel: also used for the keys left over by the vector kernels */
+static size_t
+cluster_filter_scalar_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask)
+{
+	size_t i, count;
+
+	count = 0;
+	for(i = 0; i < n; i++)
+	{
+		mask[i] = (cluster_ring_lookup_(ring, hashes[i]) == owner);
+		count += mask[i];
+	}
+	return count;
+}
+
+#ifdef CLUSTER_FILTER_AVX2
+/* AVX2 kernel: processes blocks of keys in two passes, first computing the
+ * positions of eight keys at a time and gathering their bucket entries,
+ * then resolving the entries for shared buckets and building the mask.
+ * Keeping the passes separate means that the (unpredictable) branch for
+ * shared buckets does not stall the vector pipeline.
+ */
+__attribute__((target("avx2")))
+static size_t
+cluster_filter_avx2_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask)
+{
+	const __m256i c1 = _mm256_set1_epi32((int) 0x85ebca6bU);
+	const __m256i c2 = _mm256_set1_epi32((int) 0xc2b2ae35U);
+	const __m256i even = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	const __m128i shift = _mm_cvtsi32_si128((int) ring->shift);
+	__m256i a, b, h;
+	uint32_t keys[CLUSTER_FILTER_LANES];
+	int32_t entries[CLUSTER_FILTER_LANES];
+	size_t i, j, count;
+	int o;
+
+	count = 0;
+	for(i = 0; i + CLUSTER_FILTER_LANES <= n; i += CLUSTER_FILTER_LANES)
+	{
+		for(j = 0; j < CLUSTER_FILTER_LANES; j += 8)
+		{
+			/* Fold each 64-bit hash into 32 bits, and pack the eight
+			 * results into a single vector
+			 */
+			a = _mm256_loadu_si256((const __m256i *) (const void *) &(hashes[i + j]));
+			b = _mm256_loadu_si256((const __m256i *) (const void *) &(hashes[i + j + 4]));
+			a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 32));
+			b = _mm256_xor_si256(b, _mm256_srli_epi64(b, 32));
+			a = _mm256_permutevar8x32_epi32(a, even);
+			b = _mm256_permutevar8x32_epi32(b, even);
+			h = _mm256_inserti128_si256(a, _mm256_castsi256_si128(b), 1);
+			/* Mix, as cluster_ring_key_() */
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			h = _mm256_mullo_epi32(h, c1);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 13));
+			h = _mm256_mullo_epi32(h, c2);
+			h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+			_mm256_storeu_si256((__m256i *) (void *) &(keys[j]), h);
+			_mm256_storeu_si256((__m256i *) (void *) &(entries[j]), _mm256_i32gather_epi32((const int *) ring->buckets, _mm256_srl_epi32(h, shift), 4));
+		}
+		for(j = 0; j < CLUSTER_FILTER_LANES; j++)
+		{
+			o = entries[j];
+			if(o < 0)
+			{
+				o = cluster_ring_search_(ring, keys[j]);
+			}
+			mask[i + j] = (o == owner);
+			count += mask[i + j];
+		}
+	}
+	return count + cluster_filter_scalar_(ring, owner, &(hashes[i]), n - i, &(mask[i]));
+}
+#endif /*CLUSTER_FILTER_AVX2*/
+
+#ifdef CLUSTER_FILTER_NEON
+/* NEON kernel: as the AVX2 kernel, but four keys at a time, and because
+ * NEON has no gather instruction, the bucket table is read in the second
+ * pass
+ */
+static size_t
+cluster_filter_neon_(const CLUSTERRING *ring, int owner, const uint64_t *hashes, size_t n, uint8_t *mask)
+{
+	const uint32x4_t c1 = vdupq_n_u32(0x85ebca6bU);
+	const uint32x4_t c2 = vdupq_n_u32(0xc2b2ae35U);
+	uint64x2_t a, b;
+	uint32x4_t h;
+	uint32_t keys[CLUSTER_FILTER_LANES];
+	size_t i, j, count;
+	int o;
+
+	count = 0;
+	for(i = 0; i + CLUSTER_FILTER_LANES <= n; i += CLUSTER_FILTER_LANES)
+	{
+		for(j = 0; j < CLUSTER_FILTER_LANES; j += 4)
+		{
+			a = vld1q_u64(&(hashes[i + j]));
+			b = vld1q_u64(&(hashes[i + j + 2]));
+			a = veorq_u64(a, vshrq_n_u64(a, 32));
+			b = veorq_u64(b, vshrq_n_u64(b, 32));
+			h = vcombine_u32(vmovn_u64(a), vmovn_u64(b));
+			h = veorq_u32(h, vshrq_n_u32(h, 16));
+			h = vmulq_u32(h, c1);
+			h = veorq_u32(h, vshrq_n_u32(h, 13));
+			h = vmulq_u32(h, c2);
+			h = veorq_u32(h, vshrq_n_u32(h, 16));
+			vst1q_u32(&(keys[j]), h);
+		}
+		for(j = 0; j < CLUSTER_FILTER_LANES; j++)
+		{
+			o = ring->buckets[keys[j] >> ring->shift];
+			if(o < 0)
+			{
+				o = cluster_ring_search_(ring, keys[j]);
+			}
+			mask[i + j] = (o == owner);
+			count += mask[i + j];
+		}
+	}
+	return count + cluster_filter_scalar_(ring, owner, &(hashes[i]), n - i, &(mask[i]));
+}
+#endif /*CLUSTER_FILTER_NEON*/
@@ -23,7 +23,52 @@
 
 /* Cluster job management */
 
+/* Job objects are re-used rather than freed: each thread keeps a cache of
+ * up to CLUSTER_JOB_CACHE free objects, and exchanges them in batches with
+ * a process-wide pool (which is protected by cluster_job_poollock_) when the
+ * cache becomes empty or full. Free objects belong to no cluster, and so
+ * may be re-used by any, and outlive the cluster they were last used by.
+ * The cache also holds the buffer into which the thread formats job log
+ * messages.
+ */
+typedef struct cluster_job_cache_struct CLUSTERJOBCACHE;
+
+struct cluster_job_cache_struct
+{
+	size_t count;
+	CLUSTERJOB *jobs[CLUSTER_JOB_CACHE];
+	char logbuf[CLUSTER_JOB_LOG_LEN + 1];
+};
+
 static int cluster_job_id_valid_(const char *str);
+static int cluster_job_generate_id_(char *buf);
+static void cluster_job_init_(CLUSTERJOB *job, CLUSTER *cluster, const char *id);
+static int cluster_job_record_(CLUSTERJOB *job);
+static CLUSTERJOBCACHE *cluster_job_cache_(void);
+static void cluster_job_refill_(CLUSTERJOBCACHE *cache);
+static void cluster_job_spill_(CLUSTERJOBCACHE *cache);
+#ifdef WITH_PTHREAD
+static void cluster_job_cache_init_(void);
+static void cluster_job_cache_free_(void *ptr);
+
+static pthread_once_t cluster_job_cache_control_ = PTHREAD_ONCE_INIT;
+static pthread_key_t cluster_job_cache_key_;
+static pthread_mutex_t cluster_job_poollock_ = PTHREAD_MUTEX_INITIALIZER;
+#else
+static CLUSTERJOBCACHE cluster_job_cache_static_;
+#endif
+/* Free job objects, returned from threads' caches */
+static CLUSTERJOB *cluster_job_pool_;
+static size_t cluster_job_pooled_;
+static int cluster_job_changed_(CLUSTERJOB *job);
+static int cluster_job_set_status_(CLUSTERJOB *job, CLUSTERJOBSTATUS status);
+
+static const char *cluster_job_status_names_[] = {
+	"WAIT",
+	"ACTIVE",
+	"COMPLETE",
+	"FAIL"
+};
 
 /* Create a job object */
 CLUSTERJOB *
@@ -37,8 +82,7 @@ CLUSTERJOB *
 cluster_job_create_id(CLUSTER *cluster, const char *str)
 {
 	CLUSTERJOB *job;
-	uuid_t uuid;
-	char uuidbuf[40], *s, *t;
+	char idbuf[CLUSTER_JOB_ID_LEN+1];
 	   
 	if(str && !cluster_job_id_valid_(str))
 	{
@@ -47,48 +91,130 @@ cluster_job_create_id(CLUSTER *cluster, const char *str)
 	}	
 	if(!str)
 	{
-#ifdef WITH_LIBUUID
-		uuid_generate(uuid);
-		uuid_unparse_lower(uuid, uuidbuf);
-		s = uuidbuf;
-		for(t = uuidbuf; *t; t++)
+		if(cluster_job_generate_id_(idbuf))
 		{
-			if(isalnum(*t))
-			{
-				*s = *t;
-				s++;
-			}
+			return NULL;
 		}
-		*s = 0;
-		str = uuidbuf;
-#else
-		errno = EINVAL;
-		return NULL;   
-#endif
+		str = idbuf;
 	}
-	job = (CLUSTERJOB *) calloc(1, sizeof(CLUSTERJOB));
+	job = cluster_job_alloc_(cluster, str);
 	if(!job)
 	{
 		return NULL;
 	}
-	job->cluster = cluster;	
-	strncpy(job->id, str, CLUSTER_JOB_ID_LEN);
-	job->id[CLUSTER_JOB_ID_LEN] = 0;
-	strncpy(job->tag, str, CLUSTER_JOB_TAG_LEN);
-	job->tag[CLUSTER_JOB_TAG_LEN] = 0;
-	job->total = 1;
-	if(cluster->type == CT_SQL)
+	if(cluster_job_record_(job))
 	{
-		if(cluster_sql_job_create_(job))
+		cluster_job_destroy(job);
+		return NULL;
+	}
+	return job;
+}
+
+/* Re-use a job object for a new job with a specific ID (or a generated one
+ * if str is NULL), as if it had been destroyed and a new one created
+ */
+int
+cluster_job_reset(CLUSTERJOB *job, const char *str)
+{
+	char idbuf[CLUSTER_JOB_ID_LEN+1];
+
+	if(str && !cluster_job_id_valid_(str))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!str)
+	{
+		if(cluster_job_generate_id_(idbuf))
+		{
+			return -1;
+		}
+		str = idbuf;
+	}
+	cluster_job_init_(job, job->cluster, str);
+	return cluster_job_record_(job);
+}
+
+/* Allocate a job object, without recording it */
+CLUSTERJOB *
+cluster_job_alloc_(CLUSTER *cluster, const char *id)
+{
+	CLUSTERJOBCACHE *cache;
+	CLUSTERJOB *job;
+
+	job = NULL;
+	cache = cluster_job_cache_();
+	if(cache)
+	{
+		if(!cache->count)
+		{
+			cluster_job_refill_(cache);
+		}
+		if(cache->count)
+		{
+			cache->count--;
+			job = cache->jobs[cache->count];
+		}
+	}
+	if(!job)
+	{
+		job = (CLUSTERJOB *) malloc(sizeof(CLUSTERJOB));
+		if(!job)
 		{
-			cluster_job_destroy(job);
 			return NULL;
 		}
 	}
-	cluster_job_logf(job, LOG_INFO, "created job %s\n", job->id);
+	cluster_job_init_(job, cluster, id);
 	return job;
 }
 
+/* Invoked after fork() in the child process, where the pool lock may have
+ * been held by another thread
+ */
+void
+cluster_job_reinit_(void)
+{
+#ifdef WITH_PTHREAD
+	pthread_mutex_init(&cluster_job_poollock_, NULL);
+#endif
+}
+
+/* Claim up to max waiting jobs for this member to process: the claimed jobs
+ * are placed in the ACTIVE state and returned (as job objects which must be
+ * destroyed by the caller) in out, which must have room for max entries.
+ * Returns the number of jobs claimed, or -1 on error.
+ */
+int
+cluster_job_claim(CLUSTER *cluster, int max, CLUSTERJOB **out)
+{
+#ifdef ENABLE_SQL
+	int c, count;
+#endif
+
+	if(max < 0 || (max && !out))
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	if(!max)
+	{
+		return 0;
+	}
+#ifdef ENABLE_SQL
+	if(cluster->type == CT_SQL)
+	{
+		count = cluster_sql_job_claim_(cluster, max, out);
+		for(c = 0; c < count; c++)
+		{
+			cluster_job_logf(out[c], LOG_INFO, "+++ job is now in state ACTIVE +++\n");
+		}
+		return count;
+	}
+#endif
+	errno = ENOTSUP;
+	return -1;
+}
+
 /* Create a job object with a name and a parent ID */
 CLUSTERJOB *
 cluster_job_create_id_name(CLUSTER *cluster, const char *parentid, const char *name)
@@ -119,8 +245,20 @@ cluster_job_create_job_name(CLUSTERJOB *parent, const char *name)
 int
 cluster_job_destroy(CLUSTERJOB *job)
 {
-	free(job->logbuf);
-	free(job);
+	CLUSTERJOBCACHE *cache;
+
+	cache = cluster_job_cache_();
+	if(!cache)
+	{
+		free(job);
+		return 0;
+	}
+	if(cache->count == CLUSTER_JOB_CACHE)
+	{
+		cluster_job_spill_(cache);
+	}
+	cache->jobs[cache->count] = job;
+	cache->count++;
 	return 0;
 }
 
@@ -147,7 +285,7 @@ cluster_job_set_parent_id(CLUSTERJOB *job, const char *parentstr)
 	{
 		cluster_job_logf(job, LOG_INFO, "job no longer has a parent\n");
 		job->parent[0] = 0;
-		return 0;
+		return cluster_job_changed_(job);
 	}
 	else if(parentstr && !cluster_job_id_valid_(parentstr))
 	{
@@ -157,7 +295,7 @@ cluster_job_set_parent_id(CLUSTERJOB *job, const char *parentstr)
 	strncpy(job->parent, parentstr, CLUSTER_JOB_ID_LEN);
 	job->parent[CLUSTER_JOB_ID_LEN] = 0;
 	cluster_job_logf(job, LOG_INFO, "job is now a child of %s\n", parentstr);
-	return 0;
+	return cluster_job_changed_(job);
 }
 
 /* Change the ID of a job, if possible */
@@ -188,6 +326,7 @@ cluster_job_set_total(CLUSTERJOB *job, int total)
 			job->progress = 0;
 		}
 		cluster_job_logf(job, LOG_INFO, "job progress %d/%d\n", job->progress, job->total);
+		return cluster_job_changed_(job);
 	}	
 	return 0;
 }
@@ -200,11 +339,13 @@ cluster_job_set_progress(CLUSTERJOB *job, int progress)
 		job->progress = progress;
 		job->total = progress;
 		cluster_job_logf(job, LOG_INFO, "job progress %d/%d\n", job->progress, job->total);
+		return cluster_job_changed_(job);
 	}
 	else if(job->progress != progress)
 	{
 		job->progress = progress;
 		cluster_job_logf(job, LOG_INFO, "job progress %d/%d\n", job->progress, job->total);
+		return cluster_job_changed_(job);
 	}
 	return 0;
 }
@@ -246,24 +387,30 @@ cluster_job_set(CLUSTERJOB *restrict job, const char *key, const char *value)
 int
 cluster_job_log(CLUSTERJOB *job, int prio, const char *message)
 {
-	cluster_logf_(job->cluster, prio, "[%s:%d/%d] %s", job->tag, job->progress + 1, job->total, message);
+	cluster_job_logf(job, prio, "%s", message);
 	return 0;
 }
 
 int
 cluster_job_vlogf(CLUSTERJOB *job, int prio, const char *format, va_list ap)
 {
-	if(!job->logbuf)
+	CLUSTERJOBCACHE *cache;
+
+	/* With asynchronous logging, the message is formatted directly into
+	 * the log ring
+	 */
+	if(cluster_log_async_(job->cluster, prio, job->tag, job->progress + 1, job->total, format, ap))
 	{
-		job->logbuf = (char *) calloc(1, CLUSTER_JOB_LOG_LEN + 1);
-		if(!job->logbuf)
-		{
-			cluster_logf_(job->cluster, LOG_CRIT, "failed to allocate buffer for job log messages\n");
-			return -1;
-		}
+		return 0;
+	}
+	cache = cluster_job_cache_();
+	if(!cache)
+	{
+		cluster_logf_(job->cluster, LOG_CRIT, "failed to allocate buffer for job log messages\n");
+		return -1;
 	}
-	vsnprintf(job->logbuf, CLUSTER_JOB_LOG_LEN, format, ap);
-	cluster_job_log(job, prio, job->logbuf);
+	vsnprintf(cache->logbuf, CLUSTER_JOB_LOG_LEN, format, ap);
+	cluster_logf_(job->cluster, prio, "[%s:%d/%d] %s", job->tag, job->progress + 1, job->total, cache->logbuf);
 	return 0;
 }
 
@@ -285,29 +432,234 @@ int
 cluster_job_wait(CLUSTERJOB *job)
 {
 	cluster_job_logf(job, LOG_INFO, "--- job is now in state WAIT ---\n");
-	return 0;
+	return cluster_job_set_status_(job, CJS_WAIT);
 }
 
 int
 cluster_job_begin(CLUSTERJOB *job)
 {
 	cluster_job_logf(job, LOG_INFO, "+++ job is now in state ACTIVE +++\n");
-	return 0;
+	return cluster_job_set_status_(job, CJS_ACTIVE);
 }
 
 int
 cluster_job_complete(CLUSTERJOB *job)
 {
 	cluster_job_logf(job, LOG_INFO, "--- job is now in state COMPLETE ---\n");
-	return 0;
+	return cluster_job_set_status_(job, CJS_COMPLETE);
 }
 
 int
 cluster_job_fail(CLUSTERJOB *job)
 {
 	cluster_job_logf(job, LOG_INFO, "*** job is now in state FAIL ***\n");
+	return cluster_job_set_status_(job, CJS_FAIL);
+}
+
+/* Obtain the name of a job state, as recorded in the cluster_job table */
+const char *
+cluster_job_status_name_(CLUSTERJOBSTATUS status)
+{
+	return cluster_job_status_names_[status];
+}
+
+/* Parse the name of a job state; returns -1 if it isn't recognised */
+int
+cluster_job_status_parse_(const char *name, CLUSTERJOBSTATUS *status)
+{
+	size_t c;
+
+	for(c = 0; c < sizeof(cluster_job_status_names_) / sizeof(cluster_job_status_names_[0]); c++)
+	{
+		if(name && !strcmp(name, cluster_job_status_names_[c]))
+		{
+			*status = (CLUSTERJOBSTATUS) c;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Change the state of a job */
+static int
+cluster_job_set_status_(CLUSTERJOB *job, CLUSTERJOBSTATUS status)
+{
+	job->status = status;
+	return cluster_job_changed_(job);
+}
+
+/* Invoked when the persistent state of a job (its parent, status, total or
+ * progress) has changed: with a SQL-based cluster, the change is queued to
+ * be written to the database.
+ */
+static int
+cluster_job_changed_(CLUSTERJOB *job)
+{
+#ifdef ENABLE_SQL
+	if(job->cluster->type == CT_SQL)
+	{
+		return cluster_sql_job_update_(job);
+	}
+#endif
+	return 0;
+}
+
+/* Generate a new job ID (the hexadecimal form of a UUID) */
+static int
+cluster_job_generate_id_(char *buf)
+{
+#ifdef WITH_LIBUUID
+	static const char hex[] = "0123456789abcdef";
+	uuid_t uuid;
+	size_t c;
+
+	uuid_generate(uuid);
+	for(c = 0; c < sizeof(uuid_t); c++)
+	{
+		buf[c * 2] = hex[uuid[c] >> 4];
+		buf[c * 2 + 1] = hex[uuid[c] & 15];
+	}
+	buf[c * 2] = 0;
 	return 0;
+#else
+	(void) buf;
+	errno = EINVAL;
+	return -1;
+#endif
+}
+
+/* Initialise a (new or re-used) job object */
+static void
+cluster_job_init_(CLUSTERJOB *job, CLUSTER *cluster, const char *id)
+{
+	memset(job, 0, sizeof(CLUSTERJOB));
+	job->cluster = cluster;	
+	strncpy(job->id, id, CLUSTER_JOB_ID_LEN);
+	job->id[CLUSTER_JOB_ID_LEN] = 0;
+	strncpy(job->tag, id, CLUSTER_JOB_TAG_LEN);
+	job->tag[CLUSTER_JOB_TAG_LEN] = 0;
+	job->total = 1;
+	job->status = CJS_WAIT;
+}
+
+/* Record a newly-created job */
+static int
+cluster_job_record_(CLUSTERJOB *job)
+{
+#ifdef ENABLE_SQL
+	if(job->cluster->type == CT_SQL)
+	{
+		if(cluster_sql_job_create_(job))
+		{
+			return -1;
+		}
+	}
+#endif
+	cluster_job_logf(job, LOG_INFO, "created job %s\n", job->id);
+	return 0;
+}
+
+/* Obtain the calling thread's job cache, creating it if needed */
+static CLUSTERJOBCACHE *
+cluster_job_cache_(void)
+{
+#ifdef WITH_PTHREAD
+	CLUSTERJOBCACHE *cache;
+
+	pthread_once(&cluster_job_cache_control_, cluster_job_cache_init_);
+	cache = (CLUSTERJOBCACHE *) pthread_getspecific(cluster_job_cache_key_);
+	if(!cache)
+	{
+		cache = (CLUSTERJOBCACHE *) calloc(1, sizeof(CLUSTERJOBCACHE));
+		if(!cache)
+		{
+			return NULL;
+		}
+		pthread_setspecific(cluster_job_cache_key_, cache);
+	}
+	return cache;
+#else
+	return &cluster_job_cache_static_;
+#endif
+}
+
+/* Move up to half a cache's worth of job objects from the pool to the
+ * (empty) cache
+ */
+static void
+cluster_job_refill_(CLUSTERJOBCACHE *cache)
+{
+	CLUSTERJOB *job;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_job_poollock_);
+#endif
+	while(cluster_job_pool_ && cache->count < CLUSTER_JOB_CACHE / 2)
+	{
+		job = cluster_job_pool_;
+		cluster_job_pool_ = job->next;
+		cluster_job_pooled_--;
+		cache->jobs[cache->count] = job;
+		cache->count++;
+	}
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_job_poollock_);
+#endif
+}
+
+/* Move half of the job objects in a (full) cache to the pool, freeing any
+ * for which the pool has no room
+ */
+static void
+cluster_job_spill_(CLUSTERJOBCACHE *cache)
+{
+	CLUSTERJOB *job;
+
+#ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_job_poollock_);
+#endif
+	while(cache->count > CLUSTER_JOB_CACHE / 2)
+	{
+		cache->count--;
+		job = cache->jobs[cache->count];
+		if(cluster_job_pooled_ < CLUSTER_JOB_POOL)
+		{
+			job->next = cluster_job_pool_;
+			cluster_job_pool_ = job;
+			cluster_job_pooled_++;
+		}
+		else
+		{
+			free(job);
+		}
+	}
+#ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_job_poollock_);
+#endif
+}
+
+#ifdef WITH_PTHREAD
+static void
+cluster_job_cache_init_(void)
+{
+	pthread_key_create(&cluster_job_cache_key_, cluster_job_cache_free_);
+}
+
+/* Free a thread's job cache when the thread exits */
+static void
+cluster_job_cache_free_(void *ptr)
+{
+	CLUSTERJOBCACHE *cache;
+
+	cache = (CLUSTERJOBCACHE *) ptr;
+	while(cache->count)
+	{
+		cache->count--;
+		free(cache->jobs[cache->count]);
+	}
+	free(cache);
 }
+#endif /*WITH_PTHREAD*/
 
 /* Determine if a job ID is valid */
 static int
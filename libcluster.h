@@ -19,11 +19,22 @@
 # define LIBCLUSTER_H_                 1
 
 # include <stdarg.h>
+# include <stddef.h>
+# include <stdint.h>
 
 typedef struct cluster_struct CLUSTER;
 typedef struct cluster_state_struct CLUSTERSTATE;
 typedef struct cluster_job_struct CLUSTERJOB;
+typedef struct cluster_histogram_struct CLUSTERHISTOGRAM;
+typedef struct cluster_stats_struct CLUSTERSTATS;
+typedef struct cluster_member_info_struct CLUSTERMEMBERINFO;
+typedef struct cluster_members_struct CLUSTERMEMBERS;
+typedef struct cluster_range_struct CLUSTERRANGE;
+typedef struct cluster_diff_struct CLUSTERDIFF;
+typedef struct cluster_trace_struct CLUSTERTRACE;
 typedef int (*CLUSTERBALANCE)(CLUSTER *cluster, CLUSTERSTATE *state);
+typedef int (*CLUSTERDIFFBALANCE)(CLUSTER *cluster, CLUSTERSTATE *state, const CLUSTERDIFF *diff);
+typedef void (*CLUSTERTRACER)(CLUSTER *cluster, const CLUSTERTRACE *trace);
 
 /* Enumeration for how libcluster should behave when the process invokes
  * fork()
@@ -37,7 +48,12 @@ typedef enum
 	/* The cluster membership shall continue in both the parent and the child,
 	 * with the child being assigned a new node UUID
 	 */
-	CLUSTER_FORK_BOTH = (1<<2)
+	CLUSTER_FORK_BOTH = (1<<2),
+	/* The cluster membership shall continue in the parent, and each child
+	 * shall be leased one of the parent's workers, without joining the
+	 * registry itself
+	 */
+	CLUSTER_FORK_POOL = (1<<3)
 } CLUSTERFORK;
 
 /* A cluster member state structure, passed to the balancing callback when
@@ -56,6 +72,158 @@ struct cluster_state_struct
 	int passive;
 };
 
+/* A member of the cluster, as listed by cluster_members() */
+struct cluster_member_info_struct
+{
+	/* The member's instance identifier */
+	const char *instid;
+	/* The index of the member's first worker, and its worker count */
+	int base;
+	int workers;
+	/* The capacity weight of each of the member's workers */
+	int weight;
+};
+
+/* The members of the cluster in index order, as obtained (and retained)
+ * by cluster_members(); the list is immutable, and remains valid until it
+ * is released with cluster_members_release()
+ */
+struct cluster_members_struct
+{
+	/* Advances each time the membership changes */
+	unsigned long generation;
+	/* The total number of workers across the whole cluster */
+	int total;
+	/* The sum of the weights of all of those workers */
+	int capacity;
+	size_t count;
+	const CLUSTERMEMBERINFO *members;
+};
+
+/* A range of worker indices */
+struct cluster_range_struct
+{
+	int base;
+	int count;
+};
+
+/* The changes to this member's worker indices, passed to the callback set
+ * with cluster_set_diff_balancer() along with its new state
+ */
+struct cluster_diff_struct
+{
+	/* The state passed to the previous invocation (with an index of -1
+	 * and no workers for the first)
+	 */
+	CLUSTERSTATE previous;
+	/* The index ranges belonging to this member now but not previously,
+	 * and those which belonged to it previously but no longer do
+	 */
+	size_t ngained;
+	CLUSTERRANGE gained[2];
+	size_t nlost;
+	CLUSTERRANGE lost[2];
+	/* The current membership, or NULL if there is none (for example, in a
+	 * static cluster); valid until the callback returns
+	 */
+	const CLUSTERMEMBERS *members;
+};
+
+/* The largest capacity weight which may be given to a member's workers */
+# define CLUSTER_MAX_WEIGHT            64
+
+/* The points at which trace events are generated: see cluster_set_tracer() */
+typedef enum
+{
+	/* A refresh of this member's registry entry */
+	CLUSTER_TRACE_PING,
+	/* A housekeeping thread was woken by a possible change to the
+	 * membership
+	 */
+	CLUSTER_TRACE_WAKE,
+	/* The membership was read in full from the registry */
+	CLUSTER_TRACE_FETCH,
+	/* A balancing pass */
+	CLUSTER_TRACE_BALANCE,
+	/* An invocation of the balancing callbacks */
+	CLUSTER_TRACE_REBALANCE,
+	/* A contended acquisition of the cluster's lock, the duration being
+	 * the time spent waiting for it
+	 */
+	CLUSTER_TRACE_LOCK,
+	/* The release of a write lock, the duration being the time for which
+	 * it was held
+	 */
+	CLUSTER_TRACE_UNLOCK
+} CLUSTERTRACEPOINT;
+
+/* A trace event, passed to the callback set with cluster_set_tracer() */
+struct cluster_trace_struct
+{
+	CLUSTERTRACEPOINT point;
+	/* When the operation began, in microseconds from an arbitrary epoch,
+	 * and how long it took (zero for instantaneous events)
+	 */
+	uint64_t start_us;
+	uint64_t duration_us;
+	/* The state generation (see cluster_state_generation()) when the
+	 * event was generated
+	 */
+	unsigned long generation;
+	/* Zero if the operation succeeded, or -1 if it failed; for lock
+	 * acquisitions, 1 for a write lock and 0 for a read lock
+	 */
+	int result;
+};
+
+/* Number of buckets in a latency histogram */
+# define CLUSTER_STATS_BUCKETS         32
+
+/* A histogram of the durations of an operation, in microseconds: bucket 0
+ * counts operations which took less than a microsecond, and bucket n those
+ * which took at least 2^(n-1) but less than 2^n microseconds; the last
+ * bucket also counts any which took longer.
+ */
+struct cluster_histogram_struct
+{
+	/* The number of operations recorded */
+	uint64_t count;
+	/* The total and longest durations of those operations */
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t buckets[CLUSTER_STATS_BUCKETS];
+};
+
+/* Runtime statistics for a cluster, maintained by its housekeeping
+ * threads; all values increase monotonically for the life of the cluster
+ */
+struct cluster_stats_struct
+{
+	/* Refreshes of this member's entry in the registry */
+	CLUSTERHISTOGRAM ping;
+	/* Balancing passes: reading the membership (where the engine does so
+	 * each time) and determining this member's index
+	 */
+	CLUSTERHISTOGRAM balance;
+	/* Invocations of the balancing callback */
+	CLUSTERHISTOGRAM rebalance;
+	/* Waits to acquire the cluster's lock (uncontended acquisitions are
+	 * not recorded)
+	 */
+	CLUSTERHISTOGRAM lock_wait;
+	/* The number of times the balancer was woken by a possible change to
+	 * the membership, and the number of balancing passes which found that
+	 * the membership had actually changed
+	 */
+	uint64_t wakeups;
+	uint64_t changes;
+	/* The number of registry operations which failed, and the number which
+	 * were rescheduled to be re-attempted as a result
+	 */
+	uint64_t errors;
+	uint64_t retries;
+};
+
 /* Create a new cluster connection */
 CLUSTER *cluster_create(const char *key);
 
@@ -124,23 +292,153 @@ int cluster_workers(CLUSTER *cluster);
 /* Set the number of worker this cluster member has */
 int cluster_set_workers(CLUSTER *cluster, int nworkers);
 
+/* Get the capacity weight of each of this member's workers */
+int cluster_weight(CLUSTER *cluster);
+
+/* Set the capacity weight of each of this member's workers (from 1, the
+ * default, to CLUSTER_MAX_WEIGHT): the share of the keys owned by a worker
+ * is proportional to its weight, while indices and totals continue to
+ * count each worker once
+ */
+int cluster_set_weight(CLUSTER *cluster, int weight);
+
 /* Atomically obtain the current cluster state */
 int cluster_state(CLUSTER *cluster, CLUSTERSTATE *statebuf);
 
-/* Set the registry endpoint URI; NULL indicates this is a static cluster */
+/* Obtain a counter which changes whenever the cluster state does; callers
+ * can compare it against a previously-obtained value to determine whether
+ * any data derived from the cluster state must be recalculated
+ */
+unsigned long cluster_state_generation(CLUSTER *cluster);
+
+/* Determine whether the current cluster state was restored from a
+ * warm-start snapshot and has not yet been confirmed by the registry (see
+ * cluster_set_snapshot())
+ */
+int cluster_provisional(CLUSTER *cluster);
+
+/* Determine the index of the worker (across the whole cluster) which owns
+ * a key, given a 64-bit hash of it, or -1 if not joined. Ownership is
+ * assigned by consistent hashing, so that a member joining or leaving
+ * moves only a proportionate share of the keyspace between workers.
+ */
+int cluster_owner(CLUSTER *cluster, uint64_t hash);
+
+/* Determine whether the given worker of this member owns a key, given a
+ * 64-bit hash of it
+ */
+int cluster_owns(CLUSTER *cluster, int worker, uint64_t hash);
+
+/* Determine which of a batch of n keys (given their 64-bit hashes) are
+ * owned by the given worker of this member, setting mask_out[i] to 1 if
+ * hashes[i] is owned and 0 if not; returns the number of keys owned. The
+ * whole batch is resolved against a single consistent snapshot.
+ */
+size_t cluster_filter_owned(CLUSTER *cluster, int worker, const uint64_t *hashes, size_t n, uint8_t *mask_out);
+
+/* As cluster_filter_owned(), but write the positions of the owned keys
+ * within hashes to index_out (which must have room for n entries) and
+ * return the number written
+ */
+size_t cluster_compact_owned(CLUSTER *cluster, int worker, const uint64_t *hashes, size_t n, size_t *index_out);
+
+/* Obtain the current membership, which must be released with
+ * cluster_members_release(); returns NULL if there is none (for example,
+ * because the cluster hasn't been joined, or is a static cluster)
+ */
+CLUSTERMEMBERS *cluster_members(CLUSTER *cluster);
+
+/* Release a membership list obtained with cluster_members() */
+void cluster_members_release(CLUSTERMEMBERS *members);
+
+/* Set the registry endpoint URI; NULL indicates this is a static cluster.
+ * For etcd registries, this may be a comma-separated list of the URIs of
+ * equivalent endpoints, amongst which requests are distributed according
+ * to their responsiveness
+ */
 int cluster_set_registry(CLUSTER *cluster, const char *uri);
 
+/* Set the connection and request timeouts, in milliseconds, of requests
+ * made to an etcd registry, after which they are re-sent to another
+ * endpoint if there is one (defaults are 2000 and 0; zero for none)
+ */
+int cluster_set_registry_timeouts(CLUSTER *cluster, int connect, int request);
+
+/* Set the path of a warm-start snapshot file, to which this member's state
+ * is written whenever the cluster is re-balanced; if, when joining, the
+ * file holds a state for the same cluster written no more than maxage
+ * seconds earlier (zero for no limit), the join completes asynchronously
+ * and that state is reported (flagged as provisional, see
+ * cluster_provisional()) until the registry
+ * has confirmed or corrected it. NULL disables the snapshot.
+ */
+int cluster_set_snapshot(CLUSTER *cluster, const char *path, int maxage);
+
+/* Set the name of a host state segment (a POSIX shared memory object) into
+ * which this member publishes the membership whenever it changes, so that
+ * other processes on the host can join passively with a registry URI of
+ * "host:NAME" instead of contacting the registry. NULL disables publication.
+ */
+int cluster_set_host_state(CLUSTER *cluster, const char *name);
+
 /* Set the logging callback */
 int cluster_set_logger(CLUSTER *cluster, void (*logger)(int priority, const char *format, va_list ap));
 
+/* Set whether log messages are passed to the logging callback by a
+ * background thread (rather than by the thread which logs them), so that
+ * logging never blocks; messages are discarded if too many are waiting
+ */
+int cluster_set_async_logging(CLUSTER *cluster, int async);
+
+/* Obtain the number of log messages discarded by asynchronous logging */
+unsigned long cluster_log_dropped(CLUSTER *cluster);
+
+/* Obtain the cluster's runtime statistics; each value is read atomically,
+ * but they are not a consistent snapshot of one another
+ */
+int cluster_stats(CLUSTER *cluster, CLUSTERSTATS *out);
+
+/* Set a callback which is passed an event at each of the trace points
+ * (CLUSTER_TRACE_xxx), or NULL for none. The callback is invoked by
+ * whichever thread generated the event, possibly with the cluster
+ * read-locked (events which end while it is write-locked are passed on
+ * once it has been unlocked), and so must not invoke any libcluster
+ * functions.
+ */
+int cluster_set_tracer(CLUSTER *cluster, CLUSTERTRACER tracer);
+
 /* Set the callback invoked when this member's status within the cluster
  * has changed
  */
 int cluster_set_balancer(CLUSTER *cluster, CLUSTERBALANCE callback);
 
+/* Set a callback invoked (after the balancing callback) whenever this
+ * member's status within the cluster has changed, which is also passed
+ * the worker indices gained and lost since it was last invoked
+ */
+int cluster_set_diff_balancer(CLUSTER *cluster, CLUSTERDIFFBALANCE callback);
+
+/* Set the re-balancing settle window: changes which arrive within delay
+ * seconds of one another are applied together, with a single invocation
+ * of the balancing callback, but never more than limit seconds after the
+ * first of them (default is zero, re-balancing immediately)
+ */
+int cluster_set_rebalance_delay(CLUSTER *cluster, int delay, int limit);
+
 /* Set the fork behaviour (default is CLUSTER_FORK_CHILD) */
 int cluster_set_fork(CLUSTER *cluster, CLUSTERFORK mode);
 
+/* Set whether housekeeping is performed by a thread shared between all
+ * clusters which enable it (rather than by threads of its own)
+ */
+int cluster_set_shared_housekeeping(CLUSTER *cluster, int shared);
+
+/* Set whether members claim stable slots, which are retained while they
+ * remain members, and are assigned indices in slot order (rather than in
+ * order of instance identifier); all of a cluster's members should agree
+ */
+int cluster_set_stable_slots(CLUSTER *cluster, int enable);
+
 /** Static clustering support **/
 
 /* Set the numeric index of this member (0..n) */
@@ -163,6 +461,16 @@ CLUSTERJOB *cluster_job_create_id_name(CLUSTER *cluster, const char *parentid, c
 /* Create a job object with a name and a parent job */
 CLUSTERJOB *cluster_job_create_job_name(CLUSTERJOB *parent, const char *name);
 
+/* Claim up to max waiting jobs, placing them in the ACTIVE state; returns
+ * the number of jobs claimed, which must be destroyed by the caller
+ */
+int cluster_job_claim(CLUSTER *cluster, int max, CLUSTERJOB **out);
+
+/* Re-use a job object for a new job (with a generated ID if id is NULL),
+ * as if it had been destroyed and another created
+ */
+int cluster_job_reset(CLUSTERJOB *job, const char *id);
+
 /* Destroy a job object */
 int cluster_job_destroy(CLUSTERJOB *job);
 
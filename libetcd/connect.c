@@ -21,34 +21,62 @@
 
 #include "p_libetcd.h"
 
-struct etcd_data_struct
-{
-	CURL *ch;
-	char *buf;
-	size_t size, len;
-};
-
 static size_t etcd_payload_(char *ptr, size_t size, size_t nmemb, void *userdata);
+static size_t etcd_header_(char *ptr, size_t size, size_t nmemb, void *userdata);
+static int etcd_error_code_(struct etcd_data_struct *data);
+static int etcd_curl_result_(CURL *ch, CURLcode c, struct etcd_data_struct *data, ETCDINDEX *index);
 static size_t etcd_sink_(char *ptr, size_t size, size_t nmemb, void *userdata);
+static int etcd_progress_(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+static ETCDSHARE *etcd_share_create_(void);
+static ETCDSHARE *etcd_share_ref_(ETCDSHARE *share);
+static void etcd_share_unref_(ETCDSHARE *share);
+static void etcd_share_lock_(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr);
+static void etcd_share_unlock_(CURL *handle, curl_lock_data data, void *userptr);
+static ETCD *etcd_connect_list_(const char *url, ETCD *(*connect)(const URI *uri));
 
+/* Connect to etcd given a URL, or a comma-separated list of the URLs of
+ * equivalent endpoints (see endpoint.c)
+ */
 ETCD *
 etcd_connect(const char *url)
 {
-	URI *uri;
+	return etcd_connect_list_(url, etcd_connect_uri);
+}
+
+ETCD *
+etcd_connect_uri(const URI *uri)
+{
 	ETCD *p;
 
-	uri = uri_create_str(url, NULL);
-	if(!uri)
+	p = (ETCD *) calloc(1, sizeof(ETCD));
+	if(!p)
 	{
 		return NULL;
 	}
-	p = etcd_connect_uri(uri);
-	uri_destroy(uri);
+	p->uri = uri_create_str("/v2/keys/", uri);
+	if(!p->uri)
+	{
+		free(p);
+		return NULL;
+	}
+	p->share = etcd_share_create_();
+	if(etcd_init_(p, NULL))
+	{
+		etcd_destroy_(p);
+		return NULL;
+	}
 	return p;
 }
 
+/* Connect to the etcd v3 API (see v3.c), as etcd_connect() */
 ETCD *
-etcd_connect_uri(const URI *uri)
+etcd3_connect(const char *url)
+{
+	return etcd_connect_list_(url, etcd3_connect_uri);
+}
+
+ETCD *
+etcd3_connect_uri(const URI *uri)
 {
 	ETCD *p;
 
@@ -57,12 +85,18 @@ etcd_connect_uri(const URI *uri)
 	{
 		return NULL;
 	}
-	p->uri = uri_create_str("/v2/keys/", uri);
+	p->uri = uri_create_str("/v3/", uri);
 	if(!p->uri)
 	{
 		free(p);
 		return NULL;
 	}
+	p->share = etcd_share_create_();
+	if(etcd_init_(p, NULL))
+	{
+		etcd_destroy_(p);
+		return NULL;
+	}
 	return p;
 }
 
@@ -82,7 +116,11 @@ etcd_clone(ETCD *etcd)
 		free(p);
 		return NULL;
 	}
-	p->verbose = etcd->verbose;
+	if(etcd_init_(p, etcd))
+	{
+		etcd_destroy_(p);
+		return NULL;
+	}
 	return p;
 }
 
@@ -90,11 +128,7 @@ etcd_clone(ETCD *etcd)
 void
 etcd_disconnect(ETCD *etcd)
 {
-	if(etcd && etcd->uri)
-	{
-		uri_destroy(etcd->uri);
-	}
-	free(etcd);
+	etcd_destroy_(etcd);
 }
 
 int
@@ -104,72 +138,379 @@ etcd_set_verbose(ETCD *etcd, int verbose)
 	return 0;
 }
 
-CURL *
-etcd_curl_create_(ETCD *etcd, URI *uri, const char *query)
+/* Set the function used to determine whether requests made via this handle
+ * (and those subsequently derived from it) should be abandoned; this allows
+ * long-running requests, such as waiting for changes, to be interrupted.
+ * An abandoned request fails as any other would.
+ */
+int
+etcd_set_cancel(ETCD *etcd, ETCDCANCELFN fn, void *data)
 {
-	char *uristr, *buf;
-	CURL *ch;
+	etcd->cancel = fn;
+	etcd->canceldata = data;
+	return 0;
+}
 
-	(void) etcd;
+/* Set the connection and request timeouts, in milliseconds (zero for none,
+ * the default), for requests made via this handle (and those subsequently
+ * derived from it). Requests which wait for changes are only subject to the
+ * connection timeout. A request which times out is re-sent to another
+ * endpoint, if there are any.
+ */
+int
+etcd_set_timeouts(ETCD *etcd, long connect, long request)
+{
+	etcd->connect_timeout = connect;
+	etcd->request_timeout = request;
+	return 0;
+}
 
-	uristr = uri_stralloc(uri);
-	if(!uristr)
+/* Finish initialising a newly-allocated handle whose URI has been set,
+ * inheriting settings (and the connection share) from parent, if supplied.
+ */
+int
+etcd_init_(ETCD *etcd, ETCD *parent)
+{
+	etcd->pid = getpid();
+	etcd->endpoint = -1;
+	if(parent)
 	{
-		return NULL;
+		etcd->verbose = parent->verbose;
+		etcd->cancel = parent->cancel;
+		etcd->canceldata = parent->canceldata;
+		etcd->connect_timeout = parent->connect_timeout;
+		etcd->request_timeout = parent->request_timeout;
+		etcd->endpoints = etcd_endpoints_ref_(parent->endpoints);
+		if(parent->pid == etcd->pid)
+		{
+			etcd->share = etcd_share_ref_(parent->share);
+		}
 	}
-	if(query)
+	etcd->url = uri_stralloc(etcd->uri);
+	if(!etcd->url)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Release a handle and its resources */
+void
+etcd_destroy_(ETCD *etcd)
+{
+	if(!etcd)
+	{
+		return;
+	}
+	if(etcd->pid == getpid())
+	{
+		if(etcd->ch)
+		{
+			curl_easy_cleanup(etcd->ch);
+		}
+		etcd_share_unref_(etcd->share);
+	}
+	etcd_endpoints_unref_(etcd->endpoints);
+	if(etcd->uri)
+	{
+		uri_destroy(etcd->uri);
+	}
+	free(etcd->url);
+	free(etcd->urlbuf);
+	free(etcd->buf);
+	free(etcd);
+}
+
+/* Connect to the first of a comma-separated list of endpoint URLs using
+ * connect, with the remainder as alternatives
+ */
+static ETCD *
+etcd_connect_list_(const char *url, ETCD *(*connect)(const URI *uri))
+{
+	const char *next;
+	char *first;
+	URI *uri;
+	ETCD *p;
+
+	first = NULL;
+	next = strchr(url, ',');
+	if(next)
 	{
-		buf = (char *) calloc(1, strlen(uristr) + strlen(query) + 2);
-		if(!buf)
+		first = (char *) calloc(1, (size_t) (next - url) + 1);
+		if(!first)
 		{
-			free(uristr);
 			return NULL;
 		}
-		strcpy(buf, uristr);
-		strcat(buf, "?");
-		strcat(buf, query);
-		free(uristr);
-		uristr = buf;
+		memcpy(first, url, (size_t) (next - url));
 	}
-	ch = curl_easy_init();
-	if(!ch)
+	uri = uri_create_str((first ? first : url), NULL);
+	free(first);
+	if(!uri)
+	{
+		return NULL;
+	}
+	p = connect(uri);
+	uri_destroy(uri);
+	if(p && next && etcd_endpoints_create_(p, next + 1))
 	{
-		free(uristr);
+		etcd_destroy_(p);
 		return NULL;
 	}
-	curl_easy_setopt(ch, CURLOPT_VERBOSE, (int) (etcd->verbose));
-	curl_easy_setopt(ch, CURLOPT_URL, uristr);
+	return p;
+}
+
+/* Create a connection share, allowing handles derived from the same
+ * connection to share a DNS cache, TLS sessions and (where supported by
+ * libcurl) live connections. Returns NULL (which is not fatal) if a share
+ * cannot be created.
+ */
+static ETCDSHARE *
+etcd_share_create_(void)
+{
+	ETCDSHARE *share;
+	size_t n;
+
+	share = (ETCDSHARE *) calloc(1, sizeof(ETCDSHARE));
+	if(!share)
+	{
+		return NULL;
+	}
+	share->sh = curl_share_init();
+	if(!share->sh)
+	{
+		free(share);
+		return NULL;
+	}
+	pthread_mutex_init(&(share->lock), NULL);
+	for(n = 0; n < ETCD_SHARE_LOCKS; n++)
+	{
+		pthread_mutex_init(&(share->data[n]), NULL);
+	}
+	share->refcount = 1;
+	curl_share_setopt(share->sh, CURLSHOPT_LOCKFUNC, etcd_share_lock_);
+	curl_share_setopt(share->sh, CURLSHOPT_UNLOCKFUNC, etcd_share_unlock_);
+	curl_share_setopt(share->sh, CURLSHOPT_USERDATA, (void *) share);
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+# if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(share->sh, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+# endif
+	return share;
+}
+
+static ETCDSHARE *
+etcd_share_ref_(ETCDSHARE *share)
+{
+	if(share)
+	{
+		pthread_mutex_lock(&(share->lock));
+		share->refcount++;
+		pthread_mutex_unlock(&(share->lock));
+	}
+	return share;
+}
+
+static void
+etcd_share_unref_(ETCDSHARE *share)
+{
+	int r;
+	size_t n;
+
+	if(!share)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(share->lock));
+	share->refcount--;
+	r = share->refcount;
+	pthread_mutex_unlock(&(share->lock));
+	if(r)
+	{
+		return;
+	}
+	curl_share_cleanup(share->sh);
+	pthread_mutex_destroy(&(share->lock));
+	for(n = 0; n < ETCD_SHARE_LOCKS; n++)
+	{
+		pthread_mutex_destroy(&(share->data[n]));
+	}
+	free(share);
+}
+
+static void
+etcd_share_lock_(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+	ETCDSHARE *share;
+
+	(void) handle;
+	(void) access;
+
+	share = (ETCDSHARE *) userptr;
+	pthread_mutex_lock(&(share->data[data % ETCD_SHARE_LOCKS]));
+}
+
+static void
+etcd_share_unlock_(CURL *handle, curl_lock_data data, void *userptr)
+{
+	ETCDSHARE *share;
+
+	(void) handle;
+
+	share = (ETCDSHARE *) userptr;
+	pthread_mutex_unlock(&(share->data[data % ETCD_SHARE_LOCKS]));
+}
+
+/* Obtain the handle's curl easy handle, prepared for a new request to url
+ * (optionally with the name of an entry and a query-string appended).
+ *
+ * The easy handle is owned by the ETCD object and re-used for each request,
+ * so that the connection to the server can be kept alive between them.
+ * The cached URL string for the handle is usually passed as url, avoiding
+ * re-serialising the URI on every request.
+ */
+CURL *
+etcd_curl_create_(ETCD *etcd, const char *url, const char *name, const char *query)
+{
+	CURL *ch;
+	size_t l;
+	char *p;
+
+	if(etcd->pid != getpid())
+	{
+		/* The handle was inherited across fork(): its connections belong to
+		 * the parent and must not be used or closed by the child, so simply
+		 * abandon them.
+		 */
+		etcd->ch = NULL;
+		etcd->share = NULL;
+		etcd->pid = getpid();
+	}
+	/* Each character of the name may need to be percent-encoded */
+	l = strlen(url) + (name ? strlen(name) * 3 : 0) + (query ? strlen(query) + 1 : 0) + 1;
+	if(l > etcd->urlbufsize)
+	{
+		p = (char *) realloc(etcd->urlbuf, l);
+		if(!p)
+		{
+			return NULL;
+		}
+		etcd->urlbuf = p;
+		etcd->urlbufsize = l;
+	}
+	p = etcd->urlbuf;
+	strcpy(p, url);
+	p += strlen(p);
+	if(name)
+	{
+		while(*name == '/')
+		{
+			name++;
+		}
+		for(; *name; name++)
+		{
+			if(isalnum((unsigned char) *name) || strchr("-._~/", *name))
+			{
+				*p = *name;
+				p++;
+				continue;
+			}
+			p += sprintf(p, "%%%02X", (unsigned char) *name);
+		}
+	}
+	if(query)
+	{
+		*p = '?';
+		p++;
+		strcpy(p, query);
+	}
+	else
+	{
+		*p = 0;
+	}
+	if(etcd->ch)
+	{
+		/* Resetting the handle discards the options from the previous
+		 * request, but retains any live connections and caches
+		 */
+		ch = etcd->ch;
+		curl_easy_reset(ch);
+	}
+	else
+	{
+		ch = curl_easy_init();
+		if(!ch)
+		{
+			return NULL;
+		}
+		etcd->ch = ch;
+	}
+	curl_easy_setopt(ch, CURLOPT_VERBOSE, (long) (etcd->verbose ? 1 : 0));
+	curl_easy_setopt(ch, CURLOPT_URL, etcd->urlbuf);
 	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, etcd_sink_);
-	free(uristr);
+	curl_easy_setopt(ch, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(ch, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(ch, CURLOPT_CONNECTTIMEOUT_MS, etcd->connect_timeout);
+	curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, etcd->request_timeout);
+	/* Allows the synchronous request functions, which are passed only the
+	 * easy handle, to locate the ETCD object
+	 */
+	curl_easy_setopt(ch, CURLOPT_PRIVATE, (void *) etcd);
+	etcd->longpoll = 0;
+	etcd->failover = 0;
+	etcd->idempotent = 1;
+	etcd_endpoint_select_(etcd, ch, 0);
+	if(etcd->share)
+	{
+		curl_easy_setopt(ch, CURLOPT_SHARE, etcd->share->sh);
+	}
+	if(etcd->cancel)
+	{
+		/* libcurl invokes the progress callback at least once per second,
+		 * even if no data is being transferred
+		 */
+		curl_easy_setopt(ch, CURLOPT_XFERINFOFUNCTION, etcd_progress_);
+		curl_easy_setopt(ch, CURLOPT_XFERINFODATA, (void *) etcd);
+		curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 0L);
+	}
 	return ch;
 }
 
+/* Indicate that the request made using ch has completed. The handle itself
+ * remains owned by the ETCD object for re-use.
+ */
 void
-etcd_curl_done_(CURL *ch)
+etcd_curl_done_(ETCD *etcd, CURL *ch)
 {
-	curl_easy_cleanup(ch);
+	(void) etcd;
+
+	if(ch)
+	{
+		curl_easy_setopt(ch, CURLOPT_POSTFIELDS, NULL);
+	}
 }
 
 CURL *
-etcd_curl_put_(ETCD *etcd, URI *uri, const char *data, const char *query)
+etcd_curl_put_(ETCD *etcd, const char *url, const char *name, const char *data, const char *query)
 {
 	CURL *ch;
 
-	if(!(ch = etcd_curl_create_(etcd, uri, query)))
+	if(!(ch = etcd_curl_create_(etcd, url, name, query)))
 	{
 		return NULL;
 	}
 	curl_easy_setopt(ch, CURLOPT_POSTFIELDS, (char *) data);
 	curl_easy_setopt(ch, CURLOPT_CUSTOMREQUEST, "PUT");
+	/* Creating an entry which must not already exist fails if repeated */
+	etcd->idempotent = !(query && strstr(query, "prevExist=false"));
 	return ch;
 }
 
 CURL *
-etcd_curl_delete_(ETCD *etcd, URI *uri, const char *query)
+etcd_curl_delete_(ETCD *etcd, const char *url, const char *name, const char *query)
 {
 	CURL *ch;
 
-	if(!(ch = etcd_curl_create_(etcd, uri, query)))
+	if(!(ch = etcd_curl_create_(etcd, url, name, query)))
 	{
 		return NULL;
 	}
@@ -182,8 +523,19 @@ etcd_curl_perform_(CURL *ch)
 {
 	CURLcode c;
 	long status;
+	void *etcd;
 
-	c = curl_easy_perform(ch);
+	if(!ch)
+	{
+		return -1;
+	}
+	etcd = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, &etcd);
+	if(!etcd)
+	{
+		return -1;
+	}
+	c = etcd_curl_exec_((ETCD *) etcd, ch);
 	if(c != CURLE_OK)
 	{
 		return c;
@@ -204,41 +556,237 @@ etcd_curl_perform_(CURL *ch)
 int
 etcd_curl_perform_json_(CURL *ch, json_t **dict)
 {
-	CURLcode c;
-	long status;
+	return etcd_curl_perform_json_index_(ch, dict, NULL);
+}
+
+/* Perform a request and parse the JSON response; if index is non-NULL, it
+ * will be set to the value of the X-Etcd-Index response header (or zero if
+ * none was sent). If etcd reports an error, its errorCode is returned.
+ */
+int
+etcd_curl_perform_json_index_(CURL *ch, json_t **dict, ETCDINDEX *index)
+{
 	struct etcd_data_struct data;
+	void *etcd;
 
 	*dict = NULL;
-	memset(&data, 0, sizeof(data));
-	data.ch = ch;
-	curl_easy_setopt(data.ch, CURLOPT_WRITEFUNCTION, etcd_payload_);
-	curl_easy_setopt(data.ch, CURLOPT_WRITEDATA, (void *) &data);
-	c = curl_easy_perform(ch);
+	if(index)
+	{
+		*index = 0;
+	}
+	if(!ch)
+	{
+		return -1;
+	}
+	etcd = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, &etcd);
+	if(!etcd)
+	{
+		return -1;
+	}
+	etcd_curl_borrow_((ETCD *) etcd, ch, &data);
+	return etcd_curl_result_json_(ch, etcd_curl_exec_((ETCD *) etcd, ch), &data, dict, index);
+}
+
+/* Perform a request, leaving a successful response's payload in data for
+ * the caller to process and then release with etcd_curl_release_(); returns
+ * as etcd_curl_perform_json_index_(), with the payload already released if
+ * the request was unsuccessful.
+ */
+int
+etcd_curl_perform_payload_(CURL *ch, struct etcd_data_struct *data, ETCDINDEX *index)
+{
+	void *etcd;
+
+	memset(data, 0, sizeof(struct etcd_data_struct));
+	if(index)
+	{
+		*index = 0;
+	}
+	if(!ch)
+	{
+		return -1;
+	}
+	etcd = NULL;
+	curl_easy_getinfo(ch, CURLINFO_PRIVATE, &etcd);
+	if(!etcd)
+	{
+		return -1;
+	}
+	etcd_curl_borrow_((ETCD *) etcd, ch, data);
+	return etcd_curl_result_(ch, etcd_curl_exec_((ETCD *) etcd, ch), data, index);
+}
+
+/* Obtain the handle used to perform an asynchronous request */
+CURL *
+etcd_request_handle(ETCDREQUEST *request)
+{
+	return request->ch;
+}
+
+/* Complete an asynchronous request which has been performed, given its
+ * outcome, and free it; returns as etcd_curl_perform_json_()
+ */
+int
+etcd_request_finish(ETCDREQUEST *request, CURLcode result, json_t **out)
+{
+	int r;
+
+	etcd_curl_outcome_(request->etcd, request->ch, result);
+	r = etcd_curl_result_json_(request->ch, result, &(request->data), out, NULL);
+	etcd_curl_done_(request->etcd, request->ch);
+	free(request->body);
+	free(request);
+	return r;
+}
+
+/* Abandon an asynchronous request which has not completed (and which must
+ * no longer be in use by the caller), and free it
+ */
+void
+etcd_request_cancel(ETCDREQUEST *request)
+{
+	json_t *dummy;
+
+	etcd_curl_result_json_(request->ch, CURLE_ABORTED_BY_CALLBACK, &(request->data), &dummy, NULL);
+	etcd_curl_done_(request->etcd, request->ch);
+	free(request->body);
+	free(request);
+}
+
+/* Prepare to capture the response to a request made using ch in data */
+void
+etcd_curl_capture_(CURL *ch, struct etcd_data_struct *data)
+{
+	memset(data, 0, sizeof(struct etcd_data_struct));
+	data->ch = ch;
+	curl_easy_setopt(ch, CURLOPT_WRITEFUNCTION, etcd_payload_);
+	curl_easy_setopt(ch, CURLOPT_WRITEDATA, (void *) data);
+	curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, etcd_header_);
+	curl_easy_setopt(ch, CURLOPT_HEADERDATA, (void *) data);
+}
+
+/* As etcd_curl_capture_(), but capturing into the handle's own buffer,
+ * which the handle relinquishes until etcd_curl_release_() is invoked
+ */
+void
+etcd_curl_borrow_(ETCD *etcd, CURL *ch, struct etcd_data_struct *data)
+{
+	etcd_curl_capture_(ch, data);
+	if(etcd)
+	{
+		data->owner = etcd;
+		data->buf = etcd->buf;
+		data->size = etcd->bufsize;
+		etcd->buf = NULL;
+		etcd->bufsize = 0;
+	}
+}
+
+/* Release the payload captured in data */
+void
+etcd_curl_release_(struct etcd_data_struct *data)
+{
+	if(data->owner && !data->owner->buf)
+	{
+		data->owner->buf = data->buf;
+		data->owner->bufsize = data->size;
+	}
+	else
+	{
+		free(data->buf);
+	}
+	data->buf = NULL;
+	data->size = data->len = 0;
+}
+
+/* Process the outcome (c) of a request whose response was captured in data,
+ * as etcd_curl_perform_json_index_(), releasing the captured payload
+ */
+int
+etcd_curl_result_json_(CURL *ch, CURLcode c, struct etcd_data_struct *data, json_t **dict, ETCDINDEX *index)
+{
+	int r;
+
+	*dict = NULL;
+	if((r = etcd_curl_result_(ch, c, data, index)))
+	{
+		return r;
+	}
+	if(data->len)
+	{
+		*dict = json_loads(data->buf, 0, NULL);
+	}
+	r = (data->len && !*dict ? -1 : 0);
+	etcd_curl_release_(data);
+	return r;
+}
+
+/* Process the outcome (c) of a request whose response was captured in data:
+ * returns zero if it was successful, leaving the payload in place, or
+ * otherwise releases it and returns as etcd_curl_perform_json_index_()
+ */
+static int
+etcd_curl_result_(CURL *ch, CURLcode c, struct etcd_data_struct *data, ETCDINDEX *index)
+{
+	long status;
+	int r;
+
+	if(index)
+	{
+		*index = 0;
+	}
+	curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(ch, CURLOPT_HEADERDATA, NULL);
 	if(c != CURLE_OK)
 	{
+		etcd_curl_release_(data);
 		return c;
 	}
+	if(index)
+	{
+		*index = data->index;
+	}
 	status = 0;
 	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
 	if(status == 0)
 	{
+		etcd_curl_release_(data);
 		return -1;
 	}
 	if(status >= 200 && status <= 299)
 	{
-		if(data.len)
-		{
-			*dict = json_loads(data.buf, 0, NULL);
-		}
-		free(data.buf);
-		if(data.len && !*dict)
-		{
-			return -1;
-		}
 		return 0;
 	}
-	free(data.buf);
-	return -1;
+	r = etcd_error_code_(data);
+	etcd_curl_release_(data);
+	return r;
+}
+
+/* Extract the errorCode from an etcd error response, if there is one */
+static int
+etcd_error_code_(struct etcd_data_struct *data)
+{
+	json_t *dict, *code;
+	int r;
+
+	if(!data->len)
+	{
+		return -1;
+	}
+	dict = json_loads(data->buf, 0, NULL);
+	if(!dict)
+	{
+		return -1;
+	}
+	r = -1;
+	code = json_object_get(dict, "errorCode");
+	if(code && json_typeof(code) == JSON_INTEGER && json_integer_value(code) > 0)
+	{
+		r = (int) json_integer_value(code);
+	}
+	json_decref(dict);
+	return r;
 }
 
 static size_t
@@ -250,6 +798,20 @@ etcd_sink_(char *ptr, size_t size, size_t nmemb, void *userdata)
 	return size * nmemb;
 }
 
+static int
+etcd_progress_(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	ETCD *etcd;
+
+	(void) dltotal;
+	(void) dlnow;
+	(void) ultotal;
+	(void) ulnow;
+
+	etcd = (ETCD *) userdata;
+	return (etcd->cancel(etcd->canceldata) ? 1 : 0);
+}
+
 static size_t
 etcd_payload_(char *ptr, size_t size, size_t nmemb, void *userdata)
 {
@@ -259,17 +821,24 @@ etcd_payload_(char *ptr, size_t size, size_t nmemb, void *userdata)
 	
 	data = (struct etcd_data_struct *) userdata;
 	size *= nmemb;
-	n = data->size;
+	if(data->len + size + 1 > MAX_PAYLOAD_SIZE)
+	{
+		return 0;
+	}
+	/* Grow geometrically, so that a large response doesn't result in
+	 * repeated re-allocation (and copying) of the buffer
+	 */
+	n = (data->size ? data->size : PAYLOAD_ALLOC_BLOCK);
 	while(n < data->len + size + 1)
 	{
-		n += PAYLOAD_ALLOC_BLOCK;
+		n *= 2;
+	}
+	if(n > MAX_PAYLOAD_SIZE)
+	{
+		n = MAX_PAYLOAD_SIZE;
 	}
 	if(n != data->size)
 	{
-		if(n > MAX_PAYLOAD_SIZE)
-		{
-			return 0;
-		}
 		p = (char *) realloc(data->buf, n);
 		if(!p)
 		{
@@ -283,3 +852,25 @@ etcd_payload_(char *ptr, size_t size, size_t nmemb, void *userdata)
 	data->buf[data->len] = 0;
 	return size;
 }
+
+static size_t
+etcd_header_(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct etcd_data_struct *data;
+	static const char name[] = "X-Etcd-Index:";
+	size_t n;
+	
+	data = (struct etcd_data_struct *) userdata;
+	size *= nmemb;
+	n = sizeof(name) - 1;
+	if(size > n && !strncasecmp(ptr, name, n))
+	{
+		data->index = 0;
+		for(; n < size && (ptr[n] == ' ' || ptr[n] == '\t'); n++);
+		for(; n < size && isdigit((unsigned char) ptr[n]); n++)
+		{
+			data->index = (data->index * 10) + (ptr[n] - '0');
+		}
+	}
+	return size;
+}
@@ -21,6 +21,8 @@
 
 #include "p_libetcd.h"
 
+static void etcd_dir_wait_query_(char *query, size_t size, ETCDFLAGS flags, ETCDINDEX waitindex);
+
 ETCD *
 etcd_dir_create_(ETCD *parent, const char *name)
 {
@@ -73,7 +75,11 @@ etcd_dir_create_(ETCD *parent, const char *name)
 		free(dir);
 		return NULL;
 	}
-	dir->verbose = parent->verbose;
+	if(etcd_init_(dir, parent))
+	{
+		etcd_destroy_(dir);
+		return NULL;
+	}
 	return dir;
 }	
 
@@ -90,7 +96,7 @@ etcd_dir_open(ETCD *parent, const char *name)
 	{
 		return NULL;
 	}
-	ch = etcd_curl_create_(parent, dir->uri, NULL);
+	ch = etcd_curl_create_(parent, dir->url, NULL, NULL);
 	if(!ch)
 	{
 		etcd_dir_close(dir);
@@ -112,7 +118,7 @@ etcd_dir_open(ETCD *parent, const char *name)
 		}
 		json_decref(dict);
 	}
-	etcd_curl_done_(ch);
+	etcd_curl_done_(parent, ch);
 	if(status)
 	{
 		etcd_dir_close(dir);
@@ -144,9 +150,9 @@ etcd_dir_create(ETCD *parent, const char *name, ETCDFLAGS flags)
 	{
 		query = NULL;
 	}
-	ch = etcd_curl_put_(parent, dir->uri, data, query);
+	ch = etcd_curl_put_(parent, dir->url, NULL, data, query);
 	status = etcd_curl_perform_(ch);
-	etcd_curl_done_(ch);
+	etcd_curl_done_(parent, ch);
 	if(status)
 	{
 		etcd_dir_close(dir);
@@ -158,15 +164,21 @@ etcd_dir_create(ETCD *parent, const char *name, ETCDFLAGS flags)
 void
 etcd_dir_close(ETCD *dir)
 {
-	if(dir && dir->uri)
-	{
-		uri_destroy(dir->uri);
-	}
-	free(dir);
+	etcd_destroy_(dir);
 }
 
 int
 etcd_dir_get(ETCD *dir, json_t **out)
+{
+	return etcd_dir_get_index(dir, out, NULL);
+}
+
+/* Retrieve the contents of a directory; if index is non-NULL, it will be set
+ * to the etcd index at the time of the request, which can be used (plus one)
+ * as the starting point for a subsequent etcd_dir_wait_index().
+ */
+int
+etcd_dir_get_index(ETCD *dir, json_t **out, ETCDINDEX *index)
 {
 	CURL *ch;
 	int status;
@@ -175,13 +187,13 @@ etcd_dir_get(ETCD *dir, json_t **out)
 	size_t c, n;
 
 	*out = NULL;
-	ch = etcd_curl_create_(dir, dir->uri, NULL);
+	ch = etcd_curl_create_(dir, dir->url, NULL, NULL);
 	if(!ch)
 	{
 		return -1;
 	}	
-	status = etcd_curl_perform_json_(ch, &dict);
-	etcd_curl_done_(ch);
+	status = etcd_curl_perform_json_index_(ch, &dict, index);
+	etcd_curl_done_(dir, ch);
 	if(status)
 	{
 		json_decref(dict);
@@ -233,22 +245,109 @@ etcd_dir_get(ETCD *dir, json_t **out)
 	return 0;
 }
 
+/* Retrieve the contents of a directory without constructing a JSON tree,
+ * invoking fn for each entry which is not itself a directory, in order of
+ * key, with the last component of the entry's key, its value and its
+ * modification index. The key and value are valid only for the duration of
+ * the invocation. If index is non-NULL, it is set as for
+ * etcd_dir_get_index(). If fn returns non-zero, the retrieval is abandoned
+ * and that value returned.
+ */
+int
+etcd_dir_list(ETCD *dir, ETCDKVFN fn, void *data, ETCDINDEX *index)
+{
+	struct etcd_data_struct payload;
+	CURL *ch;
+	int status;
+
+	ch = etcd_curl_create_(dir, dir->url, NULL, "sorted=true");
+	if(!ch)
+	{
+		return -1;
+	}
+	status = etcd_curl_perform_payload_(ch, &payload, index);
+	etcd_curl_done_(dir, ch);
+	if(status)
+	{
+		return status;
+	}
+	status = (payload.len ? etcd_scan_dir_(payload.buf, payload.len, fn, data) : -1);
+	etcd_curl_release_(&payload);
+	return status;
+}
+
 int
 etcd_dir_wait(ETCD *dir, ETCDFLAGS flags, json_t **out)
+{
+	return etcd_dir_wait_index(dir, flags, 0, out);
+}
+
+/* Wait for a change to a directory; if waitindex is nonzero, changes are
+ * returned starting from that modification index (which may have already
+ * occurred). If etcd no longer holds history back as far as waitindex,
+ * ETCD_E_INDEX_CLEARED is returned and the caller must re-read the directory.
+ */
+int
+etcd_dir_wait_index(ETCD *dir, ETCDFLAGS flags, ETCDINDEX waitindex, json_t **out)
 {
 	CURL *ch;
-	const char *data = "wait=true", *rdata = "wait=true&recursive=true";
-	int status, recursive;
+	char query[96];
+	int status;
 
 	*out = NULL;
-	recursive = (flags & ETCD_RECURSE);
-	ch = etcd_curl_create_(dir, dir->uri, (recursive ? rdata : data));
+	etcd_dir_wait_query_(query, sizeof(query), flags, waitindex);
+	ch = etcd_curl_create_(dir, dir->url, NULL, query);
 	if(!ch)
 	{
 		return -1;
 	}	
+	etcd_curl_wait_(dir, ch);
 	status = etcd_curl_perform_json_(ch, out);
-	etcd_curl_done_(ch);
+	etcd_curl_done_(dir, ch);
 	return status;
 }
 
+/* Begin an asynchronous wait for a change to a directory, as
+ * etcd_dir_wait_index()
+ */
+ETCDREQUEST *
+etcd_dir_wait_request(ETCD *dir, ETCDFLAGS flags, ETCDINDEX waitindex)
+{
+	ETCDREQUEST *request;
+	char query[96];
+
+	request = (ETCDREQUEST *) calloc(1, sizeof(ETCDREQUEST));
+	if(!request)
+	{
+		return NULL;
+	}
+	etcd_dir_wait_query_(query, sizeof(query), flags, waitindex);
+	request->ch = etcd_curl_create_(dir, dir->url, NULL, query);
+	if(!request->ch)
+	{
+		free(request);
+		return NULL;
+	}
+	request->etcd = dir;
+	etcd_curl_wait_(dir, request->ch);
+	etcd_curl_capture_(request->ch, &(request->data));
+	return request;
+}
+
+/* Construct the query string for a wait request */
+static void
+etcd_dir_wait_query_(char *query, size_t size, ETCDFLAGS flags, ETCDINDEX waitindex)
+{
+	int recursive;
+
+	recursive = (flags & ETCD_RECURSE);
+	if(waitindex)
+	{
+		snprintf(query, size, "wait=true%s&waitIndex=%llu", (recursive ? "&recursive=true" : ""), waitindex);
+	}
+	else
+	{
+		snprintf(query, size, "wait=true%s", (recursive ? "&recursive=true" : ""));
+	}
+}
+
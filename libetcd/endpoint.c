@@ -0,0 +1,453 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libetcd.h"
+
+/* Multiple endpoints
+ *
+ * A connection may be given alternative endpoints (servers or proxies for
+ * the same cluster, whose URLs differ from the first only in their scheme,
+ * host and port). Every handle derived from the connection shares the set,
+ * along with each endpoint's smoothed round-trip time and failure rate.
+ *
+ * Each request is sent to the endpoint with the lowest round-trip time,
+ * weighted by its failure rate, amongst those which haven't recently
+ * failed (an endpoint which has not yet been measured is preferred, so
+ * that each is tried). An endpoint which fails is avoided for a period
+ * which doubles with each consecutive failure, and a synchronous request
+ * which fails before any response was received is re-sent to the next
+ * best endpoint straight away. Long-running requests which wait for
+ * changes are abandoned and re-sent if the endpoint they're using is
+ * found by other requests to be failing (provided another isn't).
+ *
+ * The set's lock is only held briefly, and never while a request is being
+ * performed.
+ */
+
+/* The weight given to each new measurement in the smoothed values */
+#define ETCD_ENDPOINT_ALPHA             0.2
+
+static int etcd_endpoint_add_(ETCDENDPOINTS *set, const char *url, size_t len);
+static int etcd_endpoint_failing_(ETCD *etcd);
+static void etcd_endpoint_record_(ETCD *etcd, CURL *ch, CURLcode c);
+static time_t etcd_endpoint_now_(void);
+static int etcd_endpoint_progress_(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+
+/* Attach a set of endpoints to a newly-connected handle: the first is that
+ * of the handle's own URI, and alternatives is a comma-separated list of
+ * the URLs of the others
+ */
+int
+etcd_endpoints_create_(ETCD *etcd, const char *alternatives)
+{
+	ETCDENDPOINTS *set;
+	const char *p;
+	size_t len;
+
+	set = (ETCDENDPOINTS *) calloc(1, sizeof(ETCDENDPOINTS));
+	if(!set)
+	{
+		return -1;
+	}
+	pthread_mutex_init(&(set->lock), NULL);
+	set->refcount = 1;
+	if(etcd_endpoint_add_(set, etcd->url, strlen(etcd->url)))
+	{
+		etcd_endpoints_unref_(set);
+		return -1;
+	}
+	while(*alternatives)
+	{
+		while(*alternatives == ',' || isspace((unsigned char) *alternatives))
+		{
+			alternatives++;
+		}
+		if(!*alternatives)
+		{
+			break;
+		}
+		p = strchr(alternatives, ',');
+		len = (p ? (size_t) (p - alternatives) : strlen(alternatives));
+		while(len && isspace((unsigned char) alternatives[len - 1]))
+		{
+			len--;
+		}
+		if(etcd_endpoint_add_(set, alternatives, len))
+		{
+			etcd_endpoints_unref_(set);
+			return -1;
+		}
+		alternatives += len;
+	}
+	etcd->endpoints = set;
+	return 0;
+}
+
+ETCDENDPOINTS *
+etcd_endpoints_ref_(ETCDENDPOINTS *set)
+{
+	if(set)
+	{
+		pthread_mutex_lock(&(set->lock));
+		set->refcount++;
+		pthread_mutex_unlock(&(set->lock));
+	}
+	return set;
+}
+
+void
+etcd_endpoints_unref_(ETCDENDPOINTS *set)
+{
+	size_t n;
+	int r;
+
+	if(!set)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(set->lock));
+	set->refcount--;
+	r = set->refcount;
+	pthread_mutex_unlock(&(set->lock));
+	if(r)
+	{
+		return;
+	}
+	for(n = 0; n < set->count; n++)
+	{
+		free(set->ep[n].base);
+	}
+	pthread_mutex_destroy(&(set->lock));
+	free(set);
+}
+
+/* Select the endpoint for a new request made using ch and point it there;
+ * invoked by etcd_curl_create_() once etcd->urlbuf has been populated
+ */
+void
+etcd_endpoint_select_(ETCD *etcd, CURL *ch, unsigned int exclude)
+{
+	ETCDENDPOINTS *set;
+	struct etcd_endpoint_struct *ep;
+	double cost, best;
+	time_t now;
+	size_t n, len;
+	char *url;
+	int i, fallback;
+
+	set = etcd->endpoints;
+	etcd->endpoint = -1;
+	if(!set || set->count < 2 ||
+	   strncmp(etcd->urlbuf, set->ep[0].base, set->ep[0].len))
+	{
+		return;
+	}
+	now = etcd_endpoint_now_();
+	i = -1;
+	fallback = -1;
+	best = 0;
+	pthread_mutex_lock(&(set->lock));
+	for(n = 0; n < set->count; n++)
+	{
+		if(exclude & (1U << n))
+		{
+			continue;
+		}
+		ep = &(set->ep[n]);
+		if(ep->avoid > now)
+		{
+			/* If every endpoint is being avoided, use the one which will
+			 * cease to be soonest
+			 */
+			if(fallback < 0 || ep->avoid < set->ep[fallback].avoid)
+			{
+				fallback = (int) n;
+			}
+			continue;
+		}
+		cost = ep->rtt * (1.0 + 10.0 * ep->errors);
+		if(i < 0 || cost < best)
+		{
+			i = (int) n;
+			best = cost;
+		}
+	}
+	pthread_mutex_unlock(&(set->lock));
+	if(i < 0)
+	{
+		i = fallback;
+	}
+	if(i < 0)
+	{
+		return;
+	}
+	etcd->endpoint = i;
+	if(!i)
+	{
+		curl_easy_setopt(ch, CURLOPT_URL, etcd->urlbuf);
+		return;
+	}
+	/* The base of the first endpoint is replaced by that of the chosen one
+	 * (libcurl takes a copy of the URL)
+	 */
+	len = set->ep[i].len + strlen(etcd->urlbuf + set->ep[0].len) + 1;
+	url = (char *) malloc(len);
+	if(!url)
+	{
+		etcd->endpoint = 0;
+		curl_easy_setopt(ch, CURLOPT_URL, etcd->urlbuf);
+		return;
+	}
+	snprintf(url, len, "%s%s", set->ep[i].base, etcd->urlbuf + set->ep[0].len);
+	curl_easy_setopt(ch, CURLOPT_URL, url);
+	free(url);
+}
+
+/* Mark the request about to be made using ch as one which waits for
+ * changes: it is not subject to the request timeout, its duration isn't a
+ * measure of the endpoint's round-trip time, and it may be abandoned if its
+ * endpoint is found to be failing
+ */
+void
+etcd_curl_wait_(ETCD *etcd, CURL *ch)
+{
+	etcd->longpoll = 1;
+	curl_easy_setopt(ch, CURLOPT_TIMEOUT_MS, 0L);
+}
+
+/* Perform a synchronous request, re-sending it to another endpoint if the
+ * one selected fails before a response has been received, and recording
+ * the outcome. A request which isn't idempotent is only re-sent if it was
+ * never sent to the failed endpoint (that is, if it failed while
+ * connecting), as it may otherwise have been applied.
+ */
+CURLcode
+etcd_curl_exec_(ETCD *etcd, CURL *ch)
+{
+	unsigned int tried;
+	curl_off_t received;
+	long sent;
+	CURLcode c;
+
+	if(etcd->endpoint < 0)
+	{
+		return curl_easy_perform(ch);
+	}
+	if(etcd->longpoll)
+	{
+		curl_easy_setopt(ch, CURLOPT_XFERINFOFUNCTION, etcd_endpoint_progress_);
+		curl_easy_setopt(ch, CURLOPT_XFERINFODATA, (void *) etcd);
+		curl_easy_setopt(ch, CURLOPT_NOPROGRESS, 0L);
+	}
+	tried = 0;
+	for(;;)
+	{
+		c = curl_easy_perform(ch);
+		etcd_endpoint_record_(etcd, ch, c);
+		if(c == CURLE_OK || c == CURLE_WRITE_ERROR ||
+		   (c == CURLE_ABORTED_BY_CALLBACK && !etcd->failover))
+		{
+			return c;
+		}
+		received = 0;
+		curl_easy_getinfo(ch, CURLINFO_SIZE_DOWNLOAD_T, &received);
+		if(received)
+		{
+			/* The caller must decide whether the request can be repeated */
+			return c;
+		}
+		sent = 0;
+		curl_easy_getinfo(ch, CURLINFO_REQUEST_SIZE, &sent);
+		if(sent && !etcd->idempotent)
+		{
+			return c;
+		}
+		tried |= (1U << etcd->endpoint);
+		etcd_endpoint_select_(etcd, ch, tried);
+		if(etcd->endpoint < 0)
+		{
+			return c;
+		}
+		etcd->failover = 0;
+	}
+}
+
+/* Record the outcome of an asynchronous request made using ch */
+void
+etcd_curl_outcome_(ETCD *etcd, CURL *ch, CURLcode c)
+{
+	if(etcd->endpoint >= 0)
+	{
+		etcd_endpoint_record_(etcd, ch, c);
+	}
+}
+
+/* Add an endpoint, given a URL (of length len) from which its scheme and
+ * authority are taken
+ */
+static int
+etcd_endpoint_add_(ETCDENDPOINTS *set, const char *url, size_t len)
+{
+	struct etcd_endpoint_struct *ep;
+	const char *p, *end;
+
+	if(set->count >= ETCD_MAX_ENDPOINTS)
+	{
+		return -1;
+	}
+	end = url + len;
+	for(p = url; p + 3 <= end && strncmp(p, "://", 3); p++);
+	if(p + 3 > end)
+	{
+		return -1;
+	}
+	for(p += 3; p < end && *p != '/'; p++);
+	ep = &(set->ep[set->count]);
+	ep->len = (size_t) (p - url);
+	ep->base = (char *) calloc(1, ep->len + 1);
+	if(!ep->base)
+	{
+		return -1;
+	}
+	memcpy(ep->base, url, ep->len);
+	set->count++;
+	return 0;
+}
+
+/* Determine whether the endpoint used by the current request is being
+ * avoided following failures of other requests, while another is not
+ */
+static int
+etcd_endpoint_failing_(ETCD *etcd)
+{
+	ETCDENDPOINTS *set;
+	time_t now;
+	size_t n;
+	int r;
+
+	set = etcd->endpoints;
+	now = etcd_endpoint_now_();
+	r = 0;
+	pthread_mutex_lock(&(set->lock));
+	if(set->ep[etcd->endpoint].avoid > now)
+	{
+		for(n = 0; n < set->count; n++)
+		{
+			if(set->ep[n].avoid <= now)
+			{
+				r = 1;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&(set->lock));
+	return r;
+}
+
+/* Update the statistics of the endpoint used by a request which has been
+ * performed using ch, whose outcome was c
+ */
+static void
+etcd_endpoint_record_(ETCD *etcd, CURL *ch, CURLcode c)
+{
+	struct etcd_endpoint_struct *ep;
+	double elapsed;
+	long status;
+	int failed, backoff;
+
+	status = 0;
+	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+	if(c == CURLE_OK)
+	{
+		/* Proxies report unreachable or overloaded servers this way */
+		failed = (status >= 500);
+	}
+	else
+	{
+		/* Abandoning a request, or refusing its response, is not the
+		 * endpoint's fault
+		 */
+		failed = (c != CURLE_WRITE_ERROR && (c != CURLE_ABORTED_BY_CALLBACK || etcd->failover));
+		if(!failed)
+		{
+			return;
+		}
+	}
+	elapsed = 0;
+	curl_easy_getinfo(ch, CURLINFO_TOTAL_TIME, &elapsed);
+	pthread_mutex_lock(&(etcd->endpoints->lock));
+	ep = &(etcd->endpoints->ep[etcd->endpoint]);
+	ep->errors = ep->errors * (1.0 - ETCD_ENDPOINT_ALPHA) + (failed ? ETCD_ENDPOINT_ALPHA : 0);
+	if(failed)
+	{
+		ep->failures++;
+		backoff = ETCD_BACKOFF_MAX;
+		if(ep->failures < 8 && (ETCD_BACKOFF_MIN << (ep->failures - 1)) < ETCD_BACKOFF_MAX)
+		{
+			backoff = ETCD_BACKOFF_MIN << (ep->failures - 1);
+		}
+		ep->avoid = etcd_endpoint_now_() + backoff;
+	}
+	else
+	{
+		ep->failures = 0;
+		ep->avoid = 0;
+		if(!etcd->longpoll)
+		{
+			elapsed *= 1000000.0;
+			ep->rtt = (ep->rtt ? ep->rtt * (1.0 - ETCD_ENDPOINT_ALPHA) + elapsed * ETCD_ENDPOINT_ALPHA : elapsed);
+		}
+	}
+	pthread_mutex_unlock(&(etcd->endpoints->lock));
+}
+
+static time_t
+etcd_endpoint_now_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/* Progress callback for synchronous requests which wait for changes */
+static int
+etcd_endpoint_progress_(void *userdata, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow)
+{
+	ETCD *etcd;
+
+	(void) dltotal;
+	(void) dlnow;
+	(void) ultotal;
+	(void) ulnow;
+
+	etcd = (ETCD *) userdata;
+	if(etcd->cancel && etcd->cancel(etcd->canceldata))
+	{
+		return 1;
+	}
+	if(etcd_endpoint_failing_(etcd))
+	{
+		etcd->failover = 1;
+		return 1;
+	}
+	return 0;
+}
@@ -23,6 +23,8 @@
 
 #define XDIGIT(c) ((c < 10) ? '0' + c : 'a' + (c - 10))
 
+static char *etcd_key_body_(const unsigned char *data, size_t len, int ttl, ETCDFLAGS flags, const char **query);
+
 int
 etcd_key_set(ETCD *dir, const char *name, const char *value, ETCDFLAGS flags)
 {
@@ -36,27 +38,111 @@ etcd_key_set_ttl(ETCD *dir, const char *name, const char *value, int ttl, ETCDFL
 	return etcd_key_set_data_ttl(dir, name, (const unsigned char *) value, strlen(value), ttl, flags);
 }
 
+/* Extend the TTL of an existing key without altering its value; unlike
+ * setting the key, this does not notify anything watching it.
+ */
+int
+etcd_key_refresh_ttl(ETCD *dir, const char *name, int ttl)
+{
+	return etcd_key_set_data_ttl(dir, name, NULL, 0, ttl, ETCD_REFRESH);
+}
+
+/* Set the value of a key; if flags includes ETCD_REFRESH, the data is ignored
+ * and only the TTL of the (existing) key is updated. Returns etcd's errorCode
+ * if the request is rejected (e.g., ETCD_E_KEY_NOT_FOUND).
+ */
 int
 etcd_key_set_data_ttl(ETCD *dir, const char *name, const unsigned char *data, size_t len, int ttl, ETCDFLAGS flags)
 {
-	URI *uri;
 	CURL *ch;
-	char *encoded, *p;
+	char *encoded;
 	const char *query;
-	const unsigned char *dp;
-	size_t enclen, l;
-	int status, c;
+	int status;
+	json_t *dict;
 
 	while(*name == '/')
 	{
 		name++;
 	}
+	encoded = etcd_key_body_(data, len, ttl, flags, &query);
+	if(!encoded)
+	{
+		return -1;
+	}
+	ch = etcd_curl_put_(dir, dir->url, name, encoded, query);
+	if(!ch)
+	{
+		free(encoded);
+		return -1;
+	}
+	status = etcd_curl_perform_json_(ch, &dict);
+	json_decref(dict);
+	etcd_curl_done_(dir, ch);
+
+	free(encoded);
+	return status;
+}
+
+/* Prepare an asynchronous request to set the value of a key (or, if flags
+ * includes ETCD_REFRESH, to extend its TTL), as etcd_key_set_ttl() would;
+ * etcd_request_finish() returns etcd's errorCode if it is rejected.
+ */
+ETCDREQUEST *
+etcd_key_set_request(ETCD *dir, const char *name, const char *value, int ttl, ETCDFLAGS flags)
+{
+	ETCDREQUEST *request;
+	const char *query;
+
+	while(*name == '/')
+	{
+		name++;
+	}
+	request = (ETCDREQUEST *) calloc(1, sizeof(ETCDREQUEST));
+	if(!request)
+	{
+		return NULL;
+	}
+	/* The body must remain valid until the request has completed */
+	request->body = etcd_key_body_((const unsigned char *) value, (value ? strlen(value) : 0), ttl, flags, &query);
+	if(!request->body)
+	{
+		free(request);
+		return NULL;
+	}
+	request->ch = etcd_curl_put_(dir, dir->url, name, request->body, query);
+	if(!request->ch)
+	{
+		free(request->body);
+		free(request);
+		return NULL;
+	}
+	request->etcd = dir;
+	etcd_curl_capture_(request->ch, &(request->data));
+	return request;
+}
+
+/* Construct the (form-encoded) body of a request to set a key, and select
+ * the query string to accompany it
+ */
+static char *
+etcd_key_body_(const unsigned char *data, size_t len, int ttl, ETCDFLAGS flags, const char **query)
+{
+	char *encoded, *p;
+	const unsigned char *dp;
+	size_t enclen, l;
+	int c;
+
+	if(flags & ETCD_REFRESH)
+	{
+		/* A refresh must not include a value */
+		len = 0;
+	}
 	enclen = 6 + len * 3;
 	if(ttl)
 	{
 		enclen += 32;
 	}
-	if(flags & ETCD_EXISTS)
+	if(flags & (ETCD_EXISTS|ETCD_REFRESH))
 	{
 		enclen += 32;
 	}
@@ -64,10 +150,17 @@ etcd_key_set_data_ttl(ETCD *dir, const char *name, const unsigned char *data, si
 	encoded = (char *) calloc(1, enclen);
 	if(!encoded)
 	{
-		return -1;
+		return NULL;
+	}
+	if(flags & ETCD_REFRESH)
+	{
+		p = encoded + sprintf(encoded, "refresh=true");
+	}
+	else
+	{
+		strcpy(encoded, "value=");
+		p = encoded + 6;
 	}
-	strcpy(encoded, "value=");
-	p = encoded + 6;
 	l = 0;
 	for(dp = data; l < len; dp++, l++)
 	{
@@ -93,52 +186,33 @@ etcd_key_set_data_ttl(ETCD *dir, const char *name, const unsigned char *data, si
 	{
 		*p = 0;
 	}
-	if(flags & ETCD_EXISTS)
+	if(flags & (ETCD_EXISTS|ETCD_REFRESH))
 	{
-		query = "prevExist=true";
+		*query = "prevExist=true";
 	}
-	else
+	else if(flags & ETCD_CREATE)
 	{
-		query = NULL;
+		*query = "prevExist=false";
 	}
-	uri = uri_create_str(name, dir->uri);
-	if(!uri)
+	else
 	{
-		free(encoded);
-		return -1;
+		*query = NULL;
 	}
-	ch = etcd_curl_put_(dir, uri, encoded, query);
-	status = etcd_curl_perform_(ch);
-	etcd_curl_done_(ch);
-
-	free(encoded);
-	uri_destroy(uri);
-	return status;
+	return encoded;
 }
 
 int
 etcd_key_delete(ETCD *dir, const char *name, ETCDFLAGS flags)
 {
-	URI *uri;
 	CURL *ch;
 	int status;
 
 	(void) flags;
 
-	while(*name == '/')
-	{
-		name++;
-	}
-	uri = uri_create_str(name, dir->uri);
-	if(!uri)
-	{
-		return -1;
-	}
-	ch = etcd_curl_delete_(dir, uri, NULL);
+	ch = etcd_curl_delete_(dir, dir->url, name, NULL);
 	status = etcd_curl_perform_(ch);
-	etcd_curl_done_(ch);
+	etcd_curl_done_(dir, ch);
 
-	uri_destroy(uri);
 	return status;
 }
 
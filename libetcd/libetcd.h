@@ -18,36 +18,106 @@
 #ifndef LIBETCD_H_
 # define LIBETCD_H_                     1
 
+# include <curl/curl.h>
 # include <jansson.h>
 
 # include "liburi.h"
 
 typedef struct etcd_struct ETCD;
+typedef struct etcd_request_struct ETCDREQUEST;
+
+/* An etcd modification index (as reported in modifiedIndex and in the
+ * X-Etcd-Index response header)
+ */
+typedef unsigned long long ETCDINDEX;
+
+/* A function invoked periodically during requests; if it returns nonzero,
+ * the request is abandoned
+ */
+typedef int (*ETCDCANCELFN)(void *data);
+
+/* An etcd v3 lease identifier */
+typedef long long ETCDLEASE;
+
+/* A function invoked for each key retrieved from, or changed in, an etcd v3
+ * store (see etcd3_kv_range() and etcd3_watch()), or retrieved from an etcd
+ * v2 directory (see etcd_dir_list()); value is NULL if the key has been
+ * deleted. If it returns nonzero, the request is abandoned.
+ */
+typedef int (*ETCDKVFN)(void *data, const char *key, const char *value, ETCDINDEX revision);
 
 typedef enum
 {
 	ETCD_NONE = 0,
 	ETCD_EXISTS = (1<<0),
-	ETCD_RECURSE = (1<<1)
+	ETCD_RECURSE = (1<<1),
+	/* Extend the TTL of an existing key without modifying it (and so
+	 * without waking anything watching it)
+	 */
+	ETCD_REFRESH = (1<<2),
+	/* Only create the key: fail with ETCD_E_NODE_EXIST if it exists */
+	ETCD_CREATE = (1<<3)
 } ETCDFLAGS;
 
+/* Error codes returned by etcd which callers may need to distinguish from
+ * other failures
+ */
+typedef enum
+{
+	ETCD_E_KEY_NOT_FOUND = 100,
+	ETCD_E_NODE_EXIST = 105,
+	ETCD_E_INDEX_CLEARED = 401
+} ETCDERROR;
+
 ETCD *etcd_connect(const char *url);
 ETCD *etcd_connect_uri(const URI *uri);
 void etcd_disconnect(ETCD *etcd);
 ETCD *etcd_clone(ETCD *etcd);
 
 int etcd_set_verbose(ETCD *etcd, int verbose);
+int etcd_set_cancel(ETCD *etcd, ETCDCANCELFN fn, void *data);
+int etcd_set_timeouts(ETCD *etcd, long connect, long request);
 
 ETCD *etcd_dir_open(ETCD *parent, const char *name);
 ETCD *etcd_dir_create(ETCD *parent, const char *name, ETCDFLAGS flags);
 int etcd_dir_get(ETCD *dir, json_t **out);
+int etcd_dir_get_index(ETCD *dir, json_t **out, ETCDINDEX *index);
+int etcd_dir_list(ETCD *dir, ETCDKVFN fn, void *data, ETCDINDEX *index);
 int etcd_dir_delete(ETCD *parent, const char *name, ETCDFLAGS flags);
 void etcd_dir_close(ETCD *dir);
 int etcd_dir_wait(ETCD *dir, ETCDFLAGS flags, json_t **change);
+int etcd_dir_wait_index(ETCD *dir, ETCDFLAGS flags, ETCDINDEX waitindex, json_t **change);
+
+/* Asynchronous requests: the caller performs the request using the handle
+ * (e.g., via a curl multi handle), then passes the result to
+ * etcd_request_finish(). Only one request may be outstanding on a given
+ * ETCD handle at a time.
+ */
+ETCDREQUEST *etcd_dir_wait_request(ETCD *dir, ETCDFLAGS flags, ETCDINDEX waitindex);
+ETCDREQUEST *etcd_key_set_request(ETCD *dir, const char *name, const char *value, int ttl, ETCDFLAGS flags);
+CURL *etcd_request_handle(ETCDREQUEST *request);
+int etcd_request_finish(ETCDREQUEST *request, CURLcode result, json_t **change);
+void etcd_request_cancel(ETCDREQUEST *request);
 
 int etcd_key_set(ETCD *dir, const char *name, const char *value, ETCDFLAGS flags);
 int etcd_key_delete(ETCD *dir, const char *name, ETCDFLAGS flags);
 int etcd_key_set_ttl(ETCD *dir, const char *name, const char *value, int ttl, ETCDFLAGS flags);
 int etcd_key_set_data_ttl(ETCD *dir, const char *name, const unsigned char *data, size_t len, int ttl, ETCDFLAGS flags);
+int etcd_key_refresh_ttl(ETCD *dir, const char *name, int ttl);
+
+/* etcd v3, via the JSON gateway: keys are absolute, rather than relative
+ * to a directory handle, and are deleted when their lease (if any) expires
+ */
+ETCD *etcd3_connect(const char *url);
+ETCD *etcd3_connect_uri(const URI *uri);
+
+int etcd3_lease_grant(ETCD *etcd, int ttl, ETCDLEASE *lease);
+int etcd3_lease_keepalive(ETCD *etcd, ETCDLEASE lease);
+int etcd3_lease_revoke(ETCD *etcd, ETCDLEASE lease);
+
+int etcd3_kv_put(ETCD *etcd, const char *key, const char *value, ETCDLEASE lease, ETCDFLAGS flags);
+int etcd3_kv_delete(ETCD *etcd, const char *key, ETCDFLAGS flags);
+int etcd3_kv_range(ETCD *etcd, const char *prefix, ETCDKVFN fn, void *data, ETCDINDEX *revision);
+int etcd3_watch(ETCD *etcd, const char *prefix, ETCDINDEX start, ETCDKVFN fn, void *data);
 
 #endif /*!LIBETCD_H_*/
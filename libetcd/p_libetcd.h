@@ -21,29 +21,166 @@
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <strings.h>
 # include <ctype.h>
+# include <time.h>
+# include <pthread.h>
+
+# ifdef HAVE_UNISTD_H
+#  include <unistd.h>
+# endif
 
 # include <curl/curl.h>
 # include <jansson.h>
 
 # include "libetcd.h"
 
+/* The initial size of a payload buffer, which doubles as required */
 # define PAYLOAD_ALLOC_BLOCK            1024
 # define MAX_PAYLOAD_SIZE               16777216
 
+/* The number of locks protecting the data shared between handles */
+# define ETCD_SHARE_LOCKS               8
+
+/* The most endpoints a connection may have */
+# define ETCD_MAX_ENDPOINTS             16
+/* How long (in seconds) an endpoint is avoided after its first consecutive
+ * failure, doubling with each subsequent one up to the maximum
+ */
+# define ETCD_BACKOFF_MIN               1
+# define ETCD_BACKOFF_MAX               30
+
+typedef struct etcd_share_struct ETCDSHARE;
+typedef struct etcd_endpoints_struct ETCDENDPOINTS;
+
+/* Data shared between all of the handles derived from a single connection */
+struct etcd_share_struct
+{
+	CURLSH *sh;
+	/* Protects refcount */
+	pthread_mutex_t lock;
+	pthread_mutex_t data[ETCD_SHARE_LOCKS];
+	int refcount;
+};
+
+/* One of a connection's endpoints (see endpoint.c) */
+struct etcd_endpoint_struct
+{
+	/* The scheme and authority, e.g. "http://host:2379" */
+	char *base;
+	size_t len;
+	/* Smoothed round-trip time in microseconds (zero until measured), and
+	 * proportion of requests which failed
+	 */
+	double rtt;
+	double errors;
+	/* Consecutive failures, and the (monotonic) time until which the
+	 * endpoint should be avoided as a result
+	 */
+	int failures;
+	time_t avoid;
+};
+
+/* The endpoints shared between all of the handles derived from a single
+ * connection; the first is that of the connection's URI
+ */
+struct etcd_endpoints_struct
+{
+	/* Protects refcount and the endpoints' statistics */
+	pthread_mutex_t lock;
+	int refcount;
+	size_t count;
+	struct etcd_endpoint_struct ep[ETCD_MAX_ENDPOINTS];
+};
+
 struct etcd_struct
 {
 	URI *uri;
+	/* Cached string form of uri */
+	char *url;
 	int verbose;
+	/* Invoked periodically during requests to determine whether they
+	 * should be abandoned
+	 */
+	ETCDCANCELFN cancel;
+	void *canceldata;
+	/* The process which created the handle */
+	pid_t pid;
+	/* Easy handle re-used for each request made via this handle */
+	CURL *ch;
+	ETCDSHARE *share;
+	/* Buffer used to construct request URLs */
+	char *urlbuf;
+	size_t urlbufsize;
+	/* Buffer used to capture the responses to synchronous requests, which
+	 * is retained so that large directory listings don't have to re-grow it
+	 */
+	char *buf;
+	size_t bufsize;
+	/* Alternative endpoints, if any, the one used by the current request
+	 * (or -1 if there is no choice), whether the current request waits for
+	 * changes, whether it was abandoned because its endpoint is failing,
+	 * and whether it may safely be repeated if it may have been received
+	 */
+	ETCDENDPOINTS *endpoints;
+	int endpoint;
+	int longpoll;
+	int failover;
+	int idempotent;
+	/* Connection and request timeouts in milliseconds, or zero for none */
+	long connect_timeout;
+	long request_timeout;
+};
+
+/* Buffers a response payload, as well as the X-Etcd-Index header; if owner
+ * is non-NULL, buf was borrowed from that handle and is returned to it
+ * rather than being freed
+ */
+struct etcd_data_struct
+{
+	CURL *ch;
+	ETCD *owner;
+	char *buf;
+	size_t size, len;
+	ETCDINDEX index;
 };
 
+/* An asynchronous request, and its body (if any), which is freed along
+ * with it
+ */
+struct etcd_request_struct
+{
+	ETCD *etcd;
+	CURL *ch;
+	struct etcd_data_struct data;
+	char *body;
+};
+
+int etcd_init_(ETCD *etcd, ETCD *parent);
+void etcd_destroy_(ETCD *etcd);
 ETCD *etcd_dir_create_(ETCD *parent, const char *name);
 
-CURL *etcd_curl_create_(ETCD *etcd, URI *uri, const char *query);
-CURL *etcd_curl_put_(ETCD *etcd, URI *uri, const char *data, const char *query);
-CURL *etcd_curl_delete_(ETCD *etcd, URI *uri, const char *query);
-void etcd_curl_done_(CURL *ch);
+CURL *etcd_curl_create_(ETCD *etcd, const char *url, const char *name, const char *query);
+CURL *etcd_curl_put_(ETCD *etcd, const char *url, const char *name, const char *data, const char *query);
+CURL *etcd_curl_delete_(ETCD *etcd, const char *url, const char *name, const char *query);
+void etcd_curl_done_(ETCD *etcd, CURL *ch);
 int etcd_curl_perform_(CURL *ch);
 int etcd_curl_perform_json_(CURL *ch, json_t **dict);
+int etcd_curl_perform_json_index_(CURL *ch, json_t **dict, ETCDINDEX *index);
+void etcd_curl_capture_(CURL *ch, struct etcd_data_struct *data);
+void etcd_curl_borrow_(ETCD *etcd, CURL *ch, struct etcd_data_struct *data);
+int etcd_curl_result_json_(CURL *ch, CURLcode c, struct etcd_data_struct *data, json_t **dict, ETCDINDEX *index);
+int etcd_curl_perform_payload_(CURL *ch, struct etcd_data_struct *data, ETCDINDEX *index);
+void etcd_curl_release_(struct etcd_data_struct *data);
+
+int etcd_scan_dir_(char *buf, size_t len, ETCDKVFN fn, void *data);
+
+int etcd_endpoints_create_(ETCD *etcd, const char *alternatives);
+ETCDENDPOINTS *etcd_endpoints_ref_(ETCDENDPOINTS *set);
+void etcd_endpoints_unref_(ETCDENDPOINTS *set);
+void etcd_endpoint_select_(ETCD *etcd, CURL *ch, unsigned int exclude);
+void etcd_curl_wait_(ETCD *etcd, CURL *ch);
+CURLcode etcd_curl_exec_(ETCD *etcd, CURL *ch);
+void etcd_curl_outcome_(ETCD *etcd, CURL *ch, CURLcode c);
 
 #endif /*!P_LIBETCD_H_*/
@@ -0,0 +1,477 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libetcd.h"
+
+/* A single-pass scanner for directory listings: rather than parsing the
+ * response into a tree (which, for a large directory, amounts to a great
+ * many small allocations), the entries are picked out of the payload as it
+ * is scanned, with strings being decoded in place.
+ */
+
+struct etcd_scan_struct
+{
+	char *p;
+	char *end;
+};
+
+static int etcd_scan_node_(struct etcd_scan_struct *s, ETCDKVFN fn, void *data);
+static int etcd_scan_entry_(struct etcd_scan_struct *s, ETCDKVFN fn, void *data);
+static int etcd_scan_member_(struct etcd_scan_struct *s, int *first, char **name);
+static int etcd_scan_element_(struct etcd_scan_struct *s, int *first);
+static char *etcd_scan_string_(struct etcd_scan_struct *s);
+static int etcd_scan_hex_(struct etcd_scan_struct *s, unsigned long *cp);
+static int etcd_scan_skip_(struct etcd_scan_struct *s);
+static int etcd_scan_expect_(struct etcd_scan_struct *s, char c);
+static void etcd_scan_ws_(struct etcd_scan_struct *s);
+
+/* Scan the response to a directory request (buf, which holds len bytes and
+ * is followed by a NUL terminator, and which will be modified), invoking fn
+ * for each entry in the directory which isn't itself a directory, with the
+ * last component of its key. The key and value passed to fn are valid only
+ * for the duration of the invocation. If fn returns non-zero, scanning is
+ * abandoned and that value returned; if the response is malformed, -1 is
+ * returned.
+ */
+int
+etcd_scan_dir_(char *buf, size_t len, ETCDKVFN fn, void *data)
+{
+	struct etcd_scan_struct s;
+	char *name;
+	int first, found, r;
+
+	s.p = buf;
+	s.end = buf + len;
+	if(!etcd_scan_expect_(&s, '{'))
+	{
+		return -1;
+	}
+	first = 1;
+	found = 0;
+	while(!(r = etcd_scan_member_(&s, &first, &name)))
+	{
+		if(!found && !strcmp(name, "node"))
+		{
+			found = 1;
+			if((r = etcd_scan_node_(&s, fn, data)))
+			{
+				return r;
+			}
+			continue;
+		}
+		if(etcd_scan_skip_(&s))
+		{
+			return -1;
+		}
+	}
+	if(r < 0 || !found)
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Scan the node describing the directory itself */
+static int
+etcd_scan_node_(struct etcd_scan_struct *s, ETCDKVFN fn, void *data)
+{
+	char *name;
+	int first, efirst, r;
+
+	if(!etcd_scan_expect_(s, '{'))
+	{
+		return -1;
+	}
+	first = 1;
+	while(!(r = etcd_scan_member_(s, &first, &name)))
+	{
+		etcd_scan_ws_(s);
+		if(strcmp(name, "nodes") || s->p >= s->end || *s->p != '[')
+		{
+			if(etcd_scan_skip_(s))
+			{
+				return -1;
+			}
+			continue;
+		}
+		s->p++;
+		efirst = 1;
+		while(!(r = etcd_scan_element_(s, &efirst)))
+		{
+			if((r = etcd_scan_entry_(s, fn, data)))
+			{
+				return r;
+			}
+		}
+		if(r < 0)
+		{
+			return -1;
+		}
+	}
+	return (r < 0 ? -1 : 0);
+}
+
+/* Scan one of the entries in a directory and pass it to fn */
+static int
+etcd_scan_entry_(struct etcd_scan_struct *s, ETCDKVFN fn, void *data)
+{
+	char *name, *key, *value, *t;
+	ETCDINDEX modified;
+	int first, dir, r;
+
+	if(!etcd_scan_expect_(s, '{'))
+	{
+		return -1;
+	}
+	key = NULL;
+	value = NULL;
+	modified = 0;
+	dir = 0;
+	first = 1;
+	while(!(r = etcd_scan_member_(s, &first, &name)))
+	{
+		etcd_scan_ws_(s);
+		if(s->p < s->end && *s->p == '"' && (!strcmp(name, "key") || !strcmp(name, "value")))
+		{
+			t = etcd_scan_string_(s);
+			if(!t)
+			{
+				return -1;
+			}
+			if(name[0] == 'k')
+			{
+				key = t;
+			}
+			else
+			{
+				value = t;
+			}
+			continue;
+		}
+		if(s->p < s->end && isdigit((unsigned char) *s->p) && !strcmp(name, "modifiedIndex"))
+		{
+			modified = strtoull(s->p, &t, 10);
+			s->p = t;
+			continue;
+		}
+		if(s->end - s->p >= 4 && !strncmp(s->p, "true", 4) && !strcmp(name, "dir"))
+		{
+			dir = 1;
+			s->p += 4;
+			continue;
+		}
+		if(etcd_scan_skip_(s))
+		{
+			return -1;
+		}
+	}
+	if(r < 0)
+	{
+		return -1;
+	}
+	if(!key || !value || dir)
+	{
+		return 0;
+	}
+	t = strrchr(key, '/');
+	return fn(data, (t ? t + 1 : key), value, modified);
+}
+
+/* Advance to the next member of an object, setting name to its name and
+ * consuming the colon which follows; returns 1 if the end of the object was
+ * reached instead, or -1 if the object is malformed
+ */
+static int
+etcd_scan_member_(struct etcd_scan_struct *s, int *first, char **name)
+{
+	if(etcd_scan_expect_(s, '}'))
+	{
+		return 1;
+	}
+	if(!*first && !etcd_scan_expect_(s, ','))
+	{
+		return -1;
+	}
+	*first = 0;
+	etcd_scan_ws_(s);
+	if(!(*name = etcd_scan_string_(s)) || !etcd_scan_expect_(s, ':'))
+	{
+		return -1;
+	}
+	return 0;
+}
+
+/* Advance to the next element of an array; returns 1 if the end of the
+ * array was reached instead, or -1 if it is malformed
+ */
+static int
+etcd_scan_element_(struct etcd_scan_struct *s, int *first)
+{
+	if(etcd_scan_expect_(s, ']'))
+	{
+		return 1;
+	}
+	if(!*first && !etcd_scan_expect_(s, ','))
+	{
+		return -1;
+	}
+	*first = 0;
+	return 0;
+}
+
+/* Decode the string at the current position in place, returning it; the
+ * decoded form is never longer than the encoded, so the terminator is
+ * written at or before the closing quote
+ */
+static char *
+etcd_scan_string_(struct etcd_scan_struct *s)
+{
+	char *start, *out;
+	unsigned long cp, lo;
+
+	if(s->p >= s->end || *s->p != '"')
+	{
+		return NULL;
+	}
+	s->p++;
+	start = out = s->p;
+	for(; s->p < s->end && *s->p != '"'; s->p++)
+	{
+		if(*s->p != '\\')
+		{
+			*out = *s->p;
+			out++;
+			continue;
+		}
+		s->p++;
+		if(s->p >= s->end)
+		{
+			return NULL;
+		}
+		switch(*s->p)
+		{
+		case '"':
+		case '\\':
+		case '/':
+			*out = *s->p;
+			break;
+		case 'b':
+			*out = '\b';
+			break;
+		case 'f':
+			*out = '\f';
+			break;
+		case 'n':
+			*out = '\n';
+			break;
+		case 'r':
+			*out = '\r';
+			break;
+		case 't':
+			*out = '\t';
+			break;
+		case 'u':
+			if(etcd_scan_hex_(s, &cp) || !cp || (cp >= 0xdc00 && cp <= 0xdfff))
+			{
+				return NULL;
+			}
+			if(cp >= 0xd800 && cp <= 0xdbff)
+			{
+				/* A surrogate pair */
+				if(s->end - s->p < 3 || s->p[1] != '\\' || s->p[2] != 'u')
+				{
+					return NULL;
+				}
+				s->p += 2;
+				if(etcd_scan_hex_(s, &lo) || lo < 0xdc00 || lo > 0xdfff)
+				{
+					return NULL;
+				}
+				cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			}
+			if(cp < 0x80)
+			{
+				*out = (char) cp;
+			}
+			else if(cp < 0x800)
+			{
+				*out = (char) (0xc0 | (cp >> 6));
+				out++;
+				*out = (char) (0x80 | (cp & 0x3f));
+			}
+			else if(cp < 0x10000)
+			{
+				*out = (char) (0xe0 | (cp >> 12));
+				out++;
+				*out = (char) (0x80 | ((cp >> 6) & 0x3f));
+				out++;
+				*out = (char) (0x80 | (cp & 0x3f));
+			}
+			else
+			{
+				*out = (char) (0xf0 | (cp >> 18));
+				out++;
+				*out = (char) (0x80 | ((cp >> 12) & 0x3f));
+				out++;
+				*out = (char) (0x80 | ((cp >> 6) & 0x3f));
+				out++;
+				*out = (char) (0x80 | (cp & 0x3f));
+			}
+			break;
+		default:
+			return NULL;
+		}
+		out++;
+	}
+	if(s->p >= s->end)
+	{
+		return NULL;
+	}
+	*out = 0;
+	s->p++;
+	return start;
+}
+
+/* Decode the four hex digits following the 'u' of a \u escape at the
+ * current position, leaving the position at the last of them
+ */
+static int
+etcd_scan_hex_(struct etcd_scan_struct *s, unsigned long *cp)
+{
+	int n, c;
+
+	if(s->end - s->p < 5)
+	{
+		return -1;
+	}
+	*cp = 0;
+	for(n = 0; n < 4; n++)
+	{
+		s->p++;
+		c = (unsigned char) *s->p;
+		if(c >= '0' && c <= '9')
+		{
+			c -= '0';
+		}
+		else if(c >= 'a' && c <= 'f')
+		{
+			c -= 'a' - 10;
+		}
+		else if(c >= 'A' && c <= 'F')
+		{
+			c -= 'A' - 10;
+		}
+		else
+		{
+			return -1;
+		}
+		*cp = (*cp << 4) | (unsigned long) c;
+	}
+	return 0;
+}
+
+/* Skip over the value at the current position, whatever it is */
+static int
+etcd_scan_skip_(struct etcd_scan_struct *s)
+{
+	char *start;
+	int depth, str;
+
+	etcd_scan_ws_(s);
+	if(s->p >= s->end)
+	{
+		return -1;
+	}
+	if(*s->p != '{' && *s->p != '[' && *s->p != '"')
+	{
+		/* A number or literal */
+		for(start = s->p; s->p < s->end && !strchr(",}] \t\r\n", *s->p); s->p++);
+		return (s->p == start ? -1 : 0);
+	}
+	depth = 0;
+	str = 0;
+	for(; s->p < s->end; s->p++)
+	{
+		if(str)
+		{
+			if(*s->p == '\\' && s->end - s->p > 1)
+			{
+				s->p++;
+			}
+			else if(*s->p == '"')
+			{
+				str = 0;
+				if(!depth)
+				{
+					s->p++;
+					return 0;
+				}
+			}
+			continue;
+		}
+		switch(*s->p)
+		{
+		case '"':
+			str = 1;
+			break;
+		case '{':
+		case '[':
+			depth++;
+			break;
+		case '}':
+		case ']':
+			depth--;
+			if(!depth)
+			{
+				s->p++;
+				return 0;
+			}
+			if(depth < 0)
+			{
+				return -1;
+			}
+			break;
+		}
+	}
+	return -1;
+}
+
+/* Skip whitespace and consume c if it is the next character */
+static int
+etcd_scan_expect_(struct etcd_scan_struct *s, char c)
+{
+	etcd_scan_ws_(s);
+	if(s->p < s->end && *s->p == c)
+	{
+		s->p++;
+		return 1;
+	}
+	return 0;
+}
+
+static void
+etcd_scan_ws_(struct etcd_scan_struct *s)
+{
+	while(s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\n' || *s->p == '\r'))
+	{
+		s->p++;
+	}
+}
@@ -0,0 +1,764 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libetcd.h"
+
+/* etcd v3 API
+ *
+ * Requests are made via the JSON gateway which etcd (3.4 and later) serves
+ * at /v3/, rather than via gRPC itself: each request is a POST of a JSON
+ * object, in which keys and values are base64-encoded and 64-bit integers
+ * are sent as strings (responses may use either form). The responses of
+ * streaming methods (watches and lease keepalives) consist of a sequence
+ * of newline-delimited JSON objects, each wrapping a message in "result"
+ * (or a failure in "error").
+ *
+ * Failures reported by etcd are mapped to the v2 ETCDERROR codes where
+ * there's an equivalent.
+ */
+
+/* gRPC's NOT_FOUND status, reported for leases which have expired */
+#define ETCD3_GRPC_NOT_FOUND            5
+
+/* The state of a streaming response */
+struct etcd3_stream_struct
+{
+	CURL *ch;
+	ETCDKVFN fn;
+	void *data;
+	char *buf;
+	size_t size, len;
+	/* Non-zero once the stream should be abandoned */
+	int status;
+	/* The revision of the last change delivered */
+	ETCDINDEX last;
+};
+
+static char *etcd3_encode_(const char *str);
+static char *etcd3_decode_(json_t *value);
+static char *etcd3_range_end_(const char *prefix);
+static long long etcd3_int_(json_t *value);
+static int etcd3_error_(json_t *dict);
+static int etcd3_post_(ETCD *etcd, const char *method, json_t *body, json_t **out);
+static json_t *etcd3_range_body_(const char *key, ETCDFLAGS flags);
+static int etcd3_kv_(json_t *kv, int deleted, ETCDKVFN fn, void *data);
+static int etcd3_watch_once_(ETCD *etcd, const char *prefix, ETCDINDEX start, struct etcd3_stream_struct *s);
+static size_t etcd3_stream_(char *ptr, size_t size, size_t nmemb, void *userdata);
+static void etcd3_message_(struct etcd3_stream_struct *s, const char *buf, size_t len);
+
+static const char etcd3_base64_[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/* Grant a lease with the given TTL (in seconds) */
+int
+etcd3_lease_grant(ETCD *etcd, int ttl, ETCDLEASE *lease)
+{
+	json_t *body, *dict;
+	int r;
+
+	*lease = 0;
+	body = json_object();
+	if(!body)
+	{
+		return -1;
+	}
+	json_object_set_new(body, "TTL", json_integer(ttl));
+	r = etcd3_post_(etcd, "lease/grant", body, &dict);
+	if(r)
+	{
+		return r;
+	}
+	*lease = (ETCDLEASE) etcd3_int_(json_object_get(dict, "ID"));
+	json_decref(dict);
+	return (*lease ? 0 : -1);
+}
+
+/* Renew a lease, restoring its TTL to that with which it was granted;
+ * returns ETCD_E_KEY_NOT_FOUND if the lease has already expired (and so
+ * any keys attached to it have been deleted)
+ */
+int
+etcd3_lease_keepalive(ETCD *etcd, ETCDLEASE lease)
+{
+	json_t *body, *dict;
+	char buf[32];
+	long long ttl;
+	int r;
+
+	body = json_object();
+	if(!body)
+	{
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%lld", (long long) lease);
+	json_object_set_new(body, "ID", json_string(buf));
+	r = etcd3_post_(etcd, "lease/keepalive", body, &dict);
+	if(r)
+	{
+		return r;
+	}
+	ttl = etcd3_int_(json_object_get(dict, "TTL"));
+	json_decref(dict);
+	return (ttl > 0 ? 0 : ETCD_E_KEY_NOT_FOUND);
+}
+
+/* Revoke a lease, deleting any keys attached to it */
+int
+etcd3_lease_revoke(ETCD *etcd, ETCDLEASE lease)
+{
+	json_t *body, *dict;
+	char buf[32];
+	int r;
+
+	body = json_object();
+	if(!body)
+	{
+		return -1;
+	}
+	snprintf(buf, sizeof(buf), "%lld", (long long) lease);
+	json_object_set_new(body, "ID", json_string(buf));
+	r = etcd3_post_(etcd, "lease/revoke", body, &dict);
+	json_decref(dict);
+	return r;
+}
+
+/* Set the value of a key, attaching it to lease if non-zero (so that it is
+ * deleted when the lease expires or is revoked). If flags includes
+ * ETCD_CREATE, the key is only set if it doesn't already exist, failing
+ * with ETCD_E_NODE_EXIST otherwise.
+ */
+int
+etcd3_kv_put(ETCD *etcd, const char *key, const char *value, ETCDLEASE lease, ETCDFLAGS flags)
+{
+	json_t *put, *body, *compare, *op, *dict;
+	char *ekey, *evalue, buf[32];
+	int r;
+
+	ekey = etcd3_encode_(key);
+	evalue = etcd3_encode_(value);
+	put = json_object();
+	if(!ekey || !evalue || !put)
+	{
+		free(ekey);
+		free(evalue);
+		json_decref(put);
+		return -1;
+	}
+	json_object_set_new(put, "key", json_string(ekey));
+	json_object_set_new(put, "value", json_string(evalue));
+	if(lease)
+	{
+		snprintf(buf, sizeof(buf), "%lld", (long long) lease);
+		json_object_set_new(put, "lease", json_string(buf));
+	}
+	if(!(flags & ETCD_CREATE))
+	{
+		free(ekey);
+		free(evalue);
+		r = etcd3_post_(etcd, "kv/put", put, &dict);
+		json_decref(dict);
+		return r;
+	}
+	/* Creation is a transaction which only performs the put if the key's
+	 * creation revision is zero (i.e., it doesn't exist)
+	 */
+	body = json_object();
+	compare = json_object();
+	op = json_object();
+	if(!body || !compare || !op)
+	{
+		json_decref(body);
+		json_decref(compare);
+		json_decref(op);
+		json_decref(put);
+		free(ekey);
+		free(evalue);
+		return -1;
+	}
+	json_object_set_new(compare, "key", json_string(ekey));
+	json_object_set_new(compare, "target", json_string("CREATE"));
+	json_object_set_new(compare, "result", json_string("EQUAL"));
+	json_object_set_new(compare, "create_revision", json_string("0"));
+	json_object_set_new(op, "request_put", put);
+	json_object_set_new(body, "compare", json_array());
+	json_array_append_new(json_object_get(body, "compare"), compare);
+	json_object_set_new(body, "success", json_array());
+	json_array_append_new(json_object_get(body, "success"), op);
+	free(ekey);
+	free(evalue);
+	r = etcd3_post_(etcd, "kv/txn", body, &dict);
+	if(r)
+	{
+		return r;
+	}
+	r = (json_is_true(json_object_get(dict, "succeeded")) ? 0 : ETCD_E_NODE_EXIST);
+	json_decref(dict);
+	return r;
+}
+
+/* Delete a key, or (if flags includes ETCD_RECURSE) all of the keys which
+ * begin with it
+ */
+int
+etcd3_kv_delete(ETCD *etcd, const char *key, ETCDFLAGS flags)
+{
+	json_t *body, *dict;
+	int r;
+
+	if(!(body = etcd3_range_body_(key, flags)))
+	{
+		return -1;
+	}
+	r = etcd3_post_(etcd, "kv/deleterange", body, &dict);
+	json_decref(dict);
+	return r;
+}
+
+/* Retrieve all of the keys which begin with prefix, invoking fn for each;
+ * revision is set to the store's revision at the time of retrieval, which
+ * is that from which a watch should begin (plus one) to observe subsequent
+ * changes. If fn returns non-zero, the retrieval is abandoned and that
+ * value returned.
+ */
+int
+etcd3_kv_range(ETCD *etcd, const char *prefix, ETCDKVFN fn, void *data, ETCDINDEX *revision)
+{
+	json_t *body, *dict, *kvs;
+	size_t n;
+	int r;
+
+	*revision = 0;
+	if(!(body = etcd3_range_body_(prefix, ETCD_RECURSE)))
+	{
+		return -1;
+	}
+	r = etcd3_post_(etcd, "kv/range", body, &dict);
+	if(r)
+	{
+		return r;
+	}
+	*revision = (ETCDINDEX) etcd3_int_(json_object_get(json_object_get(dict, "header"), "revision"));
+	kvs = json_object_get(dict, "kvs");
+	for(n = 0; !r && n < json_array_size(kvs); n++)
+	{
+		r = etcd3_kv_(json_array_get(kvs, n), 0, fn, data);
+	}
+	json_decref(dict);
+	return r;
+}
+
+/* Watch for changes to the keys which begin with prefix, from revision
+ * start (or from the present if start is zero), until the request is
+ * abandoned (see etcd_set_cancel()), fails, or fn returns non-zero.
+ *
+ * fn is invoked for each change as it arrives, with a NULL value if the
+ * key was deleted, followed by an invocation with a NULL key (and the
+ * store's revision) once each group of changes reported together has been
+ * delivered.
+ *
+ * Returns ETCD_E_INDEX_CLEARED if the history from start has been
+ * compacted, the value returned by fn if it was non-zero, or a non-zero
+ * value on other failures (including being abandoned); returns zero only if
+ * the server ended the stream.
+ */
+int
+etcd3_watch(ETCD *etcd, const char *prefix, ETCDINDEX start, ETCDKVFN fn, void *data)
+{
+	struct etcd3_stream_struct s;
+	int r;
+
+	memset(&s, 0, sizeof(s));
+	s.fn = fn;
+	s.data = data;
+	for(;;)
+	{
+		r = etcd3_watch_once_(etcd, prefix, start, &s);
+		if(!etcd->failover)
+		{
+			break;
+		}
+		/* The watch was abandoned because its endpoint is failing: resume
+		 * it via another from the change following the last delivered
+		 */
+		if(s.last)
+		{
+			start = s.last + 1;
+		}
+		s.status = 0;
+		s.len = 0;
+	}
+	free(s.buf);
+	return r;
+}
+
+/* Perform a single watch request on behalf of etcd3_watch() */
+static int
+etcd3_watch_once_(ETCD *etcd, const char *prefix, ETCDINDEX start, struct etcd3_stream_struct *s)
+{
+	json_t *body, *create, *dict;
+	char *payload, buf[32];
+	CURLcode c;
+	long status;
+	int r;
+
+	body = json_object();
+	if(!body || !(create = etcd3_range_body_(prefix, ETCD_RECURSE)))
+	{
+		json_decref(body);
+		return -1;
+	}
+	if(start)
+	{
+		snprintf(buf, sizeof(buf), "%llu", start);
+		json_object_set_new(create, "start_revision", json_string(buf));
+	}
+	json_object_set_new(body, "create_request", create);
+	payload = json_dumps(body, JSON_COMPACT);
+	json_decref(body);
+	if(!payload)
+	{
+		return -1;
+	}
+	s->ch = etcd_curl_create_(etcd, etcd->url, "watch", NULL);
+	if(!s->ch)
+	{
+		free(payload);
+		return -1;
+	}
+	etcd_curl_wait_(etcd, s->ch);
+	curl_easy_setopt(s->ch, CURLOPT_POSTFIELDS, payload);
+	curl_easy_setopt(s->ch, CURLOPT_WRITEFUNCTION, etcd3_stream_);
+	curl_easy_setopt(s->ch, CURLOPT_WRITEDATA, (void *) s);
+	c = etcd_curl_exec_(etcd, s->ch);
+	status = 0;
+	curl_easy_getinfo(s->ch, CURLINFO_RESPONSE_CODE, &status);
+	etcd_curl_done_(etcd, s->ch);
+	free(payload);
+	if(s->status)
+	{
+		r = s->status;
+	}
+	else if(c != CURLE_OK)
+	{
+		r = c;
+	}
+	else if(status < 200 || status > 299)
+	{
+		/* The body of an error response is buffered rather than parsed
+		 * as a stream
+		 */
+		dict = (s->len ? json_loadb(s->buf, s->len, 0, NULL) : NULL);
+		r = etcd3_error_(dict);
+		json_decref(dict);
+	}
+	else
+	{
+		r = 0;
+	}
+	return r;
+}
+
+/* Perform a request, releasing body; the response (unwrapped from "result",
+ * in the case of a streaming method) is stored in *out if the request
+ * succeeds.
+ */
+static int
+etcd3_post_(ETCD *etcd, const char *method, json_t *body, json_t **out)
+{
+	struct etcd_data_struct data;
+	json_t *dict, *result;
+	char *payload;
+	CURL *ch;
+	CURLcode c;
+	long status;
+	int r;
+
+	*out = NULL;
+	payload = json_dumps(body, JSON_COMPACT);
+	json_decref(body);
+	if(!payload)
+	{
+		return -1;
+	}
+	ch = etcd_curl_create_(etcd, etcd->url, method, NULL);
+	if(!ch)
+	{
+		free(payload);
+		return -1;
+	}
+	/* A transaction (used to create keys which must not already exist)
+	 * fails if repeated, and a repeated grant obtains a second lease
+	 */
+	etcd->idempotent = (strcmp(method, "kv/txn") && strcmp(method, "lease/grant"));
+	curl_easy_setopt(ch, CURLOPT_POSTFIELDS, payload);
+	etcd_curl_borrow_(etcd, ch, &data);
+	c = etcd_curl_exec_(etcd, ch);
+	curl_easy_setopt(ch, CURLOPT_HEADERFUNCTION, NULL);
+	curl_easy_setopt(ch, CURLOPT_HEADERDATA, NULL);
+	status = 0;
+	curl_easy_getinfo(ch, CURLINFO_RESPONSE_CODE, &status);
+	etcd_curl_done_(etcd, ch);
+	free(payload);
+	if(c != CURLE_OK)
+	{
+		etcd_curl_release_(&data);
+		return c;
+	}
+	dict = (data.len ? json_loadb(data.buf, data.len, 0, NULL) : NULL);
+	etcd_curl_release_(&data);
+	if(status < 200 || status > 299 || !dict || json_object_get(dict, "error"))
+	{
+		r = etcd3_error_(dict);
+		json_decref(dict);
+		return r;
+	}
+	result = json_object_get(dict, "result");
+	if(json_is_object(result))
+	{
+		json_incref(result);
+		json_decref(dict);
+		dict = result;
+	}
+	*out = dict;
+	return 0;
+}
+
+/* Map a failure reported by the gateway to an ETCDERROR where possible:
+ * unary methods report {"error":"...","code":N}, and streaming methods
+ * {"error":{"grpc_code":N,...}}, where N is a gRPC status code
+ */
+static int
+etcd3_error_(json_t *dict)
+{
+	json_t *error, *code;
+
+	if(!json_is_object(dict))
+	{
+		return -1;
+	}
+	code = json_object_get(dict, "code");
+	error = json_object_get(dict, "error");
+	if(json_is_object(error))
+	{
+		code = json_object_get(error, "grpc_code");
+	}
+	if(etcd3_int_(code) == ETCD3_GRPC_NOT_FOUND)
+	{
+		return ETCD_E_KEY_NOT_FOUND;
+	}
+	return -1;
+}
+
+/* Construct the body of a request for a key, or (if flags includes
+ * ETCD_RECURSE) for all of the keys which begin with it
+ */
+static json_t *
+etcd3_range_body_(const char *key, ETCDFLAGS flags)
+{
+	json_t *body;
+	char *ekey, *end, *eend;
+
+	body = json_object();
+	ekey = etcd3_encode_(key);
+	if(!body || !ekey)
+	{
+		json_decref(body);
+		free(ekey);
+		return NULL;
+	}
+	json_object_set_new(body, "key", json_string(ekey));
+	free(ekey);
+	if(flags & ETCD_RECURSE)
+	{
+		end = etcd3_range_end_(key);
+		eend = (end ? etcd3_encode_(end) : NULL);
+		free(end);
+		if(!eend)
+		{
+			json_decref(body);
+			return NULL;
+		}
+		json_object_set_new(body, "range_end", json_string(eend));
+		free(eend);
+	}
+	return body;
+}
+
+/* Decode a key-value pair and pass it to fn */
+static int
+etcd3_kv_(json_t *kv, int deleted, ETCDKVFN fn, void *data)
+{
+	char *key, *value;
+	int r;
+
+	key = etcd3_decode_(json_object_get(kv, "key"));
+	value = (deleted ? NULL : etcd3_decode_(json_object_get(kv, "value")));
+	if(!key || (!deleted && !value))
+	{
+		free(key);
+		free(value);
+		return -1;
+	}
+	r = fn(data, key, value, (ETCDINDEX) etcd3_int_(json_object_get(kv, "mod_revision")));
+	free(key);
+	free(value);
+	return r;
+}
+
+/* Receive part of a streaming response, processing each complete message
+ * within it
+ */
+static size_t
+etcd3_stream_(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+	struct etcd3_stream_struct *s;
+	size_t n, start;
+	long status;
+	char *p;
+
+	s = (struct etcd3_stream_struct *) userdata;
+	size *= nmemb;
+	n = s->size;
+	while(n < s->len + size + 1)
+	{
+		n += PAYLOAD_ALLOC_BLOCK;
+	}
+	if(n != s->size)
+	{
+		if(n > MAX_PAYLOAD_SIZE)
+		{
+			return 0;
+		}
+		p = (char *) realloc(s->buf, n);
+		if(!p)
+		{
+			return 0;
+		}
+		s->size = n;
+		s->buf = p;
+	}
+	memcpy(&(s->buf[s->len]), ptr, size);
+	s->len += size;
+	s->buf[s->len] = 0;
+	status = 0;
+	curl_easy_getinfo(s->ch, CURLINFO_RESPONSE_CODE, &status);
+	if(status < 200 || status > 299)
+	{
+		/* Processed by etcd3_watch() once complete */
+		return size;
+	}
+	start = 0;
+	for(n = 0; n < s->len && !s->status; n++)
+	{
+		if(s->buf[n] != '\n')
+		{
+			continue;
+		}
+		if(n > start)
+		{
+			etcd3_message_(s, &(s->buf[start]), n - start);
+		}
+		start = n + 1;
+	}
+	if(s->status)
+	{
+		/* Abandon the request */
+		return 0;
+	}
+	memmove(s->buf, &(s->buf[start]), s->len - start);
+	s->len -= start;
+	s->buf[s->len] = 0;
+	return size;
+}
+
+/* Process a single message received from a watch */
+static void
+etcd3_message_(struct etcd3_stream_struct *s, const char *buf, size_t len)
+{
+	json_t *dict, *result, *events, *event, *type;
+	size_t n;
+	int r, deleted;
+
+	dict = json_loadb(buf, len, 0, NULL);
+	if(!dict)
+	{
+		s->status = -1;
+		return;
+	}
+	result = json_object_get(dict, "result");
+	if(json_object_get(dict, "error") || !json_is_object(result))
+	{
+		s->status = etcd3_error_(dict);
+		json_decref(dict);
+		return;
+	}
+	if(etcd3_int_(json_object_get(result, "compact_revision")) > 0)
+	{
+		/* The history we asked for is no longer available */
+		s->status = ETCD_E_INDEX_CLEARED;
+		json_decref(dict);
+		return;
+	}
+	if(json_is_true(json_object_get(result, "canceled")))
+	{
+		s->status = -1;
+		json_decref(dict);
+		return;
+	}
+	events = json_object_get(result, "events");
+	r = 0;
+	for(n = 0; !r && n < json_array_size(events); n++)
+	{
+		event = json_array_get(events, n);
+		/* The type is omitted for puts, being the default */
+		type = json_object_get(event, "type");
+		deleted = (json_is_string(type) && !strcmp(json_string_value(type), "DELETE"));
+		r = etcd3_kv_(json_object_get(event, "kv"), deleted, s->fn, s->data);
+		if(!r)
+		{
+			s->last = (ETCDINDEX) etcd3_int_(json_object_get(json_object_get(event, "kv"), "mod_revision"));
+		}
+	}
+	if(!r && json_array_size(events))
+	{
+		r = s->fn(s->data, NULL, NULL, (ETCDINDEX) etcd3_int_(json_object_get(json_object_get(result, "header"), "revision")));
+	}
+	s->status = r;
+	json_decref(dict);
+}
+
+/* Obtain a 64-bit integer, which may be sent as a string or a number */
+static long long
+etcd3_int_(json_t *value)
+{
+	if(json_is_integer(value))
+	{
+		return (long long) json_integer_value(value);
+	}
+	if(json_is_string(value))
+	{
+		return strtoll(json_string_value(value), NULL, 10);
+	}
+	return 0;
+}
+
+/* Base64-encode a string */
+static char *
+etcd3_encode_(const char *str)
+{
+	const unsigned char *s;
+	unsigned long v;
+	size_t len, n;
+	char *buf, *p;
+
+	s = (const unsigned char *) str;
+	len = strlen(str);
+	buf = (char *) malloc(((len + 2) / 3) * 4 + 1);
+	if(!buf)
+	{
+		return NULL;
+	}
+	p = buf;
+	for(n = 0; n < len; n += 3)
+	{
+		v = (unsigned long) s[n] << 16;
+		if(n + 1 < len)
+		{
+			v |= (unsigned long) s[n + 1] << 8;
+		}
+		if(n + 2 < len)
+		{
+			v |= s[n + 2];
+		}
+		p[0] = etcd3_base64_[(v >> 18) & 63];
+		p[1] = etcd3_base64_[(v >> 12) & 63];
+		p[2] = (n + 1 < len ? etcd3_base64_[(v >> 6) & 63] : '=');
+		p[3] = (n + 2 < len ? etcd3_base64_[v & 63] : '=');
+		p += 4;
+	}
+	*p = 0;
+	return buf;
+}
+
+/* Decode a base64-encoded string value; a missing value (which the gateway
+ * omits if empty) is decoded as an empty string
+ */
+static char *
+etcd3_decode_(json_t *value)
+{
+	const char *s, *c;
+	unsigned long v;
+	char *buf, *p;
+	int bits;
+
+	s = (json_is_string(value) ? json_string_value(value) : "");
+	buf = (char *) malloc(((strlen(s) + 3) / 4) * 3 + 1);
+	if(!buf)
+	{
+		return NULL;
+	}
+	p = buf;
+	v = 0;
+	bits = 0;
+	for(; *s && *s != '='; s++)
+	{
+		if(!(c = strchr(etcd3_base64_, *s)))
+		{
+			free(buf);
+			return NULL;
+		}
+		v = (v << 6) | (unsigned long) (c - etcd3_base64_);
+		bits += 6;
+		if(bits >= 8)
+		{
+			bits -= 8;
+			*p = (char) ((v >> bits) & 0xff);
+			p++;
+		}
+	}
+	*p = 0;
+	return buf;
+}
+
+/* Obtain the end of the range of keys which begin with prefix: the prefix
+ * with its last byte incremented
+ */
+static char *
+etcd3_range_end_(const char *prefix)
+{
+	char *end;
+	size_t l;
+
+	end = strdup(prefix);
+	if(!end)
+	{
+		return NULL;
+	}
+	for(l = strlen(end); l; l--)
+	{
+		if((unsigned char) end[l - 1] < 0xff)
+		{
+			end[l - 1]++;
+			break;
+		}
+		end[l - 1] = 0;
+	}
+	return end;
+}
@@ -0,0 +1,390 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Asynchronous logging
+ *
+ * When enabled, log messages are formatted by the thread which logs them
+ * into a record in the cluster's log ring, and passed to the logging
+ * callback by a background 'drainer' thread. Writers claim records using
+ * a compare-and-swap on the ring's head and publish them by advancing the
+ * record's sequence number, so logging never waits for a lock, for the
+ * callback, or for the drainer; if the ring is full, the message is
+ * discarded and counted instead.
+ *
+ * The drainer sleeps when the ring is empty; a writer only acquires the
+ * ring's mutex (to wake it) if it has announced that it is sleeping.
+ *
+ * Once created, a cluster's log ring exists until the cluster is destroyed,
+ * so that writers needn't hold the cluster lock to use it.
+ */
+
+#ifdef CLUSTER_LOG_ASYNC
+static void *cluster_log_thread_(void *arg);
+static size_t cluster_log_drain_(CLUSTER *cluster, CLUSTERLOGRING *ring);
+static void cluster_log_reset_(CLUSTERLOGRING *ring);
+static void cluster_log_emit_locked_(CLUSTER *cluster, int priority, const char *format, ...);
+#endif
+
+/* Set whether log messages are passed to the logging callback by a
+ * background thread
+ */
+int
+cluster_set_async_logging(CLUSTER *cluster, int async)
+{
+#ifdef CLUSTER_LOG_ASYNC
+	CLUSTERLOGRING *ring;
+	pthread_condattr_t attr;
+
+	cluster_wrlock_(cluster);
+	ring = cluster->logring;
+	if(!ring)
+	{
+		if(!async)
+		{
+			cluster_unlock_(cluster);
+			return 0;
+		}
+		ring = (CLUSTERLOGRING *) calloc(1, sizeof(CLUSTERLOGRING));
+		if(!ring)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate asynchronous log\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+		ring->cluster = cluster;
+		cluster_log_reset_(ring);
+		pthread_mutex_init(&(ring->lock), NULL);
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&(ring->cond), &attr);
+		pthread_condattr_destroy(&attr);
+		if(pthread_create(&(ring->thread), NULL, cluster_log_thread_, (void *) ring))
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to start asynchronous logging thread\n");
+			pthread_cond_destroy(&(ring->cond));
+			pthread_mutex_destroy(&(ring->lock));
+			free(ring);
+			cluster_unlock_(cluster);
+			return -1;
+		}
+		__atomic_store_n(&(cluster->logring), ring, __ATOMIC_RELEASE);
+	}
+	/* Messages already in the ring are still passed to the callback if
+	 * asynchronous logging is disabled
+	 */
+	__atomic_store_n(&(ring->enabled), (async ? 1 : 0), __ATOMIC_RELEASE);
+	cluster_unlock_(cluster);
+	return 0;
+#else
+	if(async)
+	{
+		cluster_logf_(cluster, LOG_ERR, "libcluster: asynchronous logging is not supported by this build\n");
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+/* Obtain the number of log messages discarded because the asynchronous log
+ * was full
+ */
+unsigned long
+cluster_log_dropped(CLUSTER *cluster)
+{
+#ifdef CLUSTER_LOG_ASYNC
+	CLUSTERLOGRING *ring;
+
+	ring = __atomic_load_n(&(cluster->logring), __ATOMIC_ACQUIRE);
+	if(ring)
+	{
+		return __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+	}
+#else
+	(void) cluster;
+#endif
+	return 0;
+}
+
+/* If asynchronous logging is enabled, format a message into the log ring
+ * (or discard it if the ring is full) and return 1; otherwise, return 0
+ * without using ap. If tag is not NULL, the message relates to the job
+ * with that tag, progress and total.
+ *
+ * The cluster lock need not be held when invoking this function.
+ */
+int
+cluster_log_async_(CLUSTER *cluster, int priority, const char *tag, int progress, int total, const char *format, va_list ap)
+{
+#ifdef CLUSTER_LOG_ASYNC
+	CLUSTERLOGRING *ring;
+	CLUSTERLOGRECORD *rec;
+	unsigned long pos, seq;
+	long diff;
+
+	ring = __atomic_load_n(&(cluster->logring), __ATOMIC_ACQUIRE);
+	if(!ring || !__atomic_load_n(&(ring->enabled), __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+	pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+	for(;;)
+	{
+		rec = &(ring->records[pos & (CLUSTER_LOG_RING - 1)]);
+		seq = __atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE);
+		diff = (long) (seq - pos);
+		if(!diff)
+		{
+			if(__atomic_compare_exchange_n(&(ring->head), &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			{
+				break;
+			}
+		}
+		else if(diff < 0)
+		{
+			/* The record hasn't been read since it was last written */
+			__atomic_fetch_add(&(ring->dropped), 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+		else
+		{
+			pos = __atomic_load_n(&(ring->head), __ATOMIC_RELAXED);
+		}
+	}
+	rec->priority = priority;
+	if(tag)
+	{
+		strncpy(rec->tag, tag, CLUSTER_JOB_TAG_LEN);
+		rec->tag[CLUSTER_JOB_TAG_LEN] = 0;
+	}
+	else
+	{
+		rec->tag[0] = 0;
+	}
+	rec->progress = progress;
+	rec->total = total;
+	vsnprintf(rec->message, sizeof(rec->message), format, ap);
+	__atomic_store_n(&(rec->seq), pos + 1, __ATOMIC_RELEASE);
+	/* Wake the drainer if it has gone to sleep (see cluster_log_thread_()) */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if(__atomic_load_n(&(ring->sleeping), __ATOMIC_RELAXED))
+	{
+		pthread_mutex_lock(&(ring->lock));
+		__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+		pthread_cond_signal(&(ring->cond));
+		pthread_mutex_unlock(&(ring->lock));
+	}
+	return 1;
+#else
+	(void) cluster;
+	(void) priority;
+	(void) tag;
+	(void) progress;
+	(void) total;
+	(void) format;
+	(void) ap;
+	return 0;
+#endif
+}
+
+/* Stop the drainer, once it has passed any remaining messages to the
+ * callback, and free the log ring: invoked when the cluster is destroyed
+ */
+void
+cluster_log_destroy_(CLUSTER *cluster)
+{
+#ifdef CLUSTER_LOG_ASYNC
+	CLUSTERLOGRING *ring;
+
+	ring = cluster->logring;
+	if(!ring)
+	{
+		return;
+	}
+	pthread_mutex_lock(&(ring->lock));
+	ring->stop = 1;
+	__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+	pthread_cond_signal(&(ring->cond));
+	pthread_mutex_unlock(&(ring->lock));
+	pthread_join(ring->thread, NULL);
+	pthread_cond_destroy(&(ring->cond));
+	pthread_mutex_destroy(&(ring->lock));
+	cluster->logring = NULL;
+	free(ring);
+#else
+	(void) cluster;
+#endif
+}
+
+/* Invoked in the child process after a fork(): the drainer doesn't exist
+ * in the child, and records may have been claimed by threads which don't
+ * either, so the ring is emptied and a new drainer started
+ */
+void
+cluster_log_child_(CLUSTER *cluster)
+{
+#ifdef CLUSTER_LOG_ASYNC
+	CLUSTERLOGRING *ring;
+	pthread_condattr_t attr;
+
+	ring = cluster->logring;
+	if(!ring)
+	{
+		return;
+	}
+	cluster_log_reset_(ring);
+	pthread_mutex_init(&(ring->lock), NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&(ring->cond), &attr);
+	pthread_condattr_destroy(&attr);
+	ring->sleeping = 0;
+	ring->stop = 0;
+	pthread_create(&(ring->thread), NULL, cluster_log_thread_, (void *) ring);
+#else
+	(void) cluster;
+#endif
+}
+
+#ifdef CLUSTER_LOG_ASYNC
+/* The drainer: pass messages from the ring to the logging callback until
+ * the cluster is destroyed
+ */
+static void *
+cluster_log_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	CLUSTERLOGRING *ring;
+	struct timespec deadline;
+	unsigned long dropped, reported;
+	int stop;
+
+	ring = (CLUSTERLOGRING *) arg;
+	cluster = ring->cluster;
+	reported = 0;
+	for(;;)
+	{
+		if(cluster_log_drain_(cluster, ring))
+		{
+			continue;
+		}
+		dropped = __atomic_load_n(&(ring->dropped), __ATOMIC_RELAXED);
+		if(dropped != reported)
+		{
+			cluster_rdlock_(cluster);
+			cluster_log_emit_locked_(cluster, LOG_WARNING, "libcluster: %lu log messages were discarded because the asynchronous log was full\n", dropped - reported);
+			cluster_unlock_(cluster);
+			reported = dropped;
+		}
+		/* Announce that we're going to sleep, then check once more for
+		 * messages: a writer either sees the announcement (and wakes us),
+		 * or published its message before the check
+		 */
+		__atomic_store_n(&(ring->sleeping), 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&(ring->records[ring->tail & (CLUSTER_LOG_RING - 1)].seq), __ATOMIC_ACQUIRE) == ring->tail + 1)
+		{
+			__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+			continue;
+		}
+		pthread_mutex_lock(&(ring->lock));
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_sec++;
+		while(__atomic_load_n(&(ring->sleeping), __ATOMIC_RELAXED) && !ring->stop)
+		{
+			if(pthread_cond_timedwait(&(ring->cond), &(ring->lock), &deadline) == ETIMEDOUT)
+			{
+				break;
+			}
+		}
+		__atomic_store_n(&(ring->sleeping), 0, __ATOMIC_RELAXED);
+		stop = ring->stop;
+		pthread_mutex_unlock(&(ring->lock));
+		if(stop && !cluster_log_drain_(cluster, ring))
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/* Pass any messages in the ring to the callback, returning the number of
+ * messages passed
+ */
+static size_t
+cluster_log_drain_(CLUSTER *cluster, CLUSTERLOGRING *ring)
+{
+	CLUSTERLOGRECORD *rec;
+	size_t count;
+
+	for(count = 0; ; count++)
+	{
+		rec = &(ring->records[ring->tail & (CLUSTER_LOG_RING - 1)]);
+		if(__atomic_load_n(&(rec->seq), __ATOMIC_ACQUIRE) != ring->tail + 1)
+		{
+			break;
+		}
+		cluster_rdlock_(cluster);
+		if(rec->tag[0])
+		{
+			cluster_log_emit_locked_(cluster, rec->priority, "[%s:%d/%d] %s", rec->tag, rec->progress, rec->total, rec->message);
+		}
+		else
+		{
+			cluster_log_emit_locked_(cluster, rec->priority, "%s", rec->message);
+		}
+		cluster_unlock_(cluster);
+		/* Make the record available to be written again */
+		__atomic_store_n(&(rec->seq), ring->tail + CLUSTER_LOG_RING, __ATOMIC_RELEASE);
+		ring->tail++;
+	}
+	return count;
+}
+
+/* Mark every record in the ring as writable */
+static void
+cluster_log_reset_(CLUSTERLOGRING *ring)
+{
+	unsigned long c;
+
+	ring->head = 0;
+	ring->tail = 0;
+	for(c = 0; c < CLUSTER_LOG_RING; c++)
+	{
+		ring->records[c].seq = c;
+	}
+}
+
+/* Pass a message to the callback; the cluster should be at least
+ * read-locked
+ */
+static void
+cluster_log_emit_locked_(CLUSTER *cluster, int priority, const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	cluster_log_write_locked_(cluster, priority, format, ap);
+	va_end(ap);
+}
+#endif /*CLUSTER_LOG_ASYNC*/
@@ -0,0 +1,458 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Cluster member table management
+ *
+ * The member table is an array of members ordered by instance identifier,
+ * which allows engines to apply individual changes reported by the registry
+ * rather than re-reading the whole membership each time something changes.
+ *
+ * Whenever the ring is rebuilt, an immutable copy of the members in index
+ * order is built alongside it, which is handed out (by reference) to
+ * callers of cluster_members().
+ *
+ * Except for cluster_members() and cluster_members_release(), the cluster
+ * should be write-locked when invoking any of these functions.
+ */
+
+static int cluster_members_slotcmp_(const void *a, const void *b);
+static void cluster_members_retain_(CLUSTERMEMBERSARENA *arena);
+
+#if !defined(CLUSTER_ATOMICS) && defined(WITH_PTHREAD)
+/* Protects the reference counts of membership lists */
+static pthread_mutex_t cluster_members_lock_ = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Obtain the current membership list */
+CLUSTERMEMBERS *
+cluster_members(CLUSTER *cluster)
+{
+	CLUSTERMEMBERSARENA *arena;
+
+	cluster_rdlock_(cluster);
+	if((arena = cluster->membership))
+	{
+		cluster_members_retain_(arena);
+	}
+	cluster_unlock_(cluster);
+	if(!arena)
+	{
+		errno = EPERM;
+		return NULL;
+	}
+	return &(arena->list);
+}
+
+/* Release a membership list, freeing it once the last reference has gone */
+void
+cluster_members_release(CLUSTERMEMBERS *members)
+{
+	CLUSTERMEMBERSARENA *arena;
+	unsigned long refs;
+
+	if(!members)
+	{
+		return;
+	}
+	arena = (CLUSTERMEMBERSARENA *) (void *) members;
+#ifdef CLUSTER_ATOMICS
+	refs = __atomic_sub_fetch(&(arena->refcount), 1, __ATOMIC_ACQ_REL);
+#else
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_members_lock_);
+# endif
+	refs = --arena->refcount;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_members_lock_);
+# endif
+#endif
+	if(!refs)
+	{
+		free(arena);
+	}
+}
+
+/* Grow the member table so that it can hold at least one more entry */
+static int
+cluster_members_grow_(CLUSTER *cluster)
+{
+	CLUSTERMEMBER *p;
+	size_t n;
+
+	if(cluster->nmembers < cluster->memberalloc)
+	{
+		return 0;
+	}
+	n = (cluster->memberalloc ? cluster->memberalloc * 2 : 16);
+	p = (CLUSTERMEMBER *) realloc(cluster->members, n * sizeof(CLUSTERMEMBER));
+	if(!p)
+	{
+		return -1;
+	}
+	cluster->members = p;
+	cluster->memberalloc = n;
+	return 0;
+}
+
+/* Locate a member in the table; if pos is non-NULL, it will be set to the
+ * position the member occupies or (if it is not present) the position at
+ * which it should be inserted.
+ */
+CLUSTERMEMBER *
+cluster_member_find_(CLUSTER *cluster, const char *instid, size_t *pos)
+{
+	size_t lo, hi, mid;
+	int r;
+
+	lo = 0;
+	hi = cluster->nmembers;
+	while(lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		r = strcmp(cluster->members[mid].instid, instid);
+		if(!r)
+		{
+			if(pos)
+			{
+				*pos = mid;
+			}
+			return &(cluster->members[mid]);
+		}
+		if(r < 0)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if(pos)
+	{
+		*pos = lo;
+	}
+	return NULL;
+}
+
+/* Add a member to the table, or update an existing entry. A weight outside
+ * the permitted range (such as that of a member which doesn't publish one)
+ * is treated as 1. Returns 1 if the membership changed as a result, 0 if it
+ * did not, or -1 on error.
+ */
+int
+cluster_member_set_(CLUSTER *cluster, const char *instid, int workers, int weight, int slot, unsigned long long modified)
+{
+	CLUSTERMEMBER *m;
+	size_t pos;
+	char *p;
+
+	if(weight < 1 || weight > CLUSTER_MAX_WEIGHT)
+	{
+		weight = 1;
+	}
+	if((m = cluster_member_find_(cluster, instid, &pos)))
+	{
+		m->modified = modified;
+		if(m->workers == workers && m->weight == weight && m->slot == slot)
+		{
+			return 0;
+		}
+		m->workers = workers;
+		m->weight = weight;
+		m->slot = slot;
+		cluster->memberschanged = 1;
+		return 1;
+	}
+	if(cluster_members_grow_(cluster))
+	{
+		return -1;
+	}
+	p = strdup(instid);
+	if(!p)
+	{
+		return -1;
+	}
+	memmove(&(cluster->members[pos + 1]), &(cluster->members[pos]), (cluster->nmembers - pos) * sizeof(CLUSTERMEMBER));
+	cluster->members[pos].instid = p;
+	cluster->members[pos].workers = workers;
+	cluster->members[pos].weight = weight;
+	cluster->members[pos].slot = slot;
+	cluster->members[pos].modified = modified;
+	cluster->nmembers++;
+	cluster->memberschanged = 1;
+	return 1;
+}
+
+/* Remove a member from the table. Returns 1 if the member was present, or
+ * 0 if it was not.
+ */
+int
+cluster_member_remove_(CLUSTER *cluster, const char *instid)
+{
+	size_t pos;
+
+	if(!cluster_member_find_(cluster, instid, &pos))
+	{
+		return 0;
+	}
+	free(cluster->members[pos].instid);
+	cluster->nmembers--;
+	memmove(&(cluster->members[pos]), &(cluster->members[pos + 1]), (cluster->nmembers - pos) * sizeof(CLUSTERMEMBER));
+	cluster->memberschanged = 1;
+	return 1;
+}
+
+/* Remove any members whose modification marker is less than the one
+ * supplied; returns the number of members removed.
+ */
+int
+cluster_members_expire_(CLUSTER *cluster, unsigned long long before)
+{
+	size_t n, c;
+	int r;
+
+	r = 0;
+	for(n = c = 0; n < cluster->nmembers; n++)
+	{
+		if(cluster->members[n].modified < before)
+		{
+			free(cluster->members[n].instid);
+			r++;
+			continue;
+		}
+		if(c != n)
+		{
+			cluster->members[c] = cluster->members[n];
+		}
+		c++;
+	}
+	cluster->nmembers = c;
+	if(r)
+	{
+		cluster->memberschanged = 1;
+	}
+	return r;
+}
+
+/* Empty the member table */
+void
+cluster_members_clear_(CLUSTER *cluster)
+{
+	size_t n;
+
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		free(cluster->members[n].instid);
+	}
+	if(cluster->nmembers)
+	{
+		cluster->memberschanged = 1;
+	}
+	cluster->nmembers = 0;
+}
+
+/* Set the member table aside, leaving it empty, so that it can be re-read
+ * in full without losing it if that fails
+ */
+void
+cluster_members_stash_(CLUSTER *cluster, CLUSTERMEMBERSTASH *stash)
+{
+	stash->members = cluster->members;
+	stash->nmembers = cluster->nmembers;
+	stash->memberalloc = cluster->memberalloc;
+	stash->memberschanged = cluster->memberschanged;
+	cluster->members = NULL;
+	cluster->nmembers = 0;
+	cluster->memberalloc = 0;
+}
+
+/* Dispose of a member table set aside by cluster_members_stash_(): if
+ * restore is set, it replaces whatever has been read since; otherwise, it
+ * is discarded in favour of it
+ */
+void
+cluster_members_unstash_(CLUSTER *cluster, CLUSTERMEMBERSTASH *stash, int restore)
+{
+	CLUSTERMEMBER *members;
+	size_t n, count;
+
+	if(restore)
+	{
+		members = cluster->members;
+		count = cluster->nmembers;
+		cluster->members = stash->members;
+		cluster->nmembers = stash->nmembers;
+		cluster->memberalloc = stash->memberalloc;
+		cluster->memberschanged = stash->memberschanged;
+	}
+	else
+	{
+		members = stash->members;
+		count = stash->nmembers;
+		/* The table is new, regardless of whether it differs */
+		cluster->memberschanged = 1;
+	}
+	for(n = 0; n < count; n++)
+	{
+		free(members[n].instid);
+	}
+	free(members);
+	stash->members = NULL;
+	stash->nmembers = 0;
+	stash->memberalloc = 0;
+}
+
+/* Obtain the members in the order in which indices are assigned to them:
+ * by instance identifier or, if stable slots are in use, by slot (with any
+ * members which have not claimed one following, by instance identifier).
+ * The array returned has nmembers entries, and is valid until the member
+ * table is next modified.
+ */
+CLUSTERMEMBER **
+cluster_members_order_(CLUSTER *cluster)
+{
+	CLUSTERMEMBER **p;
+	size_t n;
+
+	if(cluster->orderalloc < cluster->memberalloc)
+	{
+		p = (CLUSTERMEMBER **) realloc(cluster->memberorder, cluster->memberalloc * sizeof(CLUSTERMEMBER *));
+		if(!p)
+		{
+			return NULL;
+		}
+		cluster->memberorder = p;
+		cluster->orderalloc = cluster->memberalloc;
+	}
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		cluster->memberorder[n] = &(cluster->members[n]);
+	}
+	if((cluster->flags & CF_SLOTS) && cluster->nmembers > 1)
+	{
+		qsort(cluster->memberorder, cluster->nmembers, sizeof(CLUSTERMEMBER *), cluster_members_slotcmp_);
+	}
+	return cluster->memberorder;
+}
+
+/* qsort() callback used by cluster_members_order_() */
+static int
+cluster_members_slotcmp_(const void *a, const void *b)
+{
+	const CLUSTERMEMBER *ma, *mb;
+
+	ma = *(const CLUSTERMEMBER *const *) a;
+	mb = *(const CLUSTERMEMBER *const *) b;
+	if(ma->slot != mb->slot)
+	{
+		if(ma->slot < 0)
+		{
+			return 1;
+		}
+		if(mb->slot < 0)
+		{
+			return -1;
+		}
+		return (ma->slot < mb->slot ? -1 : 1);
+	}
+	return strcmp(ma->instid, mb->instid);
+}
+
+/* Build the membership list from the members in index order (as obtained
+ * from cluster_members_order_()), replacing the current one; the indices
+ * are assigned in the same way as the ring's.
+ */
+int
+cluster_members_build_locked_(CLUSTER *cluster, CLUSTERMEMBER **order)
+{
+	CLUSTERMEMBERSARENA *arena;
+	CLUSTERMEMBERINFO *info;
+	size_t n, len;
+	char *p;
+	int total, capacity;
+
+	cluster_members_discard_locked_(cluster);
+	len = 0;
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		len += strlen(order[n]->instid) + 1;
+	}
+	arena = (CLUSTERMEMBERSARENA *) malloc(sizeof(CLUSTERMEMBERSARENA) + cluster->nmembers * sizeof(CLUSTERMEMBERINFO) + len);
+	if(!arena)
+	{
+		return -1;
+	}
+	info = (CLUSTERMEMBERINFO *) (void *) (arena + 1);
+	p = (char *) (void *) (info + cluster->nmembers);
+	total = 0;
+	capacity = 0;
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		len = strlen(order[n]->instid) + 1;
+		memcpy(p, order[n]->instid, len);
+		info[n].instid = p;
+		info[n].base = total;
+		info[n].workers = (order[n]->workers > 0 ? order[n]->workers : 0);
+		info[n].weight = order[n]->weight;
+		total += info[n].workers;
+		capacity += info[n].workers * info[n].weight;
+		p += len;
+	}
+	cluster->membership_generation++;
+	arena->refcount = 1;
+	arena->list.generation = cluster->membership_generation;
+	arena->list.total = total;
+	arena->list.capacity = capacity;
+	arena->list.count = cluster->nmembers;
+	arena->list.members = info;
+	cluster->membership = arena;
+	return 0;
+}
+
+/* Release the cluster's reference to the current membership list */
+void
+cluster_members_discard_locked_(CLUSTER *cluster)
+{
+	if(cluster->membership)
+	{
+		cluster_members_release(&(cluster->membership->list));
+		cluster->membership = NULL;
+	}
+}
+
+/* Add a reference to a membership list */
+static void
+cluster_members_retain_(CLUSTERMEMBERSARENA *arena)
+{
+#ifdef CLUSTER_ATOMICS
+	__atomic_add_fetch(&(arena->refcount), 1, __ATOMIC_RELAXED);
+#else
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_members_lock_);
+# endif
+	arena->refcount++;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_members_lock_);
+# endif
+#endif
+}
@@ -21,8 +21,10 @@
 # include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <strings.h>
 # include <ctype.h>
 # include <errno.h>
+# include <time.h>
 
 # ifdef HAVE_UNISTD_H
 #  include <unistd.h>
@@ -46,6 +48,35 @@
 
 # ifdef ENABLE_ETCD
 #  include "libetcd.h"
+/* The shared housekeeping thread requires curl_multi_poll() and
+ * curl_multi_wakeup(), added in libcurl 7.68.0
+ */
+#  if LIBCURL_VERSION_NUM >= 0x074400
+#   define CLUSTER_REACTOR              1
+#  endif
+/* Returned by cluster_etcd_beat_() if a heartbeat must be performed
+ * synchronously
+ */
+#  define CLUSTER_ETCD_BEAT_SYNC        -2
+# endif
+
+/* Warm-start snapshots and shared-memory registries are mapped into memory */
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+
+# ifdef ENABLE_PROBES
+/* USDT (SystemTap-compatible) static probes, in the provider 'libcluster' */
+#  include <sys/sdt.h>
+#  define CLUSTER_PROBE1(name, a)       DTRACE_PROBE1(libcluster, name, a)
+#  define CLUSTER_PROBE2(name, a, b)    DTRACE_PROBE2(libcluster, name, a, b)
+#  define CLUSTER_PROBE3(name, a, b, c) DTRACE_PROBE3(libcluster, name, a, b, c)
+#  define CLUSTER_PROBE4(name, a, b, c, d) DTRACE_PROBE4(libcluster, name, a, b, c, d)
+# else
+#  define CLUSTER_PROBE1(name, a)
+#  define CLUSTER_PROBE2(name, a, b)
+#  define CLUSTER_PROBE3(name, a, b, c)
+#  define CLUSTER_PROBE4(name, a, b, c, d)
 # endif
 
 # include "libcluster.h"
@@ -56,6 +87,11 @@
 # define CLUSTER_DEFAULT_TTL            120
 /* Default etcd refresh time */
 # define CLUSTER_DEFAULT_REFRESH        30
+/* Default etcd connection and request timeouts, in milliseconds (requests
+ * have no timeout by default)
+ */
+# define CLUSTER_DEFAULT_CONNECT_TIMEOUT 2000
+# define CLUSTER_DEFAULT_REQUEST_TIMEOUT 0
 /* Maximum length of a job identifier */
 # define CLUSTER_JOB_ID_LEN             32
 /* Maximum length of a job tag */
@@ -64,6 +100,89 @@
 # define CLUSTER_JOB_LOG_LEN            511
 /* Maximum length of a job name */
 # define CLUSTER_JOB_NAME_LEN           32
+/* Number of free job objects cached by each thread, and retained in the
+ * process-wide pool which the threads' caches are refilled from and spill
+ * into (see job.c)
+ */
+# define CLUSTER_JOB_CACHE              16
+# define CLUSTER_JOB_POOL               256
+/* Number of records in the asynchronous log ring (must be a power of two) */
+# define CLUSTER_LOG_RING               1024
+/* Number of hash buckets used to coalesce queued job updates */
+# define CLUSTER_JOB_BUCKETS            64
+/* Number of trace events kept while the write lock is held */
+# define CLUSTER_TRACE_PENDING          8
+/* Average number of points each worker occupies on the consistent-hash
+ * ring, however the workers are weighted
+ */
+# define CLUSTER_RING_REPLICAS          128
+/* Limits on the size of a ring's bucket table (each must be a power of two) */
+# define CLUSTER_RING_MIN_BUCKETS       256
+# define CLUSTER_RING_MAX_BUCKETS       262144
+/* Number of entries in an in-memory or shared-memory registry table */
+# define CLUSTER_MEM_ENTRIES            4096
+/* Size of the string fields of an in-memory registry entry, including
+ * the terminating NUL
+ */
+# define CLUSTER_MEM_NAME_LEN           64
+/* Maximum number of members in a host state segment or worker pool table */
+# define CLUSTER_SHARED_MEMBERS         4096
+/* Maximum number of workers a member can lease to its children */
+# define CLUSTER_POOL_SLOTS             1024
+/* The longest a thread waits for another process to update shared memory
+ * before checking its cluster's flags; where futexes aren't available, it
+ * polls meanwhile, at intervals growing from CLUSTER_SHARED_POLL_MIN_MS to
+ * CLUSTER_SHARED_POLL_MAX_MS milliseconds
+ */
+# define CLUSTER_SHARED_WAIT            1
+# define CLUSTER_SHARED_POLL_MIN_MS     20
+# define CLUSTER_SHARED_POLL_MAX_MS     500
+
+/* Use lock-free reads of the published cluster state where the compiler
+ * provides the __atomic builtins; otherwise readers take the cluster lock
+ */
+# if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#  define CLUSTER_ATOMICS              1
+# endif
+
+# if defined(ENABLE_LOGGING) && defined(WITH_PTHREAD) && defined(CLUSTER_ATOMICS)
+/* Log messages may be passed to the callback by a background thread,
+ * through a lock-free ring
+ */
+#  define CLUSTER_LOG_ASYNC             1
+# endif
+
+# if defined(ENABLE_MEM) && defined(WITH_POSIX_SHM) && defined(CLUSTER_ATOMICS)
+/* Shared memory segments are initialised and read by other processes
+ * without a lock, and so are only supported with the atomic builtins
+ */
+#  define CLUSTER_MEM_SHARED            1
+/* The membership may be published to other processes on the host */
+#  define CLUSTER_HOST_STATE            1
+#  include <signal.h>
+# endif
+
+# if defined(WITH_PTHREAD) && defined(CLUSTER_ATOMICS) && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+/* Workers may be leased to forked children through an anonymous shared
+ * mapping
+ */
+#  define CLUSTER_WORKER_POOL           1
+#  ifndef MAP_ANONYMOUS
+#   define MAP_ANONYMOUS                MAP_ANON
+#  endif
+#  include <signal.h>
+# endif
+
+# if (defined(CLUSTER_MEM_SHARED) || defined(CLUSTER_WORKER_POOL)) && defined(HAVE_LINUX_FUTEX_H)
+/* Threads waiting for other processes to update shared memory sleep on a
+ * futex until woken by them
+ */
+#  define CLUSTER_SHARED_FUTEX          1
+#  include <limits.h>
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+# endif
 
 /* We only use syslog for the LOG_xxx constants; if they aren't available
  * we can provide generic values instead.
@@ -104,7 +223,20 @@ typedef enum
 {
 	CT_STATIC,
 	CT_ETCD,
-	CT_SQL
+	CT_SQL,
+# ifdef ENABLE_ETCD
+	CT_ETCD3,
+# endif
+# ifdef ENABLE_MEM
+	CT_MEM,
+# endif
+# ifdef CLUSTER_HOST_STATE
+	CT_HOST,
+# endif
+# ifdef CLUSTER_WORKER_POOL
+	/* A child leasing one of its parent's workers */
+	CT_POOL,
+# endif
 } CLUSTERTYPE;
 
 typedef enum
@@ -113,9 +245,441 @@ typedef enum
 	CF_JOINED = (1<<0),
 	CF_LEAVING = (1<<1),
 	CF_VERBOSE = (1<<2),
-	CF_PASSIVE = (1<<3)
+	CF_PASSIVE = (1<<3),
+	/* Housekeeping is performed by the shared thread, rather than by
+	 * per-cluster threads
+	 */
+	CF_SHARED = (1<<4),
+	/* Members claim stable slots, which determine their order */
+	CF_SLOTS = (1<<5),
+	/* The published state was restored from a warm-start snapshot, and
+	 * the join is being completed by the snapshot thread (see snapshot.c)
+	 */
+	CF_PROVISIONAL = (1<<6)
 } CLUSTERFLAGS;
 
+/* Events which wake a cluster's housekeeping threads */
+typedef enum
+{
+	CW_NONE = 0,
+	/* The threads should terminate (raised when CF_LEAVING is set) */
+	CW_LEAVE = (1<<0),
+	/* The registry should be pinged without waiting for the refresh time */
+	CW_PING = (1<<1),
+	/* Queued job updates should be written without waiting for the flush
+	 * interval
+	 */
+	CW_JOBS = (1<<2)
+} CLUSTERWAKE;
+
+/* The states of a job, as recorded in the cluster_job table */
+typedef enum
+{
+	CJS_WAIT,
+	CJS_ACTIVE,
+	CJS_COMPLETE,
+	CJS_FAIL
+} CLUSTERJOBSTATUS;
+
+/* A queued update to a job's persistent state: a copy of the job's state
+ * at the time of its most recent change
+ */
+typedef struct cluster_job_update_struct CLUSTERJOBUPDATE;
+
+struct cluster_job_update_struct
+{
+	/* The next update in the queue (or the free list) */
+	CLUSTERJOBUPDATE *next;
+	/* The next update in the same hash bucket */
+	CLUSTERJOBUPDATE *hnext;
+	char id[CLUSTER_JOB_ID_LEN+1];
+	char parent[CLUSTER_JOB_ID_LEN+1];
+	CLUSTERJOBSTATUS status;
+	int total;
+	int progress;
+	/* Set if the job was created since its row was last written, and so
+	 * the row may not exist yet
+	 */
+	int insert;
+	/* Set if the job's state has changed, and should replace that of any
+	 * existing row; otherwise, an existing row is left as it is
+	 */
+	int overwrite;
+};
+
+# ifdef CLUSTER_LOG_ASYNC
+/* A log message awaiting the asynchronous logging thread */
+typedef struct cluster_log_record_struct CLUSTERLOGRECORD;
+
+struct cluster_log_record_struct
+{
+	/* Equal to the record's next position within the ring while it may be
+	 * written, one greater once it has been written and may be read
+	 */
+	unsigned long seq;
+	int priority;
+	/* The tag, progress and total of the job the message relates to; the
+	 * tag is empty if it doesn't relate to a job
+	 */
+	char tag[CLUSTER_JOB_TAG_LEN+1];
+	int progress;
+	int total;
+	char message[CLUSTER_JOB_LOG_LEN+1];
+};
+
+/* The asynchronous log ring: see log.c */
+typedef struct cluster_log_ring_struct CLUSTERLOGRING;
+
+struct cluster_log_ring_struct
+{
+	CLUSTER *cluster;
+	/* The next position to be written (advanced by writers), and the next
+	 * to be read (used only by the drainer)
+	 */
+	unsigned long head;
+	unsigned long tail;
+	/* The number of messages discarded because the ring was full */
+	unsigned long dropped;
+	/* Non-zero if messages should be written to the ring */
+	int enabled;
+	/* The drainer sleeps on cond, protected by lock, while sleeping is
+	 * set; stop is set when the cluster is destroyed
+	 */
+	int sleeping;
+	int stop;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	CLUSTERLOGRECORD records[CLUSTER_LOG_RING];
+};
+# endif /*CLUSTER_LOG_ASYNC*/
+
+/* Size of the buffer holding a cluster's scope (its key, partition and
+ * environment, as recorded in snapshots and host state segments)
+ */
+# define CLUSTER_SCOPE_LEN              256
+
+/* The contents of a warm-start snapshot file: see snapshot.c */
+typedef struct cluster_snapshot_struct CLUSTERSNAPSHOT;
+
+struct cluster_snapshot_struct
+{
+	uint32_t magic;
+	uint32_t size;
+	/* The (wall-clock) time at which the snapshot was written */
+	int64_t written;
+	int32_t passive;
+	int32_t index;
+	int32_t workers;
+	int32_t total;
+	/* The cluster key, partition and environment, separated by slashes */
+	char scope[CLUSTER_SCOPE_LEN];
+};
+
+# ifdef ENABLE_MEM
+/* An entry in an in-memory registry table: an entry is free if instid is
+ * empty, and disregarded once the (monotonic) time given by expires has
+ * passed
+ */
+typedef struct cluster_mem_entry_struct CLUSTERMEMENTRY;
+
+struct cluster_mem_entry_struct
+{
+	char key[CLUSTER_MEM_NAME_LEN];
+	char env[CLUSTER_MEM_NAME_LEN];
+	char partition[CLUSTER_MEM_NAME_LEN];
+	char instid[CLUSTER_MEM_NAME_LEN];
+	int32_t workers;
+	int32_t weight;
+	int32_t slot;
+	int64_t expires;
+};
+
+/* An in-memory registry table, which may reside in a shared memory
+ * segment: see mem.c
+ */
+typedef struct cluster_mem_table_struct CLUSTERMEMTABLE;
+
+struct cluster_mem_table_struct
+{
+	/* Set once a shared table has been initialised */
+	uint32_t magic;
+	uint32_t size;
+	pthread_mutex_t lock;
+	/* Signalled whenever generation is advanced (private tables only) */
+	pthread_cond_t cond;
+	/* Advanced whenever an entry is added, changed or removed */
+	uint64_t generation;
+	/* The number of entries which have ever been used */
+	uint32_t used;
+	CLUSTERMEMENTRY entries[CLUSTER_MEM_ENTRIES];
+};
+
+/* A process's handle on an in-memory registry table */
+typedef struct cluster_mem_registry_struct CLUSTERMEMREGISTRY;
+
+struct cluster_mem_registry_struct
+{
+	CLUSTERMEMREGISTRY *next;
+	char *name;
+	int shared;
+	unsigned long refcount;
+	CLUSTERMEMTABLE *table;
+};
+# endif /*ENABLE_MEM*/
+
+# if defined(CLUSTER_HOST_STATE) || defined(CLUSTER_WORKER_POOL)
+/* A member in a host state segment or worker pool table */
+typedef struct cluster_shared_member_struct CLUSTERSHAREDMEMBER;
+
+struct cluster_shared_member_struct
+{
+	char instid[CLUSTER_MEM_NAME_LEN];
+	int32_t workers;
+	int32_t weight;
+	int32_t slot;
+};
+# endif
+
+# ifdef CLUSTER_HOST_STATE
+/* A host state segment, into which one process publishes the membership
+ * for others on the host to read: see host.c
+ */
+typedef struct cluster_host_table_struct CLUSTERHOSTTABLE;
+
+struct cluster_host_table_struct
+{
+	/* Set once the segment has been initialised */
+	uint32_t magic;
+	uint32_t size;
+	/* The sequence counter, which is odd while the membership is being
+	 * updated, and the process publishing it (or zero if there is none)
+	 */
+	uint64_t seq;
+	int32_t publisher;
+	/* Non-zero if the members claim stable slots */
+	int32_t slots;
+	uint32_t nmembers;
+	char scope[CLUSTER_SCOPE_LEN];
+	CLUSTERSHAREDMEMBER members[CLUSTER_SHARED_MEMBERS];
+};
+# endif /*CLUSTER_HOST_STATE*/
+
+# ifdef CLUSTER_WORKER_POOL
+/* The table through which a member leases its workers to the children it
+ * forks, one apiece: see pool.c
+ */
+typedef struct cluster_pool_table_struct CLUSTERPOOLTABLE;
+
+struct cluster_pool_table_struct
+{
+	/* The sequence counter, which is odd while the table is being updated
+	 * by the parent
+	 */
+	uint64_t seq;
+	/* The parent's published state: its base index (or -1 if it isn't a
+	 * member), worker count (the number of slots which may be leased) and
+	 * the cluster's total
+	 */
+	int32_t index;
+	int32_t workers;
+	int32_t total;
+	/* Non-zero if the members claim stable slots */
+	int32_t slots;
+	uint32_t nmembers;
+	/* The process ID of the child holding each slot, or zero if free;
+	 * these are only modified by the children
+	 */
+	int32_t holders[CLUSTER_POOL_SLOTS];
+	CLUSTERSHAREDMEMBER members[CLUSTER_SHARED_MEMBERS];
+};
+# endif /*CLUSTER_WORKER_POOL*/
+
+# ifdef ENABLE_ETCD
+/* An etcd v3 lease shared by the clusters in this process which use the
+ * same registry and TTL, and kept alive by a single thread: see etcd3.c
+ */
+typedef struct cluster_etcd3_lease_struct CLUSTERETCD3LEASE;
+
+struct cluster_etcd3_lease_struct
+{
+	CLUSTERETCD3LEASE *next;
+	char *url;
+	int ttl;
+	/* The interval between keepalives: the shortest refresh interval of
+	 * any of the clusters which have used the lease
+	 */
+	int refresh;
+	/* Only used by the keepalive thread once it has started */
+	ETCD *etcd;
+	ETCDLEASE id;
+	/* The clusters using the lease, linked via etcd3_next */
+	CLUSTER *clusters;
+	pthread_t thread;
+	/* Whether the thread is running: it is stopped, without revoking the
+	 * lease, while the process forks
+	 */
+	int running;
+	/* Signalled when the thread should re-examine refresh or stop */
+	pthread_cond_t cond;
+	int stop;
+	/* Non-zero while the thread records the outcome of a keepalive in the
+	 * statistics of the clusters using the lease, without holding
+	 * cluster_etcd3_lock; idle is signalled once it has finished, before
+	 * which none of them can complete detaching
+	 */
+	int busy;
+	pthread_cond_t idle;
+};
+# endif /*ENABLE_ETCD*/
+
+# ifdef ENABLE_SQL
+/* The number of connections to a SQL registry: one each for pinging,
+ * balancing and jobs
+ */
+#  define CLUSTER_SQL_CONNECTIONS       3
+
+/* The connections to a SQL registry shared by the clusters in this process
+ * which use it, along with the single thread which refreshes all of their
+ * entries: see sql.c
+ */
+typedef struct cluster_sql_share_struct CLUSTERSQLSHARE;
+
+struct cluster_sql_share_struct
+{
+	CLUSTERSQLSHARE *next;
+	char *registry;
+	/* Each connection is used by one thread at a time, under its lock
+	 * (which may be acquired while holding a cluster lock, and before
+	 * acquiring cluster_sql_lock, but never while holding it)
+	 */
+	SQL *db[CLUSTER_SQL_CONNECTIONS];
+	pthread_mutex_t dblock[CLUSTER_SQL_CONNECTIONS];
+	/* Masks of the server-side prepared statements created on each */
+	unsigned stmts[CLUSTER_SQL_CONNECTIONS];
+	/* The clusters using the connections, linked via sql_next */
+	CLUSTER *clusters;
+	/* The number of combined membership queries which have been made */
+	unsigned long long fetches;
+	/* The interval between refreshes: the shortest refresh interval of
+	 * any of the clusters which have used the connections
+	 */
+	int refresh;
+	pthread_t thread;
+	/* Signalled when the thread should re-examine refresh or stop */
+	pthread_cond_t cond;
+	int stop;
+	/* Non-zero while the thread records the outcome of a refresh in the
+	 * statistics of the clusters it refreshed, without holding
+	 * cluster_sql_lock; idle is signalled once it has finished, before
+	 * which none of them can complete detaching
+	 */
+	int busy;
+	pthread_cond_t idle;
+};
+
+/* A member's entry, as read by a combined membership query */
+typedef struct cluster_sql_row_struct CLUSTERSQLROW;
+
+struct cluster_sql_row_struct
+{
+	char id[33];
+	char expires[64];
+	int threads;
+	int weight;
+	int slot;
+};
+# endif /*ENABLE_SQL*/
+
+/* A member of the cluster, as last seen in the registry */
+typedef struct cluster_member_struct CLUSTERMEMBER;
+
+struct cluster_member_struct
+{
+	char *instid;
+	int workers;
+	/* The capacity weight of each of the member's workers */
+	int weight;
+	/* The stable slot claimed by the member, or -1 if none */
+	int slot;
+	/* Registry-specific modification marker (e.g., etcd's modifiedIndex) */
+	unsigned long long modified;
+};
+
+/* A member table set aside by cluster_members_stash_() while the table is
+ * re-read in full
+ */
+typedef struct cluster_member_stash_struct CLUSTERMEMBERSTASH;
+
+struct cluster_member_stash_struct
+{
+	CLUSTERMEMBER *members;
+	size_t nmembers;
+	size_t memberalloc;
+	int memberschanged;
+};
+
+/* A membership list returned by cluster_members(), allocated as a single
+ * block along with its members and their identifiers
+ */
+typedef struct cluster_members_arena_struct CLUSTERMEMBERSARENA;
+
+struct cluster_members_arena_struct
+{
+	/* This must be the first member */
+	CLUSTERMEMBERS list;
+	unsigned long refcount;
+};
+
+/* A copy of the member's state, published for lock-free readers */
+typedef struct cluster_published_struct CLUSTERPUBLISHED;
+
+struct cluster_published_struct
+{
+	int joined;
+	int index;
+	int workers;
+	int total;
+	int passive;
+	int provisional;
+};
+
+/* A consistent-hash ring, built from the member table */
+typedef struct cluster_ring_struct CLUSTERRING;
+typedef struct cluster_ring_point_struct CLUSTERRINGPOINT;
+
+struct cluster_ring_point_struct
+{
+	uint32_t point;
+	/* The index of the worker which owns this point */
+	int owner;
+};
+
+struct cluster_ring_struct
+{
+	/* The list of retired rings, and which of the reader counters have
+	 * been seen to be zero since this ring was retired; see ring.c
+	 */
+	CLUSTERRING *next;
+	unsigned int drained;
+	/* The total number of workers, and this member's base index and worker
+	 * count (base is -1 if this member is not present)
+	 */
+	int total;
+	int base;
+	int workers;
+	/* The points on the ring, sorted by position */
+	size_t npoints;
+	CLUSTERRINGPOINT *points;
+	/* The bucket table: the owner of positions (key >> shift), or if that
+	 * range has more than one owner, -(j + 1) where j is the index of the
+	 * first point within it
+	 */
+	size_t nbuckets;
+	unsigned int shift;
+	int32_t *buckets;
+};
+
 struct cluster_struct
 {
 	CLUSTER *next;
@@ -135,14 +699,110 @@ struct cluster_struct
 	int inst_index;
 	int inst_threads;
 	int total_threads;
+	/* The capacity weight of each of this member's workers */
+	int inst_weight;
+	/* Member table, sorted by instance identifier, maintained by engines
+	 * which apply incremental changes
+	 */
+	CLUSTERMEMBER *members;
+	size_t nmembers;
+	size_t memberalloc;
+	/* Set when the member table changes, cleared when the ring is rebuilt */
+	int memberschanged;
+	/* The members in the order in which indices are assigned; see
+	 * cluster_members_order_()
+	 */
+	CLUSTERMEMBER **memberorder;
+	size_t orderalloc;
+	/* The membership list built along with the ring (holding a reference
+	 * of its own), and the generation of the most recent one
+	 */
+	CLUSTERMEMBERSARENA *membership;
+	unsigned long membership_generation;
+	/* The current consistent-hash ring, and rings awaiting release */
+	CLUSTERRING *ring;
+	CLUSTERRING *retired;
+	/* The number of lock-free readers of the ring which registered with
+	 * each of the two counters, and the epoch whose low bit selects the
+	 * counter new readers register with
+	 */
+	unsigned long ring_readers[2];
+	unsigned int ring_epoch;
+	/* Advanced whenever a ring is built or withdrawn, so that a ring built
+	 * without holding the lock isn't published if it has been overtaken
+	 */
+	unsigned long ring_seq;
+	/* The published state and its sequence counter: the counter is odd
+	 * while an update is in progress, and advances by two each time the
+	 * published state changes; see cluster_publish_locked_()
+	 */
+	unsigned long pubseq;
+	CLUSTERPUBLISHED published;
+	/* Runtime statistics: see stats.c */
+	CLUSTERSTATS stats;
+	/* The tracing callback (which is read and written atomically), and
+	 * when the write lock was acquired, if it was acquired while the
+	 * callback was set (otherwise zero); see trace.c
+	 */
+	CLUSTERTRACER tracer;
+	uint64_t locked_at;
+	/* Events which ended while the write lock was held, to be passed to
+	 * the callback once it has been released; only the holder of the
+	 * write lock sets (or clears) these
+	 */
+	CLUSTERTRACE trace_pending[CLUSTER_TRACE_PENDING];
+	int trace_npending;
 	/* Callbacks */
 # ifdef ENABLE_LOGGING
 	void (*logger)(int priority, const char *format, va_list ap);
+# endif
+# ifdef CLUSTER_LOG_ASYNC
+	/* The asynchronous log ring, if asynchronous logging has ever been
+	 * enabled; once created, it exists until the cluster is destroyed
+	 */
+	CLUSTERLOGRING *logring;
 # endif
 	CLUSTERBALANCE balancer;
-# if defined(ENABLE_ETCD) || defined(ENABLE_SQL)
+	CLUSTERDIFFBALANCE diff_balancer;
+	/* The state last passed to the balancing callbacks */
+	CLUSTERSTATE reported;
+	/* The re-balancing settle window: see cluster_set_rebalance_delay() */
+	int settle_delay;
+	int settle_limit;
+	/* The (monotonic) times at which the first deferred change arrived
+	 * and at which re-balancing is due, or zero if no re-balancing has
+	 * been deferred; these are only modified by the thread which performs
+	 * re-balancing
+	 */
+	time_t settle_first;
+	time_t settle_deadline;
+	/* Registry timeouts: see cluster_set_registry_timeouts() */
+	long connect_timeout;
+	long request_timeout;
+	/* The warm-start snapshot file, if any, and the age beyond which its
+	 * contents are disregarded (zero for no limit); see snapshot.c
+	 */
+	char *snapshot;
+	int snapshot_maxage;
+	/* The state restored from the snapshot, which is published in place
+	 * of the current state while CF_PROVISIONAL is set
+	 */
+	int snapshot_index;
+	int snapshot_others;
+# ifdef WITH_PTHREAD
+	/* The thread completing a provisional join, and why it has been asked
+	 * to stop (CLUSTER_SNAPSHOT_xxx), which is protected by wake_lock
+	 */
+	pthread_t snapshot_thread;
+	int snapshot_stop;
+# endif
+# if defined(ENABLE_ETCD) || defined(ENABLE_SQL) || defined(ENABLE_MEM)
 	int ttl;
 	int refresh;
+	/* The stable slot claimed by this member, or -1 if none; only
+	 * modified by whichever thread pings
+	 */
+	int slot;
 # endif
 # ifdef ENABLE_ETCD
 	/* etcd-based clustering */
@@ -150,28 +810,218 @@ struct cluster_struct
 	ETCD *etcd_clusterdir;
 	ETCD *etcd_partitiondir;
 	ETCD *etcd_envdir;
+	/* The directory in which stable slots are claimed */
+	ETCD *etcd_slotdir;
+	/* The modification index the balancer should next wait from */
+	ETCDINDEX etcd_index;
+	/* Set if re-reading the directory failed, in which case it must be
+	 * re-read before waiting for changes again
+	 */
+	int etcd_reload;
+	/* The worker count and weight last written to the registry (the count
+	 * being -1 if our entry must be (re-)written in full); only used by
+	 * whichever thread pings
+	 */
+	int etcd_published;
+	int etcd_weight;
+	/* State belonging to the shared housekeeping thread (see reactor.c):
+	 * these members are protected by the reactor's own lock, or owned by
+	 * the reactor thread while the cluster is attached, rather than being
+	 * protected by the cluster lock
+	 */
+	CLUSTER *reactor_next;
+	ETCD *reactor_dir;
+	char *reactor_prefix;
+	ETCDREQUEST *reactor_watch;
+	ETCDINDEX reactor_index;
+	time_t reactor_ping;
+	time_t reactor_retry;
+	int reactor_state;
+	int reactor_detach;
+	/* The handle used for heartbeats, the heartbeat request outstanding
+	 * (if any) and its step, the worker count and weight it is writing, and
+	 * when it began; see cluster_etcd_beat_()
+	 */
+	ETCD *reactor_pingdir;
+	ETCDREQUEST *reactor_beat;
+	int reactor_step;
+	int reactor_threads;
+	int reactor_weight;
+	uint64_t reactor_beatstart;
+	/* Work which may block (processing changes, re-balancing, and claiming
+	 * slots) is handed to the reactor's dispatch thread: the work handed
+	 * over and not yet collected, and when deferred re-balancing is due
+	 * (or zero), are owned by the reactor thread; the remainder, which
+	 * describe the work queued, in progress and completed, are protected
+	 * by the reactor lock
+	 */
+	int reactor_pending;
+	time_t reactor_due;
+	CLUSTER *reactor_qnext;
+	int reactor_queued;
+	int reactor_busy;
+	int reactor_work;
+	int reactor_done;
+	int reactor_status;
+	json_t *reactor_change;
+	int reactor_delay;
+	int reactor_beatfail;
+	time_t reactor_settle;
+	/* etcd v3-based clustering (see etcd3.c), which also uses etcd_index
+	 * (as the revision from which to watch, or zero if the membership must
+	 * be re-read) and etcd_published
+	 */
+	ETCD *etcd3;
+	/* The prefix of the keys of member entries */
+	char *etcd3_prefix;
+	/* The shared lease to which our entries are attached, and the next
+	 * cluster using it (protected by the lease lock)
+	 */
+	CLUSTERETCD3LEASE *etcd3_lease;
+	CLUSTER *etcd3_next;
+	/* The lease under which our entry was last written, or zero if it must
+	 * be (re-)written; only used by whichever thread pings
+	 */
+	ETCDLEASE etcd3_published;
+	/* When a failed write of our entry should be retried, if it has
+	 * failed; only used by the balancer thread
+	 */
+	time_t etcd3_retry;
 # endif /*ENABLE_ETCD*/
 # ifdef ENABLE_SQL
-	SQL *pingdb;
-	SQL *balancedb;
-	SQL *jobdb;
+	/* The connections shared with the other clusters using the registry,
+	 * and the next of those clusters; set while joined
+	 */
+	CLUSTERSQLSHARE *sql_share;
+	CLUSTER *sql_next;
+	/* Non-zero if our entry is refreshed by the share's thread, which
+	 * writes it as the row sql_batchrow, formatted in sql_batchdialect
+	 * while pinging (because that thread never examines the cluster
+	 * itself); all are protected by cluster_sql_lock
+	 */
+	int sql_batched;
+	char *sql_batchrow;
+	int sql_batchdialect;
+	/* Our members, as read by the last combined membership query to
+	 * include us (when our generation number was sql_rowsgen), if
+	 * sql_fetched is non-zero; sql_fetching is the number of the last query
+	 * to include us, and sql_fetchgen our generation number as read by it.
+	 * All are protected by cluster_sql_lock.
+	 */
+	CLUSTERSQLROW *sql_rows;
+	size_t sql_nrows;
+	size_t sql_rowsize;
+	int sql_fetched;
+	unsigned long long sql_fetching;
+	long long sql_fetchgen;
+	long long sql_rowsgen;
+	/* The generation number the membership must reflect when next read,
+	 * or -1 if it must be read afresh; only used while balancing
+	 */
+	long long sql_generation;
+	/* Incremented on each balancing pass, to mark current members */
+	unsigned long long sql_pass;
+	/* The SQL dialect spoken by the registry (CLUSTER_SQL_xxx) */
+	int sql_dialect;
+	/* Non-zero if the registry is a PostgreSQL database, in which case
+	 * changes to our entry are announced on a notification channel
+	 */
+	int sql_notify;
+	char sql_channel[32];
+	/* The worker count and weight last announced (the count being -1 if
+	 * our next ping must be announced); only used by whichever thread pings
+	 */
+	int sql_announced;
+	int sql_announcedweight;
+	/* The earliest expiry time of the members last read, as reported by
+	 * the database server, or an empty string if there were none
+	 */
+	char sql_boundary[64];
+	/* Non-zero if jobs may be claimed using SELECT ... FOR UPDATE SKIP
+	 * LOCKED
+	 */
+	int sql_skiplocked;
+	/* The write-behind queue of job updates, written by the job thread;
+	 * updates are coalesced by job ID via job_hash. The queue is protected
+	 * by job_lock, which must not be held while using a connection.
+	 */
+	pthread_mutex_t job_lock;
+	pthread_t job_thread;
+	CLUSTERJOBUPDATE *job_queue;
+	CLUSTERJOBUPDATE *job_free;
+	CLUSTERJOBUPDATE *job_hash[CLUSTER_JOB_BUCKETS];
+	size_t job_queued;
+	/* Non-zero while the job thread is running and will write updates */
+	int job_accept;
 # endif /*ENABLE_SQL*/
+# ifdef ENABLE_MEM
+	/* In-memory registry clustering */
+	CLUSTERMEMREGISTRY *mem_registry;
+	/* The table generation and the earliest expiry time of the members
+	 * seen by the last balancing pass, and the number of that pass
+	 */
+	uint64_t mem_generation;
+	time_t mem_boundary;
+	unsigned long long mem_pass;
+# endif /*ENABLE_MEM*/
+# ifdef CLUSTER_HOST_STATE
+	/* The host state segment into which this member publishes the
+	 * membership, if any, and the process which has claimed it (or zero)
+	 */
+	char *host_name;
+	CLUSTERHOSTTABLE *host_table;
+	pid_t host_claimed;
+	/* For host state readers (CT_HOST), the sequence number of the
+	 * membership last read, the number of that pass, and the buffer into
+	 * which it's copied
+	 */
+	uint64_t host_seq;
+	unsigned long long host_pass;
+	CLUSTERSHAREDMEMBER *host_buf;
+# endif
+# ifdef CLUSTER_WORKER_POOL
+	/* The table shared with (or, in a child, with the parent and its
+	 * other children), once CLUSTER_FORK_POOL has been selected; it exists
+	 * until the cluster is destroyed
+	 */
+	CLUSTERPOOLTABLE *pool_table;
+	/* Set by the fork preparation handler if the fork is being handled
+	 * by pool.c rather than by the engine
+	 */
+	int pool_forking;
+	/* For children (CT_POOL), the slot leased (or -1), the sequence number
+	 * of the table last read, the number of that pass, and the buffer
+	 * into which the membership is copied
+	 */
+	int pool_slot;
+	uint64_t pool_seq;
+	unsigned long long pool_pass;
+	CLUSTERSHAREDMEMBER *pool_buf;
+# endif
 # ifdef WITH_PTHREAD
 	pthread_t ping_thread;
 	pthread_t balancer_thread;
+	/* Housekeeping threads wait on wake_cond for wake_events (CW_xxx) to
+	 * be raised, or for their deadlines to pass
+	 */
+	pthread_mutex_t wake_lock;
+	pthread_cond_t wake_cond;
+	unsigned int wake_events;
 # endif /*WITH_PTHREAD*/
 };
 
 struct cluster_job_struct
 {
 	CLUSTER *cluster;
+	/* The next free job object in the process-wide pool */
+	CLUSTERJOB *next;
 	char id[CLUSTER_JOB_ID_LEN+1];
 	char parent[CLUSTER_JOB_ID_LEN+1];
 	char tag[CLUSTER_JOB_TAG_LEN+1];
 	char name[CLUSTER_JOB_NAME_LEN+1];
+	CLUSTERJOBSTATUS status;
 	int total;
 	int progress;
-	char *logbuf;
 };
 
 void cluster_logf_(CLUSTER *cluster, int priority, const char *format, ...);
@@ -190,13 +1040,82 @@ void cluster_vlogf_locked_(CLUSTER *cluster, int priority, const char *format, v
 #   define NEED_LOGGING_NOOPS           1
 #  endif
 #  define cluster_vlogf_locked_(c, p, f, a) /* */
+# else
+void cluster_log_write_locked_(CLUSTER *cluster, int priority, const char *format, va_list ap);
 # endif
 
+int cluster_log_async_(CLUSTER *cluster, int priority, const char *tag, int progress, int total, const char *format, va_list ap);
+void cluster_log_destroy_(CLUSTER *cluster);
+void cluster_log_child_(CLUSTER *cluster);
+
 void cluster_rdlock_(CLUSTER *cluster);
 void cluster_wrlock_(CLUSTER *cluster);
 void cluster_unlock_(CLUSTER *cluster);
 
 int cluster_rebalanced_(CLUSTER *cluster);
+int cluster_report_(CLUSTER *cluster, CLUSTERSTATE *state);
+
+uint64_t cluster_stats_start_(void);
+void cluster_stats_record_(CLUSTERHISTOGRAM *hist, uint64_t start);
+void cluster_stats_count_(uint64_t *counter);
+
+uint64_t cluster_trace_begin_(CLUSTER *cluster, CLUSTERTRACEPOINT point);
+void cluster_trace_end_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result);
+void cluster_trace_end_locked_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result);
+void cluster_trace_flush_(CLUSTER *cluster, const CLUSTERTRACE *pending, int npending);
+int cluster_tracing_(CLUSTER *cluster);
+
+int cluster_settle_locked_(CLUSTER *cluster);
+int cluster_settled_locked_(CLUSTER *cluster);
+int cluster_settle_wait_(CLUSTER *cluster);
+time_t cluster_now_(void);
+int cluster_scope_locked_(CLUSTER *cluster, char *buf);
+# ifdef WITH_PTHREAD
+void cluster_wake_init_(CLUSTER *cluster);
+void cluster_wake_(CLUSTER *cluster, CLUSTERWAKE events);
+void cluster_wake_reset_(CLUSTER *cluster);
+CLUSTERWAKE cluster_wait_(CLUSTER *cluster, CLUSTERWAKE events, int seconds);
+int cluster_leaving_(CLUSTER *cluster);
+CLUSTERWAKE cluster_woken_(CLUSTER *cluster, CLUSTERWAKE events);
+# if defined(CLUSTER_MEM_SHARED) || defined(CLUSTER_WORKER_POOL)
+void cluster_shared_wait_(CLUSTER *cluster, uint64_t *word, uint64_t value, time_t boundary);
+void cluster_shared_wake_(uint64_t *word);
+# endif
+# endif
+void cluster_publish_locked_(CLUSTER *cluster);
+
+CLUSTERMEMBER *cluster_member_find_(CLUSTER *cluster, const char *instid, size_t *pos);
+int cluster_member_set_(CLUSTER *cluster, const char *instid, int workers, int weight, int slot, unsigned long long modified);
+int cluster_member_remove_(CLUSTER *cluster, const char *instid);
+int cluster_members_expire_(CLUSTER *cluster, unsigned long long before);
+void cluster_members_clear_(CLUSTER *cluster);
+void cluster_members_stash_(CLUSTER *cluster, CLUSTERMEMBERSTASH *stash);
+void cluster_members_unstash_(CLUSTER *cluster, CLUSTERMEMBERSTASH *stash, int restore);
+CLUSTERMEMBER **cluster_members_order_(CLUSTER *cluster);
+int cluster_members_build_locked_(CLUSTER *cluster, CLUSTERMEMBER **order);
+void cluster_members_discard_locked_(CLUSTER *cluster);
+
+int cluster_ring_members_locked_(CLUSTER *cluster);
+int cluster_ring_static_locked_(CLUSTER *cluster);
+void cluster_ring_clear_locked_(CLUSTER *cluster);
+void cluster_ring_destroy_(CLUSTER *cluster);
+int cluster_ring_lookup_(const CLUSTERRING *ring, uint64_t hash);
+int cluster_ring_search_(const CLUSTERRING *ring, uint32_t key);
+uint32_t cluster_ring_key_(uint64_t hash);
+CLUSTERRING *cluster_ring_acquire_(CLUSTER *cluster, int *reader);
+void cluster_ring_release_(CLUSTER *cluster, int reader);
+
+int cluster_join_engine_(CLUSTER *cluster);
+int cluster_leave_engine_(CLUSTER *cluster);
+
+int cluster_snapshot_join_(CLUSTER *cluster);
+void cluster_snapshot_leave_(CLUSTER *cluster);
+void cluster_snapshot_write_(CLUSTER *cluster, const CLUSTERSTATE *state);
+# ifdef WITH_PTHREAD
+void cluster_snapshot_prepare_(CLUSTER *cluster);
+void cluster_snapshot_child_(CLUSTER *cluster);
+void cluster_snapshot_parent_(CLUSTER *cluster);
+# endif
 
 int cluster_static_join_(CLUSTER *cluster);
 int cluster_static_leave_(CLUSTER *cluster);
@@ -207,6 +1126,26 @@ int cluster_etcd_leave_(CLUSTER *cluster);
 void cluster_etcd_prepare_(CLUSTER *cluster);
 void cluster_etcd_child_(CLUSTER *cluster);
 void cluster_etcd_parent_(CLUSTER *cluster);
+int cluster_etcd_heartbeat_(CLUSTER *cluster);
+int cluster_etcd_beat_(CLUSTER *cluster, ETCD *dir, int step, int status, ETCDREQUEST **request);
+void cluster_etcd_settle_(CLUSTER *cluster);
+int cluster_etcd_changed_(CLUSTER *cluster, ETCD *dir, const char *prefix, int status, ETCDINDEX index, json_t *change);
+int cluster_etcd_workers_(const char *value);
+int cluster_etcd_slot_(const char *value);
+int cluster_etcd_weight_(const char *value);
+void cluster_etcd_format_(CLUSTER *cluster, int slot, char *buf, size_t size);
+
+int cluster_etcd3_join_(CLUSTER *cluster);
+int cluster_etcd3_leave_(CLUSTER *cluster);
+void cluster_etcd3_prepare_(CLUSTER *cluster);
+void cluster_etcd3_child_(CLUSTER *cluster);
+void cluster_etcd3_parent_(CLUSTER *cluster);
+void cluster_etcd3_reinit_(void);
+
+int cluster_reactor_attach_(CLUSTER *cluster, ETCD *dir, ETCD *pingdir, char *prefix);
+int cluster_reactor_detach_(CLUSTER *cluster);
+void cluster_reactor_wake_(void);
+void cluster_reactor_child_(void);
 # endif
 
 # ifdef ENABLE_SQL
@@ -215,9 +1154,51 @@ int cluster_sql_leave_(CLUSTER *cluster);
 void cluster_sql_prepare_(CLUSTER *cluster);
 void cluster_sql_child_(CLUSTER *cluster);
 void cluster_sql_parent_(CLUSTER *cluster);
+void cluster_sql_init_(CLUSTER *cluster);
+void cluster_sql_destroy_(CLUSTER *cluster);
 int cluster_sql_job_create_(CLUSTERJOB *job);
+int cluster_sql_job_update_(CLUSTERJOB *job);
+int cluster_sql_job_claim_(CLUSTER *cluster, int max, CLUSTERJOB **out);
+void cluster_sql_reinit_(void);
+# endif
+
+# ifdef ENABLE_MEM
+int cluster_mem_join_(CLUSTER *cluster);
+int cluster_mem_leave_(CLUSTER *cluster);
+void cluster_mem_prepare_(CLUSTER *cluster);
+void cluster_mem_child_(CLUSTER *cluster);
+void cluster_mem_parent_(CLUSTER *cluster);
+void cluster_mem_reinit_(void);
 # endif
 
+# ifdef CLUSTER_HOST_STATE
+int cluster_host_join_(CLUSTER *cluster);
+int cluster_host_leave_(CLUSTER *cluster);
+void cluster_host_prepare_(CLUSTER *cluster);
+void cluster_host_child_(CLUSTER *cluster);
+void cluster_host_parent_(CLUSTER *cluster);
+void cluster_host_publish_locked_(CLUSTER *cluster);
+void cluster_host_withdraw_locked_(CLUSTER *cluster);
+void cluster_host_destroy_(CLUSTER *cluster);
+# endif
+
+# ifdef CLUSTER_WORKER_POOL
+int cluster_pool_create_locked_(CLUSTER *cluster);
+int cluster_pool_join_(CLUSTER *cluster);
+int cluster_pool_leave_(CLUSTER *cluster);
+int cluster_pool_prepare_(CLUSTER *cluster);
+void cluster_pool_child_(CLUSTER *cluster);
+void cluster_pool_parent_(CLUSTER *cluster);
+void cluster_pool_publish_locked_(CLUSTER *cluster);
+void cluster_pool_ring_locked_(CLUSTER *cluster, CLUSTERRING *ring);
+void cluster_pool_destroy_(CLUSTER *cluster);
+# endif
+
+CLUSTERJOB *cluster_job_alloc_(CLUSTER *cluster, const char *id);
+void cluster_job_reinit_(void);
+const char *cluster_job_status_name_(CLUSTERJOBSTATUS status);
+int cluster_job_status_parse_(const char *name, CLUSTERJOBSTATUS *status);
+
 int cluster_reset_instance_locked_(CLUSTER *cluster);
 
 /* Deprecated public methods retained for binary compatibility */
@@ -0,0 +1,646 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Worker pools
+ *
+ * With CLUSTER_FORK_POOL, a member which forks retains its membership (and
+ * its housekeeping threads) in the parent, and each child is leased one of
+ * the parent's workers instead of joining the registry itself. Forking
+ * therefore causes no registry traffic and no re-balancing.
+ *
+ * When the mode is selected, an anonymous shared mapping is created which
+ * is inherited by every child forked afterwards. Whenever the parent's
+ * state or membership changes, it's copied into the table, guarded by a
+ * sequence counter in the same way as a host state segment (see host.c).
+ * In the child, the cluster becomes a CT_POOL member: it claims the lowest
+ * free slot below the parent's worker count by storing its process ID,
+ * then waits for the counter to change, deriving its state and ring from the parent's:
+ * its index is the parent's base index plus its slot, and it has a single
+ * worker. A child which finds no free slot waits for one to become
+ * available; slots held by children which exited without leaving are
+ * reclaimed once no process with that ID exists.
+ */
+
+#ifdef CLUSTER_WORKER_POOL
+
+/* How often a child without a slot tries to claim one */
+#define CLUSTER_POOL_CLAIM_WAIT         1
+/* How many times a child retries a copy which is being updated */
+#define CLUSTER_POOL_READ_TRIES         100
+
+static int cluster_pool_start_locked_(CLUSTER *cluster);
+static int cluster_pool_claim_locked_(CLUSTER *cluster, int workers);
+static void cluster_pool_release_locked_(CLUSTER *cluster);
+static int cluster_pool_read_(CLUSTER *cluster, CLUSTERPOOLTABLE *copy);
+static int cluster_pool_balance_(CLUSTER *cluster);
+static void cluster_pool_stop_(CLUSTER *cluster);
+static void cluster_pool_forget_(CLUSTER *cluster);
+static void *cluster_pool_thread_(void *arg);
+
+/* Create the table shared with children, if it doesn't already exist, and
+ * publish the current state into it
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+int
+cluster_pool_create_locked_(CLUSTER *cluster)
+{
+	CLUSTERPOOLTABLE *table;
+
+	if(cluster->pool_table)
+	{
+		return 0;
+	}
+	table = (CLUSTERPOOLTABLE *) mmap(NULL, sizeof(CLUSTERPOOLTABLE), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(table == MAP_FAILED)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: failed to map worker pool table: %s\n", strerror(errno));
+		return -1;
+	}
+	/* Anonymous mappings are zero-filled */
+	table->index = -1;
+	cluster->pool_table = table;
+	cluster->pool_slot = -1;
+	cluster_pool_publish_locked_(cluster);
+	return 0;
+}
+
+/* Copy the published state and membership into the table, if this member
+ * leases its workers to its children; invoked whenever either changes
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_pool_publish_locked_(CLUSTER *cluster)
+{
+	CLUSTERPOOLTABLE *table;
+	CLUSTERSHAREDMEMBER *e;
+	uint64_t seq;
+	size_t n, nmembers;
+
+	if(!(table = cluster->pool_table) || cluster->type == CT_POOL)
+	{
+		return;
+	}
+	nmembers = cluster->published.joined ? cluster->nmembers : 0;
+	if(nmembers > CLUSTER_SHARED_MEMBERS)
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: cannot publish %lu members to worker pool\n", (unsigned long) nmembers);
+		nmembers = 0;
+	}
+	for(n = 0; n < nmembers; n++)
+	{
+		if(strlen(cluster->members[n].instid) >= CLUSTER_MEM_NAME_LEN)
+		{
+			cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: cannot publish member '%s' to worker pool\n", cluster->members[n].instid);
+			nmembers = 0;
+		}
+	}
+	seq = __atomic_load_n(&(table->seq), __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->seq), seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for(n = 0; n < nmembers; n++)
+	{
+		e = &(table->members[n]);
+		memset(e->instid, 0, CLUSTER_MEM_NAME_LEN);
+		strcpy(e->instid, cluster->members[n].instid);
+		e->workers = cluster->members[n].workers;
+		e->weight = cluster->members[n].weight;
+		e->slot = cluster->members[n].slot;
+	}
+	__atomic_store_n(&(table->index), (cluster->published.joined && !cluster->published.passive ? cluster->published.index : -1), __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->workers), (cluster->published.workers < CLUSTER_POOL_SLOTS ? cluster->published.workers : CLUSTER_POOL_SLOTS), __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->total), cluster->published.total, __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->slots), ((cluster->flags & CF_SLOTS) ? 1 : 0), __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->nmembers), (uint32_t) nmembers, __ATOMIC_RELAXED);
+	__atomic_store_n(&(table->seq), seq + 2, __ATOMIC_RELEASE);
+	cluster_shared_wake_(&(table->seq));
+}
+
+/* Restrict a child's ring entry to the worker it has leased: invoked once
+ * the ring has been built from the parent's membership
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_pool_ring_locked_(CLUSTER *cluster, CLUSTERRING *ring)
+{
+	if(cluster->type != CT_POOL || ring->base < 0)
+	{
+		return;
+	}
+	if(cluster->pool_slot < 0 || cluster->pool_slot >= ring->workers)
+	{
+		ring->base = -1;
+		ring->workers = 0;
+		return;
+	}
+	ring->base += cluster->pool_slot;
+	ring->workers = 1;
+}
+
+/* Join a cluster as a child leasing one of its parent's workers
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_pool_join_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	if(cluster_pool_start_locked_(cluster))
+	{
+		cluster_unlock_(cluster);
+		cluster_pool_leave_(cluster);
+		return -1;
+	}
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: successfully joined the cluster\n");
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Leave a cluster joined by leasing a worker, releasing the slot
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_pool_leave_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	cluster_pool_stop_(cluster);
+	cluster_pool_release_locked_(cluster);
+	cluster_pool_forget_(cluster);
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Invoked before a parent process forks: returns 1, leaving the cluster
+ * locked, if the fork is handled here rather than by the cluster's engine
+ * (because the cluster leases its workers to its children, or is itself
+ * such a child, in which case its thread is terminated)
+ */
+int
+cluster_pool_prepare_(CLUSTER *p)
+{
+	cluster_wrlock_(p);
+	p->pool_forking = 0;
+	if(p->type == CT_POOL)
+	{
+		cluster_pool_stop_(p);
+		p->pool_forking = 1;
+	}
+	else if(p->pool_table && (p->forkmode & CLUSTER_FORK_POOL) && p->type != CT_STATIC
+# ifdef CLUSTER_HOST_STATE
+		&& p->type != CT_HOST
+# endif
+		)
+	{
+		/* The housekeeping threads continue to run once the lock has been
+		 * released in the parent
+		 */
+		p->pool_forking = 1;
+	}
+	if(!p->pool_forking)
+	{
+		cluster_unlock_(p);
+	}
+	return p->pool_forking;
+}
+
+/* Invoked after fork() in the parent process */
+void
+cluster_pool_parent_(CLUSTER *p)
+{
+	/* The cluster is locked on entry */
+	p->pool_forking = 0;
+	if(p->type == CT_POOL && (p->flags & CF_JOINED))
+	{
+		cluster_wake_reset_(p);
+		pthread_create(&(p->balancer_thread), NULL, cluster_pool_thread_, (void *) p);
+	}
+	cluster_unlock_(p);
+}
+
+/* Invoked after fork() in the child process: a member becomes a child
+ * leasing one of its workers (if it was joined, it claims a slot), while
+ * a child's child claims a slot of its own
+ */
+void
+cluster_pool_child_(CLUSTER *p)
+{
+	int joined;
+
+	/* The cluster was locked by the parent on entry, reset the lock */
+	pthread_rwlock_init(&(p->lock), NULL);
+	cluster_wake_init_(p);
+	cluster_wrlock_(p);
+	p->pool_forking = 0;
+	joined = (p->flags & (CF_JOINED|CF_PROVISIONAL));
+	if(p->type != CT_POOL)
+	{
+		/* None of the parent's threads exist here, and the registry entry
+		 * remains the parent's, so its engine state is abandoned
+		 */
+		p->type = CT_POOL;
+		p->ping_thread = 0;
+		p->balancer_thread = 0;
+# ifdef ENABLE_SQL
+		pthread_mutex_init(&(p->job_lock), NULL);
+		p->job_thread = 0;
+		p->sql_share = NULL;
+		p->sql_next = NULL;
+		p->sql_batched = 0;
+		p->sql_batchrow = NULL;
+		p->sql_fetched = 0;
+		p->job_accept = 0;
+# endif
+# ifdef CLUSTER_HOST_STATE
+		/* The membership is published by the parent, not its children */
+		cluster_host_destroy_(p);
+# endif
+		/* Nor should children overwrite the parent's snapshot */
+		free(p->snapshot);
+		p->snapshot = NULL;
+		p->flags &= ~(CF_JOINED|CF_PROVISIONAL|CF_LEAVING);
+		p->inst_threads = 1;
+	}
+	p->pool_slot = -1;
+	if(joined)
+	{
+		p->flags &= ~CF_JOINED;
+		if(cluster_pool_start_locked_(p))
+		{
+			cluster_pool_forget_(p);
+		}
+	}
+	cluster_unlock_(p);
+}
+
+/* Release a cluster's worker pool resources when it's being destroyed */
+void
+cluster_pool_destroy_(CLUSTER *cluster)
+{
+	if(cluster->pool_table)
+	{
+		munmap(cluster->pool_table, sizeof(CLUSTERPOOLTABLE));
+		cluster->pool_table = NULL;
+	}
+	free(cluster->pool_buf);
+	cluster->pool_buf = NULL;
+}
+
+/* Claim a slot, read the parent's state, and start the thread
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_pool_start_locked_(CLUSTER *cluster)
+{
+	if(!cluster->pool_table)
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: pool: this process was not forked by a member leasing its workers\n");
+		errno = EPERM;
+		return -1;
+	}
+	if(!cluster->pool_buf)
+	{
+		cluster->pool_buf = (CLUSTERSHAREDMEMBER *) calloc(CLUSTER_SHARED_MEMBERS, sizeof(CLUSTERSHAREDMEMBER));
+		if(!cluster->pool_buf)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: pool: failed to allocate membership buffer\n");
+			return -1;
+		}
+	}
+	cluster->inst_index = -1;
+	cluster->inst_threads = 1;
+	cluster->total_threads = 0;
+	/* The ring inherited from the parent must be rebuilt for our slot */
+	cluster->memberschanged = 1;
+	if(cluster_pool_balance_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: pool: failed to perform initial balancing\n");
+		return -1;
+	}
+	cluster_wake_reset_(cluster);
+	pthread_create(&(cluster->balancer_thread), NULL, cluster_pool_thread_, (void *) cluster);
+	cluster->flags |= CF_JOINED;
+	cluster_publish_locked_(cluster);
+	return 0;
+}
+
+/* Claim the lowest free slot below workers, if we hold none (or hold one
+ * which is no longer below it); returns 0 if a slot is held
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_pool_claim_locked_(CLUSTER *cluster, int workers)
+{
+	CLUSTERPOOLTABLE *table;
+	int32_t holder, pid;
+	int n;
+
+	if(cluster->pool_slot >= workers)
+	{
+		/* The parent's worker count has fallen */
+		cluster_pool_release_locked_(cluster);
+	}
+	if(cluster->pool_slot >= 0)
+	{
+		return 0;
+	}
+	table = cluster->pool_table;
+	pid = (int32_t) getpid();
+	for(n = 0; n < workers; n++)
+	{
+		holder = __atomic_load_n(&(table->holders[n]), __ATOMIC_ACQUIRE);
+		if(holder && (!kill((pid_t) holder, 0) || errno == EPERM))
+		{
+			continue;
+		}
+		/* The slot is free, or its holder has exited without leaving */
+		if(__atomic_compare_exchange_n(&(table->holders[n]), &holder, pid, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			cluster->pool_slot = n;
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: leased worker slot %d\n", n);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Release the slot held by this process, if any
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static void
+cluster_pool_release_locked_(CLUSTER *cluster)
+{
+	int32_t pid;
+
+	if(cluster->pool_slot < 0 || !cluster->pool_table)
+	{
+		return;
+	}
+	pid = (int32_t) getpid();
+	__atomic_compare_exchange_n(&(cluster->pool_table->holders[cluster->pool_slot]), &pid, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: released worker slot %d\n", cluster->pool_slot);
+	cluster->pool_slot = -1;
+}
+
+/* Obtain a consistent copy of the table's header, placing the membership
+ * in cluster->pool_buf; returns -1 if no consistent copy could be made
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_pool_read_(CLUSTER *cluster, CLUSTERPOOLTABLE *copy)
+{
+	CLUSTERPOOLTABLE *table;
+	struct timespec ts;
+	uint64_t check;
+	uint32_t n;
+	int tries;
+
+	table = cluster->pool_table;
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000;
+	for(tries = 0; tries < CLUSTER_POOL_READ_TRIES; tries++)
+	{
+		copy->seq = __atomic_load_n(&(table->seq), __ATOMIC_ACQUIRE);
+		if(!(copy->seq & 1))
+		{
+			copy->index = __atomic_load_n(&(table->index), __ATOMIC_RELAXED);
+			copy->workers = __atomic_load_n(&(table->workers), __ATOMIC_RELAXED);
+			copy->total = __atomic_load_n(&(table->total), __ATOMIC_RELAXED);
+			copy->slots = __atomic_load_n(&(table->slots), __ATOMIC_RELAXED);
+			n = __atomic_load_n(&(table->nmembers), __ATOMIC_RELAXED);
+			if(n > CLUSTER_SHARED_MEMBERS)
+			{
+				n = CLUSTER_SHARED_MEMBERS;
+			}
+			memcpy(cluster->pool_buf, table->members, n * sizeof(CLUSTERSHAREDMEMBER));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			check = __atomic_load_n(&(table->seq), __ATOMIC_RELAXED);
+			if(check == copy->seq)
+			{
+				copy->nmembers = n;
+				return 0;
+			}
+		}
+		nanosleep(&ts, NULL);
+	}
+	return -1;
+}
+
+/* Re-read the parent's state, claiming a slot if we have none, and
+ * re-balance
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static int
+cluster_pool_balance_(CLUSTER *cluster)
+{
+	CLUSTERPOOLTABLE copy;
+	CLUSTERSHAREDMEMBER *e;
+	uint64_t start;
+	uint32_t n;
+	int index, workers;
+
+	start = cluster_trace_begin_(cluster, CLUSTER_TRACE_BALANCE);
+	/* Only the header is copied to the stack */
+	if(cluster_pool_read_(cluster, &copy))
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: pool: failed to obtain a consistent copy of the parent's state\n");
+		return -1;
+	}
+	cluster->pool_seq = copy.seq;
+	workers = (copy.workers > 0 ? copy.workers : 0);
+	if(cluster_pool_claim_locked_(cluster, workers) && (cluster->flags & CF_VERBOSE))
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: all %d worker slots are leased\n", workers);
+	}
+	if(copy.slots)
+	{
+		cluster->flags |= CF_SLOTS;
+	}
+	else
+	{
+		cluster->flags &= ~CF_SLOTS;
+	}
+	cluster->pool_pass++;
+	for(n = 0; n < copy.nmembers; n++)
+	{
+		e = &(cluster->pool_buf[n]);
+		e->instid[CLUSTER_MEM_NAME_LEN - 1] = 0;
+		if(!e->instid[0] || e->workers < 0)
+		{
+			continue;
+		}
+		if(cluster_member_set_(cluster, e->instid, e->workers, e->weight, e->slot, cluster->pool_pass) < 0)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: pool: failed to update member table\n");
+			return -1;
+		}
+	}
+	cluster_members_expire_(cluster, cluster->pool_pass);
+	if(cluster->memberschanged)
+	{
+		cluster_stats_count_(&(cluster->stats.changes));
+	}
+	/* The slot may have changed even if the membership hasn't */
+	cluster->memberschanged = 1;
+	cluster_ring_members_locked_(cluster);
+	cluster_stats_record_(&(cluster->stats.balance), start);
+	cluster_trace_end_locked_(cluster, CLUSTER_TRACE_BALANCE, start, 0);
+	index = (copy.index >= 0 && cluster->pool_slot >= 0) ? copy.index + cluster->pool_slot : -1;
+	if(copy.total != cluster->total_threads || index != cluster->inst_index)
+	{
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: cluster %s/%s has re-balanced: new index is %d (was %d), new total is %d (was %d)\n", cluster->key, cluster->env, index, cluster->inst_index, copy.total, cluster->total_threads);
+		cluster->inst_index = index;
+		cluster->total_threads = copy.total;
+		cluster_publish_locked_(cluster);
+		cluster_unlock_(cluster);
+		cluster_rebalanced_(cluster);
+		/* Re-acquire the lock to restore state */
+		cluster_wrlock_(cluster);
+	}
+	return 0;
+}
+
+/* Terminate the thread, if it's running
+ *
+ * The cluster must be write-locked when invoking this function; the lock
+ * will be released while waiting for the thread to terminate.
+ */
+static void
+cluster_pool_stop_(CLUSTER *cluster)
+{
+	CLUSTERFLAGS flags;
+	pthread_t bt;
+
+	if(!cluster->balancer_thread)
+	{
+		return;
+	}
+	flags = cluster->flags;
+	cluster->flags |= CF_LEAVING;
+	cluster_wake_(cluster, CW_LEAVE);
+	bt = cluster->balancer_thread;
+	/* The thread may be waiting for the table to change */
+	cluster_shared_wake_(&(cluster->pool_table->seq));
+	/* Unlock to allow the thread to read the flag */
+	cluster_unlock_(cluster);
+	pthread_join(bt, NULL);
+	/* Re-acquire the lock so that the unwinding can safely complete */
+	cluster_wrlock_(cluster);
+	cluster->balancer_thread = 0;
+	cluster->flags = flags;
+}
+
+/* Discard the cluster's membership state; the table remains mapped, so
+ * that the cluster can be joined again
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+static void
+cluster_pool_forget_(CLUSTER *cluster)
+{
+	cluster->flags &= ~(CF_JOINED|CF_LEAVING);
+	cluster->inst_index = -1;
+	cluster->total_threads = 0;
+	cluster_publish_locked_(cluster);
+	cluster_members_clear_(cluster);
+	cluster_ring_clear_locked_(cluster);
+}
+
+/* A child's thread: wait for the table's sequence counter to change,
+ * re-reading the parent's state whenever it does (or, while we hold no
+ * slot, every CLUSTER_POOL_CLAIM_WAIT seconds), until cluster->flags &
+ * CF_LEAVING is set
+ */
+static void *
+cluster_pool_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	CLUSTERPOOLTABLE *table;
+	time_t retry;
+	uint64_t seen, seq;
+
+	cluster = (CLUSTER *) arg;
+	cluster_rdlock_(cluster);
+	cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: pool: re-balancing thread started for %s/%s\n", cluster->key, cluster->env);
+	table = cluster->pool_table;
+	seen = cluster->pool_seq;
+	cluster_unlock_(cluster);
+	retry = cluster_now_() + CLUSTER_POOL_CLAIM_WAIT;
+	while(!cluster_leaving_(cluster))
+	{
+		seq = __atomic_load_n(&(table->seq), __ATOMIC_ACQUIRE);
+		if(seq & 1)
+		{
+			cluster_shared_wait_(cluster, &(table->seq), seq, 0);
+			continue;
+		}
+		if(seq == seen)
+		{
+			if(cluster_now_() < retry)
+			{
+				cluster_shared_wait_(cluster, &(table->seq), seq, retry);
+				continue;
+			}
+			retry = cluster_now_() + CLUSTER_POOL_CLAIM_WAIT;
+			cluster_rdlock_(cluster);
+			if(cluster->pool_slot >= 0)
+			{
+				cluster_unlock_(cluster);
+				continue;
+			}
+			cluster_unlock_(cluster);
+		}
+		else
+		{
+			cluster_stats_count_(&(cluster->stats.wakeups));
+			cluster_trace_end_(cluster, CLUSTER_TRACE_WAKE, 0, 0);
+		}
+		cluster_wrlock_(cluster);
+		if(cluster->flags & CF_LEAVING)
+		{
+			cluster_unlock_(cluster);
+			break;
+		}
+		if(cluster_pool_balance_(cluster))
+		{
+			cluster_stats_count_(&(cluster->stats.errors));
+			seen = seq;
+		}
+		else
+		{
+			seen = cluster->pool_seq;
+		}
+		cluster_unlock_(cluster);
+	}
+	cluster_logf_(cluster, LOG_DEBUG, "libcluster: pool: re-balancing thread is terminating\n");
+	return NULL;
+}
+
+#endif /*CLUSTER_WORKER_POOL*/
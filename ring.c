@@ -0,0 +1,614 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Consistent-hash ownership
+ *
+ * Each worker of each member is placed at CLUSTER_RING_REPLICAS points on a
+ * 32-bit hash ring, positioned according to the member's instance
+ * identifier and the worker's number within that member, rather than its
+ * current index. A key is owned by the worker holding the first point at or
+ * after the key's position, so that when a member joins or leaves only
+ * the keys nearest to its own points change hands.
+ *
+ * A member's capacity weight determines the number of points each of its
+ * workers holds, and so the share of the keys each owns: workers hold
+ * CLUSTER_RING_REPLICAS points scaled by the ratio of their weight to the
+ * average weight of all of the workers, so that the size of a ring (and
+ * the time taken to build it) depends only upon the number of workers.
+ * A worker's first points are the same whatever their number, so that
+ * where all members have the same weight the ring is the same as one
+ * built before weights existed, and changing a member's weight mostly
+ * moves keys to or from that member's workers.
+ *
+ * Static clusters have no membership list, so a worker's index is used as
+ * its identity instead.
+ *
+ * A ring is built from a copy of the member table, taken while the cluster
+ * is write-locked, without holding the lock, so that readers and the
+ * engines' other threads aren't held up while points are sorted; the lock
+ * is then re-acquired to publish it, unless another ring has been built or
+ * withdrawn in the meantime.
+ *
+ * Rings are immutable once published. A replaced ring is retired rather
+ * than freed immediately, because lock-free readers may still be using it.
+ * Each reader registers with one of a pair of counters before loading the
+ * ring pointer, and deregisters when it has finished; the low bit of the
+ * epoch selects which counter new readers use, and the epoch advances
+ * whenever a ring is replaced, so that the counter used by earlier readers
+ * can drain. Any reader still using a retired ring registered before the
+ * ring was replaced, and so a retired ring is only freed once each counter
+ * has been seen to be zero at some point since then: however long a reader
+ * is stalled, the counter it registered with cannot reach zero until it
+ * has finished.
+ *
+ * Alongside the points, each ring holds a bucket table dividing the ring
+ * into equal ranges: where a whole range belongs to a single worker, its
+ * bucket records that worker, so that most keys can be resolved with one
+ * table lookup rather than a binary search (and so that batches of keys can
+ * be resolved using vector instructions, see filter.c). Otherwise, the
+ * bucket records where the range's points begin, so that only those need
+ * be examined.
+ */
+
+/* The points held by a member's workers, copied from the member table */
+typedef struct cluster_ring_input_struct CLUSTERRINGINPUT;
+
+struct cluster_ring_input_struct
+{
+	uint32_t id;
+	int base;
+	int workers;
+	int replicas;
+};
+
+static CLUSTERRING *cluster_ring_create_(size_t npoints);
+static void cluster_ring_publish_locked_(CLUSTER *cluster, CLUSTERRING *ring);
+static int cluster_ring_compare_(const void *a, const void *b);
+static uint32_t cluster_ring_point_(uint32_t id, int worker, int replica);
+static size_t cluster_ring_add_(CLUSTERRING *ring, size_t c, uint32_t id, int base, int workers, int replicas);
+static void cluster_ring_finish_(CLUSTERRING *ring);
+
+/* Determine the index of the worker which owns the key with the given hash */
+int
+cluster_owner(CLUSTER *cluster, uint64_t hash)
+{
+	CLUSTERRING *ring;
+	int reader, r;
+
+	ring = cluster_ring_acquire_(cluster, &reader);
+	r = cluster_ring_lookup_(ring, hash);
+	cluster_ring_release_(cluster, reader);
+	if(r < 0)
+	{
+		errno = EPERM;
+	}
+	return r;
+}
+
+/* Determine whether a worker of this member owns the key with the given
+ * hash
+ */
+int
+cluster_owns(CLUSTER *cluster, int worker, uint64_t hash)
+{
+	CLUSTERRING *ring;
+	int reader, r;
+
+	ring = cluster_ring_acquire_(cluster, &reader);
+	if(!ring || ring->base < 0)
+	{
+		cluster_ring_release_(cluster, reader);
+		errno = EPERM;
+		return 0;
+	}
+	if(worker < 0 || worker >= ring->workers)
+	{
+		cluster_ring_release_(cluster, reader);
+		errno = EINVAL;
+		return 0;
+	}
+	r = (cluster_ring_lookup_(ring, hash) == ring->base + worker);
+	cluster_ring_release_(cluster, reader);
+	return r;
+}
+
+/* Locate the owner of a key within a ring, returning -1 if there is none */
+int
+cluster_ring_lookup_(const CLUSTERRING *ring, uint64_t hash)
+{
+	uint32_t key;
+
+	if(!ring)
+	{
+		return -1;
+	}
+	key = cluster_ring_key_(hash);
+	if(ring->buckets[key >> ring->shift] >= 0)
+	{
+		return ring->buckets[key >> ring->shift];
+	}
+	return cluster_ring_search_(ring, key);
+}
+
+/* Locate the owner of a position on the ring which falls into a bucket
+ * shared between more than one worker, by scanning the (few) points within
+ * the bucket's range
+ */
+int
+cluster_ring_search_(const CLUSTERRING *ring, uint32_t key)
+{
+	size_t j;
+
+	j = (size_t) -(ring->buckets[key >> ring->shift] + 1);
+	while(j < ring->npoints && ring->points[j].point < key)
+	{
+		j++;
+	}
+	if(j == ring->npoints)
+	{
+		/* Wrap around to the first point */
+		j = 0;
+	}
+	return ring->points[j].owner;
+}
+
+/* Obtain the position of a key on the ring from its (64-bit) hash; the
+ * halves are folded together and then mixed (using the MurmurHash3
+ * finaliser), so that keys with poorly-distributed hashes still spread
+ * evenly around the ring.
+ */
+uint32_t
+cluster_ring_key_(uint64_t hash)
+{
+	uint32_t h;
+
+	h = (uint32_t) hash ^ (uint32_t) (hash >> 32);
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+/* Re-build the ring from the member table, if the membership has changed
+ * since it was last built. The lock is released while the ring is built,
+ * as described above.
+ *
+ * The cluster must be write-locked when invoking this function, and is
+ * write-locked once again when it returns.
+ */
+int
+cluster_ring_members_locked_(CLUSTER *cluster)
+{
+	CLUSTERRING *ring;
+	CLUSTERMEMBER **order, *m;
+	CLUSTERRINGINPUT *input;
+	size_t n, ninput, npoints, c;
+	uint64_t workers, weights;
+	unsigned long seq;
+	uint32_t id;
+	const unsigned char *s;
+	int total, base, mine;
+
+	if(!cluster->memberschanged)
+	{
+		return 0;
+	}
+#ifdef CLUSTER_HOST_STATE
+	cluster_host_publish_locked_(cluster);
+#endif
+#ifdef CLUSTER_WORKER_POOL
+	cluster_pool_publish_locked_(cluster);
+#endif
+	/* Workers are numbered in the same order as by the engines */
+	if(!(order = cluster_members_order_(cluster)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate member order\n");
+		return -1;
+	}
+	if(cluster_members_build_locked_(cluster, order))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate membership list\n");
+	}
+	workers = weights = 0;
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		if(cluster->members[n].workers > 0)
+		{
+			workers += (uint64_t) cluster->members[n].workers;
+			weights += (uint64_t) cluster->members[n].workers * (uint64_t) cluster->members[n].weight;
+		}
+	}
+	if(!workers)
+	{
+		cluster->ring_seq++;
+		cluster_ring_publish_locked_(cluster, NULL);
+		return 0;
+	}
+	if(!(input = (CLUSTERRINGINPUT *) calloc(cluster->nmembers, sizeof(CLUSTERRINGINPUT))))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate hash ring for %lu workers\n", (unsigned long) workers);
+		return -1;
+	}
+	total = 0;
+	base = -1;
+	mine = 0;
+	ninput = 0;
+	npoints = 0;
+	for(n = 0; n < cluster->nmembers; n++)
+	{
+		m = order[n];
+		if(m->workers < 1)
+		{
+			continue;
+		}
+		if(!(cluster->flags & CF_PASSIVE) && !strcmp(m->instid, cluster->instid))
+		{
+			base = total;
+			mine = m->workers;
+		}
+		/* FNV-1a hash of the instance identifier */
+		id = 2166136261U;
+		for(s = (const unsigned char *) m->instid; *s; s++)
+		{
+			id ^= *s;
+			id *= 16777619U;
+		}
+		input[ninput].id = id;
+		input[ninput].base = total;
+		input[ninput].workers = m->workers;
+		/* The ratio of the weight to the average, rounded to the nearest
+		 * point (but never to none)
+		 */
+		input[ninput].replicas = (int) ((CLUSTER_RING_REPLICAS * (uint64_t) m->weight * workers + weights / 2) / weights);
+		if(input[ninput].replicas < 1)
+		{
+			input[ninput].replicas = 1;
+		}
+		npoints += (size_t) m->workers * (size_t) input[ninput].replicas;
+		ninput++;
+		total += m->workers;
+	}
+	seq = ++cluster->ring_seq;
+	cluster->memberschanged = 0;
+	cluster_unlock_(cluster);
+	if((ring = cluster_ring_create_(npoints)))
+	{
+		ring->total = total;
+		ring->base = base;
+		ring->workers = mine;
+		for(c = 0, n = 0; n < ninput; n++)
+		{
+			c = cluster_ring_add_(ring, c, input[n].id, input[n].base, input[n].workers, input[n].replicas);
+		}
+		cluster_ring_finish_(ring);
+	}
+	free(input);
+	cluster_wrlock_(cluster);
+	if(!ring)
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate hash ring with %lu points\n", (unsigned long) npoints);
+		/* Ensure the next pass tries again */
+		cluster->memberschanged = 1;
+		return -1;
+	}
+	if(seq != cluster->ring_seq)
+	{
+		/* Overtaken by another ring, or withdrawn */
+		free(ring);
+		return 0;
+	}
+#ifdef CLUSTER_WORKER_POOL
+	cluster_pool_ring_locked_(cluster, ring);
+#endif
+	cluster_ring_publish_locked_(cluster, ring);
+	return 0;
+}
+
+/* Publish a ring for a static cluster. There is no membership list, so
+ * each worker's index is used as its identity; growing or shrinking the
+ * total therefore only moves keys to or from the workers added or removed.
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+int
+cluster_ring_static_locked_(CLUSTER *cluster)
+{
+	CLUSTERRING *ring;
+	size_t c;
+	int n;
+
+	if(!(ring = cluster_ring_create_((size_t) cluster->total_threads * CLUSTER_RING_REPLICAS)))
+	{
+		cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to allocate hash ring for %d workers\n", cluster->total_threads);
+		return -1;
+	}
+	ring->total = cluster->total_threads;
+	if(!(cluster->flags & CF_PASSIVE))
+	{
+		ring->base = cluster->inst_index;
+		ring->workers = cluster->inst_threads;
+	}
+	for(c = 0, n = 0; n < cluster->total_threads; n++)
+	{
+		c = cluster_ring_add_(ring, c, cluster_ring_key_((uint64_t) n), n, 1, CLUSTER_RING_REPLICAS);
+	}
+	cluster_ring_finish_(ring);
+	cluster->ring_seq++;
+	cluster_ring_publish_locked_(cluster, ring);
+	return 0;
+}
+
+/* Withdraw the current ring (for example, having left the cluster)
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_ring_clear_locked_(CLUSTER *cluster)
+{
+#ifdef CLUSTER_HOST_STATE
+	cluster_host_withdraw_locked_(cluster);
+#endif
+	cluster_members_discard_locked_(cluster);
+	cluster->ring_seq++;
+	cluster_ring_publish_locked_(cluster, NULL);
+}
+
+/* Free the current ring and any retired rings; there must be no concurrent
+ * readers (i.e., the cluster is being destroyed)
+ */
+void
+cluster_ring_destroy_(CLUSTER *cluster)
+{
+	CLUSTERRING *p;
+
+	while((p = cluster->retired))
+	{
+		cluster->retired = p->next;
+		free(p);
+	}
+	free(cluster->ring);
+	cluster->ring = NULL;
+	cluster_members_discard_locked_(cluster);
+}
+
+/* Replace the current ring, retiring the old one; any retired rings which
+ * can no longer be in use by readers are freed.
+ */
+static void
+cluster_ring_publish_locked_(CLUSTER *cluster, CLUSTERRING *ring)
+{
+	CLUSTERRING *old, *p, **pp;
+	unsigned int drained;
+	int c;
+
+	cluster->memberschanged = 0;
+	old = cluster->ring;
+	if(!old && !ring)
+	{
+		return;
+	}
+#ifdef CLUSTER_ATOMICS
+	/* The store must be ordered before the loads of the reader counters
+	 * below, just as a reader's registration is ordered before its load
+	 * of the ring pointer
+	 */
+	__atomic_store_n(&(cluster->ring), ring, __ATOMIC_SEQ_CST);
+#else
+	cluster->ring = ring;
+#endif
+	if(old)
+	{
+		old->drained = 0;
+		old->next = cluster->retired;
+		cluster->retired = old;
+	}
+	drained = 0;
+	for(c = 0; c < 2; c++)
+	{
+#ifdef CLUSTER_ATOMICS
+		if(!__atomic_load_n(&(cluster->ring_readers[c]), __ATOMIC_SEQ_CST))
+#else
+		if(!cluster->ring_readers[c])
+#endif
+		{
+			drained |= (1U << c);
+		}
+	}
+	for(pp = &(cluster->retired); *pp; )
+	{
+		p = *pp;
+		p->drained |= drained;
+		if(p->drained == 3)
+		{
+			*pp = p->next;
+			free(p);
+			continue;
+		}
+		pp = &(p->next);
+	}
+	/* Direct new readers to the other counter, so that this one can drain
+	 * before the ring is next replaced
+	 */
+#ifdef CLUSTER_ATOMICS
+	__atomic_store_n(&(cluster->ring_epoch), cluster->ring_epoch + 1, __ATOMIC_RELAXED);
+#else
+	cluster->ring_epoch++;
+#endif
+}
+
+/* Allocate a ring able to hold npoints points (which must be nonzero) and
+ * its bucket table, as a single block
+ */
+static CLUSTERRING *
+cluster_ring_create_(size_t npoints)
+{
+	CLUSTERRING *ring;
+	size_t nbuckets;
+
+	/* Size the bucket table so that most buckets contain no points */
+	for(nbuckets = CLUSTER_RING_MIN_BUCKETS; nbuckets < npoints * 8 && nbuckets < CLUSTER_RING_MAX_BUCKETS; nbuckets <<= 1)
+	{
+	}
+	ring = (CLUSTERRING *) calloc(1, sizeof(CLUSTERRING) + npoints * sizeof(CLUSTERRINGPOINT) + nbuckets * sizeof(int32_t));
+	if(!ring)
+	{
+		return NULL;
+	}
+	ring->base = -1;
+	ring->npoints = npoints;
+	ring->points = (CLUSTERRINGPOINT *) (void *) (ring + 1);
+	ring->nbuckets = nbuckets;
+	ring->buckets = (int32_t *) (void *) (ring->points + npoints);
+	for(ring->shift = 32; nbuckets > 1; nbuckets >>= 1)
+	{
+		ring->shift--;
+	}
+	return ring;
+}
+
+/* Add the points for a member's workers to a ring, starting at position c;
+ * returns the position following the last point added
+ */
+static size_t
+cluster_ring_add_(CLUSTERRING *ring, size_t c, uint32_t id, int base, int workers, int replicas)
+{
+	int w, r;
+
+	for(w = 0; w < workers; w++)
+	{
+		for(r = 0; r < replicas; r++)
+		{
+			ring->points[c].point = cluster_ring_point_(id, w, r);
+			ring->points[c].owner = base + w;
+			c++;
+		}
+	}
+	return c;
+}
+
+/* Sort the points of a fully-populated ring and then fill its bucket table:
+ * each bucket is set to the owner of every position within its range or,
+ * if the range is divided between more than one worker, to -(j + 1) where
+ * j is the first point within the range.
+ */
+static void
+cluster_ring_finish_(CLUSTERRING *ring)
+{
+	size_t b, j, k;
+	uint32_t lo, hi;
+	int owner;
+
+	qsort(ring->points, ring->npoints, sizeof(CLUSTERRINGPOINT), cluster_ring_compare_);
+	j = 0;
+	for(b = 0; b < ring->nbuckets; b++)
+	{
+		lo = (uint32_t) b << ring->shift;
+		hi = lo | ((((uint32_t) 1) << ring->shift) - 1);
+		/* Skip to the first point at or after the start of the range */
+		while(j < ring->npoints && ring->points[j].point < lo)
+		{
+			j++;
+		}
+		/* Every position in the range up to and including each point
+		 * within it maps to that point, and the remainder to the first
+		 * point following the range (wrapping around if needed)
+		 */
+		owner = ring->points[j < ring->npoints ? j : 0].owner;
+		for(k = j; k < ring->npoints && ring->points[k].point < hi; k++)
+		{
+			if(ring->points[k + 1 < ring->npoints ? k + 1 : 0].owner != owner)
+			{
+				owner = -(int) (j + 1);
+				break;
+			}
+		}
+		ring->buckets[b] = owner;
+	}
+}
+
+/* Obtain the current ring, registering as a reader of it; readers must
+ * call cluster_ring_release_() with the value stored in reader when they
+ * have finished with it
+ */
+CLUSTERRING *
+cluster_ring_acquire_(CLUSTER *cluster, int *reader)
+{
+#ifdef CLUSTER_ATOMICS
+	*reader = (int) (__atomic_load_n(&(cluster->ring_epoch), __ATOMIC_RELAXED) & 1);
+	__atomic_add_fetch(&(cluster->ring_readers[*reader]), 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&(cluster->ring), __ATOMIC_SEQ_CST);
+#else
+	*reader = 0;
+	cluster_rdlock_(cluster);
+	return cluster->ring;
+#endif
+}
+
+void
+cluster_ring_release_(CLUSTER *cluster, int reader)
+{
+#ifdef CLUSTER_ATOMICS
+	__atomic_sub_fetch(&(cluster->ring_readers[reader]), 1, __ATOMIC_RELEASE);
+#else
+	(void) reader;
+	cluster_unlock_(cluster);
+#endif
+}
+
+/* Order ring points by position, then by owner so that the ring is
+ * deterministic in the (unlikely) event of collisions
+ */
+static int
+cluster_ring_compare_(const void *a, const void *b)
+{
+	const CLUSTERRINGPOINT *pa, *pb;
+
+	pa = (const CLUSTERRINGPOINT *) a;
+	pb = (const CLUSTERRINGPOINT *) b;
+	if(pa->point != pb->point)
+	{
+		return (pa->point < pb->point ? -1 : 1);
+	}
+	return (pa->owner < pb->owner ? -1 : (pa->owner > pb->owner));
+}
+
+/* Determine the position of one of a worker's points on the ring; the
+ * points beyond the first CLUSTER_RING_REPLICAS (held by workers weighted
+ * above the average) are distinguished by a second multiplier
+ */
+static uint32_t
+cluster_ring_point_(uint32_t id, int worker, int replica)
+{
+	uint32_t h;
+
+	h = id ^ (((uint32_t) worker * CLUSTER_RING_REPLICAS + (uint32_t) (replica % CLUSTER_RING_REPLICAS) + 1) * 0x9e3779b9U);
+	h ^= (uint32_t) (replica / CLUSTER_RING_REPLICAS) * 0x632be5abU;
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
@@ -0,0 +1,502 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Warm-start snapshots
+ *
+ * If a snapshot file has been configured, this member's state is written
+ * to it (as a single fixed-size record, replaced atomically by renaming a
+ * new copy over it) each time the cluster is re-balanced. When joining,
+ * a valid snapshot for the same cluster allows cluster_join() to return
+ * at once: the state it records is published, flagged as provisional,
+ * and reported to the balancing callback, while the snapshot thread
+ * performs the engine's (synchronous) join, retrying until it succeeds.
+ * Once it has, the flag is cleared and the actual state is reported.
+ *
+ * While CF_PROVISIONAL is set, cluster_publish_locked_() publishes the
+ * snapshot's state in place of the engine's, and cluster_rebalanced_()
+ * does not invoke the callback, so that the engine's own progress isn't
+ * visible until it's complete.
+ */
+
+/* Identifies a snapshot file */
+#define CLUSTER_SNAPSHOT_MAGIC          0x4c435331
+/* The interval between attempts to complete a provisional join */
+#define CLUSTER_SNAPSHOT_RETRY          5
+
+/* Why the snapshot thread has been asked to stop */
+#define CLUSTER_SNAPSHOT_LEAVE          1
+#define CLUSTER_SNAPSHOT_SUSPEND        2
+
+static int cluster_snapshot_read_locked_(CLUSTER *cluster, CLUSTERSNAPSHOT *snap);
+#ifdef WITH_PTHREAD
+static int cluster_snapshot_start_locked_(CLUSTER *cluster);
+static void cluster_snapshot_stop_(CLUSTER *cluster, int why);
+static int cluster_snapshot_stopping_(CLUSTER *cluster, int seconds);
+static void cluster_snapshot_resume_(CLUSTER *cluster, int keep);
+static void *cluster_snapshot_thread_(void *arg);
+#endif
+
+/* Set the path of the warm-start snapshot file, or NULL to disable it */
+int
+cluster_set_snapshot(CLUSTER *cluster, const char *path, int maxage)
+{
+	char *p;
+
+	if(maxage < 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+	cluster_wrlock_(cluster);
+	if(cluster->flags & (CF_JOINED|CF_PROVISIONAL))
+	{
+		cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: cannot alter cluster parameters while joined\n");
+		cluster_unlock_(cluster);
+		errno = EPERM;
+		return -1;
+	}
+	p = NULL;
+	if(path)
+	{
+		p = strdup(path);
+		if(!p)
+		{
+			cluster_logf_locked_(cluster, LOG_CRIT, "libcluster: failed to duplicate snapshot path\n");
+			cluster_unlock_(cluster);
+			return -1;
+		}
+	}
+	free(cluster->snapshot);
+	cluster->snapshot = p;
+	cluster->snapshot_maxage = maxage;
+	if(cluster->flags & CF_VERBOSE)
+	{
+		if(p)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: warm-start snapshot set to <%s>\n", p);
+		}
+		else
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: warm-start snapshot disabled\n");
+		}
+	}
+	cluster_unlock_(cluster);
+	return 0;
+}
+
+/* Join a cluster provisionally, if a snapshot of its state is available:
+ * returns 1 if so (the join being completed by the snapshot thread), or
+ * 0 if the cluster should be joined synchronously.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+int
+cluster_snapshot_join_(CLUSTER *cluster)
+{
+#ifdef WITH_PTHREAD
+	CLUSTERSNAPSHOT snap;
+	CLUSTERSTATE state;
+
+	cluster_wrlock_(cluster);
+	if(!cluster->snapshot || cluster->type == CT_STATIC)
+	{
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	if(cluster_snapshot_read_locked_(cluster, &snap))
+	{
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	cluster->snapshot_index = snap.index;
+	cluster->snapshot_others = snap.total - (snap.passive ? 0 : snap.workers);
+	if(cluster->snapshot_others < 0)
+	{
+		cluster->snapshot_others = 0;
+	}
+	cluster->flags |= CF_PROVISIONAL;
+	cluster_publish_locked_(cluster);
+	memset(&state, 0, sizeof(state));
+	state.index = cluster->published.index;
+	state.workers = cluster->published.workers;
+	state.total = cluster->published.total;
+	state.passive = cluster->published.passive;
+	cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: joined provisionally from snapshot <%s>; this instance has base index %d (%d workers) from a total of %d\n", cluster->snapshot, state.index, state.workers, state.total);
+	cluster_unlock_(cluster);
+	/* The provisional state is reported before the snapshot thread starts,
+	 * so that it can't be reported after the actual state
+	 */
+	cluster_report_(cluster, &state);
+	cluster_wrlock_(cluster);
+	if(cluster_snapshot_start_locked_(cluster))
+	{
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: failed to create thread to complete provisional join: %s\n", strerror(errno));
+		cluster->flags &= ~CF_PROVISIONAL;
+		cluster_publish_locked_(cluster);
+		cluster_unlock_(cluster);
+		return 0;
+	}
+	cluster_unlock_(cluster);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+/* Abandon any provisional join which is in progress, waiting for the
+ * snapshot thread to terminate. If the join has already completed, the
+ * cluster is left joined (and so should be left as normal).
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+void
+cluster_snapshot_leave_(CLUSTER *cluster)
+{
+#ifdef WITH_PTHREAD
+	pthread_t thread;
+
+	cluster_wrlock_(cluster);
+	thread = cluster->snapshot_thread;
+	cluster->snapshot_thread = 0;
+	cluster_unlock_(cluster);
+	if(thread)
+	{
+		cluster_snapshot_stop_(cluster, CLUSTER_SNAPSHOT_LEAVE);
+		pthread_join(thread, NULL);
+	}
+	cluster_wrlock_(cluster);
+	if(cluster->flags & CF_PROVISIONAL)
+	{
+		cluster->flags &= ~CF_PROVISIONAL;
+		cluster_publish_locked_(cluster);
+		cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: abandoned provisional membership\n");
+	}
+	cluster_unlock_(cluster);
+#endif
+}
+
+/* Write the state passed to the balancing callback to the snapshot file.
+ * Failures are logged, but are otherwise of no consequence.
+ *
+ * The cluster lock should not be held when invoking this function.
+ */
+void
+cluster_snapshot_write_(CLUSTER *cluster, const CLUSTERSTATE *state)
+{
+	CLUSTERSNAPSHOT snap;
+	char *path, *tmp;
+	size_t l;
+	ssize_t r;
+	int fd;
+
+	if(!state->passive && state->index < 0)
+	{
+		/* We aren't a member of the cluster */
+		return;
+	}
+	memset(&snap, 0, sizeof(snap));
+	cluster_rdlock_(cluster);
+	if(!cluster->snapshot || cluster->type == CT_STATIC || cluster_scope_locked_(cluster, snap.scope))
+	{
+		cluster_unlock_(cluster);
+		return;
+	}
+	path = strdup(cluster->snapshot);
+	cluster_unlock_(cluster);
+	if(!path)
+	{
+		return;
+	}
+	l = strlen(path) + 8;
+	tmp = (char *) malloc(l);
+	if(!tmp)
+	{
+		free(path);
+		return;
+	}
+	snprintf(tmp, l, "%s.XXXXXX", path);
+	snap.magic = CLUSTER_SNAPSHOT_MAGIC;
+	snap.size = (uint32_t) sizeof(CLUSTERSNAPSHOT);
+	snap.written = (int64_t) time(NULL);
+	snap.passive = state->passive;
+	snap.index = state->index;
+	snap.workers = state->workers;
+	snap.total = state->total;
+	fd = mkstemp(tmp);
+	if(fd == -1)
+	{
+		cluster_logf_(cluster, LOG_WARNING, "libcluster: failed to create snapshot <%s>: %s\n", tmp, strerror(errno));
+		free(tmp);
+		free(path);
+		return;
+	}
+	r = write(fd, &snap, sizeof(snap));
+	if(close(fd) || r != (ssize_t) sizeof(snap) || rename(tmp, path))
+	{
+		cluster_logf_(cluster, LOG_WARNING, "libcluster: failed to write snapshot <%s>: %s\n", path, (r == -1 || r == (ssize_t) sizeof(snap) ? strerror(errno) : "short write"));
+		unlink(tmp);
+	}
+	free(tmp);
+	free(path);
+}
+
+#ifdef WITH_PTHREAD
+/* Invoked before a process forks: a provisional join which is in progress
+ * is suspended once its current attempt has succeeded or failed, and is
+ * resumed after the fork by whichever processes retain the membership
+ */
+void
+cluster_snapshot_prepare_(CLUSTER *cluster)
+{
+	pthread_t thread;
+
+	cluster_wrlock_(cluster);
+	thread = cluster->snapshot_thread;
+	cluster->snapshot_thread = 0;
+	cluster_unlock_(cluster);
+	if(thread)
+	{
+		cluster_snapshot_stop_(cluster, CLUSTER_SNAPSHOT_SUSPEND);
+		pthread_join(thread, NULL);
+	}
+}
+
+/* Invoked after fork() in the child process, once the cluster's lock has
+ * been re-initialised
+ */
+void
+cluster_snapshot_child_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	if((cluster->flags & CF_PROVISIONAL) && (cluster->forkmode & CLUSTER_FORK_CHILD) && (cluster->forkmode & CLUSTER_FORK_PARENT))
+	{
+		cluster_reset_instance_locked_(cluster);
+	}
+	cluster_snapshot_resume_(cluster, (cluster->forkmode & CLUSTER_FORK_CHILD));
+	cluster_unlock_(cluster);
+}
+
+/* Invoked after fork() in the parent process */
+void
+cluster_snapshot_parent_(CLUSTER *cluster)
+{
+	cluster_wrlock_(cluster);
+	cluster_snapshot_resume_(cluster, (cluster->forkmode & CLUSTER_FORK_PARENT));
+	cluster_unlock_(cluster);
+}
+#endif /*WITH_PTHREAD*/
+
+/* Read the snapshot file, returning 0 if it holds a state which can be
+ * used to join the cluster provisionally
+ */
+static int
+cluster_snapshot_read_locked_(CLUSTER *cluster, CLUSTERSNAPSHOT *snap)
+{
+	char scope[CLUSTER_SCOPE_LEN];
+	const CLUSTERSNAPSHOT *p;
+	const char *reason;
+	struct stat sbuf;
+	void *addr;
+	time_t now;
+	int fd;
+
+	if(cluster_scope_locked_(cluster, scope))
+	{
+		return -1;
+	}
+	fd = open(cluster->snapshot, O_RDONLY);
+	if(fd == -1)
+	{
+		if(cluster->flags & CF_VERBOSE)
+		{
+			cluster_logf_locked_(cluster, LOG_DEBUG, "libcluster: cannot open snapshot <%s>: %s\n", cluster->snapshot, strerror(errno));
+		}
+		return -1;
+	}
+	if(fstat(fd, &sbuf) || sbuf.st_size != (off_t) sizeof(CLUSTERSNAPSHOT))
+	{
+		close(fd);
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: ignoring snapshot <%s> which is not a valid snapshot\n", cluster->snapshot);
+		return -1;
+	}
+	addr = mmap(NULL, sizeof(CLUSTERSNAPSHOT), PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED)
+	{
+		cluster_logf_locked_(cluster, LOG_WARNING, "libcluster: failed to map snapshot <%s>: %s\n", cluster->snapshot, strerror(errno));
+		return -1;
+	}
+	p = (const CLUSTERSNAPSHOT *) addr;
+	now = time(NULL);
+	reason = NULL;
+	if(p->magic != CLUSTER_SNAPSHOT_MAGIC || p->size != (uint32_t) sizeof(CLUSTERSNAPSHOT) || p->scope[CLUSTER_SCOPE_LEN - 1] || p->workers < 0 || p->total < 0 || (!p->passive && p->index < 0))
+	{
+		reason = "is not a valid snapshot";
+	}
+	else if(strcmp(p->scope, scope) || !p->passive != !(cluster->flags & CF_PASSIVE))
+	{
+		reason = "is for a different cluster";
+	}
+	else if(cluster->snapshot_maxage && (p->written > (int64_t) now || (int64_t) now - p->written > cluster->snapshot_maxage))
+	{
+		reason = "is out of date";
+	}
+	else
+	{
+		*snap = *p;
+	}
+	munmap(addr, sizeof(CLUSTERSNAPSHOT));
+	if(reason)
+	{
+		cluster_logf_locked_(cluster, LOG_INFO, "libcluster: ignoring snapshot <%s> which %s\n", cluster->snapshot, reason);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef WITH_PTHREAD
+/* Start the snapshot thread */
+static int
+cluster_snapshot_start_locked_(CLUSTER *cluster)
+{
+	int e;
+
+	pthread_mutex_lock(&(cluster->wake_lock));
+	cluster->snapshot_stop = 0;
+	pthread_mutex_unlock(&(cluster->wake_lock));
+	e = pthread_create(&(cluster->snapshot_thread), NULL, cluster_snapshot_thread_, (void *) cluster);
+	if(e)
+	{
+		cluster->snapshot_thread = 0;
+		errno = e;
+		return -1;
+	}
+	return 0;
+}
+
+/* Ask the snapshot thread to stop once its current attempt to join has
+ * finished. The housekeeping threads' wake events aren't used for this,
+ * because the engine may start those threads (having discarded any raised
+ * events) at any point during the attempt.
+ */
+static void
+cluster_snapshot_stop_(CLUSTER *cluster, int why)
+{
+	pthread_mutex_lock(&(cluster->wake_lock));
+	cluster->snapshot_stop = why;
+	pthread_cond_broadcast(&(cluster->wake_cond));
+	pthread_mutex_unlock(&(cluster->wake_lock));
+}
+
+/* Wait for up to the specified number of seconds for the snapshot thread
+ * to be asked to stop, returning why it has (or zero)
+ */
+static int
+cluster_snapshot_stopping_(CLUSTER *cluster, int seconds)
+{
+	struct timespec deadline;
+	int why;
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += seconds;
+	pthread_mutex_lock(&(cluster->wake_lock));
+	while(seconds && !cluster->snapshot_stop)
+	{
+		if(pthread_cond_timedwait(&(cluster->wake_cond), &(cluster->wake_lock), &deadline) == ETIMEDOUT)
+		{
+			break;
+		}
+	}
+	why = cluster->snapshot_stop;
+	pthread_mutex_unlock(&(cluster->wake_lock));
+	return why;
+}
+
+/* Following a fork, resume a suspended provisional join if this process
+ * keeps the membership, otherwise abandon it
+ */
+static void
+cluster_snapshot_resume_(CLUSTER *cluster, int keep)
+{
+	if(!(cluster->flags & CF_PROVISIONAL))
+	{
+		return;
+	}
+	if(keep)
+	{
+		if(!cluster_snapshot_start_locked_(cluster))
+		{
+			return;
+		}
+		cluster_logf_locked_(cluster, LOG_ERR, "libcluster: failed to create thread to complete provisional join: %s\n", strerror(errno));
+	}
+	cluster->flags &= ~CF_PROVISIONAL;
+	cluster_publish_locked_(cluster);
+}
+
+/* The snapshot thread: join the cluster using the registry, which is
+ * retried until it succeeds or the thread is asked to stop
+ */
+static void *
+cluster_snapshot_thread_(void *arg)
+{
+	CLUSTER *cluster;
+	int index, total, why;
+
+	cluster = (CLUSTER *) arg;
+	for(;;)
+	{
+		if(!cluster_join_engine_(cluster))
+		{
+			break;
+		}
+		why = cluster_snapshot_stopping_(cluster, 0);
+		if(why)
+		{
+			return NULL;
+		}
+		cluster_logf_(cluster, LOG_WARNING, "libcluster: failed to confirm provisional membership with the registry; retrying in %d seconds\n", CLUSTER_SNAPSHOT_RETRY);
+		if(cluster_snapshot_stopping_(cluster, CLUSTER_SNAPSHOT_RETRY))
+		{
+			return NULL;
+		}
+	}
+	if(cluster_snapshot_stopping_(cluster, 0) == CLUSTER_SNAPSHOT_LEAVE)
+	{
+		cluster_leave_engine_(cluster);
+		return NULL;
+	}
+	cluster_wrlock_(cluster);
+	index = cluster->published.index;
+	total = cluster->published.total;
+	cluster->flags &= ~CF_PROVISIONAL;
+	cluster_publish_locked_(cluster);
+	cluster_logf_locked_(cluster, LOG_NOTICE, "libcluster: provisional membership confirmed by the registry: base index is %d (was %d), total is %d (was %d)\n", cluster->inst_index, index, cluster->total_threads, total);
+	/* Used only if logging is enabled */
+	(void) index;
+	(void) total;
+	cluster_unlock_(cluster);
+	cluster_rebalanced_(cluster);
+	return NULL;
+}
+#endif /*WITH_PTHREAD*/
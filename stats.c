@@ -0,0 +1,185 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Runtime statistics
+ *
+ * Each cluster's statistics are updated by whichever threads perform the
+ * operations they describe, using relaxed atomic operations so that no
+ * lock need be held; readers may therefore observe a histogram's count
+ * before its buckets (or vice versa), but never a torn value. Where the
+ * compiler doesn't provide the atomic builtins, a lock shared by all
+ * clusters is held instead.
+ */
+
+static void cluster_stats_copy_(CLUSTERHISTOGRAM *restrict dest, CLUSTERHISTOGRAM *restrict src);
+static int cluster_stats_bucket_(uint64_t elapsed);
+
+#if !defined(CLUSTER_ATOMICS) && defined(WITH_PTHREAD)
+/* Protects the statistics of all clusters */
+static pthread_mutex_t cluster_stats_lock_ = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Obtain the cluster's runtime statistics */
+int
+cluster_stats(CLUSTER *cluster, CLUSTERSTATS *out)
+{
+	if(!out)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+#if !defined(CLUSTER_ATOMICS) && defined(WITH_PTHREAD)
+	pthread_mutex_lock(&cluster_stats_lock_);
+#endif
+	cluster_stats_copy_(&(out->ping), &(cluster->stats.ping));
+	cluster_stats_copy_(&(out->balance), &(cluster->stats.balance));
+	cluster_stats_copy_(&(out->rebalance), &(cluster->stats.rebalance));
+	cluster_stats_copy_(&(out->lock_wait), &(cluster->stats.lock_wait));
+#ifdef CLUSTER_ATOMICS
+	out->wakeups = __atomic_load_n(&(cluster->stats.wakeups), __ATOMIC_RELAXED);
+	out->changes = __atomic_load_n(&(cluster->stats.changes), __ATOMIC_RELAXED);
+	out->errors = __atomic_load_n(&(cluster->stats.errors), __ATOMIC_RELAXED);
+	out->retries = __atomic_load_n(&(cluster->stats.retries), __ATOMIC_RELAXED);
+#else
+	out->wakeups = cluster->stats.wakeups;
+	out->changes = cluster->stats.changes;
+	out->errors = cluster->stats.errors;
+	out->retries = cluster->stats.retries;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_stats_lock_);
+# endif
+#endif
+	return 0;
+}
+
+/* Obtain the time at which an operation began, for passing to
+ * cluster_stats_record_(), in microseconds from an arbitrary epoch
+ */
+uint64_t
+cluster_stats_start_(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + ((uint64_t) ts.tv_nsec / 1000);
+}
+
+/* Record the duration of an operation which began at start in a
+ * histogram
+ */
+void
+cluster_stats_record_(CLUSTERHISTOGRAM *hist, uint64_t start)
+{
+	uint64_t now, elapsed;
+	int bucket;
+#ifdef CLUSTER_ATOMICS
+	uint64_t max;
+#endif
+
+	now = cluster_stats_start_();
+	elapsed = (now > start ? now - start : 0);
+	bucket = cluster_stats_bucket_(elapsed);
+#ifdef CLUSTER_ATOMICS
+	__atomic_fetch_add(&(hist->buckets[bucket]), 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(hist->total_us), elapsed, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(hist->count), 1, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&(hist->max_us), __ATOMIC_RELAXED);
+	while(elapsed > max &&
+		  !__atomic_compare_exchange_n(&(hist->max_us), &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#else
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_stats_lock_);
+# endif
+	hist->buckets[bucket]++;
+	hist->total_us += elapsed;
+	hist->count++;
+	if(elapsed > hist->max_us)
+	{
+		hist->max_us = elapsed;
+	}
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_stats_lock_);
+# endif
+#endif
+}
+
+/* Increment one of a cluster's statistics counters */
+void
+cluster_stats_count_(uint64_t *counter)
+{
+#ifdef CLUSTER_ATOMICS
+	__atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+#else
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_stats_lock_);
+# endif
+	(*counter)++;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_stats_lock_);
+# endif
+#endif
+}
+
+/* Determine which histogram bucket a duration falls into: bucket n holds
+ * durations of less than 2^n microseconds (and at least 2^(n-1))
+ */
+static int
+cluster_stats_bucket_(uint64_t elapsed)
+{
+	int bucket;
+
+#if defined(__GNUC__)
+	bucket = (elapsed ? 64 - __builtin_clzll(elapsed) : 0);
+#else
+	for(bucket = 0; elapsed; bucket++)
+	{
+		elapsed >>= 1;
+	}
+#endif
+	if(bucket >= CLUSTER_STATS_BUCKETS)
+	{
+		bucket = CLUSTER_STATS_BUCKETS - 1;
+	}
+	return bucket;
+}
+
+/* Copy a histogram; where the atomic builtins aren't available, the
+ * statistics lock should be held when invoking this function
+ */
+static void
+cluster_stats_copy_(CLUSTERHISTOGRAM *restrict dest, CLUSTERHISTOGRAM *restrict src)
+{
+#ifdef CLUSTER_ATOMICS
+	size_t n;
+
+	dest->count = __atomic_load_n(&(src->count), __ATOMIC_RELAXED);
+	dest->total_us = __atomic_load_n(&(src->total_us), __ATOMIC_RELAXED);
+	dest->max_us = __atomic_load_n(&(src->max_us), __ATOMIC_RELAXED);
+	for(n = 0; n < CLUSTER_STATS_BUCKETS; n++)
+	{
+		dest->buckets[n] = __atomic_load_n(&(src->buckets[n]), __ATOMIC_RELAXED);
+	}
+#else
+	*dest = *src;
+#endif
+}
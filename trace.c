@@ -0,0 +1,264 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "p_libcluster.h"
+
+/* Tracing
+ *
+ * The housekeeping threads mark the beginning and end of each operation
+ * of interest with cluster_trace_begin_() and cluster_trace_end_(), which
+ * fire the corresponding static probes (if built with --enable-probes) and
+ * pass an event to the cluster's tracing callback, if one has been set.
+ * Neither takes the cluster lock, or logs anything, so that tracing
+ * perturbs the timing of what is being traced as little as possible. The
+ * time returned by cluster_trace_begin_() is read from the clock whether or
+ * not anything is being traced, because the statistics also need it; when
+ * there are neither probes nor a callback, cluster_trace_end_() costs only
+ * a single atomic load.
+ *
+ * The callback is never invoked with the write lock held: events which
+ * end while it is held are passed to cluster_trace_end_locked_(), which
+ * keeps up to CLUSTER_TRACE_PENDING of them (any more are discarded) until
+ * cluster_unlock_() has released the lock.
+ *
+ * The probes, in the provider 'libcluster', are:
+ *
+ *   ping__start, fetch__start, balance__start, rebalance__start
+ *       (cluster, generation)
+ *   ping__done, fetch__done, balance__done, rebalance__done
+ *       (cluster, duration in microseconds, generation, result)
+ *   wake (cluster, generation)
+ *   lock__acquire (cluster, non-zero for a write lock, non-zero if
+ *       contended)
+ *   lock__release (cluster)
+ *
+ * The lock probes are fired by cluster_rdlock_(), cluster_wrlock_() and
+ * cluster_unlock_() themselves, on every acquisition and release.
+ */
+
+static CLUSTERTRACER cluster_trace_event_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result, CLUSTERTRACE *trace);
+static unsigned long cluster_trace_generation_(CLUSTER *cluster);
+static CLUSTERTRACER cluster_trace_tracer_(CLUSTER *cluster);
+
+#if !defined(CLUSTER_ATOMICS) && defined(WITH_PTHREAD)
+/* Protects the tracing callbacks of all clusters */
+static pthread_mutex_t cluster_trace_lock_ = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* Set the tracing callback */
+int
+cluster_set_tracer(CLUSTER *cluster, CLUSTERTRACER tracer)
+{
+#ifdef CLUSTER_ATOMICS
+	__atomic_store_n(&(cluster->tracer), tracer, __ATOMIC_RELEASE);
+#else
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_trace_lock_);
+# endif
+	cluster->tracer = tracer;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_trace_lock_);
+# endif
+#endif
+	return 0;
+}
+
+/* Determine whether a tracing callback has been set */
+int
+cluster_tracing_(CLUSTER *cluster)
+{
+	return (cluster_trace_tracer_(cluster) != NULL);
+}
+
+/* Mark the beginning of an operation, returning the time at which it
+ * began (as obtained from cluster_stats_start_(), and so also suitable for
+ * passing to cluster_stats_record_())
+ */
+uint64_t
+cluster_trace_begin_(CLUSTER *cluster, CLUSTERTRACEPOINT point)
+{
+	(void) cluster;
+
+	switch(point)
+	{
+	case CLUSTER_TRACE_PING:
+		CLUSTER_PROBE2(ping__start, cluster, cluster_trace_generation_(cluster));
+		break;
+	case CLUSTER_TRACE_FETCH:
+		CLUSTER_PROBE2(fetch__start, cluster, cluster_trace_generation_(cluster));
+		break;
+	case CLUSTER_TRACE_BALANCE:
+		CLUSTER_PROBE2(balance__start, cluster, cluster_trace_generation_(cluster));
+		break;
+	case CLUSTER_TRACE_REBALANCE:
+		CLUSTER_PROBE2(rebalance__start, cluster, cluster_trace_generation_(cluster));
+		break;
+	default:
+		break;
+	}
+	return cluster_stats_start_();
+}
+
+/* Mark the end of an operation which began at start (or, if start is zero,
+ * an instantaneous event), with its result
+ *
+ * The cluster should not be write-locked when invoking this function.
+ */
+void
+cluster_trace_end_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result)
+{
+	CLUSTERTRACER tracer;
+	CLUSTERTRACE trace;
+
+	if((tracer = cluster_trace_event_(cluster, point, start, result, &trace)))
+	{
+		tracer(cluster, &trace);
+	}
+}
+
+/* Mark the end of an operation, as cluster_trace_end_(), keeping the event
+ * to be passed to the callback once the lock has been released
+ *
+ * The cluster must be write-locked when invoking this function.
+ */
+void
+cluster_trace_end_locked_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result)
+{
+	CLUSTERTRACE trace;
+
+	if(!cluster_trace_event_(cluster, point, start, result, &trace))
+	{
+		return;
+	}
+#ifdef WITH_PTHREAD
+	if(cluster->trace_npending < CLUSTER_TRACE_PENDING)
+	{
+		cluster->trace_pending[cluster->trace_npending] = trace;
+		cluster->trace_npending++;
+	}
+#else
+	cluster_trace_flush_(cluster, &trace, 1);
+#endif
+}
+
+/* Pass events kept by cluster_trace_end_locked_() to the callback (if one
+ * is still set); invoked by cluster_unlock_() with the events it took from
+ * the cluster before releasing the lock
+ */
+void
+cluster_trace_flush_(CLUSTER *cluster, const CLUSTERTRACE *pending, int npending)
+{
+	CLUSTERTRACER tracer;
+	int n;
+
+	if(!(tracer = cluster_trace_tracer_(cluster)))
+	{
+		return;
+	}
+	for(n = 0; n < npending; n++)
+	{
+		tracer(cluster, &(pending[n]));
+	}
+}
+
+/* Fire the probe marking the end of an operation, and if a callback is
+ * set, populate trace with the event to be passed to it; returns the
+ * callback, or NULL if there is none
+ */
+static CLUSTERTRACER
+cluster_trace_event_(CLUSTER *cluster, CLUSTERTRACEPOINT point, uint64_t start, int result, CLUSTERTRACE *trace)
+{
+	CLUSTERTRACER tracer;
+
+	tracer = cluster_trace_tracer_(cluster);
+#ifndef ENABLE_PROBES
+	if(!tracer)
+	{
+		return NULL;
+	}
+#endif
+	trace->point = point;
+	trace->start_us = cluster_stats_start_();
+	trace->duration_us = 0;
+	if(start && start < trace->start_us)
+	{
+		trace->duration_us = trace->start_us - start;
+		trace->start_us = start;
+	}
+	trace->generation = cluster_trace_generation_(cluster);
+	trace->result = result;
+	switch(point)
+	{
+	case CLUSTER_TRACE_PING:
+		CLUSTER_PROBE4(ping__done, cluster, trace->duration_us, trace->generation, result);
+		break;
+	case CLUSTER_TRACE_WAKE:
+		CLUSTER_PROBE2(wake, cluster, trace->generation);
+		break;
+	case CLUSTER_TRACE_FETCH:
+		CLUSTER_PROBE4(fetch__done, cluster, trace->duration_us, trace->generation, result);
+		break;
+	case CLUSTER_TRACE_BALANCE:
+		CLUSTER_PROBE4(balance__done, cluster, trace->duration_us, trace->generation, result);
+		break;
+	case CLUSTER_TRACE_REBALANCE:
+		CLUSTER_PROBE4(rebalance__done, cluster, trace->duration_us, trace->generation, result);
+		break;
+	default:
+		break;
+	}
+	return tracer;
+}
+
+/* Obtain the tracing callback, if any */
+static CLUSTERTRACER
+cluster_trace_tracer_(CLUSTER *cluster)
+{
+#ifdef CLUSTER_ATOMICS
+	return __atomic_load_n(&(cluster->tracer), __ATOMIC_ACQUIRE);
+#else
+	CLUSTERTRACER tracer;
+
+# ifdef WITH_PTHREAD
+	pthread_mutex_lock(&cluster_trace_lock_);
+# endif
+	tracer = cluster->tracer;
+# ifdef WITH_PTHREAD
+	pthread_mutex_unlock(&cluster_trace_lock_);
+# endif
+	return tracer;
+#endif
+}
+
+/* Obtain the state generation, as cluster_state_generation() does, but
+ * without taking the lock (which the caller may already hold); without the
+ * atomic builtins, the generation reported by an event which races with
+ * an update may be the one preceding it
+ */
+static unsigned long
+cluster_trace_generation_(CLUSTER *cluster)
+{
+#ifdef CLUSTER_ATOMICS
+	return (__atomic_load_n(&(cluster->pubseq), __ATOMIC_ACQUIRE) + 1) >> 1;
+#else
+	return cluster->pubseq >> 1;
+#endif
+}
@@ -0,0 +1,601 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "libcluster.h"
+
+/* Measure how quickly a cluster converges as its membership changes, and
+ * the load its members place on the registry.
+ *
+ * Each simulated member is a separate cluster connection within this
+ * process (and so has its own housekeeping threads), except for members
+ * which are to crash: these are forked child processes, which are killed
+ * without leaving the cluster, so that their registry entries must expire.
+ *
+ * The cluster has converged when every member within this process agrees
+ * on the expected total, and their worker indices don't overlap (and,
+ * if there are no other members, cover the whole cluster).
+ */
+
+typedef struct member_struct MEMBER;
+typedef struct totals_struct TOTALS;
+
+struct member_struct
+{
+	CLUSTER *cluster;
+	pid_t pid;
+	double started;
+};
+
+/* Statistics accumulated from members which have left */
+struct totals_struct
+{
+	size_t members;
+	double lifetime;
+	uint64_t pings;
+	uint64_t wakeups;
+	uint64_t changes;
+	uint64_t passes;
+	uint64_t callbacks;
+	uint64_t errors;
+	uint64_t retries;
+	uint64_t ping_us;
+	uint64_t ping_max;
+	uint64_t balance_us;
+	uint64_t balance_max;
+};
+
+static const char *short_program_name;
+static const char *key = "cluster-bench";
+static const char *env;
+static const char *registry;
+static int workers = 1, verbose, stable, settle, timeout = 300;
+
+static MEMBER *members;
+static size_t nmembers;
+static TOTALS totals;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+static void
+pause_ms(long ms)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	nanosleep(&ts, NULL);
+}
+
+static void
+logger(int priority, const char *format, va_list ap)
+{
+	if(!verbose && priority > 3)
+	{
+		return;
+	}
+	fprintf(stderr, "libcluster<%d>: ", priority);
+	vfprintf(stderr, format, ap);
+}
+
+/* The balancing callback does nothing: the number of times it's invoked
+ * is obtained from each member's statistics
+ */
+static int
+balancer(CLUSTER *cluster, CLUSTERSTATE *state)
+{
+	(void) cluster;
+	(void) state;
+
+	return 0;
+}
+
+static void
+usage(void)
+{
+	printf("Usage: %s [OPTIONS] -r URI\n"
+		   "\n"
+		   "OPTIONS are one or more of:\n"
+		   "  -h                        Print this message and exit\n"
+		   "  -v                        Be more verbose\n"
+		   "  -k KEY                    Set the cluster key to KEY (default cluster-bench)\n"
+		   "  -e ENV                    Set the cluster environment to ENV (default is unique to each run)\n"
+		   "  -r URI                    Set the cluster registry URI\n"
+		   "  -m COUNT                  Simulate COUNT members (default 8)\n"
+		   "  -n COUNT                  Set the number of workers of each member to COUNT (default 1)\n"
+		   "  -s SCENARIO               Perform SCENARIO (default join):\n"
+		   "       join                   All members join at once\n"
+		   "       rolling                Each member in turn is replaced by a new one\n"
+		   "       burst                  Further members join at once\n"
+		   "       crash                  Members are killed without leaving\n"
+		   "  -a COUNT                  Add or kill COUNT members in the burst or crash\n"
+		   "                            scenarios (default 1)\n"
+		   "  -d SECONDS                Set the re-balancing settle window to SECONDS\n"
+		   "  -S                        Claim stable slots\n"
+		   "  -t SECONDS                Wait up to SECONDS for each convergence (default 300)\n",
+		   short_program_name);
+}
+
+static CLUSTER *
+bench_create(void)
+{
+	CLUSTER *cluster;
+
+	cluster = cluster_create(key);
+	if(!cluster)
+	{
+		fprintf(stderr, "%s: failed to create cluster connection: %s\n", short_program_name, strerror(errno));
+		return NULL;
+	}
+	cluster_set_logger(cluster, logger);
+	cluster_set_balancer(cluster, balancer);
+	cluster_set_verbose(cluster, verbose);
+	cluster_set_env(cluster, env);
+	if(cluster_set_registry(cluster, registry))
+	{
+		fprintf(stderr, "%s: failed to set registry URI <%s>: %s\n", short_program_name, registry, strerror(errno));
+		cluster_destroy(cluster);
+		return NULL;
+	}
+	cluster_set_workers(cluster, workers);
+	/* Members within this process must not follow forked children */
+	cluster_set_fork(cluster, CLUSTER_FORK_PARENT);
+	if(stable)
+	{
+		cluster_set_stable_slots(cluster, 1);
+	}
+	if(settle)
+	{
+		cluster_set_rebalance_delay(cluster, settle, settle * 4);
+	}
+	return cluster;
+}
+
+/* Start a member within this process */
+static int
+member_start(MEMBER *m)
+{
+	memset(m, 0, sizeof(MEMBER));
+	if(!(m->cluster = bench_create()))
+	{
+		return -1;
+	}
+	if(cluster_join(m->cluster))
+	{
+		fprintf(stderr, "%s: failed to join cluster: %s\n", short_program_name, strerror(errno));
+		cluster_destroy(m->cluster);
+		m->cluster = NULL;
+		return -1;
+	}
+	m->started = now();
+	return 0;
+}
+
+/* Start a member in a child process, which remains a member until it's
+ * killed
+ */
+static int
+member_fork(MEMBER *m)
+{
+	CLUSTER *cluster;
+
+	memset(m, 0, sizeof(MEMBER));
+	m->pid = fork();
+	if(m->pid == -1)
+	{
+		fprintf(stderr, "%s: failed to fork child process: %s\n", short_program_name, strerror(errno));
+		m->pid = 0;
+		return -1;
+	}
+	if(m->pid)
+	{
+		m->started = now();
+		return 0;
+	}
+	if(!(cluster = bench_create()) || cluster_join(cluster))
+	{
+		fprintf(stderr, "%s: child %ld failed to join cluster\n", short_program_name, (long) getpid());
+		_exit(EXIT_FAILURE);
+	}
+	for(;;)
+	{
+		pause();
+	}
+}
+
+/* Add a member's statistics to the totals (or to another set of totals) */
+static void
+member_collect(MEMBER *m, TOTALS *t, double when)
+{
+	CLUSTERSTATS stats;
+
+	if(!m->cluster || cluster_stats(m->cluster, &stats))
+	{
+		return;
+	}
+	t->members++;
+	t->lifetime += when - m->started;
+	t->pings += stats.ping.count;
+	t->wakeups += stats.wakeups;
+	t->changes += stats.changes;
+	t->passes += stats.balance.count;
+	t->callbacks += stats.rebalance.count;
+	t->errors += stats.errors;
+	t->retries += stats.retries;
+	t->ping_us += stats.ping.total_us;
+	t->balance_us += stats.balance.total_us;
+	if(stats.ping.max_us > t->ping_max)
+	{
+		t->ping_max = stats.ping.max_us;
+	}
+	if(stats.balance.max_us > t->balance_max)
+	{
+		t->balance_max = stats.balance.max_us;
+	}
+}
+
+/* Stop a member: members within this process leave the cluster, while
+ * child processes are killed
+ */
+static void
+member_stop(MEMBER *m)
+{
+	if(m->pid)
+	{
+		kill(m->pid, SIGKILL);
+		waitpid(m->pid, NULL, 0);
+		m->pid = 0;
+		return;
+	}
+	if(m->cluster)
+	{
+		member_collect(m, &totals, now());
+		cluster_destroy(m->cluster);
+		m->cluster = NULL;
+	}
+}
+
+/* Determine the total number of balancing callbacks invoked so far */
+static uint64_t
+bench_callbacks(void)
+{
+	TOTALS t;
+	size_t n;
+
+	t = totals;
+	for(n = 0; n < nmembers; n++)
+	{
+		member_collect(&(members[n]), &t, now());
+	}
+	return t.callbacks;
+}
+
+static int
+bench_intervalcmp(const void *a, const void *b)
+{
+	const CLUSTERSTATE *sa = (const CLUSTERSTATE *) a, *sb = (const CLUSTERSTATE *) b;
+
+	return (sa->index < sb->index ? -1 : (sa->index > sb->index ? 1 : 0));
+}
+
+/* Determine whether the members have converged on a cluster of total
+ * workers
+ */
+static int
+bench_converged(int total)
+{
+	CLUSTERSTATE *states;
+	size_t n, count, others;
+	int r, sum;
+
+	states = (CLUSTERSTATE *) calloc(nmembers, sizeof(CLUSTERSTATE));
+	if(!states)
+	{
+		return 0;
+	}
+	count = 0;
+	others = 0;
+	r = 1;
+	for(n = 0; n < nmembers && r; n++)
+	{
+		if(members[n].pid)
+		{
+			others++;
+			continue;
+		}
+		if(!members[n].cluster)
+		{
+			continue;
+		}
+		if(cluster_state(members[n].cluster, &(states[count])) ||
+		   states[count].total != total || states[count].index < 0)
+		{
+			r = 0;
+		}
+		count++;
+	}
+	if(r)
+	{
+		qsort(states, count, sizeof(CLUSTERSTATE), bench_intervalcmp);
+		sum = 0;
+		for(n = 0; n < count; n++)
+		{
+			if((n && states[n].index < states[n - 1].index + states[n - 1].workers) ||
+			   states[n].index + states[n].workers > total)
+			{
+				r = 0;
+				break;
+			}
+			sum += states[n].workers;
+		}
+		if(r && !others && sum != total)
+		{
+			r = 0;
+		}
+	}
+	free(states);
+	return r;
+}
+
+/* Wait for the members to converge on a cluster of total workers,
+ * reporting how long it took
+ */
+static int
+bench_wait(const char *phase, int total, double start)
+{
+	uint64_t callbacks;
+	double elapsed;
+
+	callbacks = bench_callbacks();
+	while(!bench_converged(total))
+	{
+		if(now() - start > timeout)
+		{
+			fprintf(stderr, "%s: %s: cluster did not converge within %d seconds\n", short_program_name, phase, timeout);
+			return -1;
+		}
+		pause_ms(10);
+	}
+	elapsed = now() - start;
+	/* Allow callbacks still in progress to be counted */
+	pause_ms(100);
+	printf("%-24s converged in %8.3fs (total %d workers, %lu callbacks)\n", phase, elapsed, total,
+		   (unsigned long) (bench_callbacks() - callbacks));
+	return 0;
+}
+
+/* Start members [first, last) within this process */
+static int
+bench_start(size_t first, size_t last)
+{
+	size_t n;
+
+	for(n = first; n < last; n++)
+	{
+		if(member_start(&(members[n])))
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+bench_report(void)
+{
+	size_t n;
+	double when;
+
+	when = now();
+	for(n = 0; n < nmembers; n++)
+	{
+		member_collect(&(members[n]), &totals, when);
+	}
+	if(!totals.members || totals.lifetime <= 0)
+	{
+		return;
+	}
+	printf("\n%lu member lifetimes totalling %.1fs:\n", (unsigned long) totals.members, totals.lifetime);
+	printf("  registry refreshes:       %8.3f/sec per member (mean %.1fms, max %.1fms)\n",
+		   (double) totals.pings / totals.lifetime,
+		   (totals.pings ? (double) totals.ping_us / totals.pings / 1000.0 : 0.0),
+		   (double) totals.ping_max / 1000.0);
+	printf("  balancer wakeups:         %8.3f/sec per member (%lu with membership changes)\n",
+		   (double) totals.wakeups / totals.lifetime, (unsigned long) totals.changes);
+	printf("  balancing passes:         %8lu (mean %.1fms, max %.1fms)\n",
+		   (unsigned long) totals.passes,
+		   (totals.passes ? (double) totals.balance_us / totals.passes / 1000.0 : 0.0),
+		   (double) totals.balance_max / 1000.0);
+	printf("  balancing callbacks:      %8lu\n", (unsigned long) totals.callbacks);
+	printf("  registry errors/retries:  %8lu/%lu\n", (unsigned long) totals.errors, (unsigned long) totals.retries);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c, r;
+	const char *t, *scenario = "join";
+	size_t count, affected, n;
+	double start;
+	char envbuf[64], phase[64];
+
+	t = strrchr(argv[0], '/');
+	short_program_name = (t ? t + 1 : argv[0]);
+	count = 8;
+	affected = 1;
+	while((c = getopt(argc, argv, "hvk:e:r:m:n:s:a:d:St:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		case 'v':
+			verbose = 1;
+			break;
+		case 'k':
+			key = optarg;
+			break;
+		case 'e':
+			env = optarg;
+			break;
+		case 'r':
+			registry = optarg;
+			break;
+		case 'm':
+			count = strtoul(optarg, NULL, 10);
+			break;
+		case 'n':
+			workers = atoi(optarg);
+			break;
+		case 's':
+			scenario = optarg;
+			break;
+		case 'a':
+			affected = strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			settle = atoi(optarg);
+			break;
+		case 'S':
+			stable = 1;
+			break;
+		case 't':
+			timeout = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!registry || !count || workers < 1 || timeout < 1 ||
+	   (strcmp(scenario, "join") && strcmp(scenario, "rolling") &&
+		strcmp(scenario, "burst") && strcmp(scenario, "crash")))
+	{
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if(!env)
+	{
+		/* Don't collide with the members of previous runs */
+		snprintf(envbuf, sizeof(envbuf), "bench-%ld-%ld", (long) getpid(), (long) time(NULL));
+		env = envbuf;
+	}
+	if(!strcmp(scenario, "join") || !strcmp(scenario, "rolling"))
+	{
+		affected = 0;
+	}
+	nmembers = count + affected;
+	members = (MEMBER *) calloc(nmembers, sizeof(MEMBER));
+	if(!members)
+	{
+		fprintf(stderr, "%s: failed to allocate members: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	signal(SIGPIPE, SIG_IGN);
+	printf("%s: %s with %lu members of %d workers in %s/%s at <%s>\n", short_program_name, scenario,
+		   (unsigned long) count, workers, key, env, registry);
+
+	r = 0;
+	if(!strcmp(scenario, "crash"))
+	{
+		/* The members which will crash are forked before any others
+		 * have been created
+		 */
+		start = now();
+		for(n = count; n < nmembers && !r; n++)
+		{
+			r = member_fork(&(members[n]));
+		}
+		if(!r)
+		{
+			r = bench_start(0, count);
+		}
+		if(!r)
+		{
+			r = bench_wait("join", (int) nmembers * workers, start);
+		}
+		if(!r)
+		{
+			start = now();
+			for(n = count; n < nmembers; n++)
+			{
+				member_stop(&(members[n]));
+			}
+			r = bench_wait("crash (TTL expiry)", (int) count * workers, start);
+		}
+	}
+	else
+	{
+		start = now();
+		r = bench_start(0, count);
+		if(!r)
+		{
+			r = bench_wait("join", (int) count * workers, start);
+		}
+		if(!r && !strcmp(scenario, "rolling"))
+		{
+			for(n = 0; n < count && !r; n++)
+			{
+				snprintf(phase, sizeof(phase), "replace member %lu", (unsigned long) n);
+				start = now();
+				member_stop(&(members[n]));
+				r = member_start(&(members[n]));
+				if(!r)
+				{
+					r = bench_wait(phase, (int) count * workers, start);
+				}
+			}
+		}
+		if(!r && !strcmp(scenario, "burst"))
+		{
+			start = now();
+			r = bench_start(count, nmembers);
+			if(!r)
+			{
+				r = bench_wait("burst", (int) nmembers * workers, start);
+			}
+		}
+	}
+	bench_report();
+	for(n = 0; n < nmembers; n++)
+	{
+		member_stop(&(members[n]));
+	}
+	free(members);
+	return (r ? EXIT_FAILURE : EXIT_SUCCESS);
+}
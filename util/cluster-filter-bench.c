@@ -0,0 +1,174 @@
+/* Author: Mo McRoberts <mo.mcroberts@bbc.co.uk>
+ *
+ * Copyright (c) 2015-2017 BBC
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libcluster.h"
+
+/* Measure the throughput of batched ownership filtering, compared with
+ * testing each key individually with cluster_owns(), using a static
+ * cluster
+ */
+
+static const char *short_program_name;
+
+static void
+usage(void)
+{
+	printf("Usage: %s [OPTIONS]\n"
+		   "\n"
+		   "OPTIONS are one or more of:\n"
+		   "  -h                        Print this message and exit\n"
+		   "  -b COUNT                  Filter batches of COUNT keys (default 65536)\n"
+		   "  -r COUNT                  Repeat each test COUNT times (default 100)\n"
+		   "  -T COUNT                  Set the cluster worker total to COUNT (default 64)\n",
+		   short_program_name);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (double) ts.tv_sec + (double) ts.tv_nsec / 1000000000.0;
+}
+
+static void
+report(const char *name, size_t keys, double elapsed, size_t owned)
+{
+	printf("%-24s %12.0f keys/sec (%lu owned)\n", name, (double) keys / elapsed, (unsigned long) owned);
+}
+
+int
+main(int argc, char **argv)
+{
+	int c, n, rounds, total;
+	const char *t;
+	size_t batch, i, owned;
+	uint64_t *hashes, x;
+	uint8_t *mask;
+	size_t *indices;
+	double start, naive;
+	CLUSTER *cluster;
+
+	t = strrchr(argv[0], '/');
+	short_program_name = (t ? t + 1 : argv[0]);
+	batch = 65536;
+	rounds = 100;
+	total = 64;
+	while((c = getopt(argc, argv, "hb:r:T:")) != -1)
+	{
+		switch(c)
+		{
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		case 'b':
+			batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'T':
+			total = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(!batch || rounds < 1 || total < 1)
+	{
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	hashes = (uint64_t *) calloc(batch, sizeof(uint64_t));
+	mask = (uint8_t *) calloc(batch, sizeof(uint8_t));
+	indices = (size_t *) calloc(batch, sizeof(size_t));
+	if(!hashes || !mask || !indices)
+	{
+		fprintf(stderr, "%s: failed to allocate buffers: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	/* xorshift64 */
+	x = 88172645463325252ULL;
+	for(i = 0; i < batch; i++)
+	{
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		hashes[i] = x;
+	}
+	cluster = cluster_create("cluster-filter-bench");
+	if(!cluster)
+	{
+		fprintf(stderr, "%s: failed to create cluster connection: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	cluster_static_set_total(cluster, total);
+	if(cluster_join(cluster))
+	{
+		fprintf(stderr, "%s: failed to join cluster: %s\n", short_program_name, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: %d rounds of %lu keys against a cluster of %d workers\n", short_program_name, rounds, (unsigned long) batch, total);
+
+	start = now();
+	owned = 0;
+	for(n = 0; n < rounds; n++)
+	{
+		for(i = 0; i < batch; i++)
+		{
+			mask[i] = (cluster_owns(cluster, 0, hashes[i]) ? 1 : 0);
+			owned += mask[i];
+		}
+	}
+	naive = now() - start;
+	report("cluster_owns()", batch * rounds, naive, owned / rounds);
+
+	start = now();
+	owned = 0;
+	for(n = 0; n < rounds; n++)
+	{
+		owned += cluster_filter_owned(cluster, 0, hashes, batch, mask);
+	}
+	report("cluster_filter_owned()", batch * rounds, now() - start, owned / rounds);
+
+	start = now();
+	owned = 0;
+	for(n = 0; n < rounds; n++)
+	{
+		owned += cluster_compact_owned(cluster, 0, hashes, batch, indices);
+	}
+	report("cluster_compact_owned()", batch * rounds, now() - start, owned / rounds);
+
+	cluster_destroy(cluster);
+	free(hashes);
+	free(mask);
+	free(indices);
+	return 0;
+}